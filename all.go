@@ -0,0 +1,261 @@
+package orchideous
+
+import (
+	"context"
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"runtime"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/xyproto/files"
+)
+
+// plannedProject is a project that has been detected and planned, and can
+// then be built without depending on the current directory.
+type plannedProject struct {
+	dir      string // absolute
+	name     string // as given to "oh all", or relative to where it was discovered
+	exe      string
+	main     string // the main source
+	flags    BuildFlags
+	objFiles []string // nil if the executable is compiled and linked in one step
+	jobs     []compileJob
+	includes []string // the external includes, for hints when the build fails
+	events   func(BuildEvent)
+	err      error
+	duration time.Duration // planning, and the CPU time of the compiles and links
+}
+
+// skipDiscoverDirs are directories that are never searched for projects.
+var skipDiscoverDirs = map[string]bool{"common": true, "include": true, "build": true, "src": true, "pgo": true}
+
+// discoverProjects returns the project directories below root: every
+// directory with a source file, or a src/ directory with one, at the top.
+// The directories of a project are not searched further.
+func discoverProjects(root string) []string {
+	var dirs []string
+	filepath.WalkDir(root, func(path string, d os.DirEntry, err error) error {
+		if err != nil || !d.IsDir() {
+			return nil
+		}
+		name := d.Name()
+		if path != root && (strings.HasPrefix(name, ".") || skipDiscoverDirs[name]) {
+			return filepath.SkipDir
+		}
+		if hasSourceFiles(path) || hasSourceFiles(filepath.Join(path, "src")) {
+			dirs = append(dirs, path)
+			return filepath.SkipDir
+		}
+		return nil
+	})
+	return dirs
+}
+
+// hasSourceFiles reports whether dir has a source file that is not a test.
+func hasSourceFiles(dir string) bool {
+	for _, m := range filesWithExts(dir, SourceExts) {
+		if !isTestFile(m) {
+			return true
+		}
+	}
+	return false
+}
+
+// doAll builds many projects in one process, such as the examples, which is
+// much faster than running oh in each of them. The projects in dirs are
+// built, or every project below the current directory if dirs is empty.
+//
+// The projects are detected and planned in parallel, each in its own
+// directory, and share the in-process caches of the compiler
+// probes and pkg-config lookups. All their compiles and links then run on one
+// pool of jobCount workers, and a failing project does not stop the
+// others. A table with the result and the time of each project is printed at
+// the end. Since the projects wait for each other's jobs, the time is that of
+// planning the project plus the CPU time of its compiles and links.
+func doAll(opts BuildOptions, dirs []string) error {
+	if len(dirs) == 0 {
+		dirs = discoverProjects(".")
+	}
+	if len(dirs) == 0 {
+		return fmt.Errorf("no projects found")
+	}
+	// The build hosts are counted by the C++ compiler, which C projects share the toolchain of
+	slots := make(chan struct{}, jobCount(opts.Jobs, findCompiler(opts.Clang, false)))
+	local := slots
+	if remoteCompiles() != nil {
+		// The links, and the sources that are compiled and linked in one step, stay here
+		local = make(chan struct{}, runtime.NumCPU())
+	}
+	planned := make([]*plannedProject, len(dirs))
+	forEachParallel(len(dirs), runtime.NumCPU(), func(i int) {
+		p := newPlannedProject(dirs[i])
+		start := time.Now()
+		if p.err == nil {
+			p.err = planProject(p, opts, slots, local)
+		}
+		p.duration = time.Since(start)
+		planned[i] = p
+	})
+	var projects []*plannedProject
+	for _, p := range planned {
+		if p.exe != "" || p.err != nil {
+			projects = append(projects, p)
+		}
+	}
+
+	var mu sync.Mutex // keeps the output of parallel compiles and links apart
+	forEachParallel(len(projects), len(projects), func(i int) {
+		p := projects[i]
+		if p.err != nil {
+			return
+		}
+		p.err = buildPlannedProject(buildContext, p, local, func(args []string, cmd *exec.Cmd, output []byte) {
+			mu.Lock()
+			fmt.Printf("[%s] %s %s\n", filepath.Base(p.dir), p.flags.Compiler, strings.Join(compactArgs(args), " "))
+			os.Stderr.Write(output)
+			p.duration += cpuTime(cmd)
+			mu.Unlock()
+		})
+	})
+
+	failed := 0
+	fmt.Println()
+	for _, p := range projects {
+		status := "PASS"
+		if p.err != nil {
+			status = "FAIL"
+			failed++
+		}
+		fmt.Printf("%s  %-30s %8s\n", status, p.name, p.duration.Round(time.Millisecond))
+	}
+	for _, p := range projects {
+		if p.err != nil {
+			fmt.Fprintf(os.Stderr, "%s: %v\n", p.name, p.err)
+		}
+	}
+	if failed > 0 {
+		return fmt.Errorf("%d of %d projects failed", failed, len(projects))
+	}
+	fmt.Printf("All %d projects built\n", len(projects))
+	return nil
+}
+
+// newPlannedProject returns the project in dir, to be planned. The directory
+// is made absolute, so that the project does not depend on the current
+// directory of the process. If that fails, the error is in p.err.
+func newPlannedProject(dir string) *plannedProject {
+	p := &plannedProject{name: filepath.Clean(dir)}
+	abs, err := filepath.Abs(dir)
+	if err != nil {
+		p.err = fmt.Errorf("could not find the source directory: %w", err)
+		return p
+	}
+	if fi, err := os.Stat(abs); err != nil || !fi.IsDir() {
+		p.err = fmt.Errorf("%s is not a source directory", dir)
+		return p
+	}
+	p.dir = abs
+	return p
+}
+
+// planProject detects the project in p.dir and plans its compiles, like
+// doBuild does, without changing the current directory. Projects without a
+// main source are left out. The object compiles run on slots, and the rest
+// on local, if they are not nil.
+func planProject(p *plannedProject, opts BuildOptions, slots, local chan struct{}) error {
+	proj := detectProject(p.dir)
+	if proj.MainSource == "" {
+		return nil
+	}
+	p.includes = proj.Includes
+	p.events = opts.Events
+	opts.Win64 = opts.Win64 || proj.HasWin64
+	if opts.Win64 && findWin64Compiler(proj.IsC) == "" && files.WhichCached("docker") == "" {
+		// assembleFlags would exit, and take the other projects with it
+		p.exe = executableNameIn(p.dir) + ".exe"
+		return fmt.Errorf("no mingw cross-compiler found for win64 and docker is not available")
+	}
+	p.exe, p.flags = mainTarget(opts, proj)
+	p.main = proj.MainSource
+	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	if len(srcs) == 1 && !p.flags.Modules {
+		// Compiled and linked in one step, every time, like compileSources does
+		args := withLinker(p.flags, buildCompileArgs(p.flags, srcs, p.exe))
+		p.jobs = []compileJob{{src: srcs[0], obj: p.exe, args: args, slots: local}}
+	} else {
+		p.flags = withPrecompiledHeader(srcs, p.flags, filepath.Base(p.dir))
+		p.objFiles, p.jobs = planCompileJobs(srcs, p.flags)
+		for i := range p.jobs {
+			p.jobs[i].slots = slots
+		}
+	}
+	for i := range p.jobs {
+		p.jobs[i].dir = p.dir
+		p.jobs[i].events = p.events
+	}
+	return nil
+}
+
+// buildPlannedProject runs the compiles that planProject planned, and links
+// the executable if it is out of date. The commands run in the directory of
+// the project, on the shared slots if they are not nil, so the current
+// directory does not matter. Every command is passed to report when it is done.
+func buildPlannedProject(ctx context.Context, p *plannedProject, slots chan struct{}, report func(args []string, cmd *exec.Cmd, output []byte)) error {
+	if p.flags.DockerImage != "" {
+		defer stopDockerContainers(p.dir)
+	}
+	err := runCompileJobsContext(ctx, p.flags, p.jobs, func(r compileResult) {
+		report(r.job.args, r.cmd, r.output)
+	})
+	if err != nil {
+		return err
+	}
+	manifest := loadBuildManifestIn(p.dir)
+	if p.objFiles == nil {
+		// Compiled and linked in one step
+		for _, job := range p.jobs {
+			manifest.recordLink(p.flags, p.main, p.exe, job.args)
+		}
+		manifest.save()
+		return nil
+	}
+
+	args := linkArgs(p.flags, p.objFiles, p.exe)
+	if len(p.jobs) == 0 && fileExists(filepath.Join(p.dir, p.exe)) && manifest.linkedWith(p.flags, p.exe, args) {
+		return nil
+	}
+	if slots != nil {
+		select {
+		case slots <- struct{}{}:
+			defer func() { <-slots }()
+		case <-ctx.Done():
+			return ctx.Err()
+		}
+	}
+	cmd := runCompilerIn(ctx, p.flags, p.dir, args)
+	emitEvent(p.events, BuildEvent{Kind: EventStarted, Output: p.exe, Command: cmdToString(cmd)})
+	span := startSpan("link", p.exe)
+	start := time.Now()
+	output, err := runCaptured(cmd)
+	span.end()
+	emitEvent(p.events, finishedEvent("", p.exe, cmd, output, err, time.Since(start)))
+	report(args, cmd, output)
+	if err != nil {
+		return fmt.Errorf("linking failed: %w", err)
+	}
+	manifest.recordLink(p.flags, p.main, p.exe, args)
+	manifest.save()
+	return nil
+}
+
+// cpuTime returns the user and system time of a finished command.
+func cpuTime(cmd *exec.Cmd) time.Duration {
+	if cmd.ProcessState == nil {
+		return 0
+	}
+	return cmd.ProcessState.UserTime() + cmd.ProcessState.SystemTime()
+}
@@ -0,0 +1,211 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+
+	"github.com/xyproto/files"
+)
+
+// The benchmarks run detection, flag assembly and rebuild checks over
+// synthetic projects of 10, 100 and 1000 sources, and over copies of the
+// examples. Besides ns/op they report spawns/op, the subprocesses that were
+// started, since those are where most of the time of oh goes. Run them with
+// "make bench", and compare two runs with benchstat.
+
+var benchSizes = []int{10, 100, 1000}
+
+// writeSyntheticProject writes a project with a main source and n-1 other
+// sources, each with its own header in include/, and returns its directory.
+func writeSyntheticProject(b *testing.B, n int) string {
+	b.Helper()
+	dir := b.TempDir()
+	var main strings.Builder
+	main.WriteString("#include <cstdio>\n")
+	for i := 1; i < n; i++ {
+		name := fmt.Sprintf("mod%d", i)
+		fmt.Fprintf(&main, "#include \"%s.h\"\n", name)
+		benchWriteFile(b, filepath.Join(dir, "include", name+".h"), fmt.Sprintf("#pragma once\n#include <string>\nint %s();\n", name))
+		benchWriteFile(b, filepath.Join(dir, name+".cpp"), fmt.Sprintf("#include \"%s.h\"\n#include <vector>\nint %s() { return std::vector<int>(%d).size(); }\n", name, name, i))
+	}
+	main.WriteString("int main() { return 0; }\n")
+	benchWriteFile(b, filepath.Join(dir, "main.cpp"), main.String())
+	return dir
+}
+
+func benchWriteFile(b *testing.B, path, content string) {
+	b.Helper()
+	os.MkdirAll(filepath.Dir(path), 0o755)
+	if err := os.WriteFile(path, []byte(content), 0o644); err != nil {
+		b.Fatal(err)
+	}
+}
+
+// benchExamples copies the examples with a main source to a temporary
+// directory, so that the caches that oh writes do not end up in the tree,
+// and returns their directories.
+func benchExamples(b *testing.B) []string {
+	b.Helper()
+	orig, err := os.Getwd()
+	if err != nil {
+		b.Fatal(err)
+	}
+	root := b.TempDir()
+	var dirs []string
+	for _, dir := range discoverProjects(filepath.Join(orig, "examples")) {
+		dst := filepath.Join(root, filepath.Base(dir))
+		err := filepath.WalkDir(dir, func(path string, d os.DirEntry, err error) error {
+			if err != nil || d.IsDir() {
+				return err
+			}
+			rel, _ := filepath.Rel(dir, path)
+			os.MkdirAll(filepath.Join(dst, filepath.Dir(rel)), 0o755)
+			return copyFile(path, filepath.Join(dst, rel), 0o644)
+		})
+		if err != nil {
+			b.Fatal(err)
+		}
+		dirs = append(dirs, dst)
+	}
+	return dirs
+}
+
+// benchInDir changes to dir until the benchmark is done.
+func benchInDir(b *testing.B, dir string) {
+	b.Helper()
+	orig, err := os.Getwd()
+	if err != nil {
+		b.Fatal(err)
+	}
+	if err := os.Chdir(dir); err != nil {
+		b.Fatal(err)
+	}
+	b.Cleanup(func() { os.Chdir(orig) })
+}
+
+// resetSourceScans empties the in-process cache of source scans, so that
+// every iteration reads the sources, like a new oh process does.
+func resetSourceScans() {
+	sourceScanMutex.Lock()
+	sourceScanCache = make(map[string]sourceScanEntry)
+	sourceScanMutex.Unlock()
+}
+
+// benchProjects runs fn as a sub-benchmark in each synthetic project and,
+// if withExamples is set, in each example, and reports the spawns per operation.
+func benchProjects(b *testing.B, withExamples bool, fn func(b *testing.B)) {
+	run := func(name, dir string) {
+		b.Run(name, func(b *testing.B) {
+			benchInDir(b, dir)
+			fn(b)
+		})
+	}
+	for _, n := range benchSizes {
+		run(fmt.Sprintf("sources=%d", n), writeSyntheticProject(b, n))
+	}
+	if withExamples {
+		for _, dir := range benchExamples(b) {
+			run("examples/"+filepath.Base(dir), dir)
+		}
+	}
+}
+
+// skipUnbuildable skips projects that assembleFlags would exit for.
+func skipUnbuildable(b *testing.B, proj Project) {
+	if proj.HasWin64 && findWin64Compiler(proj.IsC) == "" && files.WhichCached("docker") == "" {
+		b.Skip("no mingw cross-compiler or docker for win64")
+	}
+}
+
+// reportSpawns reports the subprocesses that were started since before, per operation.
+func reportSpawns(b *testing.B, before int64) {
+	b.ReportMetric(float64(spawnCount.Load()-before)/float64(b.N), "spawns/op")
+}
+
+func BenchmarkDetectProject(b *testing.B) {
+	benchProjects(b, true, func(b *testing.B) {
+		before := spawnCount.Load()
+		for i := 0; i < b.N; i++ {
+			resetSourceScans()
+			detectProject(".")
+		}
+		reportSpawns(b, before)
+	})
+}
+
+func BenchmarkCollectExternalIncludes(b *testing.B) {
+	benchProjects(b, false, func(b *testing.B) {
+		proj := detectProject(".")
+		srcs := append([]string{proj.MainSource}, proj.DepSources...)
+		b.ResetTimer()
+		before := spawnCount.Load()
+		for i := 0; i < b.N; i++ {
+			resetSourceScans()
+			collectExternalIncludes(".", srcs, false)
+		}
+		reportSpawns(b, before)
+	})
+}
+
+// BenchmarkAssembleFlags measures a build where the flag cache is warm,
+// which is the common case.
+func BenchmarkAssembleFlags(b *testing.B) {
+	benchProjects(b, true, func(b *testing.B) {
+		proj := detectProject(".")
+		skipUnbuildable(b, proj)
+		assembleFlags(proj, BuildOptions{})
+		b.ResetTimer()
+		before := spawnCount.Load()
+		for i := 0; i < b.N; i++ {
+			assembleFlags(proj, BuildOptions{})
+		}
+		reportSpawns(b, before)
+	})
+}
+
+// BenchmarkAssembleFlagsNoCache measures flag assembly with OH_NOCACHE=1,
+// so that only the probes that are memoized in the process are not redone.
+func BenchmarkAssembleFlagsNoCache(b *testing.B) {
+	b.Setenv("OH_NOCACHE", "1")
+	benchProjects(b, false, func(b *testing.B) {
+		proj := detectProject(".")
+		b.ResetTimer()
+		before := spawnCount.Load()
+		for i := 0; i < b.N; i++ {
+			assembleFlags(proj, BuildOptions{})
+		}
+		reportSpawns(b, before)
+	})
+}
+
+// BenchmarkNeedsRecompile measures the rebuild check of an up to date
+// build, from loading the manifest to checking every object.
+func BenchmarkNeedsRecompile(b *testing.B) {
+	benchProjects(b, false, func(b *testing.B) {
+		proj := detectProject(".")
+		flags := BuildFlags{Compiler: "c++", Std: "c++20", ObjDir: filepath.Join(buildRoot, "bench")}
+		nodes := compileNodes(append([]string{proj.MainSource}, proj.DepSources...), flags)
+		manifest := loadBuildManifest()
+		for _, node := range nodes {
+			benchWriteFile(b, node.obj, "")
+			header := filepath.Join("include", strings.TrimSuffix(node.src, ".cpp")+".h")
+			benchWriteFile(b, node.depFile(), node.obj+": "+node.src+" "+header+"\n")
+			manifest.record(flags, node.src, node.obj, node.args)
+		}
+		manifest.save()
+		b.ResetTimer()
+		before := spawnCount.Load()
+		for i := 0; i < b.N; i++ {
+			m := loadBuildManifest()
+			for _, node := range nodes {
+				if m.needsRecompile(flags, node.src, node.obj, node.args) {
+					b.Fatalf("%s should be up to date", node.obj)
+				}
+			}
+		}
+		reportSpawns(b, before)
+	})
+}
@@ -0,0 +1,187 @@
+package orchideous
+
+import (
+	"fmt"
+	"math"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"slices"
+	"strconv"
+	"strings"
+)
+
+// defaultBenchBaseline is where the benchmark results are saved, and
+// compared against, unless another baseline file is given.
+var defaultBenchBaseline = filepath.Join(projectCacheDir, "bench.json")
+
+// BenchOptions configures how benchmarks are run and compared.
+type BenchOptions struct {
+	Baseline  string  // the baseline file, or "" for .oh/bench.json
+	Threshold float64 // how much slower than the baseline a benchmark can get, as a fraction (0 = 0.1)
+	Save      bool    // save the results as the new baseline, instead of failing on regressions
+	OpenMP    bool    // sweep the OpenMP settings, and save the fastest, instead of comparing
+}
+
+// benchResult is the time per operation of one benchmark, as printed by the
+// harness in a line like "bench <name> <ns> ns/op".
+type benchResult struct {
+	name string // the executable and the benchmark name, like "common/hello_bench/hello"
+	ns   float64
+}
+
+// parseBenchOutput returns the results of the benchmarks that exe printed.
+func parseBenchOutput(exe string, output []byte) []benchResult {
+	var results []benchResult
+	for _, line := range strings.Split(string(output), "\n") {
+		fields := strings.Fields(line)
+		if len(fields) < 4 || fields[0] != "bench" || fields[3] != "ns/op" {
+			continue
+		}
+		ns, err := strconv.ParseFloat(fields[2], 64)
+		if err != nil {
+			continue
+		}
+		results = append(results, benchResult{filepath.ToSlash(exe) + "/" + fields[1], ns})
+	}
+	return results
+}
+
+// compareBench prints the results next to the baseline, and returns the
+// names of the benchmarks that are slower than the baseline by more than
+// threshold.
+func compareBench(results []benchResult, baseline map[string]float64, threshold float64) []string {
+	var regressed []string
+	for _, r := range results {
+		base, ok := baseline[r.name]
+		if !ok || base <= 0 {
+			fmt.Printf("      %-40s %12.3f ns/op\n", r.name, r.ns)
+			continue
+		}
+		change := r.ns/base - 1
+		status := "    "
+		if change > threshold {
+			status = "SLOW"
+			regressed = append(regressed, r.name)
+		}
+		fmt.Printf("%s  %-40s %12.3f ns/op %+7.1f%%\n", status, r.name, r.ns, change*100)
+	}
+	return regressed
+}
+
+// runBenchmarks runs the benchmark executables one at a time, with the given
+// environment, and returns their results. The output is shown if show is set.
+func runBenchmarks(builds []testResult, env []string, show bool) ([]benchResult, error) {
+	var results []benchResult
+	for _, b := range builds {
+		if show {
+			fmt.Printf("Running %s...\n", b.exe)
+		}
+		c := exec.Command(dotSlash(b.exe))
+		c.Env = env
+		c.Stderr = os.Stderr
+		span := startSpan("bench", b.exe)
+		output, err := c.Output()
+		span.end()
+		if show {
+			os.Stdout.Write(output)
+		}
+		if err != nil {
+			return nil, fmt.Errorf("benchmark %s: %w", b.exe, err)
+		}
+		results = append(results, parseBenchOutput(b.exe, output)...)
+	}
+	return results, nil
+}
+
+// geometricMeanNs returns the geometric mean of the times of the results,
+// so that every benchmark counts the same, however long it takes.
+func geometricMeanNs(results []benchResult) float64 {
+	if len(results) == 0 {
+		return 0
+	}
+	sum := 0.0
+	for _, r := range results {
+		sum += math.Log(max(r.ns, 1e-9))
+	}
+	return math.Exp(sum / float64(len(results)))
+}
+
+// doBench builds the *_bench.cpp files of the project with the flags of
+// "oh opt", and -fno-omit-frame-pointer so that they can be profiled, and
+// runs them one at a time, so that they do not disturb each other. The
+// results are compared against the saved baseline, and the benchmarks that
+// got slower by more than the threshold fail. If there is no baseline yet,
+// or bopts.Save is set, the results are saved as the new baseline. The
+// OpenMP settings of the last sweep are used, and bopts.OpenMP sweeps them
+// again, with the mean time of all the benchmarks as the measure.
+func doBench(opts BuildOptions, bopts BenchOptions) error {
+	proj := detectProject(".")
+	benches := slices.Clone(proj.BenchSources)
+	slices.Sort(benches)
+	if len(benches) == 0 {
+		fmt.Println("Nothing to benchmark")
+		return nil
+	}
+	if bopts.OpenMP && !proj.HasOpenMP {
+		return errNoOpenMP
+	}
+	opts.Opt = true
+	opts.FramePointers = true
+	flags := assembleFlags(proj, opts)
+	if flags.DockerImage != "" {
+		defer stopDockerContainers(mustGetwd())
+	}
+
+	builds, err := buildTestExecutables(benches, proj.DepSources, flags, false)
+	if err != nil {
+		return err
+	}
+	if bopts.OpenMP {
+		best, err := sweepOpenMP(func(env []string) (float64, error) {
+			results, err := runBenchmarks(builds, append(env, "OH_BENCH_NOPIN=1"), false)
+			return geometricMeanNs(results), err
+		}, "ns/op (mean)", usesRuntimeSchedule(append(slices.Clone(benches), proj.DepSources...)))
+		if err != nil {
+			return err
+		}
+		return saveOpenMPSettings(best)
+	}
+	env := os.Environ()
+	if proj.HasOpenMP {
+		env = append(env, openMPEnv()...)
+	}
+	results, err := runBenchmarks(builds, env, true)
+	if err != nil {
+		return err
+	}
+
+	path := bopts.Baseline
+	if path == "" {
+		path = defaultBenchBaseline
+	}
+	threshold := bopts.Threshold
+	if threshold <= 0 {
+		threshold = 0.1
+	}
+	baseline := make(map[string]float64)
+	hasBaseline := readJSONFile(path, &baseline)
+
+	fmt.Println()
+	regressed := compareBench(results, baseline, threshold)
+	if !hasBaseline || bopts.Save {
+		for _, r := range results {
+			baseline[r.name] = r.ns
+		}
+		if err := writeJSONFile(path, baseline); err != nil {
+			return err
+		}
+		fmt.Printf("Saved %d results to %s\n", len(results), path)
+		return nil
+	}
+	if len(regressed) > 0 {
+		return fmt.Errorf("%d of %d benchmarks are more than %.0f%% slower than %s", len(regressed), len(results), threshold*100, path)
+	}
+	fmt.Printf("No regressions in %d benchmarks\n", len(results))
+	return nil
+}
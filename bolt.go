@@ -0,0 +1,180 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strconv"
+)
+
+// boltDir holds the profiles and intermediate executables of "oh bolt".
+var boltDir = filepath.Join(projectCacheDir, "bolt")
+
+// boltOptimizeFlags are the llvm-bolt flags for the final optimization:
+// hot blocks and functions are laid out together, and cold code is split off.
+var boltOptimizeFlags = []string{
+	"-reorder-blocks=ext-tsp",
+	"-reorder-functions=hfsort",
+	"-split-functions",
+	"-split-all-cold",
+	"-icf=1",
+	"-dyno-stats",
+}
+
+// doBolt builds the optimized executable, with the stored PGO profile if
+// there is one, records where it spends its time during the training
+// workload and then lets llvm-bolt reorder its functions and blocks. The
+// result replaces the executable. The profile is sampled with perf and
+// branch records when possible, or else recorded with an instrumented copy.
+func doBolt(training PGOTraining) error {
+	if !isLinux() {
+		return fmt.Errorf("oh bolt needs Linux, since llvm-bolt only optimizes ELF executables")
+	}
+	bolt := llvmTool("llvm-bolt")
+	if bolt == "" {
+		return fmt.Errorf("llvm-bolt not found in PATH")
+	}
+	proj := detectProject(".")
+	if proj.HasWin64 {
+		return fmt.Errorf("oh bolt can not optimize Windows executables")
+	}
+	exe := executableName()
+	if exe == "" {
+		return fmt.Errorf("no executable to optimize")
+	}
+	opts := BuildOptions{Opt: true, Bolt: true}
+	if !hasStoredProfile(".", assembleFlags(proj, opts).Compiler) {
+		fmt.Fprintln(os.Stderr, "warning: there is no profile in pgo/, run oh rec first for the best results")
+	}
+
+	// Link again, so that the executable keeps the relocations that llvm-bolt needs
+	os.Remove(exe)
+	if err := doBuild(opts); err != nil {
+		return err
+	}
+	os.RemoveAll(boltDir)
+	if err := os.MkdirAll(boltDir, 0o755); err != nil {
+		return err
+	}
+	recordArtifacts(".", "", boltDir)
+
+	profiles, err := recordPerfProfiles(exe, training)
+	if err != nil {
+		return err
+	}
+	if len(profiles) == 0 {
+		if profiles, err = recordInstrumentedProfiles(bolt, exe, training); err != nil {
+			return err
+		}
+	}
+	profile, err := mergeBoltProfiles(profiles)
+	if err != nil {
+		return err
+	}
+
+	optimized := filepath.Join(boltDir, exe)
+	args := append([]string{exe, "-o", optimized, "-data=" + profile}, boltOptimizeFlags...)
+	if err := runTool(bolt, args...); err != nil {
+		return fmt.Errorf("llvm-bolt: %w", err)
+	}
+	if err := os.Rename(optimized, exe); err != nil {
+		return err
+	}
+	fmt.Printf("Optimized %s with llvm-bolt\n", exe)
+	return nil
+}
+
+// recordPerfProfiles samples the training runs with perf, recording branches,
+// and converts each sample to a BOLT profile with perf2bolt. Returns no
+// profiles, and no error, if perf or perf2bolt are missing, or the CPU or
+// kernel can not record branches.
+func recordPerfProfiles(exe string, training PGOTraining) ([]string, error) {
+	perf, _ := exec.LookPath("perf")
+	perf2bolt := llvmTool("perf2bolt")
+	if perf == "" || perf2bolt == "" {
+		return nil, nil
+	}
+	dataFile := func(i int) string { return filepath.Join(boltDir, "perf."+strconv.Itoa(i)+".data") }
+	err := training.run(dotSlash(exe), func(i int) []string {
+		return []string{perf, "record", "-e", "cycles:u", "-j", "any,u", "-o", dataFile(i), "--"}
+	})
+	if err != nil {
+		return nil, err
+	}
+	var profiles []string
+	for i := range training.commands(exe) {
+		if fi, err := os.Stat(dataFile(i)); err != nil || fi.Size() == 0 {
+			fmt.Fprintln(os.Stderr, "warning: perf could not record branches, using an instrumented executable instead")
+			return nil, nil
+		}
+		profile := filepath.Join(boltDir, "perf."+strconv.Itoa(i)+".fdata")
+		if err := runTool(perf2bolt, "-p", dataFile(i), "-o", profile, exe); err != nil {
+			return nil, fmt.Errorf("perf2bolt: %w", err)
+		}
+		profiles = append(profiles, profile)
+	}
+	return profiles, nil
+}
+
+// recordInstrumentedProfiles runs the training workload with a copy of the
+// executable that llvm-bolt has instrumented. Every process writes its own
+// profile.
+func recordInstrumentedProfiles(bolt, exe string, training PGOTraining) ([]string, error) {
+	instrumented := filepath.Join(boltDir, exe+".instrumented")
+	abs, err := filepath.Abs(filepath.Join(boltDir, "instr.fdata"))
+	if err != nil {
+		return nil, err
+	}
+	if err := runTool(bolt, exe, "-instrument", "-instrumentation-file="+abs,
+		"-instrumentation-file-append-pid", "-o", instrumented); err != nil {
+		return nil, fmt.Errorf("llvm-bolt -instrument: %w", err)
+	}
+	if err := training.run(dotSlash(instrumented), nil); err != nil {
+		return nil, err
+	}
+	profiles, _ := filepath.Glob(abs + ".*")
+	if len(profiles) == 0 {
+		return nil, fmt.Errorf("the training runs wrote no profiles to %s", boltDir)
+	}
+	return profiles, nil
+}
+
+// mergeBoltProfiles merges the profiles of several training runs with
+// merge-fdata, and returns the merged profile.
+func mergeBoltProfiles(profiles []string) (string, error) {
+	if len(profiles) == 1 {
+		return profiles[0], nil
+	}
+	mergeFdata := llvmTool("merge-fdata")
+	if mergeFdata == "" {
+		return "", fmt.Errorf("merge-fdata not found in PATH")
+	}
+	merged := filepath.Join(boltDir, "merged.fdata")
+	args := append(append([]string{}, profiles...), "-o", merged)
+	if err := runTool(mergeFdata, args...); err != nil {
+		return "", fmt.Errorf("merge-fdata: %w", err)
+	}
+	return merged, nil
+}
+
+// runTool runs a tool, with its output shown.
+func runTool(name string, args ...string) error {
+	cmd := exec.Command(name, args...)
+	cmd.Stdout = os.Stdout
+	cmd.Stderr = os.Stderr
+	return runCommand(cmd)
+}
+
+// removeBoltData removes the profiles and executables of "oh bolt", and the
+// cache directory if it is then empty.
+func removeBoltData() bool {
+	if _, err := os.Stat(boltDir); err != nil {
+		return false
+	}
+	if err := os.RemoveAll(boltDir); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
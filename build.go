@@ -1,11 +1,18 @@
 package orchideous
 
 import (
+	"context"
 	"fmt"
 	"os"
 	"os/exec"
 	"path/filepath"
+	"runtime"
+	"slices"
+	"strconv"
 	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
 // BuildOptions holds the configuration for a build.
@@ -21,8 +28,35 @@ type BuildOptions struct {
 	Zap             bool
 	Win64           bool
 	NoSanitizers    bool
+	Unity           bool // compile the dependency sources in batched unity translation units
 	ProfileGenerate bool
 	ProfileUse      bool
+	Bolt            bool // keep the relocations in the executable, for llvm-bolt
+	FramePointers   bool // keep the frame pointers, so that profilers can walk the stack
+	DebugInfo       bool // add -g to a build that is not a debug build, for profilers
+	Native          bool // tune an optimized build for the CPU of this machine
+	MultiArch       bool // clone the functions marked with OH_CLONES for several x86-64 levels
+	Jobs            int  // number of parallel compile jobs (0 = $OH_JOBS or the number of CPUs)
+
+	// Events, if set, is called when each compile and link of Build starts
+	// and finishes, from several goroutines at once.
+	Events func(BuildEvent)
+}
+
+// multiArchDefine defines OH_CLONES for "oh multiarch", as the attribute
+// that clones a function for each x86-64 microarchitecture level.
+const multiArchDefine = `-DOH_CLONES=__attribute__((target_clones("default","arch=x86-64-v2","arch=x86-64-v3","arch=x86-64-v4")))`
+
+// multiArchSupported reports whether the compiler can build functions with
+// target_clones, which needs an x86-64 target with ifunc support.
+func multiArchSupported(compiler string, win64 bool) bool {
+	if win64 || !isLinux() {
+		return false
+	}
+	if target := compilerTarget(compiler); target != "" {
+		return strings.HasPrefix(target, "x86_64")
+	}
+	return runtime.GOARCH == "amd64"
 }
 
 // BuildFlags holds the assembled compiler and linker flags.
@@ -33,11 +67,17 @@ type BuildFlags struct {
 	LDFlags     []string
 	Defines     []string
 	IncPaths    []string
-	DockerImage string // if set, compile via "docker run" with this image
+	DockerImage string   // if set, compile in a container of this image
+	Linker      string   // -fuse-ld= flag for a faster linker, only used when oh links
+	LTOCache    []string // link flags that keep an incremental LTO cache in .oh/lto, only used when oh links
+	Jobs        int      // number of parallel compile jobs
+	ObjDir      string   // build directory for the objects of this configuration, or "" to put them next to the sources
+	Modules     bool     // the sources use C++20 modules, so interfaces are compiled before their importers
+	Dir         string   `json:"-"` // the project directory, that the paths of the sources and objects are relative to
 }
 
-// assembleFlags creates the full set of build flags for a project.
-func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
+// assembleFlagsUncached creates the full set of build flags for a project.
+func assembleFlagsUncached(proj Project, opts BuildOptions) BuildFlags {
 	// Determine if this is win64 (from options or detected from source)
 	win64 := opts.Win64 || proj.HasWin64
 
@@ -79,6 +119,12 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 	}
 
 	bf.Compiler = compiler
+	bf.Jobs = jobCount(opts.Jobs, compiler)
+	opts = withStoredProfile(proj.Dir, opts, compiler)
+	bf.ObjDir = objectDir(opts, compiler)
+	if bf.DockerImage == "" {
+		bf.Linker = selectLinker(compiler, win64)
+	}
 
 	// Determine standard
 	if proj.IsC {
@@ -96,8 +142,14 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 	// Optimization flags
 	if opts.Debug {
 		bf.CFlags = append(bf.CFlags, "-O0", "-g", "-fno-omit-frame-pointer")
-		// Add sanitizers unless disabled
-		if !opts.NoSanitizers {
+		if !isDarwin() && !win64 {
+			// Keep the debug info in .dwo files next to the objects, so that the linker has less to do
+			bf.CFlags = append(bf.CFlags, "-gsplit-dwarf")
+		}
+		// Add sanitizers unless disabled, or the sanitizer runtime is missing
+		if !opts.NoSanitizers && !compilerHasSanitizers(compiler) {
+			fmt.Fprintf(os.Stderr, "warning: %s can not link with -fsanitize=address, building without sanitizers\n", filepath.Base(compiler))
+		} else if !opts.NoSanitizers {
 			bf.CFlags = append(bf.CFlags, "-fsanitize=address")
 			bf.LDFlags = append(bf.LDFlags, "-fsanitize=address")
 			if !isDarwin() {
@@ -129,19 +181,47 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 			}
 		}
 	} else if opts.Opt {
+		// Run the link time code generation in parallel: ThinLTO for clang,
+		// and for GCC 10+ as many LTO jobs as there are CPUs (or make jobs)
+		lto := "-flto"
 		if isEffectivelyClang(compiler) {
+			lto = "-flto=thin"
 			// -Ofast is deprecated in clang 17+; use the equivalent flags instead
-			bf.CFlags = append(bf.CFlags, "-O3", "-ffast-math", "-flto")
+			bf.CFlags = append(bf.CFlags, "-O3", "-ffast-math", lto)
 		} else {
-			bf.CFlags = append(bf.CFlags, "-Ofast", "-flto")
+			if gccMajorVersion(compiler) >= 10 {
+				lto = "-flto=auto"
+			}
+			bf.CFlags = append(bf.CFlags, "-Ofast", lto)
 		}
-		bf.LDFlags = append(bf.LDFlags, "-flto")
+		bf.LDFlags = append(bf.LDFlags, lto)
+		bf.LTOCache = ltoCacheFlags(compiler, bf.Linker, win64)
 	} else if proj.HasOpenMP {
 		bf.CFlags = append(bf.CFlags, "-O3")
 	} else {
 		bf.CFlags = append(bf.CFlags, "-O2")
 	}
 
+	if opts.FramePointers && !opts.Debug {
+		bf.CFlags = append(bf.CFlags, "-fno-omit-frame-pointer")
+		bf.LDFlags = append(bf.LDFlags, "-fno-omit-frame-pointer")
+	}
+	if opts.DebugInfo && !opts.Debug {
+		bf.CFlags = append(bf.CFlags, "-g")
+	}
+
+	// Use all the instructions of this CPU, for executables that are only
+	// run here. On ARM, where GCC has no -march=native, -mcpu=native does that.
+	if opts.Native {
+		for _, native := range [][]string{{"-march=native", "-mtune=native"}, {"-mcpu=native"}} {
+			if compilerCanLinkCached(compiler, native...) {
+				bf.CFlags = append(bf.CFlags, native...)
+				bf.LDFlags = append(bf.LDFlags, native...)
+				break
+			}
+		}
+	}
+
 	// Common flags
 	bf.CFlags = append(bf.CFlags, "-pipe")
 	if !opts.Small {
@@ -165,19 +245,30 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 
 	// Include paths
 	for _, ip := range localIncludePaths {
-		if fileExists(ip) {
+		if fileExists(projectFile(proj.Dir, ip)) {
 			bf.IncPaths = appendUnique(bf.IncPaths, ip)
 		}
 	}
 
 	// Directory defines
-	bf.Defines = dirDefines()
+	bf.Defines = dirDefines(proj.Dir)
 
 	// C-specific defines
 	if proj.IsC {
 		bf.Defines = append(bf.Defines, platformCDefine)
 	}
 
+	// An executable that runs on any x86-64 CPU, with the functions marked
+	// with OH_CLONES also compiled for x86-64-v2, v3 (AVX2) and v4 (AVX-512).
+	// The dynamic loader picks the best clone for the CPU, through an ifunc.
+	if opts.MultiArch {
+		if multiArchSupported(compiler, win64) {
+			bf.Defines = append(bf.Defines, multiArchDefine)
+		} else {
+			fmt.Fprintln(os.Stderr, "warning: function multi-versioning needs an x86-64 Linux target, building without OH_CLONES")
+		}
+	}
+
 	// OpenMP
 	if proj.HasOpenMP {
 		bf.CFlags = append(bf.CFlags, "-fopenmp")
@@ -188,21 +279,19 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 	if proj.HasBoost {
 		bf.CFlags = append(bf.CFlags, "-Wno-unknown-pragmas")
 		bf.LDFlags = append(bf.LDFlags, "-pthread", "-lpthread")
-		// Link boost libraries
-		for _, lib := range proj.BoostLibs {
-			bf.LDFlags = appendUnique(bf.LDFlags, "-l"+lib)
-		}
-		// boost_system must come last
+		// Link boost libraries, except for the header-only ones, like
+		// boost/asio.hpp, which have no library to link with
 		hasBoostLib := false
 		for _, lib := range proj.BoostLibs {
-			if strings.HasPrefix(lib, "boost_") {
+			if compilerCanLinkLibrary(compiler, lib) {
+				bf.LDFlags = appendUnique(bf.LDFlags, "-l"+lib)
 				hasBoostLib = true
-				break
 			}
 		}
+		// boost_system must come last
 		if hasBoostLib {
 			// Check if boost_system is available
-			out, err := exec.Command("sh", "-c", "ldconfig -p 2>/dev/null | grep boost_system").Output()
+			out, err := commandOutput("sh", "-c", "ldconfig -p 2>/dev/null | grep boost_system")
 			if err == nil && strings.Contains(string(out), "boost_system") {
 				bf.LDFlags = appendUnique(bf.LDFlags, "-lboost_system")
 			} else if fileExists("/usr/lib/libboost_system.so") {
@@ -216,6 +305,16 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 		bf.LDFlags = appendUnique(bf.LDFlags, "-lpthread")
 	}
 
+	// The parallel algorithms of libstdc++ run on TBB when its headers are
+	// installed, and then the program must be linked with it
+	if proj.HasParallel && !proj.IsC && !win64 && compilerCanLinkLibrary(compiler, "tbb") {
+		bf.LDFlags = appendUnique(bf.LDFlags, "-ltbb")
+		bf.LDFlags = appendUnique(bf.LDFlags, "-lpthread")
+	}
+
+	// C++20 modules
+	bf.Modules = proj.HasModules && !proj.IsC
+
 	// dlopen
 	if proj.HasDlopen {
 		bf.LDFlags = appendUnique(bf.LDFlags, "-ldl")
@@ -246,36 +345,25 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 		bf.LDFlags = appendUnique(bf.LDFlags, "-lvulkan")
 	}
 
-	// Profile-guided optimization
+	// Profile-guided optimization. Optimized builds use the profile that
+	// "oh rec" has stored in pgo/, if there is one.
 	if opts.ProfileGenerate {
 		if isEffectivelyClang(compiler) {
-			bf.CFlags = append(bf.CFlags, "-fprofile-generate")
-			bf.LDFlags = append(bf.LDFlags, "-fprofile-generate")
+			bf.CFlags = append(bf.CFlags, "-fprofile-generate="+pgoRawDir)
+			bf.LDFlags = append(bf.LDFlags, "-fprofile-generate="+pgoRawDir)
 		} else if isCompilerGCC(compiler) {
 			// -coverage and -fprofile-correction are GCC-specific
 			bf.CFlags = append(bf.CFlags, "-coverage", "-fprofile-generate", "-fprofile-correction")
 			bf.LDFlags = append(bf.LDFlags, "-coverage", "-fprofile-generate", "-fprofile-correction")
 		}
 	} else if opts.ProfileUse {
-		if isEffectivelyClang(compiler) {
-			bf.CFlags = append(bf.CFlags, "-fprofile-use")
-			bf.LDFlags = append(bf.LDFlags, "-fprofile-use")
-		} else if isCompilerGCC(compiler) {
-			bf.CFlags = append(bf.CFlags, "-fprofile-use", "-fprofile-correction")
-			bf.LDFlags = append(bf.LDFlags, "-fprofile-use", "-fprofile-correction")
-		}
-	} else {
-		// Auto-detect profile data for non-rec builds
-		gcdaFiles, _ := filepath.Glob("*.gcda")
-		if len(gcdaFiles) > 0 {
-			if isEffectivelyClang(compiler) {
-				bf.CFlags = append(bf.CFlags, "-fprofile-use")
-				bf.LDFlags = append(bf.LDFlags, "-fprofile-use")
-			} else if isCompilerGCC(compiler) {
-				bf.CFlags = append(bf.CFlags, "-fprofile-use", "-fprofile-correction")
-				bf.LDFlags = append(bf.LDFlags, "-fprofile-use", "-fprofile-correction")
-			}
-		}
+		bf.CFlags = append(bf.CFlags, profileUseFlags(compiler)...)
+		bf.LDFlags = append(bf.LDFlags, profileUseFlags(compiler)...)
+	}
+
+	// llvm-bolt can only move functions around if the relocations are kept
+	if opts.Bolt && isLinux() && !win64 {
+		bf.LDFlags = append(bf.LDFlags, "-Wl,--emit-relocs")
 	}
 
 	// Win64 specific flags
@@ -287,25 +375,22 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 		}
 		bf.LDFlags = appendUnique(bf.LDFlags, "-lm")
 		// Check for mingw include dir
-		mingwDir := "/usr/x86_64-w64-mingw32/include"
-		if fileExists(mingwDir) {
-			bf.IncPaths = appendUnique(bf.IncPaths, mingwDir)
+		if fileExists(mingwIncludeDir) {
+			bf.IncPaths = appendUnique(bf.IncPaths, mingwIncludeDir)
 		}
 	}
 
 	// Resolve pkg-config flags for external includes
-	if hasPkgConfig() {
-		seen := make(map[string]bool)
-		for _, inc := range proj.Includes {
-			pkgName := pkgNameFromInclude(inc)
-			if pkgName == "" || seen[pkgName] {
-				continue
-			}
-			seen[pkgName] = true
-			flags := pkgConfigFlags(pkgName)
-			if flags != "" {
-				bf.CFlags, bf.LDFlags = mergeFlags(bf.CFlags, bf.LDFlags, flags)
-			}
+	seen := make(map[string]bool)
+	for _, inc := range proj.Includes {
+		pkgName := pkgNameFromInclude(inc)
+		if pkgName == "" || seen[pkgName] || !hostPlatform.pkgConfig() {
+			continue
+		}
+		seen[pkgName] = true
+		flags := pkgConfigFlags(pkgName)
+		if flags != "" {
+			bf.CFlags, bf.LDFlags = mergeFlags(bf.CFlags, bf.LDFlags, flags)
 		}
 	}
 
@@ -315,14 +400,14 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 	bf.LDFlags = append(bf.LDFlags, extraLDFlags...)
 
 	// Resolve via platform package manager for unresolved includes
-	pkgCFlags, pkgLDFlags := resolveIncludesViaPackageManager(proj.Includes, systemIncludeDirs(), win64, bf.Compiler)
+	pkgCFlags, pkgLDFlags := resolveIncludesViaPackageManager(proj.Includes, hostPlatform, win64, bf.Compiler)
 	bf.CFlags = append(bf.CFlags, pkgCFlags...)
 	bf.LDFlags = append(bf.LDFlags, pkgLDFlags...)
 
 	// lib/ directory
-	if fileExists("lib") {
+	if fileExists(projectFile(proj.Dir, "lib")) {
 		bf.LDFlags = append(bf.LDFlags, "-Llib", "-Wl,-rpath,./lib")
-		soFiles, _ := filepath.Glob("lib/*.so")
+		soFiles, _ := filepath.Glob(projectFile(proj.Dir, "lib/*.so"))
 		for _, so := range soFiles {
 			name := filepath.Base(so)
 			name = strings.TrimPrefix(name, "lib")
@@ -356,9 +441,9 @@ func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
 	return bf
 }
 
-// doBuild compiles the project.
+// doBuild compiles the project in the current directory.
 func doBuild(opts BuildOptions) error {
-	proj := detectProject()
+	proj := detectProject(".")
 	return doBuildWithDirOverrides(opts, proj)
 }
 
@@ -378,7 +463,32 @@ func doBuildWithDirOverrides(opts BuildOptions, proj Project) error {
 		return nil
 	}
 
-	exe := executableName()
+	exe, flags := mainTarget(opts, proj)
+	if flags.DockerImage != "" {
+		defer stopDockerContainers(mustGetwd())
+	}
+	if !opts.ProfileGenerate && slices.Contains(flags.CFlags, "-fprofile-use") && fileExists(gccProfileDir) {
+		if err := installGCCProfile(flags.ObjDir); err != nil {
+			return fmt.Errorf("installing the profile from %s: %w", gccProfileDir, err)
+		}
+	}
+	var err error
+	if unityEnabled(opts) && !flags.Modules {
+		err = compileUnity(proj.MainSource, proj.DepSources, exe, flags)
+	} else {
+		err = compileSources(append([]string{proj.MainSource}, proj.DepSources...), exe, flags)
+	}
+	if err != nil {
+		recommendPackage(proj.Includes)
+		platformHints(proj.Includes)
+		return err
+	}
+	return nil
+}
+
+// mainTarget returns the executable name and the build flags for the main source of a project.
+func mainTarget(opts BuildOptions, proj Project) (string, BuildFlags) {
+	exe := executableNameIn(proj.Dir)
 	if opts.Win64 || proj.HasWin64 {
 		exe += ".exe"
 	}
@@ -387,95 +497,319 @@ func doBuildWithDirOverrides(opts BuildOptions, proj Project) error {
 
 	// Override directory defines with install paths if InstallPrefix is set
 	if opts.InstallPrefix != "" {
-		flags.Defines = installDirDefines(opts.InstallPrefix)
-	}
-
-	srcs := append([]string{proj.MainSource}, proj.DepSources...)
-	if err := compileSources(srcs, exe, flags); err != nil {
-		recommendPackage(proj.Includes)
-		platformHints(proj.Includes)
-		return err
+		flags.Defines = installDirDefines(proj.Dir, opts.InstallPrefix)
 	}
-	return nil
+	return exe, flags
 }
 
 // compileSources compiles and links the given source files into the output executable.
 // Uses incremental compilation: each source is compiled to a .o file, then linked.
+// Stale objects are compiled in parallel, on up to flags.Jobs workers.
 func compileSources(srcs []string, output string, flags BuildFlags) error {
 	dirName := filepath.Base(mustGetwd())
-	fmt.Printf("[%s] ", dirName)
 
-	// For a single source file, compile directly (no incremental needed)
-	if len(srcs) == 1 {
-		args := buildCompileArgs(flags, srcs, output)
+	// For a single source file, compile directly (no incremental needed),
+	// unless header units have to be compiled before it
+	if len(srcs) == 1 && !flags.Modules {
+		args := withLinker(flags, buildCompileArgs(flags, srcs, output))
 		cmd := runCompiler(flags, args)
-		fmt.Println(flags.Compiler, strings.Join(compactArgs(args), " "))
+		fmt.Printf("[%s] %s %s\n", dirName, flags.Compiler, strings.Join(compactArgs(args), " "))
 		cmd.Stdout = os.Stdout
 		cmd.Stderr = os.Stderr
-		if err := cmd.Run(); err != nil {
+		span := startSpan("compile", srcs[0])
+		err := cmd.Run()
+		span.end()
+		if err != nil {
 			return fmt.Errorf("compilation failed: %w", err)
 		}
+		manifest := loadBuildManifestIn(flags.Dir)
+		manifest.recordLink(flags, srcs[0], output, args)
+		manifest.save()
 		return nil
 	}
 
-	// Incremental: compile each source to .o, then link
-	var objFiles []string
-	needLink := false
-
-	for _, src := range srcs {
-		obj := strings.TrimSuffix(src, filepath.Ext(src)) + ".o"
-		objFiles = append(objFiles, obj)
+	// Incremental: compile each stale source to .o, then link
+	flags = withPrecompiledHeader(srcs, flags, dirName)
+	objFiles, jobs := planCompileJobs(srcs, flags)
+	needLink := len(jobs) > 0
 
-		if !needsRecompile(src, obj) {
-			continue
-		}
-		needLink = true
-
-		// Compile source to object (with -MMD for dependency tracking)
-		args := []string{"-std=" + flags.Std, "-MMD"}
-		args = append(args, flags.CFlags...)
-		args = append(args, flags.Defines...)
-		for _, ip := range flags.IncPaths {
-			args = append(args, "-I"+ip)
-		}
-		args = append(args, "-c", "-o", obj, src)
-
-		cmd := runCompiler(flags, args)
-		fmt.Println(flags.Compiler, strings.Join(compactArgs(args), " "))
-		cmd.Stdout = os.Stdout
-		cmd.Stderr = os.Stderr
-		if err := cmd.Run(); err != nil {
-			return fmt.Errorf("compiling %s: %w", src, err)
-		}
+	var stats launcherStats
+	statsOK := false
+	if needLink {
+		stats, statsOK = readLauncherStats()
+	}
+	err := runCompileJobs(flags, jobs, func(r compileResult) {
+		fmt.Printf("[%s] %s %s\n", dirName, flags.Compiler, strings.Join(compactArgs(r.job.args), " "))
+		os.Stderr.Write(r.output)
+	})
+	reportLauncherStats(dirName, stats, statsOK)
+	if err != nil {
+		return err
 	}
 
-	// Check if the output binary exists
-	if !fileExists(output) {
+	// Check if the output binary exists, and was linked from these objects
+	args := linkArgs(flags, objFiles, output)
+	manifest := loadBuildManifest()
+	if !fileExists(output) || !manifest.linkedWith(flags, output, args) {
 		needLink = true
 	}
 
 	if !needLink {
-		fmt.Println("up to date")
+		fmt.Printf("[%s] up to date\n", dirName)
 		return nil
 	}
 
 	// Link
-	args := []string{"-o", output}
-	args = append(args, objFiles...)
-	args = append(args, flags.LDFlags...)
 
 	cmd := runCompiler(flags, args)
-	fmt.Printf("[%s] ", dirName)
-	fmt.Println(flags.Compiler, strings.Join(compactArgs(args), " "))
+	fmt.Printf("[%s] %s %s\n", dirName, flags.Compiler, strings.Join(compactArgs(args), " "))
 	cmd.Stdout = os.Stdout
 	cmd.Stderr = os.Stderr
-	if err := cmd.Run(); err != nil {
+	span := startSpan("link", output)
+	err = cmd.Run()
+	span.end()
+	if err != nil {
 		return fmt.Errorf("linking failed: %w", err)
 	}
+	manifest.recordLink(flags, srcs[0], output, args)
+	manifest.save()
 
 	return nil
 }
 
+// compileJob is a single source file that needs to be compiled to an object file.
+type compileJob struct {
+	src      string
+	obj      string
+	args     []string
+	manifest *buildManifest   // records the job once it has compiled, may be nil
+	dir      string           // the project directory, or "" for the current directory
+	slots    chan struct{}    // limits the compiles over several projects, may be nil
+	events   func(BuildEvent) // may be nil
+	level    int              // jobs run after those of lower levels, which compile the module interfaces they import
+}
+
+// compileResult holds the outcome of a finished compileJob.
+type compileResult struct {
+	job    compileJob
+	cmd    *exec.Cmd
+	output []byte // combined stdout and stderr of the compiler
+	err    error
+}
+
+// planCompileJobs returns the object files for the given sources, together
+// with a compile job for each object that is missing or out of date. The
+// sources and objects are in the project directory flags.Dir, where the
+// jobs then run.
+func planCompileJobs(srcs []string, flags BuildFlags) ([]string, []compileJob) {
+	var objFiles []string
+	var jobs []compileJob
+	defer startSpan("plan", "planCompileJobs").end()
+	manifest := loadBuildManifestIn(flags.Dir)
+	if flags.Modules {
+		g := newModuleGraph(srcs, flags)
+		nodes := compileNodes(g.sources, flags)
+		for _, node := range nodes {
+			objFiles = append(objFiles, node.obj)
+		}
+		jobs = planModuleJobs(g, nodes, flags, manifest)
+		manifest.save()
+		return objFiles, withJobDir(jobs, flags.Dir)
+	}
+	for _, node := range compileNodes(srcs, flags) {
+		objFiles = append(objFiles, node.obj)
+		if manifest.needsRecompile(flags, node.src, node.obj, node.args) {
+			// The compiler does not create the directory of the object
+			os.MkdirAll(projectFile(flags.Dir, filepath.Dir(node.obj)), 0o755)
+			jobs = append(jobs, compileJob{src: node.src, obj: node.obj, args: node.args, manifest: manifest})
+		}
+	}
+	manifest.save()
+	return objFiles, withJobDir(jobs, flags.Dir)
+}
+
+// withJobDir returns jobs, set to run in the project directory dir.
+func withJobDir(jobs []compileJob, dir string) []compileJob {
+	for i := range jobs {
+		jobs[i].dir = dir
+	}
+	return jobs
+}
+
+// objectCompileArgs builds the compiler arguments for compiling one source to an object file
+// (with -MMD for dependency tracking).
+func objectCompileArgs(flags BuildFlags, src, obj string) []string {
+	args := append(objectCompileFlags(flags), stdModuleIncludeArgs(flags, src)...)
+	args = append(args, "-c", "-o", obj)
+	args = append(args, moduleSourceArgs(flags, src)...)
+	return append(args, src)
+}
+
+// objectCompileFlags returns the compiler arguments that every object is compiled with.
+func objectCompileFlags(flags BuildFlags) []string {
+	args := []string{"-std=" + flags.Std, "-MMD"}
+	args = append(args, flags.CFlags...)
+	args = append(args, flags.Defines...)
+	for _, ip := range flags.IncPaths {
+		args = append(args, "-I"+ip)
+	}
+	return append(args, moduleFlags(flags)...)
+}
+
+// compileError is returned by runCompileJobs when compiling a source fails.
+type compileError struct {
+	src string
+	err error
+}
+
+func (e *compileError) Error() string { return fmt.Sprintf("compiling %s: %v", e.src, e.err) }
+func (e *compileError) Unwrap() error { return e.err }
+
+// buildContext is cancelled by CancelBuilds, when oh is interrupted. The
+// compiles and links run in their own process groups, which then are killed,
+// since a Ctrl-C in the terminal only reaches the foreground process group.
+var buildContext, cancelBuilds = context.WithCancel(context.Background())
+
+// runningWaves is the number of compile waves that are running, which an
+// interrupted oh waits for, so that cancelled compiles are cleaned up.
+var runningWaves atomic.Int64
+
+// waitForBuilds waits until no compile wave is running, for at most timeout.
+// Returns false if some still are.
+func waitForBuilds(timeout time.Duration) bool {
+	deadline := time.Now().Add(timeout)
+	for runningWaves.Load() > 0 {
+		if time.Now().After(deadline) {
+			return false
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+	return true
+}
+
+// runCompileJobs runs the compile jobs on a pool of at most flags.Jobs workers.
+// The output of each job is collected and handed to report when the job is done,
+// so that output from parallel compiles never interleaves. The first failure
+// cancels all outstanding jobs, and objects left behind by cancelled compiles
+// are removed so that they are not mistaken for being up to date.
+func runCompileJobs(flags BuildFlags, jobs []compileJob, report func(compileResult)) error {
+	return runCompileJobsContext(buildContext, flags, jobs, report)
+}
+
+// runCompileJobsContext is like runCompileJobs, but all jobs are cancelled when ctx is.
+// Jobs of a higher level only start once all jobs of the lower levels are done.
+func runCompileJobsContext(parent context.Context, flags BuildFlags, jobs []compileJob, report func(compileResult)) error {
+	for _, wave := range compileWaves(jobs) {
+		if err := runCompileWave(parent, flags, wave, report); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// runCompileWave runs compile jobs that do not depend on each other.
+func runCompileWave(parent context.Context, flags BuildFlags, jobs []compileJob, report func(compileResult)) error {
+	if len(jobs) == 0 {
+		return nil
+	}
+	workers := min(max(flags.Jobs, 1), len(jobs))
+	runningWaves.Add(1)
+	defer runningWaves.Add(-1)
+
+	ctx, cancel := context.WithCancel(parent)
+	defer cancel()
+
+	var (
+		mu       sync.Mutex
+		firstErr error
+		wg       sync.WaitGroup
+	)
+	queue := make(chan compileJob)
+	for i := 0; i < workers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for job := range queue {
+				if job.slots != nil {
+					select {
+					case job.slots <- struct{}{}:
+					case <-ctx.Done():
+						continue
+					}
+				}
+				cmd := runCompilerIn(ctx, flags, job.dir, job.args)
+				emitEvent(job.events, BuildEvent{Kind: EventStarted, Source: job.src, Output: job.obj, Command: cmdToString(cmd)})
+				span := startSpan("compile", job.src)
+				start := time.Now()
+				output, err := runCaptured(cmd)
+				span.end()
+				emitEvent(job.events, finishedEvent(job.src, job.obj, cmd, output, err, time.Since(start)))
+				if job.slots != nil {
+					<-job.slots
+				}
+				if err != nil {
+					// A failed or cancelled compiler may leave a partial object behind
+					os.Remove(filepath.Join(job.dir, job.obj))
+				}
+				mu.Lock()
+				if firstErr != nil {
+					// Another job failed first, so this one was cancelled or is no longer needed
+					mu.Unlock()
+					continue
+				}
+				report(compileResult{job: job, cmd: cmd, output: output, err: err})
+				if err != nil {
+					firstErr = &compileError{src: job.src, err: err}
+					cancel()
+				}
+				mu.Unlock()
+				if err == nil {
+					job.manifest.record(flags, job.src, job.obj, job.args)
+				}
+			}
+		}()
+	}
+
+feed:
+	for _, job := range jobs {
+		select {
+		case queue <- job:
+		case <-ctx.Done():
+			break feed
+		}
+	}
+	close(queue)
+	wg.Wait()
+
+	// Save what was compiled, even if the build failed, so that it is not redone
+	for _, job := range jobs {
+		if job.manifest != nil {
+			job.manifest.save()
+			break
+		}
+	}
+	if firstErr == nil && parent.Err() != nil {
+		return parent.Err()
+	}
+	return firstErr
+}
+
+// jobCount returns the number of parallel compile jobs to use.
+// An explicit count takes precedence, then $OH_JOBS, then the number of CPUs,
+// plus the slots of the build hosts that compile with compiler, if objects
+// are compiled remotely.
+func jobCount(n int, compiler string) int {
+	if n > 0 {
+		return n
+	}
+	if s := os.Getenv("OH_JOBS"); s != "" {
+		if v, err := strconv.Atoi(s); err == nil && v > 0 {
+			return v
+		}
+	}
+	return runtime.NumCPU() + remoteCompiles().slots(compiler)
+}
+
 // buildCompileArgs builds the full compiler arguments for a single-shot compile+link.
 func buildCompileArgs(flags BuildFlags, srcs []string, output string) []string {
 	args := []string{"-std=" + flags.Std}
@@ -490,25 +824,48 @@ func buildCompileArgs(flags BuildFlags, srcs []string, output string) []string {
 	return args
 }
 
-// runCompiler executes the compiler, routing through Docker if DockerImage is set.
+// runCompiler executes the compiler in the project directory flags.Dir,
+// routing through Docker if DockerImage is set, and object compiles through
+// the compiler cache, if there is one.
 func runCompiler(flags BuildFlags, args []string) *exec.Cmd {
+	return runCompilerContext(buildContext, flags, args)
+}
+
+// runCompilerContext is like runCompiler, but the command is killed when ctx is cancelled.
+func runCompilerContext(ctx context.Context, flags BuildFlags, args []string) *exec.Cmd {
+	return runCompilerIn(ctx, flags, flags.Dir, args)
+}
+
+// runCompilerIn is like runCompilerContext, but the command runs in the
+// project directory dir, or in the current directory if dir is "".
+func runCompilerIn(ctx context.Context, flags BuildFlags, dir string, args []string) *exec.Cmd {
+	var cmd *exec.Cmd
 	if flags.DockerImage != "" {
-		cwd, _ := os.Getwd()
-		dockerArgs := []string{"run", "-v", cwd + ":/home", "-w", "/home", "--rm", flags.DockerImage, flags.Compiler}
-		dockerArgs = append(dockerArgs, args...)
-		return exec.Command("docker", dockerArgs...)
+		mount, _ := filepath.Abs(dir)
+		cmd = dockerCommand(ctx, flags.DockerImage, flags.Compiler, mount, args)
+	} else {
+		name, launchedArgs := launchedCommand(flags.Compiler, args)
+		cmd = exec.CommandContext(ctx, name, launchedArgs...)
+		if slices.Contains(args, "-c") {
+			if env := remoteEnv(flags.Compiler, compilerLauncher()); env != nil {
+				cmd.Env = append(os.Environ(), env...)
+			}
+		}
 	}
-	return exec.Command(flags.Compiler, args...)
+	cmd.Dir = dir
+	killProcessGroupOnCancel(cmd)
+	return cmd
 }
 
-// needsRecompile checks if the object file needs to be rebuilt.
+// needsRecompile checks if the object file needs to be rebuilt, for a source
+// and an object in the project directory dir.
 // Checks both source and header dependencies (via .d files from -MMD).
-func needsRecompile(src, obj string) bool {
-	srcInfo, err := os.Stat(src)
+func needsRecompile(dir, src, obj string) bool {
+	srcInfo, err := os.Stat(projectFile(dir, src))
 	if err != nil {
 		return true
 	}
-	objInfo, err := os.Stat(obj)
+	objInfo, err := os.Stat(projectFile(dir, obj))
 	if err != nil {
 		return true // object doesn't exist
 	}
@@ -516,25 +873,13 @@ func needsRecompile(src, obj string) bool {
 		return true
 	}
 	// Check header dependencies from .d file
-	depFile := strings.TrimSuffix(obj, ".o") + ".d"
-	data, err := os.ReadFile(depFile)
-	if err != nil {
-		return false // no dep file, trust the source check
-	}
-	// Parse the .d file: format is "obj: src header1 header2 ..."
-	// Lines may be continued with backslash
-	content := strings.ReplaceAll(string(data), "\\\n", " ")
-	for _, line := range strings.Split(content, "\n") {
-		if _, after, ok := strings.Cut(line, ":"); ok {
-			for _, dep := range strings.Fields(after) {
-				depInfo, err := os.Stat(dep)
-				if err != nil {
-					continue
-				}
-				if depInfo.ModTime().After(objInfo.ModTime()) {
-					return true
-				}
-			}
+	for _, dep := range depFileInputs(projectFile(dir, obj)) {
+		depInfo, err := os.Stat(projectFile(dir, dep))
+		if err != nil {
+			continue
+		}
+		if depInfo.ModTime().After(objInfo.ModTime()) {
+			return true
 		}
 	}
 	return false
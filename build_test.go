@@ -1,11 +1,16 @@
 package orchideous
 
 import (
+	"context"
+	"fmt"
 	"os"
+	"path/filepath"
 	"runtime"
 	"slices"
 	"strings"
+	"sync"
 	"testing"
+	"time"
 )
 
 func TestAssembleFlags_DefaultBuild(t *testing.T) {
@@ -13,7 +18,7 @@ func TestAssembleFlags_DefaultBuild(t *testing.T) {
 	writeFile(t, "main.cpp", `#include <iostream>
 int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{})
 
 	if flags.Compiler == "" {
@@ -34,20 +39,23 @@ func TestAssembleFlags_DebugBuild(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Debug: true})
 
 	assertFlagPresent(t, flags.CFlags, "-O0")
 	assertFlagPresent(t, flags.CFlags, "-g")
 	assertFlagPresent(t, flags.CFlags, "-fno-omit-frame-pointer")
 	assertFlagPresent(t, flags.LDFlags, "-fsanitize=address")
+	if runtime.GOOS == "linux" {
+		assertFlagPresent(t, flags.CFlags, "-gsplit-dwarf")
+	}
 }
 
 func TestAssembleFlags_DebugNoSan(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Debug: true, NoSanitizers: true})
 
 	assertFlagPresent(t, flags.CFlags, "-O0")
@@ -58,24 +66,31 @@ func TestAssembleFlags_OptBuild(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Opt: true})
 
 	if isEffectivelyClang(flags.Compiler) {
 		// clang 17+ deprecated -Ofast; the code uses -O3 -ffast-math instead
 		assertFlagPresent(t, flags.CFlags, "-O3")
 		assertFlagPresent(t, flags.CFlags, "-ffast-math")
+		assertFlagPresent(t, flags.CFlags, "-flto=thin")
+		assertFlagPresent(t, flags.LDFlags, "-flto=thin")
 	} else {
 		assertFlagPresent(t, flags.CFlags, "-Ofast")
+		lto := "-flto"
+		if gccMajorVersion(flags.Compiler) >= 10 {
+			lto = "-flto=auto"
+		}
+		assertFlagPresent(t, flags.CFlags, lto)
+		assertFlagPresent(t, flags.LDFlags, lto)
 	}
-	assertFlagPresent(t, flags.CFlags, "-flto")
 }
 
 func TestAssembleFlags_SmallBuild(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Small: true})
 
 	assertFlagPresent(t, flags.CFlags, "-Os")
@@ -88,7 +103,7 @@ func TestAssembleFlags_TinyBuild(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Small: true, Tiny: true})
 
 	assertFlagPresent(t, flags.CFlags, "-fno-rtti")
@@ -102,7 +117,7 @@ func TestAssembleFlags_StrictBuild(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Strict: true})
 
 	assertFlagPresent(t, flags.CFlags, "-Wextra")
@@ -114,7 +129,7 @@ func TestAssembleFlags_SloppyBuild(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Sloppy: true})
 
 	assertFlagPresent(t, flags.CFlags, "-fpermissive")
@@ -126,7 +141,7 @@ func TestAssembleFlags_CProject(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.c", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	if !proj.IsC {
 		t.Fatal("expected IsC to be true")
 	}
@@ -144,7 +159,7 @@ func TestAssembleFlags_OpenMP(t *testing.T) {
 	writeFile(t, "main.cpp", `#pragma omp parallel
 int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{})
 
 	assertFlagPresent(t, flags.CFlags, "-fopenmp")
@@ -160,7 +175,7 @@ func TestAssembleFlags_LinuxHardening(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{})
 
 	assertFlagPresent(t, flags.CFlags, "-fno-plt")
@@ -174,7 +189,7 @@ func TestAssembleFlags_NoLinuxHardeningWhenSloppy(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Sloppy: true})
 
 	assertFlagAbsent(t, flags.CFlags, "-fno-plt")
@@ -185,7 +200,7 @@ func TestAssembleFlags_ProfileGenerate(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Opt: true, ProfileGenerate: true})
 
 	assertFlagPresent(t, flags.CFlags, "-fprofile-generate")
@@ -195,12 +210,247 @@ func TestAssembleFlags_ProfileUse(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{Opt: true, ProfileUse: true})
 
 	assertFlagPresent(t, flags.CFlags, "-fprofile-use")
 }
 
+func TestAssembleFlags_StoredProfile(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+	writeFile(t, "main.gcda", "")
+
+	proj := detectProject(".")
+	flags := assembleFlags(proj, BuildOptions{Opt: true})
+	if isCompilerGCC(flags.Compiler) {
+		// Stray .gcda files are no longer picked up
+		assertFlagAbsent(t, flags.CFlags, "-fprofile-use")
+	}
+
+	writeFile(t, filepath.Join(gccProfileDir, "main.gcda"), "")
+	writeFile(t, clangProfile, "")
+	flags = assembleFlags(proj, BuildOptions{Opt: true})
+	assertTrue(t, slices.ContainsFunc(flags.CFlags, func(f string) bool {
+		return strings.HasPrefix(f, "-fprofile-use")
+	}), "opt builds should use the stored profile")
+
+	flags = assembleFlags(proj, BuildOptions{Debug: true})
+	assertTrue(t, !slices.ContainsFunc(flags.CFlags, func(f string) bool {
+		return strings.HasPrefix(f, "-fprofile-use")
+	}), "only opt builds should use the stored profile")
+}
+
+func TestPGOTrainingCommands(t *testing.T) {
+	cmds := PGOTraining{}.commands("./app")
+	assertTrue(t, len(cmds) == 1 && slices.Equal(cmds[0], []string{"./app"}), "without a workload, the executable should run once")
+
+	cmds = PGOTraining{Runs: [][]string{{"a"}, {"b", "c"}}}.commands("./app")
+	assertTrue(t, len(cmds) == 2 && slices.Equal(cmds[1], []string{"./app", "b", "c"}), "every set of arguments should be one run")
+
+	cmds = PGOTraining{Script: "train.sh"}.commands("./app")
+	assertTrue(t, len(cmds) == 1 && slices.Equal(cmds[0], []string{"sh", "train.sh"}), "the script should run instead")
+}
+
+func TestAssembleFlags_Bolt(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+
+	proj := detectProject(".")
+	flags := assembleFlags(proj, BuildOptions{Opt: true, Bolt: true})
+	if isLinux() {
+		assertFlagPresent(t, flags.LDFlags, "-Wl,--emit-relocs")
+	}
+	flags = assembleFlags(proj, BuildOptions{Opt: true})
+	assertFlagAbsent(t, flags.LDFlags, "-Wl,--emit-relocs")
+}
+
+func TestGCCProfilePath(t *testing.T) {
+	objDir := filepath.Join(".oh", "build", "opt-g++")
+	cases := map[string]string{
+		"app-main.gcda":                        filepath.Join("pgo", "gcc", "app-main.gcda"),
+		filepath.Join(objDir, "main.gcda"):     filepath.Join("pgo", "gcc", "obj", "main.gcda"),
+		filepath.Join(objDir, "common/x.gcda"): filepath.Join("pgo", "gcc", "obj", "common", "x.gcda"),
+		filepath.Join(objDir, "_up/util.gcda"): filepath.Join("pgo", "gcc", "obj", "_up", "util.gcda"),
+	}
+	for in, want := range cases {
+		if got := gccProfilePath(in, objDir); got != want {
+			t.Errorf("gccProfilePath(%q) = %q, want %q", in, got, want)
+		}
+	}
+}
+
+func TestObjectPath(t *testing.T) {
+	flags := BuildFlags{ObjDir: objectDir(BuildOptions{Debug: true}, "/usr/bin/g++")}
+	assertTrue(t, flags.ObjDir == filepath.Join(".oh", "build", "debug-g++"), "unexpected build directory "+flags.ObjDir)
+	assertTrue(t, objectPath(flags, "main.cpp") == filepath.Join(flags.ObjDir, "main.o"), "objects should be in the build directory")
+	assertTrue(t, objectPath(flags, "../common/x.cpp") == filepath.Join(flags.ObjDir, "_up", "common", "x.o"), "objects from outside the project should stay in the build directory")
+	assertTrue(t, objectPath(BuildFlags{}, "common/x.cpp") == filepath.Join("common", "x.o"), "without a build directory, objects are next to their sources")
+	assertTrue(t, objectDir(BuildOptions{Opt: true}, "clang++") != objectDir(BuildOptions{}, "clang++"), "build modes should not share objects")
+	dirs := map[string]bool{}
+	for _, opts := range []BuildOptions{{Opt: true}, {Opt: true, ProfileGenerate: true}, {Opt: true, ProfileUse: true}, {Opt: true, Bolt: true}} {
+		dirs[objectDir(opts, "g++")] = true
+	}
+	assertTrue(t, len(dirs) == 4, fmt.Sprintf("instrumented, profile optimized and BOLT builds should not share objects: %v", dirs))
+}
+
+func TestCompileSources_SwitchingModesRelinks(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `#include "util.h"
+int main() { return util(); }`)
+	writeFile(t, "include/util.h", `int util();`)
+	writeFile(t, "common/util.cpp", `int util() { return 0; }`)
+
+	proj := detectProject(".")
+	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	release := assembleFlags(proj, BuildOptions{})
+	debug := assembleFlags(proj, BuildOptions{Debug: true, NoSanitizers: true})
+	if err := compileSources(srcs, "app", release); err != nil {
+		t.Fatal(err)
+	}
+	if err := compileSources(srcs, "app", debug); err != nil {
+		t.Fatal(err)
+	}
+	// Both sets of objects are up to date, but the executable is from the debug ones
+	objs, jobs := planCompileJobs(srcs, release)
+	assertTrue(t, len(jobs) == 0, "the release objects should be kept")
+	releaseLink := linkArgs(release, objs, "app")
+	assertTrue(t, !loadBuildManifest().linkedWith(release, "app", releaseLink), "app should be linked from the debug objects")
+	if err := compileSources(srcs, "app", release); err != nil {
+		t.Fatal(err)
+	}
+	assertTrue(t, loadBuildManifest().linkedWith(release, "app", releaseLink), "switching back should relink")
+}
+
+func TestDiscoverProjects(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "hello/main.cpp", `int main() { return 0; }`)
+	writeFile(t, "hello/common/util.cpp", `int util() { return 0; }`)
+	writeFile(t, "games/pong/src/main.cpp", `int main() { return 0; }`)
+	writeFile(t, "onlytests/util_test.cpp", `int main() { return 0; }`)
+	writeFile(t, ".hidden/main.cpp", `int main() { return 0; }`)
+
+	dirs := discoverProjects(".")
+	if !slices.Equal(dirs, []string{"games/pong", "hello"}) {
+		t.Errorf("unexpected projects %v", dirs)
+	}
+}
+
+func TestDoAll_FailureDoesNotStopOthers(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "good/main.cpp", `#include "util.h"
+int main() { return util(); }`)
+	writeFile(t, "good/include/util.h", `int util();`)
+	writeFile(t, "good/common/util.cpp", `int util() { return 0; }`)
+	writeFile(t, "single/main.cpp", `int main() { return 0; }`)
+	writeFile(t, "bad/main.cpp", `int main() { return undeclared; }`)
+
+	err := doAll(BuildOptions{NoSanitizers: true}, nil)
+	if err == nil || !strings.Contains(err.Error(), "1 of 3") {
+		t.Fatalf("expected one failed project, got %v", err)
+	}
+	assertTrue(t, fileExists("good/good") && fileExists("single/single"), "the other projects should be built")
+	assertTrue(t, !fileExists("bad/bad"), "the failing project should have no executable")
+
+	// The objects and the link of the multi-source project are up to date now
+	if err := os.Chdir("good"); err != nil {
+		t.Fatal(err)
+	}
+	proj := detectProject(".")
+	flags := assembleFlags(proj, BuildOptions{NoSanitizers: true})
+	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	objs, jobs := planCompileJobs(srcs, flags)
+	assertTrue(t, len(jobs) == 0, "the objects should be up to date")
+	assertTrue(t, loadBuildManifest().linkedWith(flags, "good", linkArgs(flags, objs, "good")), "the link should be recorded")
+}
+
+func TestBuild_Concurrent(t *testing.T) {
+	root := withTempDir(t)
+	writeFile(t, "one/main.cpp", `#include "util.h"
+int main() { return util(); }`)
+	writeFile(t, "one/include/util.h", `int util();`)
+	writeFile(t, "one/common/util.cpp", `int util() { return 0; }`)
+	writeFile(t, "two/main.cpp", `int main() { return 0; }`)
+
+	dirs := []string{"one", "two", "one"} // the second build of one only relinks, if anything
+	errs := make([]error, len(dirs))
+	var wg sync.WaitGroup
+	for i, dir := range dirs[:2] {
+		wg.Add(1)
+		go func(i int, dir string) {
+			defer wg.Done()
+			_, errs[i] = Build(dir, BuildOptions{NoSanitizers: true})
+		}(i, dir)
+	}
+	wg.Wait()
+	result, err := Build(dirs[2], BuildOptions{NoSanitizers: true})
+	errs[2] = err
+	for i, err := range errs {
+		if err != nil {
+			t.Fatalf("building %s: %v", dirs[i], err)
+		}
+	}
+	assertTrue(t, mustGetwd() == root, "the current directory should be restored")
+	assertTrue(t, fileExists("one/one") && fileExists("two/two"), "both projects should be built")
+	assertTrue(t, len(result.CommandsRun) == 0, "the second build should be up to date")
+}
+
+func TestBuild_Events(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `#include "util.h"
+int main() { return util(); }`)
+	writeFile(t, "include/util.h", `int util();`)
+	writeFile(t, "common/util.cpp", `int util() { return undeclared; }`)
+
+	var mu sync.Mutex
+	var events []BuildEvent
+	_, err := Build(".", BuildOptions{NoSanitizers: true, Jobs: 1, Events: func(ev BuildEvent) {
+		mu.Lock()
+		events = append(events, ev)
+		mu.Unlock()
+	}})
+	assertTrue(t, err != nil, "the build should fail")
+	var failed *BuildEvent
+	started := 0
+	for i, ev := range events {
+		if ev.Kind == EventStarted {
+			started++
+		} else if ev.ExitCode != 0 {
+			failed = &events[i]
+		}
+	}
+	assertTrue(t, started > 0, "there should be started events")
+	if failed == nil || len(failed.Diagnostics) == 0 {
+		t.Fatalf("expected a failed compile with diagnostics, got %+v", events)
+	}
+	d := failed.Diagnostics[0]
+	assertTrue(t, failed.Source == "common/util.cpp", "the failed compile should be of common/util.cpp")
+	assertTrue(t, d.File == "common/util.cpp" && d.Line == 1 && d.Severity == "error", fmt.Sprintf("unexpected diagnostic %+v", d))
+}
+
+func TestParseDiagnostics(t *testing.T) {
+	output := []byte(`main.cpp: In function 'int main()':
+main.cpp:3:12: error: 'x' was not declared in this scope
+    3 |     return x;
+      |            ^
+util.h:7: warning: no column here
+/usr/bin/ld: cannot find -lfoo: No such file or directory
+`)
+	diags := parseDiagnostics(output)
+	if len(diags) != 2 {
+		t.Fatalf("expected 2 diagnostics, got %+v", diags)
+	}
+	assertTrue(t, diags[0] == Diagnostic{File: "main.cpp", Line: 3, Column: 12, Severity: "error", Message: "'x' was not declared in this scope"}, fmt.Sprintf("unexpected %+v", diags[0]))
+	assertTrue(t, diags[1].File == "util.h" && diags[1].Line == 7 && diags[1].Column == 0 && diags[1].Severity == "warning", fmt.Sprintf("unexpected %+v", diags[1]))
+}
+
+func TestLimitedBuffer(t *testing.T) {
+	b := &limitedBuffer{limit: 8}
+	b.Write([]byte("hello "))
+	b.Write([]byte("world"))
+	assertTrue(t, string(b.Bytes()) == "hello wo\n[3 more bytes of output were dropped]\n", fmt.Sprintf("unexpected %q", b.Bytes()))
+}
+
 func TestAssembleFlags_CXXFLAGS(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
@@ -208,7 +458,7 @@ func TestAssembleFlags_CXXFLAGS(t *testing.T) {
 	os.Setenv("CXXFLAGS", "-DTEST_FLAG -march=native")
 	defer os.Unsetenv("CXXFLAGS")
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{})
 
 	assertFlagPresent(t, flags.CFlags, "-DTEST_FLAG")
@@ -222,7 +472,7 @@ func TestAssembleFlags_CFLAGS(t *testing.T) {
 	os.Setenv("CFLAGS", "-DTEST_CFLAG -march=native")
 	defer os.Unsetenv("CFLAGS")
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{})
 
 	assertFlagPresent(t, flags.CFlags, "-DTEST_CFLAG")
@@ -236,7 +486,7 @@ func TestAssembleFlags_LDFLAGS(t *testing.T) {
 	os.Setenv("LDFLAGS", "-Wl,-z,relro,-z,now")
 	defer os.Unsetenv("LDFLAGS")
 
-	proj := detectProject()
+	proj := detectProject(".")
 	flags := assembleFlags(proj, BuildOptions{})
 
 	assertFlagPresent(t, flags.LDFlags, "-Wl,-z,relro,-z,now")
@@ -300,7 +550,7 @@ func TestDirDefines(t *testing.T) {
 	os.MkdirAll("img", 0o755)
 	os.MkdirAll("data", 0o755)
 
-	defs := dirDefines()
+	defs := dirDefines(".")
 	foundImg := false
 	foundData := false
 	for _, d := range defs {
@@ -348,6 +598,65 @@ func TestDotSlash(t *testing.T) {
 	}
 }
 
+func TestJobCount(t *testing.T) {
+	os.Setenv("OH_JOBS", "3")
+	defer os.Unsetenv("OH_JOBS")
+	if got := jobCount(5, "g++"); got != 5 {
+		t.Errorf("jobCount(5) = %d, want 5", got)
+	}
+	if got := jobCount(0, "g++"); got != 3 {
+		t.Errorf("jobCount(0) with OH_JOBS=3 = %d, want 3", got)
+	}
+	os.Setenv("OH_JOBS", "bogus")
+	if got := jobCount(0, "g++"); got != runtime.NumCPU() {
+		t.Errorf("jobCount(0) with invalid OH_JOBS = %d, want %d", got, runtime.NumCPU())
+	}
+}
+
+func TestRunCompileJobs_CancelsOnFailure(t *testing.T) {
+	if runtime.GOOS == "windows" {
+		t.Skip("uses sh")
+	}
+	withTempDir(t)
+	launcherOnce.Do(func() {})
+	orig := launcherPath
+	defer func() { launcherPath = orig }()
+	launcherPath = "" // run "sh" directly, even if ccache is installed
+	flags := BuildFlags{Compiler: "sh", Jobs: 2}
+	jobs := []compileJob{
+		{src: "fail.cpp", obj: "fail.o", args: []string{"-c", "touch fail.o; exit 1"}},
+		{src: "slow.cpp", obj: "slow.o", args: []string{"-c", "touch slow.o; sleep 10"}},
+		{src: "never.cpp", obj: "never.o", args: []string{"-c", "touch never.o"}},
+	}
+	var reported []string
+	err := runCompileJobs(flags, jobs, func(r compileResult) {
+		reported = append(reported, r.job.src)
+	})
+	if err == nil || !strings.Contains(err.Error(), "fail.cpp") {
+		t.Fatalf("expected error for fail.cpp, got %v", err)
+	}
+	if !slices.Contains(reported, "fail.cpp") || slices.Contains(reported, "slow.cpp") {
+		t.Errorf("unexpected reported jobs: %v", reported)
+	}
+	if fileExists("slow.o") || fileExists("fail.o") {
+		t.Error("expected the objects of the failed and the cancelled job to be removed")
+	}
+
+	// When the build is interrupted, every job is cancelled, including the first one to fail
+	ctx, cancel := context.WithTimeout(context.Background(), 200*time.Millisecond)
+	defer cancel()
+	jobs = []compileJob{
+		{src: "a.cpp", obj: "a.o", args: []string{"-c", "touch a.o; sleep 10"}},
+		{src: "b.cpp", obj: "b.o", args: []string{"-c", "touch b.o; sleep 10"}},
+	}
+	if err := runCompileWave(ctx, flags, jobs, func(compileResult) {}); err == nil {
+		t.Error("expected an error for an interrupted build")
+	}
+	if fileExists("a.o") || fileExists("b.o") {
+		t.Error("expected the objects of the interrupted jobs to be removed")
+	}
+}
+
 // helpers
 func assertFlagPresent(t *testing.T, flags []string, flag string) {
 	t.Helper()
@@ -364,3 +673,778 @@ func assertFlagAbsent(t *testing.T, flags []string, flag string) {
 		return
 	}
 }
+
+func TestAssembleFlags_Cached(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+
+	proj := detectProject(".")
+	first := assembleFlags(proj, BuildOptions{})
+	if !fileExists(flagCacheFile) {
+		t.Fatal("expected the flag cache to be written")
+	}
+	second := assembleFlags(proj, BuildOptions{})
+	if strings.Join(first.CFlags, " ") != strings.Join(second.CFlags, " ") || first.Std != second.Std {
+		t.Errorf("cached flags differ: %v vs %v", first, second)
+	}
+
+	os.Setenv("CXXFLAGS", "-DFROM_ENV")
+	defer os.Unsetenv("CXXFLAGS")
+	third := assembleFlags(proj, BuildOptions{})
+	assertFlagPresent(t, third.CFlags, "-DFROM_ENV")
+
+	if flagCacheKey(proj, BuildOptions{}) == flagCacheKey(proj, BuildOptions{Opt: true}) {
+		t.Error("expected different cache keys for different build options")
+	}
+	if flagCacheKey(proj, BuildOptions{Jobs: 1}) != flagCacheKey(proj, BuildOptions{Jobs: 8}) {
+		t.Error("expected the job count not to affect the cache key")
+	}
+}
+
+func TestBuildManifest(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "a.cpp", "#include \"a.h\"\nint a() { return A; }\n")
+	writeFile(t, "a.h", "#define A 1\n")
+	writeFile(t, "a.o", "object")
+	writeFile(t, "a.d", "a.o: a.cpp a.h\n")
+	flags := BuildFlags{Compiler: "g++"}
+	args := []string{"-c", "-o", "a.o", "a.cpp"}
+
+	m := loadBuildManifest()
+	m.record(flags, "a.cpp", "a.o", args)
+	m.save()
+
+	// Touching the inputs without changing them is not a reason to recompile
+	future := time.Now().Add(time.Hour)
+	os.Chtimes("a.cpp", future, future)
+	os.Chtimes("a.h", future, future)
+	m = loadBuildManifest()
+	if m.needsRecompile(flags, "a.cpp", "a.o", args) {
+		t.Error("expected touched but unchanged inputs to be up to date")
+	}
+	if !m.needsRecompile(flags, "a.cpp", "a.o", append(args, "-O2")) {
+		t.Error("expected a changed compile command to require a recompile")
+	}
+}
+
+func TestBuildManifest_ChangedHeader(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "a.cpp", "#include \"a.h\"\nint a() { return A; }\n")
+	writeFile(t, "a.h", "#define A 1\n")
+	writeFile(t, "a.o", "object")
+	writeFile(t, "a.d", "a.o: a.cpp \\\n a.h\n")
+	flags := BuildFlags{Compiler: "g++"}
+	args := []string{"-c", "-o", "a.o", "a.cpp"}
+
+	m := loadBuildManifest()
+	m.record(flags, "a.cpp", "a.o", args)
+	m.save()
+
+	writeFile(t, "a.h", "#define A 2\n")
+	if !loadBuildManifest().needsRecompile(flags, "a.cpp", "a.o", args) {
+		t.Error("expected a changed header to require a recompile")
+	}
+}
+
+func TestWaitForBuilds(t *testing.T) {
+	assertTrue(t, waitForBuilds(0), "expected no compile waves to be running")
+	runningWaves.Add(1)
+	assertTrue(t, !waitForBuilds(20*time.Millisecond), "expected a running compile wave to be waited for")
+	go func() {
+		time.Sleep(20 * time.Millisecond)
+		runningWaves.Add(-1)
+	}()
+	assertTrue(t, waitForBuilds(5*time.Second), "expected the wait to end with the compile wave")
+}
+
+func TestCleanArtifacts(t *testing.T) {
+	withTempDir(t)
+	debug := BuildFlags{Compiler: "g++", ObjDir: objectDir(BuildOptions{Debug: true}, "g++")}
+	opt := BuildFlags{Compiler: "g++", ObjDir: objectDir(BuildOptions{Opt: true}, "g++")}
+	legacy := BuildFlags{Compiler: "g++"}
+	debugObj, optObj := objectPath(debug, "main.cpp"), objectPath(opt, "main.cpp")
+	writeFile(t, "main.cpp", "int main() {}\n")
+	writeFile(t, filepath.Join("src", "x.cpp"), "int x() { return 0; }\n")
+	for _, f := range []string{debugObj, optObj, filepath.Join("src", "x.o"), filepath.Join("src", "x.d"), "app"} {
+		writeFile(t, f, "")
+	}
+	m := loadBuildManifest()
+	m.record(debug, "main.cpp", debugObj, nil)
+	m.record(opt, "main.cpp", optObj, nil)
+	m.record(legacy, filepath.Join("src", "x.cpp"), filepath.Join("src", "x.o"), nil)
+	m.recordLink(debug, "main.cpp", "app", nil)
+	writeFile(t, filepath.Join(boltDir, "perf.fdata"), "")
+	m.recordArtifacts("", boltDir)
+	m.save()
+
+	removed, ok := cleanArtifacts("debug")
+	assertTrue(t, ok, "expected the build manifest to be found")
+	assertTrue(t, !fileExists(debugObj) && !fileExists("app") && !fileExists(debug.ObjDir), fmt.Sprintf("expected the debug build to be removed, removed %v", removed))
+	assertTrue(t, fileExists(optObj) && fileExists(filepath.Join("src", "x.o")), "expected the other configurations to be kept")
+	assertTrue(t, !loadBuildManifest().linkedWith(debug, "app", nil), "expected the removed files to leave the manifest")
+
+	assertTrue(t, fileExists(boltDir), "expected the shared artifacts to be kept")
+
+	cleanArtifacts("")
+	for _, f := range []string{optObj, filepath.Join("src", "x.o"), filepath.Join("src", "x.d"), boltDir, buildRoot, buildManifestFile} {
+		assertTrue(t, !fileExists(f), f+" should be removed")
+	}
+	assertTrue(t, fileExists(filepath.Join("src", "x.cpp")), "expected the sources to be kept")
+	if _, ok := cleanArtifacts(""); ok {
+		t.Error("expected no build manifest after a full clean")
+	}
+}
+
+func TestBuildManifest_PrunesRemovedSources(t *testing.T) {
+	withTempDir(t)
+	flags := BuildFlags{Compiler: "g++", ObjDir: objectDir(BuildOptions{}, "g++")}
+	oldObj, newObj := objectPath(flags, "old.cpp"), objectPath(flags, "new.cpp")
+	for _, f := range []string{"old.cpp", "new.cpp", oldObj, strings.TrimSuffix(oldObj, ".o") + ".d", newObj} {
+		writeFile(t, f, "")
+	}
+	m := loadBuildManifest()
+	m.record(flags, "old.cpp", oldObj, nil)
+	m.record(flags, "new.cpp", newObj, nil)
+	m.save()
+
+	// Renamed, like "git mv old.cpp renamed.cpp"
+	os.Remove("old.cpp")
+	m = loadBuildManifest()
+	m.save()
+	assertTrue(t, !fileExists(oldObj) && !fileExists(strings.TrimSuffix(oldObj, ".o")+".d"), "expected the objects of the removed source to be removed")
+	assertTrue(t, fileExists(newObj), "expected the other objects to be kept")
+	m = loadBuildManifest()
+	assertTrue(t, m.Objects[oldObj] == nil && m.Objects[newObj] != nil, "expected only the entry of the removed source to leave the manifest")
+}
+
+func TestPlatformEnv_Lazy(t *testing.T) {
+	env := &platformEnv{}
+	cflags, ldflags := resolveIncludesViaPackageManager(nil, env, false, "g++")
+	assertTrue(t, cflags == nil && ldflags == nil, "expected no flags without includes")
+	untouched := func(once *sync.Once) bool {
+		ran := false
+		once.Do(func() { ran = true })
+		return ran
+	}
+	assertTrue(t, untouched(&env.typeOnce) && untouched(&env.pkgConfigOnce) && untouched(&env.includeOnce),
+		"expected the platform not to be examined when there are no includes to resolve")
+
+	env = &platformEnv{}
+	assertTrue(t, env.typ() == detectPlatformType() && env.typ() == env.platformType, "expected the platform type to be remembered")
+}
+
+func TestIncludeResolveCache(t *testing.T) {
+	dir := withTempDir(t)
+	path := filepath.Join(dir, "includes.cache")
+	writeFile(t, "foo.h", "")
+
+	c := &includeResolveCache{Stamp: packageDBStamp("generic"), Flags: map[string]string{"foo.h\x00g++": "-lfoo"}, path: path, dirty: true}
+	c.save()
+
+	var loaded includeResolveCache
+	if !readJSONFile(path, &loaded) {
+		t.Fatal("expected the include resolution cache to be written")
+	}
+	loaded.path = path
+	if got := loaded.resolve("generic", "foo.h", "g++"); got != "-lfoo" {
+		t.Errorf("expected cached flags, got %q", got)
+	}
+	if got := loaded.resolve("generic", "missing.h", "g++"); got != "" || len(loaded.Flags) != 1 {
+		t.Errorf("expected missing includes not to be cached, got %q and %v", got, loaded.Flags)
+	}
+	if packageDBStamp("arch") == packageDBStamp("deb") {
+		t.Error("expected the package database stamp to depend on the platform type")
+	}
+}
+
+func TestFindIncludeFile_Indexed(t *testing.T) {
+	dir := withTempDir(t)
+	t.Setenv("OH_NOCACHE", "1")
+	writeFile(t, filepath.Join("sys", "a", "barfoo.h"), "")
+	writeFile(t, filepath.Join("sys", "b", "GL", "foo.h"), "")
+	writeFile(t, filepath.Join("sys", "c", "d", "e", "f", "deep.h"), "")
+	sysDir := filepath.Join(dir, "sys")
+
+	if got, want := findIncludeFile(sysDir, "foo.h"), filepath.Join(sysDir, "b", "GL", "foo.h"); got != want {
+		t.Errorf("findIncludeFile(foo.h) = %q, want %q", got, want)
+	}
+	if got, want := findIncludeFile(sysDir, "GL/foo.h"), filepath.Join(sysDir, "b", "GL", "foo.h"); got != want {
+		t.Errorf("findIncludeFile(GL/foo.h) = %q, want %q", got, want)
+	}
+	if got := findIncludeFile(sysDir, "deep.h"); got != "" {
+		t.Errorf("expected headers more than three levels down not to be found, got %q", got)
+	}
+	if got := findIncludeFile(sysDir, "oo.h"); got != "" {
+		t.Errorf("expected suffixes to start at a path component, got %q", got)
+	}
+}
+
+func TestWatchSession_AffectsDetection(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", "#include \"util.h\"\nint main() { return 0; }\n")
+	writeFile(t, "util.h", "#pragma once\n")
+	w := &watchSession{}
+	w.detect()
+	w.stamps = w.snapshot()
+
+	writeFile(t, "main.cpp", "#include \"util.h\"\nint main() { return 1 + 1; }\n")
+	future := time.Now().Add(time.Hour)
+	os.Chtimes("main.cpp", future, future)
+	changed := changedFiles(w.stamps, w.snapshot())
+	if !slices.Equal(changed, []string{"main.cpp"}) {
+		t.Fatalf("expected only main.cpp to have changed, got %v", changed)
+	}
+	if w.affectsDetection(changed) {
+		t.Error("a change to a function body should not require detection")
+	}
+
+	writeFile(t, "main.cpp", "#include \"util.h\"\n#include <thread>\nint main() { return 1 + 1; }\n")
+	if !w.affectsDetection(changed) {
+		t.Error("a new #include should require detection")
+	}
+
+	writeFile(t, "extra.cpp", "void extra() {}\n")
+	changed = changedFiles(w.stamps, w.snapshot())
+	if !slices.Contains(changed, "extra.cpp") || !w.affectsDetection([]string{"extra.cpp"}) {
+		t.Error("a new source file should require detection")
+	}
+}
+
+func TestPCHIncludes(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "a.cpp", "// a\n#include <vector>\n#include <string>\n#include \"a.h\"\n#include <map>\n")
+	writeFile(t, "b.cpp", "#include <string>\n#include <vector>\n#include <map>\n")
+	writeFile(t, "c.cpp", "#define NDEBUG\n#include <vector>\n")
+
+	got := pchIncludes([]string{"a.cpp", "b.cpp"})
+	if !slices.Equal(got, []string{"vector", "string"}) {
+		t.Errorf("expected [vector string], got %v", got)
+	}
+	if got := pchIncludes([]string{"a.cpp", "c.cpp"}); len(got) != 0 {
+		t.Errorf("expected no headers after a #define, got %v", got)
+	}
+}
+
+func TestPCHEnabled(t *testing.T) {
+	t.Setenv("OH_PCH", "")
+	if pchEnabled(2) || !pchEnabled(pchAutoSources) {
+		t.Error("expected precompiled headers only from pchAutoSources sources")
+	}
+	t.Setenv("OH_PCH", "1")
+	if !pchEnabled(2) || pchEnabled(1) {
+		t.Error("expected OH_PCH=1 to enable precompiled headers for more than one source")
+	}
+	t.Setenv("OH_PCH", "0")
+	if pchEnabled(100) {
+		t.Error("expected OH_PCH=0 to disable precompiled headers")
+	}
+}
+
+func TestTraceSpans(t *testing.T) {
+	dir := withTempDir(t)
+	activeTracer()
+	traceActive = &tracer{path: filepath.Join(dir, "trace.json"), start: time.Now()}
+	defer func() { traceActive = nil }()
+
+	a := startSpan("compile", "a.cpp")
+	b := startSpan("compile", "b.cpp")
+	b.end()
+	a.end()
+	startSpan("link", "main").end()
+	if _, err := commandOutput("go", "version"); err != nil {
+		t.Skip("go not in PATH")
+	}
+	if err := writeTrace(); err != nil {
+		t.Fatal(err)
+	}
+
+	var trace struct{ TraceEvents []traceEvent }
+	if !readJSONFile(filepath.Join(dir, "trace.json"), &trace) {
+		t.Fatal("expected a valid JSON trace")
+	}
+	if len(trace.TraceEvents) != 4 {
+		t.Fatalf("expected 4 events, got %d", len(trace.TraceEvents))
+	}
+	lanes := make(map[string]int)
+	for _, e := range trace.TraceEvents {
+		lanes[e.Name] = e.Tid
+		assertTrue(t, e.Ph == "X", "complete event")
+	}
+	if lanes["a.cpp"] == lanes["b.cpp"] {
+		t.Error("expected overlapping spans on different lanes")
+	}
+	if lanes["main"] != lanes["a.cpp"] {
+		t.Error("expected a free lane to be reused")
+	}
+	if !strings.HasPrefix(trace.TraceEvents[3].Name, "go version") {
+		t.Errorf("expected an exec span for the subprocess, got %q", trace.TraceEvents[3].Name)
+	}
+}
+
+func TestPlanUnityBatches(t *testing.T) {
+	withTempDir(t)
+	var deps []string
+	for _, name := range []string{"common/a.cpp", "common/b.cpp", "common/c.cpp", "common/d.cpp", "common/e.cpp", "common/x.c"} {
+		writeFile(t, name, "int f() { return 0; }\n")
+		deps = append(deps, name)
+	}
+	writeFile(t, "common/skip.cpp", "// oh:no-unity\nint g() { return 0; }\n")
+	deps = append(deps, "common/skip.cpp")
+
+	batches, single := planUnityBatches(deps, 2)
+	if len(batches) != 2 {
+		t.Fatalf("expected 2 batches, got %d", len(batches))
+	}
+	var members []string
+	for _, b := range batches {
+		assertTrue(t, strings.HasSuffix(b.file, ".cpp"), "C++ batch file")
+		assertTrue(t, len(b.members) >= unityMinBatch, "batch size")
+		members = append(members, b.members...)
+	}
+	if !slices.Equal(members, []string{"common/a.cpp", "common/b.cpp", "common/c.cpp", "common/d.cpp", "common/e.cpp"}) {
+		t.Errorf("unexpected batch members: %v", members)
+	}
+	slices.Sort(single)
+	if !slices.Equal(single, []string{"common/skip.cpp", "common/x.c"}) {
+		t.Errorf("expected the opted out source and the lone C source to be single, got %v", single)
+	}
+}
+
+func TestLaunchedCommand(t *testing.T) {
+	launcherOnce.Do(func() {})
+	orig := launcherPath
+	defer func() { launcherPath = orig }()
+	launcherPath = "/usr/bin/ccache"
+
+	name, args := launchedCommand("g++", []string{"-c", "-o", "a.o", "a.cpp"})
+	if name != "/usr/bin/ccache" || !slices.Equal(args, []string{"g++", "-c", "-o", "a.o", "a.cpp"}) {
+		t.Errorf("expected the compile to go through ccache, got %s %v", name, args)
+	}
+	if name, _ := launchedCommand("g++", []string{"-o", "main", "a.o"}); name != "g++" {
+		t.Errorf("expected the link to run the compiler directly, got %s", name)
+	}
+	if findCompilerLauncher("off") != "" {
+		t.Error("expected OH_CACHE=off to disable the launcher")
+	}
+}
+
+func TestRemoteCompiles(t *testing.T) {
+	remoteOnce.Do(func() {})
+	origRemote, origLauncher := remote, launcherPath
+	defer func() { remote, launcherPath = origRemote, origLauncher }()
+	launcherOnce.Do(func() {})
+	remote = &remoteBackend{distcc: "/usr/bin/distcc", hosts: []string{"localhost", "build1/16", "build2,lzo", "--randomize"}}
+
+	assertTrue(t, remote.slots("g++") == 2+16+4, "unexpected number of remote slots")
+	remoteHostsMutex.Lock()
+	remoteHosts["oh-test-cc"] = []string{"build1/16"} // as if the other hosts had a different compiler
+	remoteHostsMutex.Unlock()
+	assertTrue(t, remote.slots("oh-test-cc") == 16, "expected only the kept hosts to be counted")
+	launcherPath = ""
+	name, args := launchedCommand("g++", []string{"-c", "-o", "a.o", "a.cpp"})
+	assertTrue(t, name == "/usr/bin/distcc" && args[0] == "g++", "the compile should go through distcc")
+	if name, _ := launchedCommand("g++", []string{"-o", "main", "a.o"}); name != "g++" {
+		t.Errorf("expected the link to stay local, got %s", name)
+	}
+
+	launcherPath = "/usr/bin/ccache"
+	name, _ = launchedCommand("g++", []string{"-c", "-o", "a.o", "a.cpp"})
+	assertTrue(t, name == "/usr/bin/ccache", "ccache should stay in front of distcc")
+	env := remoteEnv("g++", launcherPath)
+	assertFlagPresent(t, env, "CCACHE_PREFIX=/usr/bin/distcc")
+	assertFlagPresent(t, env, "DISTCC_HOSTS=localhost build1/16 build2,lzo --randomize")
+	if findRemoteBackend("off") != nil {
+		t.Error("expected OH_REMOTE=off to compile locally")
+	}
+}
+
+func TestDistccHostSpecs(t *testing.T) {
+	for spec, want := range map[string]int{"build1": 4, "build1/16": 16, "@build2/8,lzo": 8, "localhost": 2, "user@build3:/opt/bin/distccd": 4, "+zeroconf": 0} {
+		assertTrue(t, hostSlots(spec) == want, "unexpected slots for "+spec)
+	}
+	for spec, want := range map[string]string{"build1/16": "", "@build2/8,lzo": "build2", "user@build3:/opt/bin/distccd/4": "user@build3"} {
+		assertTrue(t, sshHost(spec) == want, "unexpected ssh host for "+spec)
+	}
+}
+
+func TestDockerCommand_PersistentContainer(t *testing.T) {
+	dir := withTempDir(t)
+	dockerContainers[dockerKey("jhasse/mingw:latest", dir)] = "oh-test"
+	flags := BuildFlags{Compiler: "x86_64-w64-mingw32-g++", DockerImage: "jhasse/mingw:latest"}
+	cmd := runCompiler(flags, []string{"-c", "-o", "main.o", "main.cpp"})
+	if !slices.Equal(cmd.Args, []string{"docker", "exec", "oh-test", "x86_64-w64-mingw32-g++", "-c", "-o", "main.o", "main.cpp"}) {
+		t.Errorf("expected the compile to run in the build's container, got %v", cmd.Args)
+	}
+	stopDockerContainers(dir)
+	_, ok := dockerContainers[dockerKey("jhasse/mingw:latest", dir)]
+	assertTrue(t, !ok, "the container should be forgotten after the build")
+}
+
+func TestParseLauncherStats(t *testing.T) {
+	st, ok := parseCcacheStats([]byte("stats_updated_timestamp\t1700000000\ndirect_cache_hit\t3\npreprocessed_cache_hit\t1\ncache_miss\t2\n"))
+	if !ok || st.hits != 4 || st.misses != 2 {
+		t.Errorf("unexpected ccache stats: %+v", st)
+	}
+	st, ok = parseSccacheStats([]byte(`{"stats":{"cache_hits":{"counts":{"C/C++":5}},"cache_misses":{"counts":{"C/C++":1}}}}`))
+	if !ok || st.hits != 5 || st.misses != 1 {
+		t.Errorf("unexpected sccache stats: %+v", st)
+	}
+}
+
+func TestSelectLinker(t *testing.T) {
+	t.Setenv("OH_LINKER", "off")
+	if l := selectLinker("g++", false); l != "" {
+		t.Errorf("expected OH_LINKER=off to use the default linker, got %s", l)
+	}
+	t.Setenv("OH_LINKER", "")
+	if l := selectLinker("g++", true); l != "" {
+		t.Errorf("expected no linker to be picked for win64, got %s", l)
+	}
+	flags := BuildFlags{LDFlags: []string{"-lm"}, Linker: "-fuse-ld=mold"}
+	args := linkArgs(flags, []string{"a.o", "b.o"}, "main")
+	if !slices.Equal(args, []string{"-o", "main", "a.o", "b.o", "-lm", "-fuse-ld=mold"}) {
+		t.Errorf("unexpected link arguments: %v", args)
+	}
+}
+
+func TestLTOCacheFlags(t *testing.T) {
+	if runtime.GOOS == "darwin" {
+		assertFlagPresent(t, ltoCacheFlags("clang++", "", false), "-Wl,-cache_path_lto,"+ltoCacheDir)
+	} else {
+		assertFlagPresent(t, ltoCacheFlags("clang++", "-fuse-ld=lld", false), "-Wl,--thinlto-cache-dir="+ltoCacheDir)
+		if flags := ltoCacheFlags("clang++", "", false); flags != nil {
+			t.Errorf("expected no ThinLTO cache without lld, got %v", flags)
+		}
+	}
+	if flags := ltoCacheFlags("clang++", "-fuse-ld=lld", true); flags != nil {
+		t.Errorf("expected no LTO cache for win64, got %v", flags)
+	}
+	compilerProfileOf("fake-g++-15")
+	compilerProfilesMutex.Lock()
+	compilerProfiles["fake-g++-15"].Major = 15
+	compilerProfilesMutex.Unlock()
+	assertFlagPresent(t, ltoCacheFlags("fake-g++-15", "", false), "-flto-incremental="+ltoCacheDir)
+}
+
+func TestShardTests(t *testing.T) {
+	tests := []string{"d_test.cpp", "a_test.cpp", "c_test.cpp", "b_test.cpp", "e_test.cpp"}
+	if got := shardTests(tests, 0, 0); !slices.Equal(got, []string{"a_test.cpp", "b_test.cpp", "c_test.cpp", "d_test.cpp", "e_test.cpp"}) {
+		t.Errorf("expected all tests, sorted, got %v", got)
+	}
+	var all []string
+	for i := 1; i <= 2; i++ {
+		all = append(all, shardTests(tests, i, 2)...)
+	}
+	slices.Sort(all)
+	if !slices.Equal(all, shardTests(tests, 0, 0)) {
+		t.Errorf("expected the shards to cover every test once, got %v", all)
+	}
+	if i, n, err := parseShard("2/3"); err != nil || i != 2 || n != 3 {
+		t.Errorf("unexpected shard 2/3: %d/%d, %v", i, n, err)
+	}
+	for _, bad := range []string{"0/3", "4/3", "1", "a/b", "1/0"} {
+		if _, _, err := parseShard(bad); err == nil {
+			t.Errorf("expected an error for shard %q", bad)
+		}
+	}
+}
+
+func TestScanModules(t *testing.T) {
+	s := newSourceScan([]byte(`module;
+#include <cstdio>
+export module shapes:circle;
+import :util;
+export import math;
+import <vector>;
+import "local.h";
+`))
+	assertTrue(t, s.module == "shapes:circle", "the partition should be the module of the file, got "+s.module)
+	assertTrue(t, slices.Equal(s.imports, []string{"shapes:util", "math"}), fmt.Sprintf("unexpected imports %v", s.imports))
+	assertTrue(t, slices.Equal(s.headerUnits, []string{"<vector>", `"local.h"`}), fmt.Sprintf("unexpected header units %v", s.headerUnits))
+	assertTrue(t, s.flags.HasModules, "modules should be detected")
+
+	impl := newSourceScan([]byte("module math;\nint twice(int x) { return 2 * x; }\n"))
+	assertTrue(t, impl.module == "" && slices.Equal(impl.imports, []string{"math"}), "an implementation unit should import its module")
+
+	plain := newSourceScan([]byte("#include <cstdio>\nint important = 1;\n"))
+	assertTrue(t, !plain.flags.HasModules, "a source without modules should not be detected as using them")
+}
+
+func TestModuleGraph_Levels(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", "import shapes;\nint main() { return area(1); }\n")
+	writeFile(t, "shapes.cppm", "export module shapes;\nimport math;\nexport int area(int s) { return square(s); }\n")
+	writeFile(t, "math.cppm", "export module math;\nexport int square(int x) { return x * x; }\n")
+	writeFile(t, "math_impl.cpp", "module math;\n")
+
+	g := newModuleGraph([]string{"main.cpp", "shapes.cppm", "math.cppm", "math_impl.cpp"}, BuildFlags{Compiler: "g++", Std: "c++20"})
+	for src, want := range map[string]int{"math.cppm": 0, "math_impl.cpp": 1, "shapes.cppm": 1, "main.cpp": 2} {
+		assertTrue(t, g.levels[src] == want, fmt.Sprintf("%s should be at level %d, got %d", src, want, g.levels[src]))
+	}
+	assertTrue(t, g.dependsOn("main.cpp", map[string]bool{"shapes.cppm": true}), "main.cpp should depend on the shapes interface")
+	assertTrue(t, !g.dependsOn("math.cppm", map[string]bool{"shapes.cppm": true}), "math.cppm should not depend on shapes")
+
+	waves := compileWaves([]compileJob{{src: "main.cpp", level: 2}, {src: "math.cppm"}, {src: "shapes.cppm", level: 1}})
+	assertTrue(t, len(waves) == 3 && waves[0][0].src == "math.cppm" && waves[2][0].src == "main.cpp", "jobs should run in level order")
+}
+
+func TestBuild_Modules(t *testing.T) {
+	if _, err := commandOutput("g++", "--version"); err != nil {
+		t.Skip("g++ not in PATH")
+	}
+	withTempDir(t)
+	writeFile(t, "main.cpp", "import <cstdio>;\nimport shapes;\nint main() { std::printf(\"%d\\n\", area(7)); return 0; }\n")
+	writeFile(t, "shapes.cppm", "export module shapes;\nimport math;\nexport int area(int s) { return square(s); }\n")
+	writeFile(t, "math.cppm", "export module math;\nexport int square(int x) { return x * x; }\n")
+	t.Setenv("CXX", "g++")
+
+	if _, err := Build(".", BuildOptions{NoSanitizers: true}); err != nil {
+		t.Fatal(err)
+	}
+	out, err := commandOutput(dotSlash(executableName()))
+	assertTrue(t, err == nil && strings.TrimSpace(string(out)) == "49", "the executable should print 49, got "+string(out))
+
+	writeFile(t, "math.cppm", "export module math;\nexport int square(int x) { return x * x + 1; }\n")
+	result, err := Build(".", BuildOptions{NoSanitizers: true})
+	if err != nil {
+		t.Fatal(err)
+	}
+	assertTrue(t, len(result.CommandsRun) == 4, fmt.Sprintf("math, its importers and the link should be redone, got %d commands", len(result.CommandsRun)))
+}
+
+func TestCompilerProfile(t *testing.T) {
+	if _, err := commandOutput("g++", "--version"); err != nil {
+		t.Skip("g++ not in PATH")
+	}
+	dir := t.TempDir()
+	defer func(file string) {
+		compilerProfileFile = file
+		compilerProfilesOnce = sync.Once{}
+	}(compilerProfileFile)
+	compilerProfileFile = filepath.Join(dir, "compilers.cache")
+	compilerProfilesOnce = sync.Once{}
+
+	p := compilerProfileOf("g++")
+	if p.Clang || p.Major == 0 || p.Target == "" {
+		// g++ is clang on macOS
+		assertTrue(t, p.Clang && runtime.GOOS == "darwin", fmt.Sprintf("unexpected profile for g++: %+v", p))
+	}
+	std := bestStdFlag("g++")
+	assertTrue(t, strings.HasPrefix(std, "c++"), "expected a C++ standard, got "+std)
+
+	// A new process reads the profile back, instead of probing the compiler again
+	var saved map[string]*compilerProfile
+	path, stamp := compilerStamp("g++")
+	assertTrue(t, readJSONFile(compilerProfileFile, &saved), "the profile should be saved")
+	assertTrue(t, saved[path] != nil && saved[path].Stamp == stamp && saved[path].BestStd == std, "the saved profile should have the best standard")
+	compilerProfilesOnce = sync.Once{}
+	assertTrue(t, compilerProfileOf("g++").BestStd == std, "the profile should be loaded from the cache")
+}
+
+func TestCompilerCanLinkStamped(t *testing.T) {
+	if _, err := commandOutput("g++", "--version"); err != nil {
+		t.Skip("g++ not in PATH")
+	}
+	dir := t.TempDir()
+	defer func(file string) {
+		compilerProfileFile = file
+		compilerProfilesOnce = sync.Once{}
+	}(compilerProfileFile)
+	compilerProfileFile = filepath.Join(dir, "compilers.cache")
+	compilerProfilesOnce = sync.Once{}
+
+	// A failure that was recorded before the library was installed
+	updateCompilerProfile("g++", func(p *compilerProfile) { p.Links = map[string]bool{"-lm|before": false} })
+	assertTrue(t, !compilerCanLinkStamped("g++", "before", "-lm"), "expected the recorded answer for the same stamp")
+	assertTrue(t, compilerCanLinkStamped("g++", "after", "-lm"), "expected a new probe when the stamp changes")
+	links := compilerProfileOf("g++").Links
+	assertTrue(t, len(links) == 1 && links["-lm|after"], fmt.Sprintf("expected only the answer for the new stamp, got %v", links))
+	assertTrue(t, libraryStamp("g++") == libraryStamp("g++"), "expected the library stamp to be stable")
+}
+
+func TestRunOutput_SharesIdenticalCommands(t *testing.T) {
+	if runtime.GOOS == "windows" {
+		t.Skip("uses sh")
+	}
+	script := fmt.Sprintf("sleep 0.3; echo %d", time.Now().UnixNano())
+	before := spawnCount.Load()
+	outs := make([]string, 3)
+	var wg sync.WaitGroup
+	for i := range outs {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			out, err := commandOutput("sh", "-c", script)
+			if err != nil {
+				t.Error(err)
+			}
+			outs[i] = string(out)
+		}(i)
+	}
+	wg.Wait()
+	assertTrue(t, spawnCount.Load()-before == 1, fmt.Sprintf("identical commands should run once, ran %d times", spawnCount.Load()-before))
+	assertTrue(t, outs[0] != "" && outs[0] == outs[1] && outs[1] == outs[2], "every caller should get the output")
+
+	var stat spawnStat
+	for _, s := range spawnBreakdown() {
+		if s.Category == "sleep (sh)" {
+			stat = s
+		}
+	}
+	assertTrue(t, stat.Count == 1 && stat.Shared == 2, fmt.Sprintf("unexpected stats for the shell pipeline: %+v", stat))
+}
+
+func TestSpawnBudget(t *testing.T) {
+	t.Setenv("OH_SPAWN_BUDGET", "")
+	assertTrue(t, checkSpawnBudget() == nil, "there should be no budget by default")
+	t.Setenv("OH_SPAWN_BUDGET", "0")
+	assertTrue(t, checkSpawnBudget() == nil, "a budget without :fail should only warn")
+	commandOutput("go", "version")
+	t.Setenv("OH_SPAWN_BUDGET", "0:fail")
+	assertTrue(t, checkSpawnBudget() != nil, "exceeding a budget with :fail should be an error")
+}
+
+func TestAssembleFlags_BoostHeaderOnly(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `#include <boost/asio/post.hpp>
+int main() { return 0; }`)
+
+	proj := detectProject(".")
+	flags := assembleFlags(proj, BuildOptions{})
+
+	// Boost.Asio is header-only, so there is no boost_asio library to link with
+	assertFlagAbsent(t, flags.LDFlags, "-lboost_asio")
+	assertFlagPresent(t, flags.LDFlags, "-pthread")
+}
+
+func TestBenchResults(t *testing.T) {
+	output := []byte("warming up\nbench sum 12.5 ns/op (fastest 12.0, 15 runs of 1024 calls)\nbench copy 100 ns/op\nbench broken x ns/op\n")
+	results := parseBenchOutput("common/vec_bench", output)
+	if len(results) != 2 || results[0] != (benchResult{"common/vec_bench/sum", 12.5}) || results[1].name != "common/vec_bench/copy" {
+		t.Fatalf("unexpected results: %v", results)
+	}
+	baseline := map[string]float64{"common/vec_bench/sum": 10, "common/vec_bench/copy": 95}
+	if regressed := compareBench(results, baseline, 0.1); !slices.Equal(regressed, []string{"common/vec_bench/sum"}) {
+		t.Errorf("expected only sum to be 25%% slower than the baseline, got %v", regressed)
+	}
+	if regressed := compareBench(results, map[string]float64{}, 0.1); len(regressed) != 0 {
+		t.Errorf("expected no regressions without a baseline, got %v", regressed)
+	}
+}
+
+func TestSizeReport(t *testing.T) {
+	nm := "0000000000000000 0000000000000010 T small\n\nb.o:\n0000000000000000 0000000000000100 W std::vector<int, std::allocator<int> >::push_back(int const&)\n0000000000000000 0000000000000040 T main\n0000000000000000 0000000000000010 T small\n"
+	sizes := parseNMSizes(nm)
+	assertTrue(t, len(sizes) == 3 && sizes["small"] == 16 && sizes["std::vector<int, std::allocator<int> >::push_back(int const&)"] == 256, fmt.Sprintf("unexpected nm sizes %v", sizes))
+	bloaty := "symbols,vmsize,filesize\nmain,64,80\n\"foo(int, char)\",200,180\n"
+	sizes = parseBloatyCSV(bloaty)
+	assertTrue(t, len(sizes) == 2 && sizes["main"] == 80 && sizes["foo(int, char)"] == 200, fmt.Sprintf("unexpected bloaty sizes %v", sizes))
+	assertTrue(t, formatSize(512) == "512 B" && formatSize(1536) == "1.5 KiB" && formatSize(3<<20) == "3.0 MiB", "unexpected size formatting")
+
+	if runtime.GOOS == "linux" {
+		exe, err := os.Executable()
+		if err != nil {
+			t.Fatal(err)
+		}
+		seg, err := executableSegments(exe)
+		assertTrue(t, err == nil && seg.text > 0 && seg.data > 0, fmt.Sprintf("expected the text and data of the test executable, got %+v, %v", seg, err))
+	}
+	if _, err := executableSegments("build_test.go"); err == nil {
+		t.Error("expected an error for a file that is not an executable")
+	}
+}
+
+func TestFoldPerfScript(t *testing.T) {
+	script := `prog
+	    1130 compute+0x1c
+	    1180 main+0x20
+	    7f00 __libc_start_main+0xf3
+
+prog
+	    1130 compute+0x10
+	    1180 main+0x20
+	    7f00 __libc_start_main+0xf3
+
+prog
+	    1200 std::vector<int, std::allocator<int> >::push_back(int const&)+0x8
+	    1180 main+0x20
+	    7f00 [unknown]
+`
+	stacks := foldPerfScript(strings.NewReader(script))
+	if len(stacks) != 2 || stacks["prog;__libc_start_main;main;compute"] != 2 ||
+		stacks["prog;[unknown];main;std::vector<int, std::allocator<int> >::push_back(int const&)"] != 1 {
+		t.Fatalf("unexpected folded stacks: %v", stacks)
+	}
+	funcs, samples := hotFunctions(stacks)
+	if samples != 3 || funcs[0].name != "compute" || funcs[0].self != 2 || funcs[0].total != 2 {
+		t.Errorf("expected compute to be the hottest function, got %v of %d samples", funcs, samples)
+	}
+	for _, f := range funcs {
+		if f.name == "main" && (f.self != 0 || f.total != 3) {
+			t.Errorf("expected main to have all the samples in its callees, got %+v", f)
+		}
+	}
+	var svg strings.Builder
+	writeFlameGraph(&svg, "prog", stacks)
+	for _, want := range []string{"<svg", "compute (2 samples, 66.67%)", "std::vector&lt;int"} {
+		if !strings.Contains(svg.String(), want) {
+			t.Errorf("expected %q in the flame graph", want)
+		}
+	}
+}
+
+func TestAssembleFlags_NativeAndMultiArch(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+
+	proj := detectProject(".")
+	flags := assembleFlags(proj, BuildOptions{Opt: true, Native: true})
+	if !slices.Contains(flags.CFlags, "-march=native") && !slices.Contains(flags.CFlags, "-mcpu=native") {
+		t.Errorf("expected -march=native or -mcpu=native, got %v", flags.CFlags)
+	}
+	assertFlagAbsent(t, assembleFlags(proj, BuildOptions{Opt: true}).CFlags, "-march=native")
+
+	flags = assembleFlags(proj, BuildOptions{Opt: true, MultiArch: true})
+	if multiArchSupported(flags.Compiler, false) != slices.Contains(flags.Defines, multiArchDefine) {
+		t.Errorf("expected OH_CLONES to be defined when target_clones is supported, got %v", flags.Defines)
+	}
+	assertTrue(t, !multiArchSupported(flags.Compiler, true), "target_clones should not be used for win64")
+}
+
+func TestSweepOpenMP(t *testing.T) {
+	if got := sweepThreadCounts(6); !slices.Equal(got, []int{1, 2, 4, 6}) {
+		t.Errorf("unexpected thread counts for 6 CPUs: %v", got)
+	}
+	if got := sweepThreadCounts(1); !slices.Equal(got, []int{1}) {
+		t.Errorf("unexpected thread counts for 1 CPU: %v", got)
+	}
+
+	// A workload that is fastest with the threads spread, and guided scheduling
+	var runs int
+	best, err := sweepOpenMP(func(env []string) (float64, error) {
+		runs++
+		t := 10.0
+		if slices.Contains(env, "OMP_PROC_BIND=spread") {
+			t = 5
+		}
+		if slices.Contains(env, "OMP_SCHEDULE=guided") {
+			t--
+		}
+		return t, nil
+	}, "seconds", true)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if best.bind != "spread" || best.schedule != "guided" || runs != 3+3*len(sweepThreadCounts(runtime.NumCPU())) {
+		t.Errorf("unexpected best settings %+v after %d runs", best, runs)
+	}
+
+	withTempDir(t)
+	t.Setenv("OMP_NUM_THREADS", "3")
+	if err := saveOpenMPSettings(openMPConfig{threads: 8, bind: "close"}); err != nil {
+		t.Fatal(err)
+	}
+	if env := openMPEnv(); !slices.Equal(env, []string{"OMP_PROC_BIND=close", "OMP_PLACES=cores"}) {
+		t.Errorf("expected the saved settings, except for OMP_NUM_THREADS from the environment, got %v", env)
+	}
+}
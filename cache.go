@@ -0,0 +1,73 @@
+package orchideous
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"encoding/json"
+	"os"
+	"path/filepath"
+)
+
+// projectCacheDir is the per-project directory where oh keeps its caches.
+const projectCacheDir = ".oh"
+
+// cachingEnabled returns false if OH_NOCACHE is set, which makes oh redo all probes.
+func cachingEnabled() bool {
+	return os.Getenv("OH_NOCACHE") == ""
+}
+
+// hashStrings returns a hex encoded SHA-256 hash of the given strings.
+func hashStrings(parts ...string) string {
+	h := sha256.New()
+	for _, p := range parts {
+		h.Write([]byte(p))
+		h.Write([]byte{0})
+	}
+	return hex.EncodeToString(h.Sum(nil))
+}
+
+// userCacheFile returns the path of a file in the per-user oh cache directory,
+// for caches that are shared between projects. Returns "" if there is no such directory.
+func userCacheFile(name string) string {
+	dir, err := os.UserCacheDir()
+	if err != nil {
+		return ""
+	}
+	return filepath.Join(dir, "oh", name)
+}
+
+// readJSONFile decodes a JSON file into v. Returns false if the file is missing or invalid.
+func readJSONFile(path string, v any) bool {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return false
+	}
+	return json.Unmarshal(data, v) == nil
+}
+
+// writeJSONFile encodes v as JSON and writes it to path, creating parent
+// directories as needed. The file is replaced atomically, so that concurrent
+// readers never see a partially written cache.
+func writeJSONFile(path string, v any) error {
+	data, err := json.Marshal(v)
+	if err != nil {
+		return err
+	}
+	if err := os.MkdirAll(filepath.Dir(path), 0o755); err != nil {
+		return err
+	}
+	tmp, err := os.CreateTemp(filepath.Dir(path), filepath.Base(path)+".*")
+	if err != nil {
+		return err
+	}
+	if _, err := tmp.Write(data); err != nil {
+		tmp.Close()
+		os.Remove(tmp.Name())
+		return err
+	}
+	if err := tmp.Close(); err != nil {
+		os.Remove(tmp.Name())
+		return err
+	}
+	return os.Rename(tmp.Name(), path)
+}
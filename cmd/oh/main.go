@@ -4,8 +4,12 @@ import (
 	"fmt"
 	"os"
 	"os/exec"
+	"os/signal"
 	"path/filepath"
+	"strconv"
 	"strings"
+	"syscall"
+	"time"
 
 	"github.com/xyproto/files"
 	"github.com/xyproto/orchideous"
@@ -17,14 +21,19 @@ func printHelp() {
 	fmt.Printf(`%s
 
 oh              - build the project
-oh run          - build and run
+oh run          - build and run (--omp-sweep [args] to tune OpenMP settings)
+oh watch        - rebuild whenever a source or header changes
+oh watch run    - rebuild and restart the executable on changes
 oh debug        - debug build and launch debugger (gdb/cgdb)
 oh debugbuild   - debug build (without launching debugger)
 oh debugnosan   - debug build (without sanitizers)
 oh opt          - optimized build
+oh native       - optimized build for the CPU of this machine (-march=native)
+oh multiarch    - optimized build with OH_CLONES functions for x86-64-v2/v3/v4
 oh strict       - build with strict warning flags
 oh sloppy       - build with sloppy flags
-oh small        - build a smaller executable
+oh small        - build a smaller executable, and report its size
+oh unity        - build with the dependency sources batched into unity files
 oh tiny         - build a tiny executable (+ sstrip/upx)
 oh clang        - build using clang++
 oh clangdebug   - debug build using clang++ (launches lldb)
@@ -32,18 +41,21 @@ oh clangstrict  - use clang++ and strict flags
 oh clangsloppy  - use clang++ and sloppy flags
 oh clangrebuild - clean and build with clang++
 oh clangtest    - build and run tests with clang++
-oh clean        - remove built files
-oh fastclean    - only remove executable and *.o
+oh clean [cfg]  - remove built files, or only those of one configuration
+oh fastclean    - only remove executable and objects
 oh rebuild      - clean and build
-oh test         - build and run tests
+oh all [dirs]   - build many projects at once (default: all below here)
+oh test         - build and run tests (in parallel, --shard i/n for a part)
 oh testbuild    - build tests (without running)
-oh rec          - profile-guided optimization (build, run, rebuild)
+oh bench        - build and run *_bench.cpp with opt flags, compare with the baseline
+oh rec          - profile-guided optimization (build, train, rebuild)
+oh bolt         - optimize the layout of the executable with llvm-bolt
 oh fmt          - format source code with clang-format
 oh cmake        - generate CMakeLists.txt
 oh cmake ninja  - generate CMakeLists.txt and build with ninja
-oh ninja        - build using existing CMakeLists.txt and ninja
+oh ninja        - generate build.ninja and build with ninja
 oh ninja_install- install from ninja build
-oh ninja_clean  - clean ninja build
+oh ninja_clean  - clean ninja build and remove build.ninja
 oh pro          - generate QtCreator project file
 oh install      - install the project (PREFIX, DESTDIR)
 oh pkg          - package the project into pkg/
@@ -51,22 +63,43 @@ oh export       - export a standalone Makefile and build.sh
 oh make         - generate a standalone Makefile
 oh script       - generate build.sh and clean.sh
 oh valgrind     - build and profile with valgrind
+oh perf [args]  - build with -g, profile with perf and write a flame graph
 oh win64        - cross-compile for 64-bit Windows
 oh smallwin64   - small win64 build
 oh tinywin64    - tiny win64 build
 oh zap          - build using zapcc++
+oh stats        - show the subprocesses that detection and flag assembly spawn
 oh version      - show version
 oh -C <dir> ... - run in the given directory
+oh -j <n> ...   - number of parallel compile jobs (default: OH_JOBS or CPU count)
+oh --trace <file> ... - write a Chrome trace of the build to file (or set OH_TRACE)
 `, versionString)
 }
 
 func exitOnErr(err error) {
 	if err != nil {
 		fmt.Fprintf(os.Stderr, "error: %v\n", err)
+		writeTrace()
 		os.Exit(1)
 	}
 }
 
+// writeTrace writes the build trace, if --trace or OH_TRACE was given.
+func writeTrace() {
+	if err := orchideous.WriteTrace(); err != nil {
+		fmt.Fprintf(os.Stderr, "warning: %v\n", err)
+	}
+}
+
+// setJobs sets the number of parallel compile jobs, via OH_JOBS.
+func setJobs(n string) {
+	if v, err := strconv.Atoi(n); err != nil || v < 1 {
+		fmt.Fprintf(os.Stderr, "error: invalid job count: %s\n", n)
+		os.Exit(1)
+	}
+	os.Setenv("OH_JOBS", n)
+}
+
 func hasCommand(name string) bool {
 	return files.WhichCached(name) != ""
 }
@@ -83,11 +116,18 @@ func doRun(opts orchideous.BuildOptions, runArgs []string) error {
 		exe += ".exe"
 	}
 	exePath := orchideous.DotSlash(exe)
+	// Use the OpenMP settings that "oh run --omp-sweep" found
+	env := os.Environ()
+	if ompEnv := orchideous.OpenMPEnv(); len(ompEnv) > 0 {
+		fmt.Fprintln(os.Stderr, "Using", strings.Join(ompEnv, " "))
+		env = append(env, ompEnv...)
+	}
 	// Auto-detect .exe and use wine if available
 	if strings.HasSuffix(exePath, ".exe") {
 		if winePath := files.WhichCached("wine"); winePath != "" {
 			c := exec.Command(winePath, exePath)
 			c.Args = append(c.Args, runArgs...)
+			c.Env = env
 			c.Stdin = os.Stdin
 			c.Stdout = os.Stdout
 			c.Stderr = os.Stderr
@@ -95,15 +135,36 @@ func doRun(opts orchideous.BuildOptions, runArgs []string) error {
 		}
 	}
 	c := exec.Command(exePath, runArgs...)
+	c.Env = env
 	c.Stdin = os.Stdin
 	c.Stdout = os.Stdout
 	c.Stderr = os.Stderr
 	return c.Run()
 }
 
-func doClean() {
-	exe := orchideous.ExecutableName()
-	patterns := []string{"*.o", "*.d", "common/*.o", "common/*.d", "include/*.o", "include/*.d", "*.profraw", "*.gcda", "*.gcno", ".sconsign.dblite", "callgrind.out.*"}
+// doClean removes the built files. With a configuration name, such as
+// "debug" or "opt-fp-g++", only the files built in that configuration are
+// removed, and the caches are kept.
+func doClean(args []string) {
+	name := ""
+	if len(args) > 0 {
+		name = args[0]
+	}
+	hasManifest := removeArtifacts(name)
+	if name != "" {
+		return
+	}
+	if orchideous.RemoveFlagCache() {
+		fmt.Println("Removed", filepath.Join(".oh", "flags.cache"))
+	}
+	if hasManifest {
+		// Everything that oh built is in the manifest
+		return
+	}
+	// Built by an oh that did not record what it built, with caching
+	// disabled, or by a generated build file
+	patterns := []string{"*.profraw", "*.gcda", "*.gcno", ".sconsign.dblite", "callgrind.out.*",
+		"*.o", "*.d", "*.dwo", "common/*.o", "common/*.d", "common/*.dwo", "include/*.o", "include/*.d", "include/*.dwo"}
 	for _, pat := range patterns {
 		matches, _ := filepath.Glob(pat)
 		for _, f := range matches {
@@ -111,16 +172,24 @@ func doClean() {
 			fmt.Println("Removed", f)
 		}
 	}
-	if exe != "" {
-		if err := os.Remove(exe); err == nil {
-			fmt.Println("Removed", exe)
-		}
-		if err := os.Remove(exe + ".exe"); err == nil {
-			fmt.Println("Removed", exe+".exe")
-		}
+	removeExecutables()
+	if orchideous.RemovePrecompiledHeader() {
+		fmt.Println("Removed", filepath.Join(".oh", "pch"))
+	}
+	if orchideous.RemoveUnityBatches() {
+		fmt.Println("Removed", filepath.Join(".oh", "unity"))
 	}
-	// Clean test executables
-	testSrcs := orchideous.GetTestSources()
+	if orchideous.RemoveLTOCache() {
+		fmt.Println("Removed", filepath.Join(".oh", "lto"))
+	}
+	if orchideous.RemoveBoltData() {
+		fmt.Println("Removed", filepath.Join(".oh", "bolt"))
+	}
+	if orchideous.RemovePerfData() {
+		fmt.Println("Removed", filepath.Join(".oh", "perf"))
+	}
+	// Clean test and benchmark executables
+	testSrcs := append(orchideous.GetTestSources(), orchideous.GetBenchSources()...)
 	for _, ts := range testSrcs {
 		testExe := strings.TrimSuffix(ts, filepath.Ext(ts))
 		if err := os.Remove(testExe); err == nil {
@@ -130,13 +199,32 @@ func doClean() {
 }
 
 func doFastClean() {
-	exe := orchideous.ExecutableName()
+	if removeArtifacts("") {
+		return
+	}
 	matches, _ := filepath.Glob("*.o")
 	for _, f := range matches {
 		os.Remove(f)
 		fmt.Println("Removed", f)
 	}
-	if exe != "" {
+	removeExecutables()
+}
+
+// removeArtifacts removes the files that the build manifest lists for the
+// configurations selected by name, and their build directories. Returns
+// false if there is no build manifest.
+func removeArtifacts(name string) bool {
+	removed, hasManifest := orchideous.CleanArtifacts(name)
+	for _, f := range removed {
+		fmt.Println("Removed", f)
+	}
+	return hasManifest
+}
+
+// removeExecutables removes the main executable, when there is no build
+// manifest that it could be recorded in.
+func removeExecutables() {
+	if exe := orchideous.ExecutableName(); exe != "" {
 		if err := os.Remove(exe); err == nil {
 			fmt.Println("Removed", exe)
 		}
@@ -146,110 +234,127 @@ func doFastClean() {
 	}
 }
 
-func doTest(opts orchideous.BuildOptions) error {
-	testSrcs := orchideous.GetTestSources()
-	if len(testSrcs) == 0 {
-		fmt.Println("Nothing to test")
-		return nil
-	}
-
-	proj := orchideous.DetectProject()
-	flags := orchideous.AssembleFlags(proj, opts)
-	for _, ts := range testSrcs {
-		testExe := strings.TrimSuffix(ts, filepath.Ext(ts))
-		if opts.Win64 || proj.HasWin64 {
-			testExe += ".exe"
-		}
-		srcs := append([]string{ts}, proj.DepSources...)
-		if err := orchideous.CompileSources(srcs, testExe, flags); err != nil {
-			return fmt.Errorf("building test %s: %w", testExe, err)
-		}
-		fmt.Printf("Running %s...\n", testExe)
-		c := exec.Command(orchideous.DotSlash(testExe))
-		c.Stdout = os.Stdout
-		c.Stderr = os.Stderr
-		if err := c.Run(); err != nil {
-			return fmt.Errorf("test %s failed: %w", testExe, err)
-		}
+func doTest(opts orchideous.BuildOptions, args []string) error {
+	topts, err := testOptions(args)
+	if err != nil {
+		return err
 	}
-	return nil
+	topts.Run = true
+	return orchideous.DoTests(opts, topts)
 }
 
-func doTestBuild(opts orchideous.BuildOptions) error {
+func doTestBuild(opts orchideous.BuildOptions, args []string) error {
+	topts, err := testOptions(args)
+	if err != nil {
+		return err
+	}
 	proj := orchideous.DetectProject()
-	flags := orchideous.AssembleFlags(proj, opts)
-
 	if proj.MainSource != "" {
-		exe := orchideous.ExecutableName()
-		if opts.Win64 || proj.HasWin64 {
-			exe += ".exe"
-		}
-		srcs := append([]string{proj.MainSource}, proj.DepSources...)
-		if err := orchideous.CompileSources(srcs, exe, flags); err != nil {
+		if err := orchideous.DoBuild(opts); err != nil {
 			return err
 		}
 	}
-
-	for _, ts := range proj.TestSources {
-		testExe := strings.TrimSuffix(ts, filepath.Ext(ts))
-		if opts.Win64 || proj.HasWin64 {
-			testExe += ".exe"
-		}
-		srcs := append([]string{ts}, proj.DepSources...)
-		if err := orchideous.CompileSources(srcs, testExe, flags); err != nil {
-			return fmt.Errorf("building test %s: %w", testExe, err)
-		}
+	if len(proj.TestSources) > 0 {
+		return orchideous.DoTests(opts, topts)
 	}
-
-	if proj.MainSource == "" && len(proj.TestSources) == 0 {
+	if proj.MainSource == "" {
 		fmt.Println("Nothing to build")
 	}
 	return nil
 }
 
-func doRec(runArgs []string) error {
-	doClean()
-	if err := orchideous.DoBuild(orchideous.BuildOptions{Opt: true, ProfileGenerate: true}); err != nil {
-		return fmt.Errorf("profile generation build: %w", err)
-	}
-	exe := orchideous.ExecutableName()
-	if exe == "" {
-		return fmt.Errorf("no executable to run for profiling")
-	}
-	exePath := orchideous.DotSlash(exe)
-	c := exec.Command(exePath, runArgs...)
-	c.Stdin = os.Stdin
-	c.Stdout = os.Stdout
-	c.Stderr = os.Stderr
-	_ = c.Run()
-	// For clang-style PGO: merge .profraw files into default.profdata
-	if profrawFiles, _ := filepath.Glob("*.profraw"); len(profrawFiles) > 0 {
-		profdata := files.WhichCached("llvm-profdata")
-		if profdata == "" {
-			// Try xcrun on macOS (Command Line Tools)
-			if out, err := exec.Command("xcrun", "-f", "llvm-profdata").Output(); err == nil {
-				profdata = strings.TrimSpace(string(out))
+// testOptions parses the arguments of the test commands: "--shard i/n".
+func testOptions(args []string) (orchideous.TestOptions, error) {
+	var topts orchideous.TestOptions
+	for len(args) > 0 {
+		if len(args) >= 2 && args[0] == "--shard" {
+			i, n, err := orchideous.ParseShard(args[1])
+			if err != nil {
+				return topts, err
 			}
+			topts.Shard, topts.Shards = i, n
+			args = args[2:]
+		} else {
+			return topts, fmt.Errorf("unknown test argument: %s", args[0])
 		}
-		if profdata != "" {
-			args := append([]string{"merge", "-o", "default.profdata"}, profrawFiles...)
-			cmd := exec.Command(profdata, args...)
-			cmd.Stdout = os.Stdout
-			cmd.Stderr = os.Stderr
-			if err := cmd.Run(); err != nil {
-				fmt.Fprintf(os.Stderr, "warning: llvm-profdata merge failed: %v\n", err)
+	}
+	return topts, nil
+}
+
+// doBench parses the arguments of "oh bench": --save saves the results as the
+// new baseline, --baseline file compares against another file than
+// .oh/bench.json, --threshold pct is the slowdown, in percent, that fails,
+// and --omp-sweep finds the fastest OpenMP settings instead.
+func doBench(args []string) error {
+	var bopts orchideous.BenchOptions
+	for len(args) > 0 {
+		switch {
+		case args[0] == "--save":
+			bopts.Save = true
+			args = args[1:]
+		case args[0] == "--omp-sweep":
+			bopts.OpenMP = true
+			args = args[1:]
+		case len(args) >= 2 && args[0] == "--baseline":
+			bopts.Baseline = args[1]
+			args = args[2:]
+		case len(args) >= 2 && args[0] == "--threshold":
+			pct, err := strconv.ParseFloat(strings.TrimSuffix(args[1], "%"), 64)
+			if err != nil || pct <= 0 {
+				return fmt.Errorf("invalid threshold: %s", args[1])
 			}
+			bopts.Threshold = pct / 100
+			args = args[2:]
+		default:
+			return fmt.Errorf("unknown bench argument: %s", args[0])
 		}
 	}
-	// Remove object files (but not profile data) so the next build recompiles with PGO
-	for _, pat := range []string{"*.o", "common/*.o", "include/*.o"} {
-		if matches, _ := filepath.Glob(pat); len(matches) > 0 {
-			for _, f := range matches {
-				os.Remove(f)
+	return orchideous.DoBench(orchideous.BuildOptions{}, bopts)
+}
+
+// pgoTraining parses the arguments of "oh rec" and "oh bolt": --script file runs a
+// training script, each --run "args" runs the executable once with those
+// arguments, and any other arguments are one set of arguments.
+func pgoTraining(args []string) (orchideous.PGOTraining, error) {
+	var training orchideous.PGOTraining
+	var rest []string
+	for len(args) > 0 {
+		switch args[0] {
+		case "--script", "--run":
+			if len(args) < 2 {
+				return training, fmt.Errorf("%s needs an argument", args[0])
 			}
+			if args[0] == "--script" {
+				training.Script = args[1]
+			} else {
+				training.Runs = append(training.Runs, strings.Fields(args[1]))
+			}
+			args = args[2:]
+		default:
+			rest = append(rest, args[0])
+			args = args[1:]
 		}
 	}
-	return orchideous.DoBuild(orchideous.BuildOptions{Opt: true, ProfileUse: true})
+	if len(rest) > 0 {
+		training.Runs = append(training.Runs, rest)
+	}
+	return training, nil
+}
+
+func doRec(args []string) error {
+	training, err := pgoTraining(args)
+	if err != nil {
+		return err
+	}
+	return orchideous.DoRec(training)
+}
+
+func doBolt(args []string) error {
+	training, err := pgoTraining(args)
+	if err != nil {
+		return err
+	}
+	return orchideous.DoBolt(training)
 }
 
 func doFmt() {
@@ -289,6 +394,7 @@ func doValgrind(opts orchideous.BuildOptions) error {
 		fmt.Fprintf(os.Stderr, "warning: valgrind exited with: %v\n", err)
 	}
 	callgrindFiles, _ := filepath.Glob("callgrind.out.*")
+	orchideous.RecordArtifacts(callgrindFiles...)
 	if len(callgrindFiles) > 0 && hasCommand("gprof2dot") && hasCommand("dot") {
 		c = exec.Command("sh", "-c",
 			"gprof2dot -f callgrind "+callgrindFiles[0]+" | dot -Tsvg -o output.svg")
@@ -343,47 +449,49 @@ func doDebug(opts orchideous.BuildOptions, useClang bool) error {
 	return c.Run()
 }
 
-func doTiny(opts orchideous.BuildOptions) error {
-	if err := orchideous.DoBuild(opts); err != nil {
-		return err
-	}
-	exe := orchideous.ExecutableName()
-	if exe == "" {
-		return nil
-	}
-	if opts.Win64 {
-		exe += ".exe"
-	}
-	exePath := orchideous.DotSlash(exe)
+// interruptTimeout is how long an interrupted oh waits for the cancelled
+// compiles to be killed and cleaned up.
+const interruptTimeout = 5 * time.Second
 
-	if hasCommand("sstrip") {
-		c := exec.Command("sstrip", exePath)
-		c.Stdout = os.Stdout
-		c.Stderr = os.Stderr
-		if err := c.Run(); err == nil {
-			fmt.Println("sstrip", exePath)
-		}
-	}
-
-	if hasCommand("upx") {
-		c := exec.Command("upx", "--brute", exePath)
-		c.Stdout = os.Stdout
-		c.Stderr = os.Stderr
-		if err := c.Run(); err == nil {
-			fmt.Println("upx --brute", exePath)
-		}
-	}
-	return nil
+// forwardInterrupts makes Ctrl-C and SIGTERM kill the compiles and links
+// that are running, which are in their own process groups and would keep
+// running after oh is gone. oh exits once the cancelled compiles have
+// removed their partial objects, or after interruptTimeout, or right away on
+// a second Ctrl-C.
+func forwardInterrupts() {
+	sigs := make(chan os.Signal, 1)
+	signal.Notify(sigs, os.Interrupt, syscall.SIGTERM)
+	go func() {
+		<-sigs
+		signal.Reset()
+		orchideous.CancelBuilds()
+		orchideous.WaitForBuilds(interruptTimeout)
+		os.Exit(130)
+	}()
 }
 
 func main() {
+	forwardInterrupts()
 	args := os.Args[1:]
-	if len(args) >= 2 && args[0] == "-C" {
-		if err := os.Chdir(args[1]); err != nil {
-			fmt.Fprintf(os.Stderr, "error: %v\n", err)
-			os.Exit(1)
+	for len(args) > 0 {
+		if len(args) >= 2 && args[0] == "-C" {
+			if err := os.Chdir(args[1]); err != nil {
+				fmt.Fprintf(os.Stderr, "error: %v\n", err)
+				os.Exit(1)
+			}
+			args = args[2:]
+		} else if len(args) >= 2 && args[0] == "--trace" {
+			os.Setenv("OH_TRACE", args[1])
+			args = args[2:]
+		} else if len(args) >= 2 && args[0] == "-j" {
+			setJobs(args[1])
+			args = args[2:]
+		} else if strings.HasPrefix(args[0], "-j") && len(args[0]) > 2 {
+			setJobs(args[0][2:])
+			args = args[1:]
+		} else {
+			break
 		}
-		args = args[2:]
 	}
 
 	cmd := "build"
@@ -404,14 +512,24 @@ func main() {
 	case "build":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{}))
 	case "rebuild":
-		doClean()
+		doClean(nil)
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{}))
 	case "clean":
-		doClean()
+		doClean(subArgs)
 	case "fastclean":
 		doFastClean()
 	case "run":
-		exitOnErr(doRun(orchideous.BuildOptions{}, subArgs))
+		if len(subArgs) > 0 && subArgs[0] == "--omp-sweep" {
+			exitOnErr(orchideous.DoOpenMPSweep(orchideous.BuildOptions{}, subArgs[1:]))
+		} else {
+			exitOnErr(doRun(orchideous.BuildOptions{}, subArgs))
+		}
+	case "watch":
+		if len(subArgs) > 0 && subArgs[0] == "run" {
+			exitOnErr(orchideous.DoWatch(orchideous.BuildOptions{}, true, subArgs[1:]))
+		} else {
+			exitOnErr(orchideous.DoWatch(orchideous.BuildOptions{}, false, nil))
+		}
 	case "debug":
 		exitOnErr(doDebug(orchideous.BuildOptions{Debug: true}, false))
 	case "debugbuild":
@@ -420,14 +538,20 @@ func main() {
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Debug: true, NoSanitizers: true}))
 	case "opt":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Opt: true}))
+	case "native":
+		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Opt: true, Native: true}))
+	case "multiarch":
+		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Opt: true, MultiArch: true}))
 	case "strict":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Strict: true}))
 	case "sloppy":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Sloppy: true}))
+	case "unity":
+		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Unity: true}))
 	case "small":
-		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Small: true}))
+		exitOnErr(orchideous.DoSizeBuild(orchideous.BuildOptions{Small: true}))
 	case "tiny":
-		exitOnErr(doTiny(orchideous.BuildOptions{Small: true, Tiny: true}))
+		exitOnErr(orchideous.DoSizeBuild(orchideous.BuildOptions{Small: true, Tiny: true}))
 	case "clang":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Clang: true}))
 	case "clangdebug":
@@ -437,22 +561,28 @@ func main() {
 	case "clangsloppy":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Clang: true, Sloppy: true}))
 	case "clangrebuild":
-		doClean()
+		doClean(nil)
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Clang: true}))
 	case "clangtest":
-		exitOnErr(doTest(orchideous.BuildOptions{Clang: true}))
+		exitOnErr(doTest(orchideous.BuildOptions{Clang: true}, subArgs))
 	case "test":
-		exitOnErr(doTest(orchideous.BuildOptions{}))
+		exitOnErr(doTest(orchideous.BuildOptions{}, subArgs))
 	case "testbuild":
-		exitOnErr(doTestBuild(orchideous.BuildOptions{}))
+		exitOnErr(doTestBuild(orchideous.BuildOptions{}, subArgs))
+	case "bench":
+		exitOnErr(doBench(subArgs))
+	case "all":
+		exitOnErr(orchideous.DoAll(orchideous.BuildOptions{}, subArgs))
 	case "rec":
 		exitOnErr(doRec(subArgs))
+	case "bolt":
+		exitOnErr(doBolt(subArgs))
 	case "fmt":
 		doFmt()
 	case "cmake":
 		if len(subArgs) > 0 && subArgs[0] == "ninja" {
 			exitOnErr(orchideous.DoCMake(orchideous.BuildOptions{}))
-			exitOnErr(orchideous.DoNinja())
+			exitOnErr(orchideous.DoCMakeNinja())
 		} else {
 			exitOnErr(orchideous.DoCMake(orchideous.BuildOptions{}))
 		}
@@ -476,17 +606,23 @@ func main() {
 		exitOnErr(orchideous.DoScript())
 	case "valgrind":
 		exitOnErr(doValgrind(orchideous.BuildOptions{}))
+	case "perf":
+		exitOnErr(orchideous.DoPerf(subArgs))
 	case "win", "win64":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Win64: true}))
 	case "smallwin", "smallwin64":
-		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Win64: true, Small: true}))
+		exitOnErr(orchideous.DoSizeBuild(orchideous.BuildOptions{Win64: true, Small: true}))
 	case "tinywin", "tinywin64":
-		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Win64: true, Small: true, Tiny: true}))
+		exitOnErr(orchideous.DoSizeBuild(orchideous.BuildOptions{Win64: true, Small: true, Tiny: true}))
 	case "zap":
 		exitOnErr(orchideous.DoBuild(orchideous.BuildOptions{Zap: true}))
+	case "stats":
+		exitOnErr(orchideous.DoStats())
 	default:
 		fmt.Fprintf(os.Stderr, "unknown command: %s\n", cmd)
 		printHelp()
 		os.Exit(1)
 	}
+	exitOnErr(orchideous.CheckSpawnBudget())
+	writeTrace()
 }
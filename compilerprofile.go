@@ -0,0 +1,203 @@
+package orchideous
+
+import (
+	"bytes"
+	"fmt"
+	"os"
+	"os/exec"
+	"regexp"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// compilerProfileFile is where the compiler profiles are kept. They only
+// depend on the compiler binaries, so they are shared between projects.
+var compilerProfileFile = userCacheFile("compilers.cache")
+
+// compilerProfile is what oh knows about one compiler binary. The basics
+// come from a single "compiler -v" run, and the rest is probed the first time
+// it is needed. Profiles are kept until the compiler binary changes.
+type compilerProfile struct {
+	Stamp      string          // the size and modification time of the compiler binary
+	Version    string          // the version line of compiler -v, such as "gcc version 12.2.0 (Debian 12.2.0-14)"
+	Clang      bool            // clang, or a compiler that acts as clang, like /usr/bin/g++ on macOS
+	Major      int             // the major version, or 0 if it is not known
+	Target     string          // the target triple, as with -dumpmachine
+	BestStd    string          `json:",omitempty"` // the newest -std= that the compiler supports, once probed
+	Sanitizers *bool           `json:",omitempty"` // whether it can link with -fsanitize=address, once probed
+	Links      map[string]bool `json:",omitempty"` // whether it can link with the flags, per flag and installed linkers
+}
+
+var (
+	compilerProfilesOnce  sync.Once
+	compilerProfilesMutex sync.Mutex
+	compilerProfiles      map[string]*compilerProfile // resolved compiler path -> profile
+)
+
+// versionLinePattern matches the version line of compiler -v, and the major version in it.
+var versionLinePattern = regexp.MustCompile(`^(?:.* )?(?:gcc|clang) version (\d+)`)
+
+// compilerStamp returns the resolved path of the compiler and a stamp that
+// changes when the binary does. The stamp is "" if the compiler is not found.
+func compilerStamp(compiler string) (string, string) {
+	path, err := exec.LookPath(compiler)
+	if err != nil {
+		return compiler, ""
+	}
+	fi, err := os.Stat(path)
+	if err != nil {
+		return path, ""
+	}
+	return path, fi.ModTime().String() + "/" + strconv.FormatInt(fi.Size(), 10)
+}
+
+// compilerProfileOf returns the profile of the compiler, probing it with a
+// single compiler -v run if there is no up to date profile for it.
+func compilerProfileOf(compiler string) compilerProfile {
+	compilerProfilesOnce.Do(func() {
+		compilerProfiles = make(map[string]*compilerProfile)
+		if cachingEnabled() && compilerProfileFile != "" {
+			readJSONFile(compilerProfileFile, &compilerProfiles)
+		}
+	})
+	path, stamp := compilerStamp(compiler)
+	compilerProfilesMutex.Lock()
+	p, ok := compilerProfiles[path]
+	compilerProfilesMutex.Unlock()
+	if ok && p.Stamp == stamp {
+		return copyProfile(p)
+	}
+
+	p = &compilerProfile{Stamp: stamp}
+	var out bytes.Buffer
+	cmd := exec.Command(compiler, "-v")
+	cmd.Stdout = &out
+	cmd.Stderr = &out
+	if runCommand(cmd) == nil {
+		for _, line := range strings.Split(out.String(), "\n") {
+			if target, ok := strings.CutPrefix(line, "Target: "); ok {
+				p.Target = strings.TrimSpace(target)
+			} else if m := versionLinePattern.FindStringSubmatch(line); m != nil && p.Version == "" {
+				p.Version = strings.TrimSpace(line)
+				p.Clang = strings.Contains(line, "clang")
+				p.Major, _ = strconv.Atoi(m[1])
+			}
+		}
+	}
+	compilerProfilesMutex.Lock()
+	compilerProfiles[path] = p
+	compilerProfilesMutex.Unlock()
+	saveCompilerProfiles()
+	return copyProfile(p)
+}
+
+// updateCompilerProfile records something that was probed about the
+// compiler in its profile.
+func updateCompilerProfile(compiler string, update func(p *compilerProfile)) {
+	compilerProfileOf(compiler)
+	path, _ := compilerStamp(compiler)
+	compilerProfilesMutex.Lock()
+	update(compilerProfiles[path])
+	compilerProfilesMutex.Unlock()
+	saveCompilerProfiles()
+}
+
+// copyProfile returns a copy of p that can be read without holding the lock.
+func copyProfile(p *compilerProfile) compilerProfile {
+	compilerProfilesMutex.Lock()
+	defer compilerProfilesMutex.Unlock()
+	c := *p
+	c.Links = make(map[string]bool, len(p.Links))
+	for k, v := range p.Links {
+		c.Links[k] = v
+	}
+	return c
+}
+
+// saveCompilerProfiles writes the profiles of the compilers that were found.
+func saveCompilerProfiles() {
+	if !cachingEnabled() || compilerProfileFile == "" {
+		return
+	}
+	compilerProfilesMutex.Lock()
+	found := make(map[string]*compilerProfile, len(compilerProfiles))
+	for path, p := range compilerProfiles {
+		if p.Stamp != "" {
+			c := *p
+			found[path] = &c
+		}
+	}
+	compilerProfilesMutex.Unlock()
+	writeJSONFile(compilerProfileFile, found)
+}
+
+// compilerTarget returns the target triple of the compiler, or "".
+func compilerTarget(compiler string) string {
+	return compilerProfileOf(compiler).Target
+}
+
+// compilerCanLinkCached is compilerCanLink, remembered in the profile of
+// the compiler for as long as the same linkers are installed.
+func compilerCanLinkCached(compiler string, flags ...string) bool {
+	return compilerCanLinkStamped(compiler, linkerStamp(), flags...)
+}
+
+// compilerCanLinkLibrary reports whether the compiler can link with -l<lib>.
+// Like compilerCanLinkCached, the answer is remembered, but only for as long
+// as the installed packages and the library directories are unchanged, so
+// that a library that is installed after a failed probe is found.
+func compilerCanLinkLibrary(compiler, lib string) bool {
+	return compilerCanLinkStamped(compiler, hashStrings(linkerStamp(), libraryStamp(compiler)), "-l"+lib)
+}
+
+// compilerCanLinkStamped is compilerCanLink, remembered in the profile of the
+// compiler for as long as stamp is the same. The answers for earlier stamps
+// are dropped when a new one is stored.
+func compilerCanLinkStamped(compiler, stamp string, flags ...string) bool {
+	prefix := strings.Join(flags, " ") + "|"
+	key := prefix + stamp
+	if ok, found := compilerProfileOf(compiler).Links[key]; found {
+		return ok
+	}
+	ok := compilerCanLink(compiler, flags...)
+	updateCompilerProfile(compiler, func(p *compilerProfile) {
+		if p.Links == nil {
+			p.Links = make(map[string]bool)
+		}
+		for k := range p.Links {
+			if strings.HasPrefix(k, prefix) {
+				delete(p.Links, k)
+			}
+		}
+		p.Links[key] = ok
+	})
+	return ok
+}
+
+// libraryStamp returns a string that changes whenever packages are installed
+// or removed, or a library is added to one of the usual library directories.
+func libraryStamp(compiler string) string {
+	parts := []string{packageDBStamp(hostPlatform.typ())}
+	dirs := []string{"/usr/lib", "/usr/lib64", "/usr/local/lib", "/opt/homebrew/lib"}
+	if target := compilerTarget(compiler); target != "" {
+		dirs = append(dirs, "/usr/lib/"+target, "/lib/"+target)
+	}
+	for _, dir := range dirs {
+		if fi, err := os.Stat(dir); err == nil {
+			parts = append(parts, fmt.Sprintf("%s@%d", dir, fi.ModTime().UnixNano()))
+		}
+	}
+	return hashStrings(parts...)
+}
+
+// compilerHasSanitizers reports whether the compiler can link a program
+// with AddressSanitizer, which needs the sanitizer runtime to be installed.
+func compilerHasSanitizers(compiler string) bool {
+	if p := compilerProfileOf(compiler); p.Sanitizers != nil {
+		return *p.Sanitizers
+	}
+	ok := compilerCanLink(compiler, "-fsanitize=address")
+	updateCompilerProfile(compiler, func(p *compilerProfile) { p.Sanitizers = &ok })
+	return ok
+}
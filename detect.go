@@ -1,16 +1,14 @@
 package orchideous
 
 import (
-	"bufio"
 	"fmt"
 	"os"
-	"os/exec"
 	"path/filepath"
 	"strings"
 )
 
 // SourceExts are the recognized C/C++ source file extensions.
-var SourceExts = []string{".cpp", ".cc", ".cxx", ".c"}
+var SourceExts = []string{".cpp", ".cc", ".cxx", ".c", ".cppm", ".ixx"}
 
 // localIncludePaths are relative paths searched for project headers.
 var localIncludePaths = []string{".", "include", "Include", "..", "../include", "../Include", "common", "Common", "../common", "../Common"}
@@ -55,11 +53,14 @@ var stdHeaders = map[string]bool{
 	"dlfcn.h": true, "pthread.h": true, "glibc": true,
 }
 
-// Project holds all detected project information.
+// Project holds all detected project information. The paths of the sources
+// are relative to Dir.
 type Project struct {
+	Dir           string // the project directory, "." for the current directory
 	MainSource    string
 	DepSources    []string
 	TestSources   []string
+	BenchSources  []string
 	Includes      []string // external includes from source files
 	BoostLibs     []string
 	IsC           bool // true if main source is a .c file
@@ -72,14 +73,20 @@ type Project struct {
 	HasWin64      bool // detected from #include <windows.h>
 	HasGLFWVulkan bool // detected from #define GLFW_INCLUDE_VULKAN
 	HasDlopen     bool // detected from #include <dlfcn.h>
+	HasModules    bool // detected from module declarations and import
+	HasParallel   bool // detected from #include <execution>, for the parallel algorithms
 }
 
-// detectProject scans the current directory to detect the project layout.
-func detectProject() Project {
-	var p Project
-	p.TestSources = getTestSources()
-	p.MainSource = GetMainSourceFile(p.TestSources)
-	p.DepSources = getDepSources(p.MainSource, p.TestSources)
+// detectProject scans the project directory dir to detect the project layout.
+// The files are found relative to dir, so the current directory of the
+// process does not matter, and projects can be detected concurrently.
+func detectProject(dir string) Project {
+	defer startSpan("detect", "detectProject").end()
+	p := Project{Dir: dir}
+	p.TestSources = getTestSources(dir)
+	p.BenchSources = getBenchSources(dir)
+	p.MainSource = getMainSourceFile(dir, p.TestSources)
+	p.DepSources = getDepSources(dir, p.MainSource, p.TestSources)
 	if strings.HasSuffix(p.MainSource, ".c") {
 		p.IsC = true
 	}
@@ -91,23 +98,23 @@ func detectProject() Project {
 	}
 	allSources = append(allSources, p.DepSources...)
 	allSources = append(allSources, p.TestSources...)
+	allSources = append(allSources, p.BenchSources...)
+	span := startSpan("detect", "scanSources")
+	scanSources(projectFiles(dir, allSources))
 	for _, src := range allSources {
-		scanSourceForFlags(src, &p)
-	}
-
-	// Verify HasWin64 using the C preprocessor: if windows.h is only
-	// included inside #ifdef _WIN32 guards, it won't survive preprocessing
-	// on non-Windows hosts, so we should not treat this as a win64 project.
-	if p.HasWin64 {
-		p.HasWin64 = verifyWin64WithPreprocessor(allSources)
+		scanSourceForFlags(projectFile(dir, src), &p)
 	}
+	span.end()
 
 	// Resolve common/ sources from includes (iteratively)
+	span = startSpan("detect", "resolveCommonDeps")
 	p.resolveCommonDeps()
+	span.end()
 
 	// Final deduplication
 	p.DepSources = uniqueStrings(p.DepSources)
 	p.TestSources = uniqueStrings(p.TestSources)
+	p.BenchSources = uniqueStrings(p.BenchSources)
 
 	// Collect external includes from all sources
 	allSrcs := []string{}
@@ -116,83 +123,97 @@ func detectProject() Project {
 	}
 	allSrcs = append(allSrcs, p.DepSources...)
 	allSrcs = append(allSrcs, p.TestSources...)
-	p.Includes = collectExternalIncludes(allSrcs, p.HasWin64)
+	allSrcs = append(allSrcs, p.BenchSources...)
+	span = startSpan("detect", "preprocessSources")
+	preprocessSources(projectFiles(dir, allSrcs))
+	span.end()
+
+	// Verify HasWin64 using the C preprocessor: if windows.h is only
+	// included inside #ifdef _WIN32 guards, it won't survive preprocessing
+	// on non-Windows hosts, so we should not treat this as a win64 project.
+	if p.HasWin64 {
+		p.HasWin64 = verifyWin64WithPreprocessor(projectFiles(dir, allSources))
+	}
+
+	span = startSpan("detect", "collectExternalIncludes")
+	p.Includes = collectExternalIncludes(dir, allSrcs, p.HasWin64)
+	span.end()
 
 	return p
 }
 
+// scanSourceForFlags adds the flags detected in a source file to the project.
 func scanSourceForFlags(filename string, p *Project) {
-	f, err := os.Open(filename)
-	if err != nil {
-		return
-	}
-	defer f.Close()
-	scanner := bufio.NewScanner(f)
-	for scanner.Scan() {
-		line := scanner.Text()
-		trimmed := strings.TrimSpace(line)
+	p.mergeFlags(&scanSource(filename).flags)
+}
 
-		if strings.Contains(line, "#pragma omp") {
-			p.HasOpenMP = true
-		}
-		if strings.Contains(line, "#include <boost/") {
-			p.HasBoost = true
-			// Try to detect boost library name from the include path
-			// e.g. #include <boost/filesystem.hpp> -> boost_filesystem
-			if _, after, ok := strings.Cut(line, "<boost/"); ok {
-				rest := after
-				if end := strings.IndexAny(rest, "./>"); end >= 0 {
-					libName := "boost_" + rest[:end]
-					p.BoostLibs = appendUnique(p.BoostLibs, libName)
-				}
+// scanLineForFlags detects special flags from a single line of source code.
+func scanLineForFlags(line, trimmed string, p *Project) {
+	if strings.Contains(line, "#pragma omp") {
+		p.HasOpenMP = true
+	}
+	if strings.Contains(line, "#include <boost/") {
+		p.HasBoost = true
+		// Try to detect boost library name from the include path
+		// e.g. #include <boost/filesystem.hpp> -> boost_filesystem
+		if _, after, ok := strings.Cut(line, "<boost/"); ok {
+			rest := after
+			if end := strings.IndexAny(rest, "./>"); end >= 0 {
+				libName := "boost_" + rest[:end]
+				p.BoostLibs = appendUnique(p.BoostLibs, libName)
 			}
 		}
-		if strings.Contains(line, "#include <QApplication") {
-			p.HasQt6 = true
-		}
-		if strings.Contains(line, "#include <filesystem>") {
-			p.HasFS = true
-		}
-		if trimmed == "#include <cmath>" || trimmed == `#include "math.h"` || trimmed == "#include <math.h>" {
-			p.HasMathLib = true
-		}
-		if trimmed == "#include <thread>" || trimmed == "#include <pthread.h>" ||
-			trimmed == "#include <mutex>" || trimmed == "#include <future>" ||
-			trimmed == "#include <condition_variable>" || trimmed == "#include <shared_mutex>" {
-			p.HasThreads = true
-		}
-		if trimmed == "#include <dlfcn.h>" {
-			p.HasDlopen = true
-		}
-		// Detect win64 from includes
-		for _, wh := range []string{`#include <windows.h>`, `#include "windows.h"`, `#include<windows.h>`} {
-			if strings.Contains(line, wh) {
-				p.HasWin64 = true
-				break
-			}
-		}
-		if strings.Contains(line, "#define GLFW_INCLUDE_VULKAN") {
-			p.HasGLFWVulkan = true
+	}
+	if strings.Contains(line, "#include <QApplication") {
+		p.HasQt6 = true
+	}
+	if strings.Contains(line, "#include <filesystem>") {
+		p.HasFS = true
+	}
+	if trimmed == "#include <cmath>" || trimmed == `#include "math.h"` || trimmed == "#include <math.h>" {
+		p.HasMathLib = true
+	}
+	if trimmed == "#include <thread>" || trimmed == "#include <pthread.h>" ||
+		trimmed == "#include <mutex>" || trimmed == "#include <future>" ||
+		trimmed == "#include <condition_variable>" || trimmed == "#include <shared_mutex>" {
+		p.HasThreads = true
+	}
+	if trimmed == "#include <execution>" {
+		p.HasParallel = true
+	}
+	if trimmed == "#include <dlfcn.h>" {
+		p.HasDlopen = true
+	}
+	// Detect win64 from includes
+	for _, wh := range []string{`#include <windows.h>`, `#include "windows.h"`, `#include<windows.h>`} {
+		if strings.Contains(line, wh) {
+			p.HasWin64 = true
+			break
 		}
 	}
+	if strings.Contains(line, "#define GLFW_INCLUDE_VULKAN") {
+		p.HasGLFWVulkan = true
+	}
 }
 
 // verifyWin64WithPreprocessor checks if windows.h actually survives
 // C preprocessing (i.e., is not guarded by #ifdef _WIN32 or similar).
-// If the preprocessor is unavailable, the naive scan result is kept.
+// It uses the includes found by preprocessSources, so no file is
+// preprocessed twice. If the preprocessor is unavailable, the naive scan
+// result is kept.
 func verifyWin64WithPreprocessor(sources []string) bool {
 	preprocessorWorked := false
 	for _, src := range sources {
 		if src == "" {
 			continue
 		}
-		lines := cppPreprocessIncludes(src)
-		if lines == nil {
+		dirs := scanIncludes(src)
+		if dirs == nil {
 			continue
 		}
 		preprocessorWorked = true
-		for _, inc := range lines {
-			if inc == "windows.h" {
+		for _, inc := range dirs {
+			if inc.name == "windows.h" {
 				return true
 			}
 		}
@@ -204,18 +225,19 @@ func verifyWin64WithPreprocessor(sources []string) bool {
 	return false
 }
 
-// getTestSources returns all test source files.
-func getTestSources() []string {
+// getTestSources returns all test source files of the project in dir.
+func getTestSources(dir string) []string {
 	var tests []string
+	var testSuffixes []string
+	for _, ext := range SourceExts {
+		testSuffixes = append(testSuffixes, "_test"+ext)
+	}
 	searchDirs := append([]string{"."}, localCommonPaths...)
-	for _, dir := range searchDirs {
-		for _, ext := range SourceExts {
-			matches, _ := filepath.Glob(filepath.Join(dir, "*_test"+ext))
-			tests = append(tests, matches...)
-		}
+	for _, sub := range searchDirs {
+		tests = append(tests, projectFilesWithExts(dir, sub, testSuffixes)...)
 		for _, ext := range SourceExts {
-			name := filepath.Join(dir, "test"+ext)
-			if fileExists(name) {
+			name := filepath.Join(sub, "test"+ext)
+			if fileExists(projectFile(dir, name)) {
 				tests = append(tests, name)
 				break
 			}
@@ -224,24 +246,41 @@ func getTestSources() []string {
 	return uniqueStrings(tests)
 }
 
+// getBenchSources returns all benchmark source files of the project in dir,
+// named *_bench.cpp.
+func getBenchSources(dir string) []string {
+	var benches []string
+	var benchSuffixes []string
+	for _, ext := range SourceExts {
+		benchSuffixes = append(benchSuffixes, "_bench"+ext)
+	}
+	searchDirs := append([]string{"."}, localCommonPaths...)
+	for _, sub := range searchDirs {
+		benches = append(benches, projectFilesWithExts(dir, sub, benchSuffixes)...)
+	}
+	return uniqueStrings(benches)
+}
+
 // GetMainSourceFile finds the main C/C++ source file in the current directory.
 func GetMainSourceFile(testSrcs []string) string {
+	return getMainSourceFile(".", testSrcs)
+}
+
+// getMainSourceFile finds the main C/C++ source file of the project in dir.
+func getMainSourceFile(dir string, testSrcs []string) string {
 	// Check for explicit main.* files
 	for _, ext := range SourceExts {
 		name := "main" + ext
-		if fileExists(name) {
+		if fileExists(projectFile(dir, name)) {
 			return name
 		}
 	}
 
 	testMap := toSet(testSrcs)
 	var allSrcs []string
-	for _, ext := range SourceExts {
-		matches, _ := filepath.Glob("*" + ext)
-		for _, m := range matches {
-			if !testMap[m] && !isTestFile(m) {
-				allSrcs = append(allSrcs, m)
-			}
+	for _, m := range projectFilesWithExts(dir, ".", SourceExts) {
+		if !testMap[m] && !isTestFile(m) {
+			allSrcs = append(allSrcs, m)
 		}
 	}
 
@@ -249,16 +288,13 @@ func GetMainSourceFile(testSrcs []string) string {
 		// Fallback: check src/ subdirectory
 		for _, ext := range SourceExts {
 			name := filepath.Join("src", "main"+ext)
-			if fileExists(name) {
+			if fileExists(projectFile(dir, name)) {
 				return name
 			}
 		}
-		for _, ext := range SourceExts {
-			matches, _ := filepath.Glob(filepath.Join("src", "*"+ext))
-			for _, m := range matches {
-				if !isTestFile(m) {
-					allSrcs = append(allSrcs, m)
-				}
+		for _, m := range projectFilesWithExts(dir, "src", SourceExts) {
+			if !isTestFile(m) {
+				allSrcs = append(allSrcs, m)
 			}
 		}
 		if len(allSrcs) == 0 {
@@ -266,7 +302,7 @@ func GetMainSourceFile(testSrcs []string) string {
 		}
 	}
 	if len(allSrcs) == 1 {
-		if containsMain(allSrcs[0]) {
+		if containsMain(projectFile(dir, allSrcs[0])) {
 			return allSrcs[0]
 		}
 		return ""
@@ -274,73 +310,63 @@ func GetMainSourceFile(testSrcs []string) string {
 
 	// Multiple candidates: pick the one containing main(
 	for _, src := range allSrcs {
-		if containsMain(src) {
+		if containsMain(projectFile(dir, src)) {
 			return src
 		}
 	}
 	return ""
 }
 
-// getDepSources returns non-main, non-test source files.
-func getDepSources(mainSrc string, testSrcs []string) []string {
+// getDepSources returns the non-main, non-test source files of the project in dir.
+func getDepSources(dir, mainSrc string, testSrcs []string) []string {
 	testMap := toSet(testSrcs)
 	var deps []string
-	for _, ext := range SourceExts {
-		matches, _ := filepath.Glob("*" + ext)
-		for _, m := range matches {
-			if m != mainSrc && !testMap[m] && !isTestFile(m) {
-				deps = append(deps, m)
-			}
+	for _, m := range projectFilesWithExts(dir, ".", SourceExts) {
+		if m != mainSrc && !testMap[m] && !isTestFile(m) {
+			deps = append(deps, m)
 		}
 	}
 	// Also include common/ sources (excluding test files)
 	for _, cp := range localCommonPaths {
-		for _, ext := range SourceExts {
-			matches, _ := filepath.Glob(filepath.Join(cp, "*"+ext))
-			for _, m := range matches {
-				if !isTestFile(m) {
-					deps = append(deps, m)
-				}
+		for _, m := range projectFilesWithExts(dir, cp, SourceExts) {
+			if !isTestFile(m) {
+				deps = append(deps, m)
 			}
 		}
 	}
 	return uniqueStrings(deps)
 }
 
-// isTestFile returns true if the filename matches *_test.* or test.* patterns.
+// isTestFile returns true if the filename matches *_test.* or test.* patterns,
+// or the *_bench.* pattern of benchmarks, which are built like tests.
 func isTestFile(path string) bool {
 	base := filepath.Base(path)
 	ext := filepath.Ext(base)
 	name := strings.TrimSuffix(base, ext)
-	return strings.HasSuffix(name, "_test") || name == "test"
+	return strings.HasSuffix(name, "_test") || name == "test" || strings.HasSuffix(name, "_bench")
 }
 
 // containsMain checks if a source file contains a main function.
 func containsMain(filename string) bool {
-	data, err := os.ReadFile(filename)
-	if err != nil {
+	return scanSource(filename).hasMain
+}
+
+// lineContainsMain checks if a line of source code looks like a main function.
+func lineContainsMain(line, trimmed string) bool {
+	// Skip single-line comments
+	if strings.HasPrefix(trimmed, "//") {
 		return false
 	}
-	for _, line := range strings.Split(string(data), "\n") {
-		trimmed := strings.TrimSpace(line)
-		// Skip single-line comments
-		if strings.HasPrefix(trimmed, "//") {
-			continue
-		}
-		if strings.Contains(line, " main(") || strings.HasPrefix(trimmed, "main(") ||
-			strings.Contains(line, " SDL_main(") || strings.HasPrefix(trimmed, "SDL_main(") ||
-			strings.Contains(line, " main (") || strings.HasPrefix(trimmed, "main (") {
-			return true
-		}
-	}
-	return false
+	return strings.Contains(line, " main(") || strings.HasPrefix(trimmed, "main(") ||
+		strings.Contains(line, " SDL_main(") || strings.HasPrefix(trimmed, "SDL_main(") ||
+		strings.Contains(line, " main (") || strings.HasPrefix(trimmed, "main (")
 }
 
-// collectExternalIncludes parses source files for #include <...> directives
-// and returns those that are not standard library or local headers.
-// It first tries CPP preprocessing to resolve conditional includes,
-// then falls back to direct text scanning.
-func collectExternalIncludes(sourceFiles []string, win64 bool) []string {
+// collectExternalIncludes parses the source files of the project in dir for
+// #include <...> directives and returns those that are not standard library
+// or local headers. It first evaluates conditionals to find the includes that
+// survive preprocessing, then falls back to direct text scanning.
+func collectExternalIncludes(dir string, sourceFiles []string, win64 bool) []string {
 	seen := make(map[string]bool)
 	var result []string
 
@@ -348,19 +374,21 @@ func collectExternalIncludes(sourceFiles []string, win64 bool) []string {
 		if sf == "" {
 			continue
 		}
-		lines := cppPreprocessIncludes(sf)
-		if lines == nil {
+		var lines []string
+		if dirs := scanIncludes(projectFile(dir, sf)); dirs != nil {
+			lines = includeNames(dirs)
+		} else {
 			// Fallback: scan directly
-			lines = directScanIncludes(sf)
+			lines = directScanIncludes(projectFile(dir, sf))
 		}
 		for _, inc := range lines {
 			if stdHeaders[inc] {
 				continue
 			}
-			if win64 && win64SkipHeaders[inc] {
+			if win64 && isWin64SystemHeader(inc) {
 				continue
 			}
-			if isLocalInclude(inc) {
+			if isLocalInclude(dir, inc) {
 				continue
 			}
 			if !seen[inc] {
@@ -373,36 +401,39 @@ func collectExternalIncludes(sourceFiles []string, win64 bool) []string {
 }
 
 // cppPreprocessIncludes runs the C preprocessor on a source file to resolve
-// conditional includes, then extracts #include directives.
-func cppPreprocessIncludes(filename string) []string {
+// conditional includes, then extracts #include directives. It is used by
+// scanIncludes for files with conditionals that can not be evaluated natively.
+func cppPreprocessIncludes(filename string) []includeDirective {
 	// Use the same trick as build.py: replace #include with a marker before cpp,
 	// then restore after preprocessing to get the includes that survive conditionals.
+	// Indented directives and "# include" are replaced as well, so that cpp
+	// never follows an include.
 	marker := "@@@@@"
 	cmd := fmt.Sprintf(
-		"LC_CTYPE=C LANG=C sed 's/^#include/%sinclude/g' < %q | cpp -E -P -w -pipe 2>/dev/null | sed 's/^%sinclude/#include/g'",
+		"LC_CTYPE=C LANG=C sed 's/^[[:space:]]*#[[:space:]]*include/%sinclude/' < %q | cpp -E -P -w -pipe 2>/dev/null | sed 's/^[[:space:]]*%sinclude/#include/'",
 		marker, filename, marker)
-	out, err := exec.Command("sh", "-c", cmd).Output()
+	out, err := commandOutput("sh", "-c", cmd)
 	if err != nil {
 		return nil
 	}
-	var includes []string
+	includes := []includeDirective{}
 	for _, line := range strings.Split(string(out), "\n") {
 		line = strings.TrimSpace(line)
 		if !strings.HasPrefix(line, "#include") {
 			continue
 		}
-		inc := ""
+		inc := includeDirective{}
 		if idx := strings.Index(line, "<"); idx >= 0 {
 			if end := strings.Index(line[idx:], ">"); end >= 0 {
-				inc = line[idx+1 : idx+end]
+				inc = includeDirective{name: line[idx+1 : idx+end], system: true}
 			}
 		} else if strings.Count(line, "\"") >= 2 {
 			parts := strings.SplitN(line, "\"", 3)
 			if len(parts) >= 2 {
-				inc = parts[1]
+				inc = includeDirective{name: parts[1]}
 			}
 		}
-		if inc != "" {
+		if inc.name != "" {
 			includes = append(includes, inc)
 		}
 	}
@@ -411,31 +442,13 @@ func cppPreprocessIncludes(filename string) []string {
 
 // directScanIncludes scans a file directly for #include <...> directives.
 func directScanIncludes(filename string) []string {
-	f, err := os.Open(filename)
-	if err != nil {
-		return nil
-	}
-	defer f.Close()
-	var includes []string
-	scanner := bufio.NewScanner(f)
-	for scanner.Scan() {
-		line := strings.TrimSpace(scanner.Text())
-		if !strings.HasPrefix(line, "#include") {
-			continue
-		}
-		if idx := strings.Index(line, "<"); idx >= 0 {
-			if end := strings.Index(line[idx:], ">"); end >= 0 {
-				includes = append(includes, line[idx+1:idx+end])
-			}
-		}
-	}
-	return includes
+	return scanSource(filename).directIncludes
 }
 
-// isLocalInclude checks if the include refers to a local project file.
-func isLocalInclude(inc string) bool {
+// isLocalInclude checks if the include refers to a file of the project in dir.
+func isLocalInclude(dir, inc string) bool {
 	for _, lp := range localIncludePaths {
-		if fileExists(filepath.Join(lp, inc)) {
+		if fileExists(projectFile(dir, filepath.Join(lp, inc))) {
 			return true
 		}
 	}
@@ -443,101 +456,149 @@ func isLocalInclude(inc string) bool {
 }
 
 // resolveCommonDeps iteratively finds source files in common/ that correspond
-// to included headers. Repeats until no new deps are discovered.
+// to included headers. Only the files discovered in the previous round are
+// scanned again, until no new deps are discovered.
 func (p *Project) resolveCommonDeps() {
 	if p.MainSource == "" {
 		return
 	}
-	for {
-		allFiles := append([]string{p.MainSource}, p.DepSources...)
-		allIncludes := collectLocalIncludes(allFiles)
-		existingDeps := toSet(p.DepSources)
-		foundNew := false
-
-		for _, inc := range allIncludes {
+	w := newLocalIncludeWalker(p.Dir)
+	existingDeps := toSet(p.DepSources)
+	pending := append([]string{p.MainSource}, p.DepSources...)
+	for len(pending) > 0 {
+		newIncludes := w.walk(pending)
+		pending = nil
+		for _, inc := range newIncludes {
 			base := strings.TrimSuffix(inc, filepath.Ext(inc))
 			for _, cp := range localCommonPaths {
 				for _, ext := range SourceExts {
 					candidate := filepath.Join(cp, base+ext)
-					if fileExists(candidate) {
+					if fileExists(projectFile(p.Dir, candidate)) {
 						key := normalizePath(candidate)
 						if !existingDeps[key] {
 							p.DepSources = append(p.DepSources, candidate)
 							existingDeps[key] = true
-							foundNew = true
+							pending = append(pending, candidate)
 						}
 					}
 				}
 			}
 		}
-		if !foundNew {
-			break
-		}
 	}
 }
 
 // collectLocalIncludes extracts #include "..." from source files and their included headers.
 func collectLocalIncludes(files []string) []string {
-	seen := make(map[string]bool)
-	var result []string
-	examined := make(map[string]bool)
+	return newLocalIncludeWalker(".").walk(files)
+}
 
-	// Iteratively discover local includes from source and header files
+// localIncludeWalker follows #include "..." directives through the source and
+// header files of the project in dir, remembering what it has already seen
+// between walks.
+type localIncludeWalker struct {
+	dir      string
+	seen     map[string]bool
+	examined map[string]bool
+}
+
+func newLocalIncludeWalker(dir string) *localIncludeWalker {
+	return &localIncludeWalker{dir: dir, seen: make(map[string]bool), examined: make(map[string]bool)}
+}
+
+// walk scans the given files and the local headers they include, and returns
+// the includes that were not found by earlier walks. Each level of headers
+// is scanned concurrently.
+func (w *localIncludeWalker) walk(files []string) []string {
+	var result []string
 	queue := make([]string, len(files))
 	copy(queue, files)
 
 	for len(queue) > 0 {
-		sf := queue[0]
-		queue = queue[1:]
-		if sf == "" || examined[strings.ToLower(sf)] {
-			continue
-		}
-		examined[strings.ToLower(sf)] = true
-
-		f, err := os.Open(sf)
-		if err != nil {
-			continue
-		}
-		scanner := bufio.NewScanner(f)
-		for scanner.Scan() {
-			line := strings.TrimSpace(scanner.Text())
-			if strings.HasPrefix(line, "#include \"") {
-				parts := strings.SplitN(line, "\"", 3)
-				if len(parts) >= 2 {
-					inc := parts[1]
-					if !seen[inc] {
-						seen[inc] = true
-						result = append(result, inc)
-						// Also scan the included header itself
-						for _, lp := range localIncludePaths {
-							headerPath := filepath.Join(lp, inc)
-							if fileExists(headerPath) {
-								queue = append(queue, headerPath)
-								break
-							}
-						}
+		scanSources(projectFiles(w.dir, queue))
+		var next []string
+		for _, sf := range queue {
+			if sf == "" || w.examined[strings.ToLower(sf)] {
+				continue
+			}
+			w.examined[strings.ToLower(sf)] = true
+			for _, inc := range scanSource(projectFile(w.dir, sf)).localIncludes {
+				if w.seen[inc] {
+					continue
+				}
+				w.seen[inc] = true
+				result = append(result, inc)
+				// Also scan the included header itself
+				for _, lp := range localIncludePaths {
+					headerPath := filepath.Join(lp, inc)
+					if fileExists(projectFile(w.dir, headerPath)) {
+						next = append(next, headerPath)
+						break
 					}
 				}
 			}
 		}
-		f.Close()
+		queue = next
 	}
 	return result
 }
 
-// executableName returns the name for the output executable.
+// executableName returns the name for the output executable of the project
+// in the current directory.
 func executableName() string {
-	dir, err := os.Getwd()
+	return executableNameIn(".")
+}
+
+// executableNameIn returns the name for the output executable of the project
+// in dir, which is named after the directory.
+func executableNameIn(dir string) string {
+	abs, err := filepath.Abs(dir)
 	if err != nil {
 		return "main"
 	}
-	name := filepath.Base(dir)
+	name := filepath.Base(abs)
 	if name == "src" {
 		return "main"
 	}
 	return name
 }
 
+// projectFile returns path, which is relative to the project directory dir,
+// as a path that can be opened from the current directory of the process.
+// Absolute paths and paths in the current directory are returned as they are.
+func projectFile(dir, path string) string {
+	if dir == "" || dir == "." || filepath.IsAbs(path) {
+		return path
+	}
+	return filepath.Join(dir, path)
+}
+
+// projectFiles returns the paths of files relative to dir, see projectFile.
+func projectFiles(dir string, files []string) []string {
+	if dir == "" || dir == "." {
+		return files
+	}
+	paths := make([]string, len(files))
+	for i, f := range files {
+		if f != "" {
+			paths[i] = projectFile(dir, f)
+		}
+	}
+	return paths
+}
+
+// projectFilesWithExts is like filesWithExts for the directory sub of the
+// project in dir, but returns the paths relative to dir.
+func projectFilesWithExts(dir, sub string, exts []string) []string {
+	found := filesWithExts(projectFile(dir, sub), exts)
+	if dir == "" || dir == "." {
+		return found
+	}
+	for i, f := range found {
+		found[i] = filepath.Join(sub, filepath.Base(f))
+	}
+	return found
+}
+
 func fileExists(path string) bool {
 	_, err := os.Stat(path)
 	return err == nil
@@ -1,9 +1,11 @@
 package orchideous
 
 import (
+	"fmt"
 	"os"
 	"path/filepath"
 	"slices"
+	"strings"
 	"testing"
 )
 
@@ -85,16 +87,31 @@ func TestGetTestSources(t *testing.T) {
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 	writeFile(t, "foo_test.cpp", `int main() { return 0; }`)
 	writeFile(t, "bar_test.cc", `int main() { return 0; }`)
-	tests := getTestSources()
+	tests := getTestSources(".")
 	if len(tests) != 2 {
 		t.Errorf("expected 2 test files, got %d: %v", len(tests), tests)
 	}
 }
 
+func TestGetBenchSources(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+	writeFile(t, "foo.cpp", `int foo() { return 0; }`)
+	writeFile(t, "foo_bench.cpp", `int main() { return 0; }`)
+	writeFile(t, "foo_test.cpp", `int main() { return 0; }`)
+	p := detectProject(".")
+	if !slices.Equal(p.BenchSources, []string{"foo_bench.cpp"}) {
+		t.Errorf("expected foo_bench.cpp, got %v", p.BenchSources)
+	}
+	if !slices.Equal(p.DepSources, []string{"foo.cpp"}) {
+		t.Errorf("expected the benchmark to not be a dependency, got %v", p.DepSources)
+	}
+}
+
 func TestGetTestSources_TestDotCpp(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "test.cpp", `int main() { return 0; }`)
-	tests := getTestSources()
+	tests := getTestSources(".")
 	if len(tests) != 1 {
 		t.Fatalf("expected 1 test file, got %d: %v", len(tests), tests)
 	}
@@ -129,7 +146,7 @@ func TestGetDepSources(t *testing.T) {
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 	writeFile(t, "util.cpp", `void util() {}`)
 	writeFile(t, "foo_test.cpp", `int main() { return 0; }`)
-	deps := getDepSources("main.cpp", []string{"foo_test.cpp"})
+	deps := getDepSources(".", "main.cpp", []string{"foo_test.cpp"})
 	if len(deps) != 1 {
 		t.Fatalf("expected 1 dep, got %d: %v", len(deps), deps)
 	}
@@ -142,13 +159,57 @@ func TestGetDepSources_WithCommon(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `int main() { return 0; }`)
 	writeFile(t, "common/helper.cpp", `void helper() {}`)
-	deps := getDepSources("main.cpp", nil)
+	deps := getDepSources(".", "main.cpp", nil)
 	found := slices.Contains(deps, filepath.Join("common", "helper.cpp"))
 	if !found {
 		t.Errorf("expected common/helper.cpp in deps, got %v", deps)
 	}
 }
 
+func TestFilesWithExts(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "b.cpp", "")
+	writeFile(t, "a.cpp", "")
+	writeFile(t, "c.c", "")
+	writeFile(t, "d.cc", "")
+	writeFile(t, "e.h", "")
+	os.Mkdir("dir.cpp", 0o755)
+	got := filesWithExts(".", []string{".cpp", ".cc", ".c"})
+	want := []string{"a.cpp", "b.cpp", "d.cc", "c.c"}
+	if !slices.Equal(got, want) {
+		t.Errorf("filesWithExts = %v, want %v", got, want)
+	}
+}
+
+func TestWalkFiles(t *testing.T) {
+	dir := t.TempDir()
+	for _, f := range []string{"a.h", "GL/gl.h", "GL/glext.h", "b/c/d/e.h", "b/c/d/e/too_deep.h", "b/x.h", "z.h"} {
+		writeFile(t, filepath.Join(dir, f), "")
+	}
+	// The order of filepath.WalkDir, which the header index depends on
+	var want []string
+	filepath.WalkDir(dir, func(path string, d os.DirEntry, err error) error {
+		rel, _ := filepath.Rel(dir, path)
+		rel = filepath.ToSlash(rel)
+		if rel == "." {
+			return nil
+		}
+		if d.IsDir() {
+			if strings.Count(rel, "/") >= 3 {
+				return filepath.SkipDir
+			}
+			return nil
+		}
+		want = append(want, rel)
+		return nil
+	})
+	got := walkFiles(dir, 3)
+	if !slices.Equal(got, want) {
+		t.Errorf("walkFiles = %v, want %v", got, want)
+	}
+	assertTrue(t, !slices.Contains(got, "b/c/d/e/too_deep.h"), "files below the depth are left out")
+}
+
 func TestContainsMain(t *testing.T) {
 	dir := t.TempDir()
 	cases := []struct {
@@ -212,6 +273,11 @@ func TestScanSourceForFlags(t *testing.T) {
 			content: "#include <thread>\nint main() {}",
 			check:   func(t *testing.T, p Project) { assertTrue(t, p.HasThreads, "HasThreads") },
 		},
+		{
+			name:    "Parallel",
+			content: "#include <execution>\nint main() {}",
+			check:   func(t *testing.T, p Project) { assertTrue(t, p.HasParallel, "HasParallel") },
+		},
 		{
 			name:    "Dlopen",
 			content: "#include <dlfcn.h>\nint main() {}",
@@ -250,7 +316,7 @@ func TestDetectProject_HelloExample(t *testing.T) {
 	}
 	os.Chdir(helloDir)
 
-	p := detectProject()
+	p := detectProject(".")
 	if p.MainSource != "main.cpp" {
 		t.Errorf("expected main.cpp, got %q", p.MainSource)
 	}
@@ -265,6 +331,30 @@ func TestDetectProject_HelloExample(t *testing.T) {
 	}
 }
 
+func TestDetectProject_Dir(t *testing.T) {
+	root := withTempDir(t)
+	writeFile(t, "proj/main.cpp", "#include \"util.h\"\n#include <SDL2/SDL.h>\nint main() { return util(); }\n")
+	writeFile(t, "proj/include/util.h", "int util();\n")
+	writeFile(t, "proj/common/util.cpp", "int util() { return 0; }\n")
+	writeFile(t, "proj/util_test.cpp", "int main() { return 0; }\n")
+	os.MkdirAll("proj/img", 0o755)
+
+	// The project is found relative to its directory, from somewhere else
+	p := detectProject("proj")
+	assertTrue(t, p.Dir == "proj" && p.MainSource == "main.cpp", fmt.Sprintf("unexpected project %+v", p))
+	assertTrue(t, slices.Equal(p.DepSources, []string{filepath.Join("common", "util.cpp")}), fmt.Sprintf("unexpected dep sources %v", p.DepSources))
+	assertTrue(t, slices.Equal(p.TestSources, []string{"util_test.cpp"}), fmt.Sprintf("unexpected test sources %v", p.TestSources))
+	assertTrue(t, slices.Equal(p.Includes, []string{"SDL2/SDL.h"}), fmt.Sprintf("util.h should be a local include, got %v", p.Includes))
+	assertTrue(t, executableNameIn("proj") == "proj", "the executable should be named after the project directory")
+
+	flags := assembleFlags(p, BuildOptions{})
+	assertTrue(t, flags.Dir == "proj", "the flags should be for the project directory")
+	assertFlagPresent(t, flags.IncPaths, "include")
+	assertFlagPresent(t, flags.Defines, `-DIMGDIR="img/"`)
+	assertTrue(t, fileExists(filepath.Join("proj", flagCacheFile)) && !fileExists(flagCacheFile), "the flags should be cached in the project directory")
+	assertTrue(t, mustGetwd() == root, "the current directory should not change")
+}
+
 func TestExecutableName(t *testing.T) {
 	dir := t.TempDir()
 	orig, _ := os.Getwd()
@@ -308,6 +398,145 @@ func TestDirectScanIncludes(t *testing.T) {
 	}
 }
 
+func TestResolveCommonDeps_Chained(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", "#include \"a.h\"\nint main() {}\n")
+	writeFile(t, "common/a.h", "#pragma once\n")
+	writeFile(t, "common/a.cpp", "#include \"b.h\"\n")
+	writeFile(t, "common/b.h", "#pragma once\n")
+	writeFile(t, "common/b.cpp", "int b() { return 1; }\n")
+	p := Project{MainSource: "main.cpp"}
+	p.resolveCommonDeps()
+	expected := []string{filepath.Join("common", "a.cpp"), filepath.Join("common", "b.cpp")}
+	if !slices.Equal(p.DepSources, expected) {
+		t.Errorf("got %v, want %v", p.DepSources, expected)
+	}
+}
+
+func TestScanSource_Invalidated(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", "void foo() {}\n")
+	if containsMain("main.cpp") {
+		t.Fatal("expected no main")
+	}
+	writeFile(t, "main.cpp", "int main() { return 0; }\n")
+	if !containsMain("main.cpp") {
+		t.Error("expected scan record to be refreshed after the file changed")
+	}
+}
+
+func TestNativeScanIncludes(t *testing.T) {
+	if predefinedMacros() == nil {
+		t.Skip("cpp not available")
+	}
+	content := `#include <iostream>
+#define USE_FOO 2
+#if USE_FOO > 1 && !defined(NOT_DEFINED_ANYWHERE)
+#  include <foo.h> // picked
+#elif 1
+#include <bar.h>
+#endif
+#ifdef NOT_DEFINED_ANYWHERE
+#include <windows.h>
+#else
+#include "local.h"
+#endif
+/* #include <commented.h> */
+#if 0
+#if 1
+#include <nested.h>
+#endif
+#endif
+#undef USE_FOO
+#ifndef USE_FOO
+#include <after_undef.h>
+#endif
+`
+	dirs, err := nativeScanIncludes([]byte(content))
+	if err != nil {
+		t.Fatal(err)
+	}
+	expected := []includeDirective{{"iostream", true}, {"foo.h", true}, {"local.h", false}, {"after_undef.h", true}}
+	if !slices.Equal(dirs, expected) {
+		t.Errorf("got %v, want %v", dirs, expected)
+	}
+}
+
+func TestNativeScanIncludes_Unevaluable(t *testing.T) {
+	if predefinedMacros() == nil {
+		t.Skip("cpp not available")
+	}
+	_, err := nativeScanIncludes([]byte("#if __has_include(<foo.h>)\n#include <foo.h>\n#endif\n"))
+	if err != errUnevaluable {
+		t.Errorf("expected errUnevaluable, got %v", err)
+	}
+}
+
+func TestPreprocessedIncludeCache(t *testing.T) {
+	dir := withTempDir(t)
+	data := []byte("#if __has_include(<foo.h>)\n#include <foo.h>\n#endif\n")
+	writeFile(t, "a.cpp", string(data))
+	c := &preprocessedIncludeCache{Includes: map[string][]cachedInclude{
+		hashStrings(string(data)): {{Name: "bar.h", System: true}},
+	}, path: filepath.Join(dir, "preprocessed.cache")}
+
+	// A cached file is not run through cpp
+	if got := c.includes(hashStrings(string(data)), "a.cpp"); len(got) != 1 || got[0] != (includeDirective{name: "bar.h", system: true}) {
+		t.Errorf("expected the cached includes, got %v", got)
+	}
+	if predefinedMacros() == nil {
+		t.Skip("cpp not available")
+	}
+	changed := []byte("#include \"baz.h\"\n" + string(data))
+	writeFile(t, "a.cpp", string(changed))
+	if got := c.includes(hashStrings(string(changed)), "a.cpp"); len(got) == 0 || got[0].name != "baz.h" {
+		t.Errorf("expected changed contents to be preprocessed again, got %v", got)
+	}
+	// Indented directives are not followed by cpp either, or the missing
+	// header would stop it before the includes after it
+	indented := []byte("  #  include <oh_missing_header.h>\n#if 1\n#include <foo.h>\n#endif\n")
+	writeFile(t, "b.cpp", string(indented))
+	if got := c.includes(hashStrings(string(indented)), "b.cpp"); len(got) != 2 || got[0].name != "oh_missing_header.h" || got[1].name != "foo.h" {
+		t.Errorf("expected both includes of the indented file, got %v", got)
+	}
+	c.save()
+	var loaded preprocessedIncludeCache
+	assertTrue(t, readJSONFile(c.path, &loaded) && len(loaded.Includes) == 3, "expected every version of the files to be cached")
+}
+
+func TestIsWin64SystemHeader(t *testing.T) {
+	assertTrue(t, isWin64SystemHeader("windows.h"), "windows.h should be a Windows header")
+	assertTrue(t, isWin64SystemHeader("GL/gl.h"), "GL/gl.h should come with mingw-w64")
+	assertTrue(t, !isWin64SystemHeader("SDL2/SDL.h"), "SDL2/SDL.h should be looked up with pkg-config")
+}
+
+func TestEvalPPExpression(t *testing.T) {
+	macros := map[string]ppMacro{"A": {body: "3"}, "B": {body: "A * 2"}, "F": {isFunction: true}}
+	tests := map[string]int64{
+		"1 + 2 * 3":          7,
+		"B == 6":             1,
+		"defined A && !C":    1,
+		"defined(F)":         1,
+		"F":                  0,
+		"(A << 2) | 1":       13,
+		"A > 2 ? 10 : 20":    10,
+		"0x10 + 010 + 1UL":   25,
+		"'a' == 97":          1,
+		"UNKNOWN_MACRO || 0": 0,
+	}
+	for expr, want := range tests {
+		got, err := evalPPExpression(expr, macros)
+		if err != nil {
+			t.Errorf("%q: unexpected error %v", expr, err)
+		} else if got != want {
+			t.Errorf("%q = %d, want %d", expr, got, want)
+		}
+	}
+	if _, err := evalPPExpression("F(1)", macros); err != errUnevaluable {
+		t.Errorf("expected errUnevaluable for function-like macro, got %v", err)
+	}
+}
+
 func TestUniqueStrings(t *testing.T) {
 	input := []string{"a", "b", "a", "c", "b"}
 	got := uniqueStrings(input)
@@ -0,0 +1,75 @@
+package orchideous
+
+import (
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+)
+
+// dirReaders is how many directories walkFiles reads at the same time.
+const dirReaders = 8
+
+// filesWithExts returns the files in dir that end with one of exts, with all
+// the files of the first extension first, and sorted by name within each,
+// like a filepath.Glob per extension returns them, but with a single read
+// of the directory. Directories are left out.
+func filesWithExts(dir string, exts []string) []string {
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		return nil
+	}
+	var found []string
+	for _, ext := range exts {
+		for _, e := range entries {
+			if !e.IsDir() && strings.HasSuffix(e.Name(), ext) {
+				found = append(found, filepath.Join(dir, e.Name()))
+			}
+		}
+	}
+	return found
+}
+
+// walkFiles returns the files below root, at most depth directory levels
+// down, as slash separated paths relative to root, in the order that
+// filepath.WalkDir visits them. The directories are read in parallel, which
+// matters for large trees such as /usr/include when they are not cached.
+func walkFiles(root string, depth int) []string {
+	slots := make(chan struct{}, dirReaders)
+	var walk func(rel string) []string
+	walk = func(rel string) []string {
+		slots <- struct{}{}
+		entries, err := os.ReadDir(filepath.Join(root, filepath.FromSlash(rel)))
+		<-slots
+		if err != nil {
+			return nil
+		}
+		parts := make([][]string, len(entries))
+		var wg sync.WaitGroup
+		for i, e := range entries {
+			name := e.Name()
+			if rel != "" {
+				name = rel + "/" + name
+			}
+			if !e.IsDir() {
+				parts[i] = []string{name}
+				continue
+			}
+			if strings.Count(name, "/") >= depth {
+				continue
+			}
+			wg.Add(1)
+			go func(i int, name string) {
+				defer wg.Done()
+				parts[i] = walk(name)
+			}(i, name)
+		}
+		wg.Wait()
+		var files []string
+		for _, p := range parts {
+			files = append(files, p...)
+		}
+		return files
+	}
+	return walk("")
+}
@@ -0,0 +1,93 @@
+package orchideous
+
+import (
+	"bytes"
+	"context"
+	"fmt"
+	"os"
+	"os/exec"
+	"strings"
+	"sync"
+)
+
+var (
+	dockerMutex      sync.Mutex
+	dockerContainers = make(map[string]string) // image and project directory -> container name
+	dockerImages     = make(map[string]bool)   // images that are known to be pulled
+	dockerFailed     = make(map[string]bool)   // images that no container could be started for
+)
+
+// dockerKey identifies the container for compiling in dir with image.
+func dockerKey(image, dir string) string {
+	return image + "\x00" + dir
+}
+
+// dockerCommand returns the command for running the compiler with args in a
+// container of image, with dir mounted as /home. Starting a container takes
+// a second or more, so the first command of a build starts one container,
+// which every compile of the build then runs in with docker exec, in
+// parallel. If the container can not be started, every command runs in a
+// container of its own, as with "docker run --rm".
+func dockerCommand(ctx context.Context, image, compiler, dir string, args []string) *exec.Cmd {
+	if name, err := startDockerContainer(image, dir); err == nil {
+		return exec.CommandContext(ctx, "docker", append([]string{"exec", name, compiler}, args...)...)
+	}
+	dockerArgs := []string{"run", "-v", dir + ":/home", "-w", "/home", "--rm", image, compiler}
+	return exec.CommandContext(ctx, "docker", append(dockerArgs, args...)...)
+}
+
+// startDockerContainer returns the container for compiling in dir with
+// image, and pulls the image and starts the container if needed.
+func startDockerContainer(image, dir string) (string, error) {
+	dockerMutex.Lock()
+	defer dockerMutex.Unlock()
+	key := dockerKey(image, dir)
+	if name, ok := dockerContainers[key]; ok {
+		return name, nil
+	}
+	if dockerFailed[image] {
+		return "", fmt.Errorf("no container for %s", image)
+	}
+	err := func() error {
+		if !dockerImages[image] {
+			if runCommand(exec.Command("docker", "image", "inspect", image)) != nil {
+				fmt.Printf("Pulling %s\n", image)
+				if err := runTool("docker", "pull", image); err != nil {
+					return fmt.Errorf("docker pull %s: %w", image, err)
+				}
+			}
+			dockerImages[image] = true
+		}
+		name := "oh-" + hashStrings(key)[:12]
+		runCommand(exec.Command("docker", "rm", "-f", name)) // left behind by an interrupted build
+		var out bytes.Buffer
+		cmd := exec.Command("docker", "run", "-d", "--rm", "--name", name, "-v", dir+":/home", "-w", "/home",
+			image, "tail", "-f", "/dev/null")
+		cmd.Stdout = &out
+		cmd.Stderr = &out
+		if err := runCommand(cmd); err != nil {
+			return fmt.Errorf("starting a %s container: %v: %s", image, err, strings.TrimSpace(out.String()))
+		}
+		dockerContainers[key] = name
+		return nil
+	}()
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "warning: %v, starting a container for every command instead\n", err)
+		dockerFailed[image] = true
+		return "", err
+	}
+	return dockerContainers[key], nil
+}
+
+// stopDockerContainers removes the containers that were started for
+// compiling in dir, at the end of a build.
+func stopDockerContainers(dir string) {
+	dockerMutex.Lock()
+	defer dockerMutex.Unlock()
+	for key, name := range dockerContainers {
+		if strings.HasSuffix(key, "\x00"+dir) {
+			runCommand(exec.Command("docker", "rm", "-f", name))
+			delete(dockerContainers, key)
+		}
+	}
+}
@@ -0,0 +1,133 @@
+package orchideous
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"os/exec"
+	"regexp"
+	"strconv"
+	"time"
+)
+
+// BuildEventKind tells what a BuildEvent is about.
+type BuildEventKind int
+
+const (
+	EventStarted  BuildEventKind = iota // a compile or link has started
+	EventFinished                       // a compile or link has finished, successfully or not
+)
+
+// BuildEvent is sent to BuildOptions.Events for every compile and link,
+// when it starts and when it finishes.
+type BuildEvent struct {
+	Kind        BuildEventKind
+	Source      string        // the source that is compiled, or "" for a link
+	Output      string        // the object or executable that is written
+	Command     string        // the command, as in BuildResult.CommandsRun
+	Duration    time.Duration // for EventFinished
+	ExitCode    int           // for EventFinished: 0 on success, -1 if the command could not run
+	Diagnostics []Diagnostic  // for EventFinished: the errors and warnings of the compiler
+}
+
+// Diagnostic is an error, warning or note from the compiler or the linker.
+type Diagnostic struct {
+	File     string
+	Line     int
+	Column   int    // 0 if the compiler did not give one
+	Severity string // "error", "fatal error", "warning" or "note"
+	Message  string
+}
+
+// maxCommandOutput is how much of the output of one compiler command is kept,
+// so that a massive error spew does not use up the memory.
+const maxCommandOutput = 1 << 20
+
+// maxDiagnostics is how many diagnostics are kept for one command.
+const maxDiagnostics = 1000
+
+// diagnosticPattern matches the "file:line:col: severity: message" lines
+// that both GCC and clang print, with or without a column.
+var diagnosticPattern = regexp.MustCompile(`^(.+?):(\d+):(?:(\d+):)? (fatal error|error|warning|note): (.*)$`)
+
+// parseDiagnostics parses the diagnostics in the output of a compiler. The
+// text format is parsed instead of asking for -fdiagnostics-format=json,
+// since that would change the compile commands, and is GCC-only.
+func parseDiagnostics(output []byte) []Diagnostic {
+	var diags []Diagnostic
+	for _, line := range bytes.Split(output, []byte("\n")) {
+		m := diagnosticPattern.FindSubmatch(bytes.TrimRight(line, "\r"))
+		if m == nil {
+			continue
+		}
+		d := Diagnostic{File: string(m[1]), Severity: string(m[4]), Message: string(m[5])}
+		d.Line, _ = strconv.Atoi(string(m[2]))
+		d.Column, _ = strconv.Atoi(string(m[3]))
+		if diags = append(diags, d); len(diags) == maxDiagnostics {
+			break
+		}
+	}
+	return diags
+}
+
+// exitCode returns the exit code of a command that returned err.
+func exitCode(err error) int {
+	var exitErr *exec.ExitError
+	switch {
+	case err == nil:
+		return 0
+	case errors.As(err, &exitErr):
+		return exitErr.ExitCode()
+	}
+	return -1
+}
+
+// emitEvent sends an event to events, if it is not nil.
+func emitEvent(events func(BuildEvent), ev BuildEvent) {
+	if events != nil {
+		events(ev)
+	}
+}
+
+// finishedEvent returns the EventFinished event for a command.
+func finishedEvent(src, out string, cmd *exec.Cmd, output []byte, err error, d time.Duration) BuildEvent {
+	return BuildEvent{Kind: EventFinished, Source: src, Output: out, Command: cmdToString(cmd),
+		Duration: d, ExitCode: exitCode(err), Diagnostics: parseDiagnostics(output)}
+}
+
+// limitedBuffer keeps the first limit bytes that are written to it, and
+// counts the rest.
+type limitedBuffer struct {
+	buf     bytes.Buffer
+	limit   int
+	dropped int
+}
+
+func (b *limitedBuffer) Write(p []byte) (int, error) {
+	room := max(b.limit-b.buf.Len(), 0)
+	if len(p) > room {
+		b.buf.Write(p[:room])
+		b.dropped += len(p) - room
+	} else {
+		b.buf.Write(p)
+	}
+	return len(p), nil
+}
+
+// Bytes returns the kept output, followed by a note about what was dropped.
+func (b *limitedBuffer) Bytes() []byte {
+	if b.dropped == 0 {
+		return b.buf.Bytes()
+	}
+	return append(b.buf.Bytes(), fmt.Sprintf("\n[%d more bytes of output were dropped]\n", b.dropped)...)
+}
+
+// runCaptured runs a command with stdout and stderr combined, and keeps at
+// most maxCommandOutput bytes of the output.
+func runCaptured(cmd *exec.Cmd) ([]byte, error) {
+	out := &limitedBuffer{limit: maxCommandOutput}
+	cmd.Stdout = out
+	cmd.Stderr = out
+	err := cmd.Run()
+	return out.Bytes(), err
+}
@@ -1,25 +1,290 @@
-// From http://en.cppreference.com/w/cpp/thread/async
+// Based on http://en.cppreference.com/w/cpp/thread/async
+//
+// parallel_sum from the std::async example, on a fork-join pool with work
+// stealing instead of a new thread per split. Run with --bench [n] to
+// compare it with std::reduce(std::execution::par) on n elements (10^8 by
+// default), for a range of grain sizes.
 
 #include <algorithm>
-#include <future>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <execution>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <numeric>
+#include <thread>
 #include <vector>
 
-template <typename RandomIt> int parallel_sum(RandomIt beg, RandomIt end)
-{
-    auto len = end - beg;
-    if (len < 1000)
-        return std::accumulate(beg, end, 0);
+// task_pool runs tasks on a fixed set of threads. Every worker has a deque
+// of its own, which it pushes the tasks it forks to and pops them from, at
+// the back, so that it works depth first on what is already in its cache.
+// An idle worker steals from the front of the other deques, where the
+// largest pieces of work are.
+class task_pool {
+    struct task {
+        void (*call)(task*);
+        std::atomic<bool> done { false };
+        bool external = false; // submitted with run, by a thread outside the pool
+    };
+
+    template <typename F> struct task_of : task {
+        F& f;
+        explicit task_of(F& f_)
+            : f(f_)
+        {
+            this->call = [](task* t) { static_cast<task_of*>(t)->f(); };
+        }
+    };
+
+    struct queue {
+        std::mutex mutex;
+        std::deque<task*> tasks;
+    };
+
+    std::vector<queue> queues; // one per worker, and the last one for run
+    std::vector<std::thread> threads;
+    std::atomic<int> queued { 0 };
+    std::atomic<int> sleepers { 0 };
+    std::atomic<bool> stopping { false };
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::mutex done_mutex;
+    std::condition_variable done;
+
+    static thread_local task_pool* current_pool;
+    static thread_local int current_worker;
+
+    void push(int q, task* t)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queues[q].mutex);
+            queues[q].tasks.push_back(t);
+        }
+        queued++;
+        if (sleepers > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            wake.notify_one();
+        }
+    }
+
+    // Pops t from the back of the deque of worker w, unless it was stolen
+    bool pop_back(int w, task* t)
+    {
+        std::lock_guard<std::mutex> lock(queues[w].mutex);
+        if (queues[w].tasks.empty() || queues[w].tasks.back() != t) {
+            return false;
+        }
+        queues[w].tasks.pop_back();
+        queued--;
+        return true;
+    }
+
+    // Takes the newest task of worker w, or else the oldest task of another queue
+    task* find_task(int w)
+    {
+        int n = int(queues.size());
+        for (int k = 0; k < n; k++) {
+            queue& q = queues[(w + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task* t = k == 0 ? q.tasks.back() : q.tasks.front();
+                k == 0 ? q.tasks.pop_back() : q.tasks.pop_front();
+                queued--;
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    void execute(task* t)
+    {
+        t->call(t);
+        if (t->external) {
+            std::lock_guard<std::mutex> lock(done_mutex);
+            t->done = true;
+            done.notify_all();
+        } else {
+            t->done.store(true, std::memory_order_release);
+        }
+    }
+
+    void work(int w)
+    {
+        current_pool = this;
+        current_worker = w;
+        while (!stopping) {
+            if (task* t = find_task(w)) {
+                execute(t);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleepers++;
+            wake.wait(lock, [this] { return queued > 0 || stopping; });
+            sleepers--;
+        }
+    }
+
+public:
+    explicit task_pool(unsigned workers = std::max(1u, std::thread::hardware_concurrency()))
+        : queues(workers + 1)
+    {
+        for (unsigned w = 0; w < workers; w++) {
+            threads.emplace_back([this, w] { work(int(w)); });
+        }
+    }
+
+    ~task_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+            wake.notify_all();
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+
+    unsigned size() const { return unsigned(threads.size()); }
+
+    // Runs f on the pool, and waits for it to finish
+    template <typename F> void run(F&& f)
+    {
+        if (current_pool == this) {
+            f();
+            return;
+        }
+        task_of<F> t(f);
+        t.external = true;
+        push(int(queues.size()) - 1, &t);
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.wait(lock, [&] { return t.done.load(); });
+    }
+
+    // Runs a and b, possibly in parallel, and returns when both are done.
+    // b is offered to idle workers while a runs here, and is run here after
+    // a, if no one took it. Must be called from a task of this pool.
+    template <typename A, typename B> void fork_join(A&& a, B&& b)
+    {
+        int w = current_worker;
+        task_of<B> tb(b);
+        push(w, &tb);
+        a();
+        if (pop_back(w, &tb)) {
+            b();
+            return;
+        }
+        // b was stolen, so help with the other tasks until it is done
+        while (!tb.done.load(std::memory_order_acquire)) {
+            if (task* t = find_task(w)) {
+                execute(t);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+thread_local task_pool* task_pool::current_pool = nullptr;
+thread_local int task_pool::current_worker = -1;
 
+// Reduces the non-empty range [beg, end) with op, splitting it in halves
+// until they are at most grain elements long
+template <typename RandomIt, typename BinaryOp>
+auto reduce_range(task_pool& pool, RandomIt beg, RandomIt end, BinaryOp op, std::size_t grain)
+    -> std::decay_t<decltype(op(*beg, *beg))>
+{
+    using T = std::decay_t<decltype(op(*beg, *beg))>;
+    auto len = std::size_t(end - beg);
+    if (len <= grain) {
+        return std::accumulate(beg + 1, end, T(*beg), op);
+    }
     RandomIt mid = beg + len / 2;
-    auto handle = std::async(std::launch::async, parallel_sum<RandomIt>, mid, end);
-    int sum = parallel_sum(beg, mid);
-    return sum + handle.get();
+    T left {}, right {};
+    pool.fork_join([&] { left = reduce_range(pool, beg, mid, op, grain); },
+        [&] { right = reduce_range(pool, mid, end, op, grain); });
+    return op(left, right);
+}
+
+// The grain size that gives every worker about 8 pieces, so that there is
+// something to steal, but not less than what splitting costs
+inline std::size_t default_grain(const task_pool& pool, std::size_t len)
+{
+    return std::max<std::size_t>(len / (std::size_t(pool.size()) * 8), 4096);
+}
+
+// Reduces [beg, end) with op, starting from init, on the pool. op must be
+// associative, since the parts are reduced in parallel. A grain of 0 picks one.
+template <typename RandomIt, typename T, typename BinaryOp>
+T parallel_reduce(task_pool& pool, RandomIt beg, RandomIt end, T init, BinaryOp op, std::size_t grain = 0)
+{
+    if (beg == end) {
+        return init;
+    }
+    if (grain == 0) {
+        grain = default_grain(pool, std::size_t(end - beg));
+    }
+    T result = init;
+    pool.run([&] { result = op(init, reduce_range(pool, beg, end, op, grain)); });
+    return result;
+}
+
+template <typename RandomIt> auto parallel_sum(task_pool& pool, RandomIt beg, RandomIt end, std::size_t grain = 0)
+{
+    using T = typename std::iterator_traits<RandomIt>::value_type;
+    return parallel_reduce(pool, beg, end, T {}, std::plus<T> {}, grain);
+}
+
+// Returns the best time in milliseconds of a few runs of f, and the result
+template <typename F> double best_ms(F f, long long& result)
+{
+    double best = 1e300;
+    for (int i = 0; i < 5; i++) {
+        auto start = std::chrono::steady_clock::now();
+        result = f();
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+static void benchmark(std::size_t n)
+{
+    task_pool pool;
+    std::vector<long long> v(n);
+    for (std::size_t i = 0; i < n; i++) {
+        v[i] = static_cast<long long>(i % 7);
+    }
+    printf("Summing %zu elements on %u threads\n", n, pool.size());
+#if !defined(_PSTL_PAR_BACKEND_TBB) && defined(__GLIBCXX__)
+    printf("(std::execution::par runs serially, since libstdc++ found no TBB headers)\n");
+#endif
+    long long sum = 0;
+    auto report = [&](const char* name, double ms) {
+        printf("%-40s %10.2f ms %8.2f GB/s  sum %lld\n", name, ms, double(n * sizeof(long long)) / ms / 1e6, sum);
+    };
+    report("std::accumulate", best_ms([&] { return std::accumulate(v.begin(), v.end(), 0LL); }, sum));
+    report("std::reduce(par)", best_ms([&] { return std::reduce(std::execution::par, v.begin(), v.end(), 0LL); }, sum));
+    for (std::size_t grain : { std::size_t(1000), std::size_t(100000), std::size_t(10000000), std::size_t(0) }) {
+        std::size_t g = grain != 0 ? grain : default_grain(pool, n);
+        char name[64];
+        snprintf(name, sizeof(name), "parallel_sum, grain %zu%s", g, grain == 0 ? " (default)" : "");
+        report(name, best_ms([&] { return parallel_sum(pool, v.begin(), v.end(), g); }, sum));
+    }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        benchmark(argc > 2 ? std::size_t(std::atoll(argv[2])) : std::size_t(100000000));
+        return 0;
+    }
+    task_pool pool;
     std::vector<int> v(10000, 1);
-    std::cout << "The sum is " << parallel_sum(v.begin(), v.end()) << '\n';
+    std::cout << "The sum is " << parallel_sum(pool, v.begin(), v.end(), 1000) << '\n';
 }
@@ -1,8 +1,14 @@
+#define GL_GLEXT_PROTOTYPES
 #include <SFML/Graphics.hpp>
 #include <SFML/OpenGL.hpp>
+#include <GL/glext.h>
+#include <algorithm>
 #include <array>
 #include <cmath>
-#include <map>
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <vector>
 
 /* My second OpenGL exercise
  * Copyright (c) 1992,2019 Joel Yliluoma - https://iki.fi/bisqwit/
@@ -10,28 +16,89 @@
  * Source code license: MIT
  * Compile with (example):
  *   g++ 75000.cc -Wall -Wextra -Ofast -std=c++20 $(pkg-config sfml-graphics --libs --cflags) -lGL
+ *
+ * The geometry is uploaded once to a static vertex buffer, and drawn with a
+ * GLSL 3.30 shader that does the texturing and the fog. Run with --legacy
+ * to draw it from client memory with the fixed-function pipeline instead,
+ * as the original did. The frame rate and frame time are shown in the
+ * window title, and printed every second, for comparing the two.
  */
 
 static const char recipe[]
     = "lidjehfhfhhideiefedefedefekedeiefedefedefejfdeiefedefedefejeeieefed"
       "efedefeiekedefedefedefeiekedefedefedefeiefefedefedefedefeieghfhfhfhm";
 
-int main()
+// The shader path does what the fixed-function pipeline does for the legacy
+// path: the vertex color modulates the texture (GL_MODULATE), and GL_EXP fog
+// is blended in by the eye distance.
+static const char vertex_shader[] = R"(#version 330 core
+layout(location = 0) in vec3 color;
+layout(location = 1) in vec3 position;
+layout(location = 2) in vec2 uv;
+uniform mat4 projection, modelview;
+out vec3 v_color;
+out vec2 v_uv;
+out float v_distance;
+void main() {
+    vec4 eye = modelview * vec4(position, 1.0);
+    gl_Position = projection * eye;
+    v_color = color;
+    v_uv = uv;
+    v_distance = abs(eye.z);
+})";
+
+static const char fragment_shader[] = R"(#version 330 core
+in vec3 v_color;
+in vec2 v_uv;
+in float v_distance;
+uniform sampler2D tex;
+uniform vec3 fog_color;
+uniform float fog_density;
+out vec4 frag_color;
+void main() {
+    vec4 c = texture(tex, v_uv) * vec4(v_color, 1.0);
+    float f = clamp(exp(-fog_density * v_distance), 0.0, 1.0);
+    frag_color = vec4(mix(fog_color, c.rgb, f), c.a);
+})";
+
+static GLuint compile(GLenum type, const char* source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::fprintf(stderr, "shader: %s\n", log);
+    }
+    return shader;
+}
+
+int main(int argc, char** argv)
 {
     using namespace sf;
-    // Create the main window
+    bool legacy = argc > 1 && std::strcmp(argv[1], "--legacy") == 0;
+
+    // Create the main window. The shader path needs OpenGL 3.3, but the
+    // context is not a core profile one, since SFML and the legacy path use
+    // the fixed-function pipeline.
     RenderWindow window(VideoMode({ 3840, 2160 }), "Hello", Style::Default, State::Windowed,
-        ContextSettings { .depthBits = 24, .antiAliasingLevel = 2 });
+        ContextSettings { .depthBits = 24, .antiAliasingLevel = 2, .majorVersion = legacy ? 1u : 3u,
+            .minorVersion = legacy ? 1u : 3u });
     window.setVerticalSyncEnabled(true);
 
     // Configure OpenGL features.
     window.resetGLStates();
-    // SFML 3 no longer enables legacy fixed-function client states, so enable them manually.
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-    glEnable(GL_TEXTURE_2D);
-    glDisableClientState(GL_NORMAL_ARRAY); // Disable normals, not used.
+    if (legacy) {
+        // SFML 3 no longer enables legacy fixed-function client states, so enable them manually.
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glEnable(GL_TEXTURE_2D);
+        glDisableClientState(GL_NORMAL_ARRAY); // Disable normals, not used.
+    }
     glEnable(GL_DEPTH_TEST); // SFML disables z-buffer. Re-enable, because we need it.
     glClearDepth(1.f);
 
@@ -46,19 +113,29 @@ int main()
     (void)tx[6].loadFromFile("resources/wall3.jpg");
     (void)tx[6].generateMipmap();
 
-    // Construct the world geometry from axis-aligned cuboids made of triangles.
-    std::vector<GLfloat> tri;
+    // Construct the world geometry from axis-aligned cuboids made of triangles. The cuboids
+    // are collected first, so that the vertex array can be allocated at its final size.
+    struct cuboid {
+        unsigned mask;
+        std::array<float, 2> x, z, y;
+        std::array<float, 3> c, u, v;
+    };
+    static constexpr std::array faces { 0x960339u, 0xA9F339u, 0x436039u, 0x4C6F39u, 0x406C39u,
+        0x4F6339u }; // bottom, top, four sides
+    std::vector<cuboid> cuboids;
     auto addcuboid = [&](unsigned mask, std::array<float, 2> x, std::array<float, 2> z,
                          std::array<float, 2> y, std::array<float, 3> c, std::array<float, 3> u,
-                         std::array<float, 3> v) {
+                         std::array<float, 3> v) { cuboids.push_back({ mask, x, z, y, c, u, v }); };
+    std::vector<GLfloat> tri;
+    auto emitcuboid = [&](cuboid q) {
+        auto& [mask, x, z, y, c, u, v] = q;
         auto ext = [](auto m, unsigned n, unsigned b = 1) {
             return (m >> (n * b)) & ~(~0u << b);
         }; // extracts bits
         // Generates: For six vertices, color(rgb), coordinate(xyz) and texture coord(uv).
         std::array p { &c[0], &c[0], &c[0], &x[0], &y[0], &z[0], &u[0], &v[0] };
         // capflag(1 bit), mask(3 bits), X(4 bits), Y(4 bits), Z(4 bits), U(4 bits), V(4 bits)
-        for (unsigned m : std::array { 0x960339, 0xA9F339, 0x436039, 0x4C6F39, 0x406C39,
-                 0x4F6339 }) // bottom, top, four sides
+        for (unsigned m : faces)
             if (std::uint64_t s = (m >> 23) * 0b11'000'111 * (~0llu / 255); mask & m)
                 for (unsigned n = 0; n < 6 * 8; ++n)
                     tri.push_back(
@@ -96,9 +173,41 @@ int main()
                     { .2f + (rand() % 1000) * .4e-3f, 1, .4f + (h > .1f) }, { 0, 1, 1 },
                     { 0, h, 1 });
         }
-    glColorPointer(3, GL_FLOAT, 8 * sizeof(GLfloat), &tri[0]);
-    glVertexPointer(3, GL_FLOAT, 8 * sizeof(GLfloat), &tri[3]);
-    glTexCoordPointer(2, GL_FLOAT, 8 * sizeof(GLfloat), &tri[6]);
+    std::size_t floats = 0;
+    for (const cuboid& q : cuboids)
+        for (unsigned m : faces)
+            floats += (q.mask & m) ? 6 * 8 : 0;
+    tri.reserve(floats);
+    for (const cuboid& q : cuboids)
+        emitcuboid(q);
+
+    GLuint program = 0, vao = 0, vbo = 0;
+    GLint projection_at = -1, modelview_at = -1, fog_color_at = -1, fog_density_at = -1;
+    if (legacy) {
+        glColorPointer(3, GL_FLOAT, 8 * sizeof(GLfloat), &tri[0]);
+        glVertexPointer(3, GL_FLOAT, 8 * sizeof(GLfloat), &tri[3]);
+        glTexCoordPointer(2, GL_FLOAT, 8 * sizeof(GLfloat), &tri[6]);
+    } else {
+        // Upload the interleaved color, position and texture coordinates once
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, tri.size() * sizeof(GLfloat), tri.data(), GL_STATIC_DRAW);
+        for (GLuint attr = 0; attr < 3; ++attr) {
+            glEnableVertexAttribArray(attr);
+            glVertexAttribPointer(attr, attr < 2 ? 3 : 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat),
+                reinterpret_cast<const void*>(attr * 3 * sizeof(GLfloat)));
+        }
+        program = glCreateProgram();
+        glAttachShader(program, compile(GL_VERTEX_SHADER, vertex_shader));
+        glAttachShader(program, compile(GL_FRAGMENT_SHADER, fragment_shader));
+        glLinkProgram(program);
+        projection_at = glGetUniformLocation(program, "projection");
+        modelview_at = glGetUniformLocation(program, "modelview");
+        fog_color_at = glGetUniformLocation(program, "fog_color");
+        fog_density_at = glGetUniformLocation(program, "fog_density");
+    }
 
     GLfloat near = .03f, far = 50.f;
 
@@ -111,45 +220,78 @@ int main()
         2 * (ab * ad - aa * ac), 0, 2 * (ab * ac - aa * ad), 1 - 2 * (ab * ab + ad * ad),
         2 * (ac * ad + aa * ab), 0, 2 * (ab * ad + aa * ac), 2 * (ac * ad - aa * ab),
         1 - 2 * (ab * ab + ac * ac), 0, 0, 0, 0, 1 };
-    for (std::map<Keyboard::Key, bool> keys; window.isOpen() && !keys[Keyboard::Key::Escape];
-        window.display()) {
+    // The key state, indexed by key code. Key::Unknown is -1, so everything is one up.
+    std::array<bool, Keyboard::KeyCount + 1> keystate {};
+    auto keys = [&](Keyboard::Key k) -> bool& { return keystate[static_cast<int>(k) + 1]; };
+
+    // Frame time readout
+    Clock frameclock, reportclock;
+    double frametime_sum = 0, frametime_max = 0;
+    unsigned frames = 0;
+
+    for (; window.isOpen() && !keys(Keyboard::Key::Escape); window.display()) {
+        double frametime = frameclock.restart().asSeconds() * 1e3;
+        frametime_sum += frametime;
+        frametime_max = std::max(frametime_max, frametime);
+        if (++frames, reportclock.getElapsedTime().asSeconds() >= 1) {
+            char title[128];
+            std::snprintf(title, sizeof(title), "%s: %.1f fps, %.2f ms per frame, %.2f ms max",
+                legacy ? "legacy client arrays" : "VBO and shader", frames * 1e3 / frametime_sum,
+                frametime_sum / frames, frametime_max);
+            window.setTitle(title);
+            std::printf("%s\n", title);
+            std::fflush(stdout);
+            frametime_sum = frametime_max = 0;
+            frames = 0;
+            reportclock.restart();
+        }
+
         // Setup up the view port, the clipping planes, the aspect ratio and the field of vision
         // (FoV)
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
         glViewport(0, 0, window.getSize().x, window.getSize().y);
         GLfloat ratio = near * window.getSize().x / window.getSize().y;
-        glFrustum(-ratio, ratio, -near, near, near, far);
+        if (legacy) {
+            glMatrixMode(GL_PROJECTION);
+            glLoadIdentity();
+            glFrustum(-ratio, ratio, -near, near, near, far);
+        }
+        // The same matrix that glFrustum makes, for the shader path
+        const GLfloat projection[16] { near / ratio, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+            -(far + near) / (far - near), -1, 0, 0, -2 * far * near / (far - near), 0 };
 
         // Process events
         while (const auto event = window.pollEvent()) {
             if (event->is<Event::Closed>())
-                keys[Keyboard::Key::Escape] = true;
+                keys(Keyboard::Key::Escape) = true;
             else if (const auto* kp = event->getIf<Event::KeyPressed>())
-                keys[kp->code] = true;
+                keys(kp->code) = true;
             else if (const auto* kr = event->getIf<Event::KeyReleased>())
-                keys[kr->code] = false;
+                keys(kr->code) = false;
         }
-        if (keys[Keyboard::Key::V]) {
+        if (keys(Keyboard::Key::V)) {
             for (std::size_t p = 6 * 6 * 8; p < tri.size(); p += 8)
                 if (tri[p + 4] > 0.1)
                     tri[p + 4] *= 0.95;
             fog *= 0.95;
+            // The buildings are only lowered while V is held, so the buffer stays static otherwise
+            if (!legacy)
+                glBufferSubData(GL_ARRAY_BUFFER, 6 * 6 * 8 * sizeof(GLfloat),
+                    (tri.size() - 6 * 6 * 8) * sizeof(GLfloat), &tri[6 * 6 * 8]);
         }
 
         // The input scheme is the same as in Descent, the game by Parallax Interactive.
         // Mouse input is not handled for now.
-        bool up = keys[Keyboard::Key::Up] || keys[Keyboard::Key::Numpad8];
-        bool down = keys[Keyboard::Key::Down] || keys[Keyboard::Key::Numpad2],
-             alt = keys[Keyboard::Key::LAlt] || keys[Keyboard::Key::RAlt];
-        bool left = keys[Keyboard::Key::Left] || keys[Keyboard::Key::Numpad4],
-             rleft = keys[Keyboard::Key::Q] || keys[Keyboard::Key::Numpad7];
-        bool right = keys[Keyboard::Key::Right] || keys[Keyboard::Key::Numpad6],
-             rright = keys[Keyboard::Key::E] || keys[Keyboard::Key::Numpad9];
-        bool fwd = keys[Keyboard::Key::A], sup = keys[Keyboard::Key::Subtract],
-             sleft = keys[Keyboard::Key::Numpad1];
-        bool back = keys[Keyboard::Key::Z], sdown = keys[Keyboard::Key::Add],
-             sright = keys[Keyboard::Key::Numpad3];
+        bool up = keys(Keyboard::Key::Up) || keys(Keyboard::Key::Numpad8);
+        bool down = keys(Keyboard::Key::Down) || keys(Keyboard::Key::Numpad2),
+             alt = keys(Keyboard::Key::LAlt) || keys(Keyboard::Key::RAlt);
+        bool left = keys(Keyboard::Key::Left) || keys(Keyboard::Key::Numpad4),
+             rleft = keys(Keyboard::Key::Q) || keys(Keyboard::Key::Numpad7);
+        bool right = keys(Keyboard::Key::Right) || keys(Keyboard::Key::Numpad6),
+             rright = keys(Keyboard::Key::E) || keys(Keyboard::Key::Numpad9);
+        bool fwd = keys(Keyboard::Key::A), sup = keys(Keyboard::Key::Subtract),
+             sleft = keys(Keyboard::Key::Numpad1);
+        bool back = keys(Keyboard::Key::Z), sdown = keys(Keyboard::Key::Add),
+             sright = keys(Keyboard::Key::Numpad3);
 
         // Apply rotation delta with hysteresis: newvalue = input*eagerness +
         // oldvalue*(1-eagerness)
@@ -213,6 +355,37 @@ int main()
         //       rule, especially if you want to do it properly and have the character slide off
         //       the surface etc. So, I neglected that in favor of brevity.
 
+        if (!legacy) {
+            // The shader path. The skybox is drawn with the view rotation only, and the rest
+            // with the player coordinate too, as glTranslatef does below.
+            GLfloat modelview[16];
+            std::copy(tform, tform + 16, modelview);
+            glUseProgram(program);
+            glBindVertexArray(vao);
+            glUniformMatrix4fv(projection_at, 1, GL_FALSE, projection);
+            glUniformMatrix4fv(modelview_at, 1, GL_FALSE, modelview);
+            glUniform3f(fog_color_at, .5f, .51f, .54f);
+            glUniform1f(fog_density_at, fog / far);
+
+            glClear(GL_DEPTH_BUFFER_BIT);
+            glDepthMask(GL_FALSE);
+            for (unsigned n = 0; n < 6; ++n) {
+                Texture::bind(&tx[n]);
+                glDrawArrays(GL_TRIANGLES, n * 6, 6);
+            }
+
+            for (unsigned r = 0; r < 3; ++r)
+                modelview[12 + r] = tform[r] * lx + tform[4 + r] * ly + tform[8 + r] * lz;
+            glUniformMatrix4fv(modelview_at, 1, GL_FALSE, modelview);
+            glDepthMask(GL_TRUE);
+
+            Texture::bind(&tx[6]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glDrawArrays(GL_TRIANGLES, 6 * 6, tri.size() / 8 - 6 * 6);
+            continue;
+        }
+
         // Set up fog.
         glEnable(GL_FOG);
         glFogi(GL_FOG_MODE, GL_EXP);
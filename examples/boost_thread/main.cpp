@@ -1,6 +1,30 @@
+// Measures how the task throughput scales with the number of threads.
+//
+//     boost_thread [--tasks n] [--work n] [--threads n] [--demo]
+//
+// The same tasks, each doing --work iterations of integer arithmetic, are run
+// three ways for 1, 2, 4 ... --threads threads (the number of CPUs by
+// default): posted to a boost::asio::thread_pool, posted to strands on such a
+// pool, and taken from a shared counter by std::jthread workers. The tasks per
+// second are printed for each, and can be compared between `oh` and `oh opt`.
+// --demo runs the original example, a boost::thread that counts to five.
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/chrono.hpp>
 #include <boost/thread.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 void wait(int seconds) { boost::this_thread::sleep_for(boost::chrono::seconds { seconds }); }
 
@@ -12,8 +36,139 @@ void thread()
     }
 }
 
-int main()
+// The work of one task, which depends on its index so that it can not be
+// hoisted out of the loop
+std::uint64_t work(std::size_t task, unsigned iterations)
+{
+    std::uint64_t x = task * 0x9e3779b97f4a7c15ull + 1;
+    for (unsigned i = 0; i < iterations; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    return x;
+}
+
+struct workload {
+    std::size_t tasks;
+    unsigned iterations;
+    std::vector<std::uint64_t> results; // one slot per task, so that no task waits for another
+
+    std::uint64_t checksum() const
+    {
+        std::uint64_t sum = 0;
+        for (std::uint64_t r : results)
+            sum += r;
+        return sum;
+    }
+};
+
+// Every task is posted to the pool on its own
+void run_pool(workload& w, unsigned threads)
+{
+    boost::asio::thread_pool pool(threads);
+    for (std::size_t i = 0; i < w.tasks; i++)
+        boost::asio::post(pool, [&w, i] { w.results[i] = work(i, w.iterations); });
+    pool.join();
+}
+
+// The tasks are spread over a few strands per thread. The tasks of one strand
+// never run at the same time, so they can add to the total of the strand
+// without synchronizing, which is what strands are for.
+void run_strands(workload& w, unsigned threads)
+{
+    using strand = boost::asio::strand<boost::asio::thread_pool::executor_type>;
+    boost::asio::thread_pool pool(threads);
+    std::vector<strand> strands;
+    for (unsigned i = 0; i < threads * 4; i++)
+        strands.push_back(boost::asio::make_strand(pool.get_executor()));
+    std::vector<std::uint64_t> totals(strands.size());
+    for (std::size_t i = 0; i < w.tasks; i++) {
+        std::size_t s = i % strands.size();
+        boost::asio::post(strands[s], [&w, &totals, i, s] {
+            std::uint64_t r = work(i, w.iterations);
+            w.results[i] = r;
+            totals[s] += r;
+        });
+    }
+    pool.join();
+}
+
+// The workers take the next block of tasks from a shared counter until there
+// are none left, and the jthreads are joined when they go out of scope
+void run_jthreads(workload& w, unsigned threads)
+{
+    constexpr std::size_t block = 64;
+    std::atomic<std::size_t> next { 0 };
+    std::vector<std::jthread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&w, &next] {
+            for (;;) {
+                std::size_t first = next.fetch_add(block, std::memory_order_relaxed);
+                if (first >= w.tasks)
+                    return;
+                std::size_t last = std::min(first + block, w.tasks);
+                for (std::size_t i = first; i < last; i++)
+                    w.results[i] = work(i, w.iterations);
+            }
+        });
+    }
+}
+
+// Runs the workload and returns the tasks per second, or 0 if the results
+// are not the expected ones
+double measure(workload& w, unsigned threads, void (*run)(workload&, unsigned),
+    std::uint64_t expected)
+{
+    std::fill(w.results.begin(), w.results.end(), 0);
+    auto start = std::chrono::steady_clock::now();
+    run(w, threads);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (w.checksum() != expected)
+        return 0;
+    return double(w.tasks) / elapsed.count();
+}
+
+int main(int argc, char** argv)
 {
-    boost::thread t { thread };
-    t.join();
+    std::size_t tasks = 200000;
+    unsigned iterations = 200;
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--demo") == 0) {
+            boost::thread t { thread };
+            t.join();
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[i], "--tasks") == 0 && i + 1 < argc) {
+            tasks = (std::size_t)std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--work") == 0 && i + 1 < argc) {
+            iterations = (unsigned)std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            maxThreads = (unsigned)std::max(1, atoi(argv[++i]));
+        }
+    }
+
+    workload w { tasks, iterations, std::vector<std::uint64_t>(tasks) };
+    std::uint64_t expected = 0;
+    for (std::size_t i = 0; i < tasks; i++)
+        expected += work(i, iterations);
+
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < maxThreads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(maxThreads);
+
+    std::printf("%zu tasks of %u iterations, in million tasks per second\n", tasks, iterations);
+    std::printf("%7s %12s %12s %12s\n", "threads", "asio pool", "asio strand", "jthread");
+    for (unsigned n : counts) {
+        double pool = measure(w, n, run_pool, expected);
+        double strands = measure(w, n, run_strands, expected);
+        double jthreads = measure(w, n, run_jthreads, expected);
+        if (pool == 0 || strands == 0 || jthreads == 0) {
+            std::cerr << "The results differ with " << n << " threads\n";
+            return EXIT_FAILURE;
+        }
+        std::printf("%7u %12.3f %12.3f %12.3f\n", n, pool / 1e6, strands / 1e6, jthreads / 1e6);
+    }
+    return EXIT_SUCCESS;
 }
@@ -20,100 +20,422 @@
    ----------------------------------------------------------------------------
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <iomanip>
 #include <iostream>
 #include <libconfig.h++>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+#include <vector>
 
 using std::string;
 
 // This example reads the configuration file 'example.cfg' and displays
 // some of its contents.
+//
+//     config [file]
+//     config --watch [file]
+//     config --bench [records]
+//
+// The file is read into an inventory, by walking the tree of settings once,
+// instead of looking up every field by name. --watch keeps looking up titles
+// from two threads, and reloads the file on SIGHUP without stopping them.
+// --bench compares the two approaches on a generated file with the given
+// number of books and movies (10000 of each by default).
 
-int main()
+// The strings of an inventory, each stored once
+class string_pool {
+    std::unordered_set<string> strings; // the nodes, and so the strings, never move
+
+public:
+    std::string_view intern(const char* s) { return *strings.emplace(s).first; }
+};
+
+struct book {
+    std::string_view title, author;
+    double price;
+    int qty;
+};
+
+struct movie {
+    std::string_view title, media;
+    double price;
+    int qty;
+};
+
+// Everything that is displayed from a configuration file, in arrays of
+// plain records, and indexed by title
+struct inventory {
+    string_pool pool;
+    std::string_view name;
+    std::vector<book> books;
+    std::vector<movie> movies;
+    std::unordered_map<std::string_view, size_t> book_index, movie_index;
+
+    const book* find_book(std::string_view title) const
+    {
+        auto it = book_index.find(title);
+        return it == book_index.end() ? nullptr : &books[it->second];
+    }
+
+    const movie* find_movie(std::string_view title) const
+    {
+        auto it = movie_index.find(title);
+        return it == movie_index.end() ? nullptr : &movies[it->second];
+    }
+};
+
+// Reads the number of a setting, of any numeric type
+static bool number_of(const libconfig::Setting& s, double& value)
+{
+    switch (s.getType()) {
+    case libconfig::Setting::TypeInt:
+        value = static_cast<int>(s);
+        return true;
+    case libconfig::Setting::TypeInt64:
+        value = static_cast<double>(static_cast<long long>(s));
+        return true;
+    case libconfig::Setting::TypeFloat:
+        value = static_cast<double>(s);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool int_of(const libconfig::Setting& s, int& value)
+{
+    if (s.getType() != libconfig::Setting::TypeInt) {
+        return false;
+    }
+    value = static_cast<int>(s);
+    return true;
+}
+
+// Reads a list of groups with a title, a string field with the given name, a
+// price and a quantity, into records. The fields of each group are visited
+// once, in the order they are in. Records without all of the fields are
+// left out, like before.
+template <typename Record>
+static void read_records(const libconfig::Setting& list, const char* text_field,
+    std::string_view Record::*text, string_pool& pool, std::vector<Record>& records,
+    std::unordered_map<std::string_view, size_t>& index)
+{
+    records.reserve(list.getLength());
+    for (const auto& group : list) {
+        Record r {};
+        unsigned found = 0;
+        for (const auto& field : group) {
+            const char* name = field.getName();
+            bool is_string = field.getType() == libconfig::Setting::TypeString;
+            if (strcmp(name, "title") == 0 && is_string) {
+                r.title = pool.intern(static_cast<const char*>(field));
+                found |= 1;
+            } else if (strcmp(name, text_field) == 0 && is_string) {
+                r.*text = pool.intern(static_cast<const char*>(field));
+                found |= 2;
+            } else if (strcmp(name, "price") == 0 && number_of(field, r.price)) {
+                found |= 4;
+            } else if (strcmp(name, "qty") == 0 && int_of(field, r.qty)) {
+                found |= 8;
+            }
+        }
+        if (found == 15) {
+            index.emplace(r.title, records.size());
+            records.push_back(r);
+        }
+    }
+}
+
+// Reads a configuration file into a new inventory, or throws the exceptions of libconfig
+static std::shared_ptr<const inventory> load_inventory(const char* filename)
 {
-    auto filename = "example.cfg";
     libconfig::Config cfg;
+    cfg.readFile(filename);
+    auto inv = std::make_shared<inventory>();
+    const auto& root = cfg.getRoot();
+    for (const auto& setting : root) {
+        if (strcmp(setting.getName(), "name") == 0
+            && setting.getType() == libconfig::Setting::TypeString) {
+            inv->name = inv->pool.intern(static_cast<const char*>(setting));
+        } else if (strcmp(setting.getName(), "inventory") == 0 && setting.isGroup()) {
+            for (const auto& part : setting) {
+                if (!part.isList()) {
+                    continue;
+                }
+                if (strcmp(part.getName(), "books") == 0) {
+                    read_records(
+                        part, "author", &book::author, inv->pool, inv->books, inv->book_index);
+                } else if (strcmp(part.getName(), "movies") == 0) {
+                    read_records(
+                        part, "media", &movie::media, inv->pool, inv->movies, inv->movie_index);
+                }
+            }
+        }
+    }
+    return inv;
+}
 
-    // Read the file. If there is an error, report it and exit.
+// Like load_inventory, but reports errors, and returns nullptr for them
+static std::shared_ptr<const inventory> load_or_report(const char* filename)
+{
     try {
-        cfg.readFile(filename);
+        return load_inventory(filename);
     } catch (const libconfig::FileIOException& fioex) {
-        std::cerr << "I/O error while reading " << filename << std::endl;
-        return EXIT_FAILURE;
+        std::cerr << "I/O error while reading " << filename << '\n';
     } catch (const libconfig::ParseException& pex) {
         std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine() << " - "
-                  << pex.getError() << " in " << filename << std::endl;
-        return EXIT_FAILURE;
+                  << pex.getError() << " in " << filename << '\n';
     }
+    return nullptr;
+}
 
+static void display(const inventory& inv)
+{
     // Get the store name.
-    try {
-        string name = cfg.lookup("name");
-        std::cout << "Store name: " << name << std::endl << std::endl;
-    } catch (const libconfig::SettingNotFoundException& nfex) {
-        std::cerr << "No 'name' setting in configuration file." << std::endl;
+    if (inv.name.empty()) {
+        std::cerr << "No 'name' setting in configuration file.\n";
+    } else {
+        std::cout << "Store name: " << inv.name << "\n\n";
     }
 
-    const auto& root = cfg.getRoot();
-
     // Output a list of all books in the inventory.
-    try {
-        const auto& books = root["inventory"]["books"];
-
+    if (!inv.books.empty()) {
         std::cout << std::setw(30) << std::left << "TITLE"
                   << "  " << std::setw(30) << std::left << "AUTHOR"
                   << "   " << std::setw(6) << std::left << "PRICE"
                   << "  "
-                  << "QTY" << std::endl;
-
-        for (const auto& book : books) {
-            // Only output the record if all of the expected fields are present.
-            string title, author;
-            double price;
-            int qty;
-
-            if (!(book.lookupValue("title", title) && book.lookupValue("author", author)
-                    && book.lookupValue("price", price) && book.lookupValue("qty", qty)))
-                continue;
-
-            std::cout << std::setw(30) << std::left << title << "  " << std::setw(30) << std::left
-                      << author << "  " << '$' << std::setw(6) << std::right << price << "  "
-                      << qty << std::endl;
+                  << "QTY" << '\n';
+        for (const book& b : inv.books) {
+            std::cout << std::setw(30) << std::left << b.title << "  " << std::setw(30) << std::left
+                      << b.author << "  " << '$' << std::setw(6) << std::right << b.price << "  "
+                      << b.qty << '\n';
         }
-        std::cout << std::endl;
-    } catch (const libconfig::SettingNotFoundException& nfex) {
-        // Ignore.
+        std::cout << '\n';
     }
 
-    // Output a list of all books in the inventory.
-    try {
-        const auto& movies = root["inventory"]["movies"];
-
+    // Output a list of all movies in the inventory.
+    if (!inv.movies.empty()) {
         std::cout << std::setw(30) << std::left << "TITLE"
                   << "  " << std::setw(10) << std::left << "MEDIA"
                   << "   " << std::setw(6) << std::left << "PRICE"
                   << "  "
-                  << "QTY" << std::endl;
+                  << "QTY" << '\n';
+        for (const movie& m : inv.movies) {
+            std::cout << std::setw(30) << std::left << m.title << "  " << std::setw(10) << std::left
+                      << m.media << "  " << '$' << std::setw(6) << std::right << m.price << "  "
+                      << m.qty << '\n';
+        }
+        std::cout << '\n';
+    }
+}
+
+// The inventory that readers use. A reload builds a new one, and swaps it
+// in, while the readers keep the one they already have until they are done
+// with it. The last reader to let go of an old inventory frees it.
+static std::atomic<std::shared_ptr<const inventory>> current;
+
+static volatile sig_atomic_t reload_requested = false;
+static volatile sig_atomic_t interrupted = false;
+
+static int watch(const char* filename)
+{
+    auto first = load_or_report(filename);
+    if (!first) {
+        return EXIT_FAILURE;
+    }
+    current.store(first);
+    std::vector<string> titles;
+    for (const book& b : first->books) {
+        titles.emplace_back(b.title);
+    }
+    if (titles.empty()) {
+        titles.emplace_back("?");
+    }
+
+    signal(SIGHUP, [](int) { reload_requested = true; });
+    signal(SIGINT, [](int) { interrupted = true; });
+    std::cout << "Looking up books, send SIGHUP to " << getpid() << " to reload " << filename
+              << ", or press ctrl-c to quit" << std::endl;
+
+    std::atomic<unsigned long> lookups { 0 };
+    std::atomic<bool> running { true };
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; r++) {
+        readers.emplace_back([&, r] {
+            unsigned long n = 0;
+            for (size_t i = size_t(r); running; i++) {
+                auto inv = current.load();
+                n += inv->find_book(titles[i % titles.size()]) != nullptr;
+                lookups.fetch_add(1, std::memory_order_relaxed);
+            }
+            (void)n;
+        });
+    }
+
+    auto last = std::chrono::steady_clock::now();
+    while (!interrupted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (reload_requested) {
+            reload_requested = false;
+            auto start = std::chrono::steady_clock::now();
+            if (auto inv = load_or_report(filename)) {
+                current.store(inv);
+                auto took = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start);
+                std::cout << "Reloaded " << inv->books.size() << " books and " << inv->movies.size()
+                          << " movies in " << took.count() << " ms" << std::endl;
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - last >= std::chrono::seconds(1)) {
+            double seconds = std::chrono::duration<double>(now - last).count();
+            std::cout << lookups.exchange(0) / seconds << " lookups/s" << std::endl;
+            last = now;
+        }
+    }
+    running = false;
+    for (std::thread& t : readers) {
+        t.join();
+    }
+    return EXIT_SUCCESS;
+}
+
+// Writes a configuration file with n books and n movies
+static void generate(const std::string& path, int n)
+{
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == nullptr) {
+        throw std::runtime_error("could not write " + path);
+    }
+    fprintf(f, "name = \"Generated\";\ninventory =\n{\n  books = (\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f,
+            "    { title = \"Book %d\"; author = \"Author %d\"; price = %d.99; qty = %d; }%s\n", i,
+            i % 997, 5 + i % 40, i % 25, i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  );\n  movies = (\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "    { title = \"Movie %d\"; media = \"%s\"; price = %d.99; qty = %d; }%s\n", i,
+            i % 2 ? "DVD" : "Blu-Ray", 10 + i % 20, i % 30, i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  );\n};\n");
+    fclose(f);
+}
+
+// Returns the best time in milliseconds of a few runs of f
+template <typename F> static double best_ms(F f)
+{
+    double best = 1e300;
+    for (int i = 0; i < 3; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        best = std::min(best, took.count());
+    }
+    return best;
+}
 
-        for (const auto& movie : movies) {
-            // Only output the record if all of the expected fields are present.
-            string title, media;
-            double price;
-            int qty;
+static int benchmark(int n)
+{
+    auto path = (std::filesystem::temp_directory_path() / "config_bench.cfg").string();
+    generate(path, n);
+    const int keyed = 1000; // title lookups
+    long sink = 0;
+
+    libconfig::Config cfg;
+    double parse = best_ms([&] { cfg.readFile(path.c_str()); });
 
-            if (!(movie.lookupValue("title", title) && movie.lookupValue("media", media)
-                    && movie.lookupValue("price", price) && movie.lookupValue("qty", qty)))
-                continue;
+    // As before: every field by name, in every record
+    double scan_lookup = best_ms([&] {
+        for (const char* list : { "inventory.books", "inventory.movies" }) {
+            const auto& records = cfg.lookup(list);
+            for (const auto& r : records) {
+                string title, text;
+                double price;
+                int qty;
+                if (r.lookupValue("title", title)
+                    && (r.lookupValue("author", text) || r.lookupValue("media", text))
+                    && r.lookupValue("price", price) && r.lookupValue("qty", qty)) {
+                    sink += qty;
+                }
+            }
+        }
+    });
+    // As before: finding a book by title means looking at the title of every book
+    double find_lookup = best_ms([&] {
+        const auto& books = cfg.lookup("inventory.books");
+        for (int k = 0; k < keyed; k++) {
+            string wanted = "Book " + std::to_string((k * 7919) % n);
+            for (const auto& b : books) {
+                string title;
+                if (b.lookupValue("title", title) && title == wanted) {
+                    sink++;
+                    break;
+                }
+            }
+        }
+    });
 
-            std::cout << std::setw(30) << std::left << title << "  " << std::setw(10) << std::left
-                      << media << "  " << '$' << std::setw(6) << std::right << price << "  " << qty
-                      << std::endl;
+    std::shared_ptr<const inventory> inv;
+    double load = best_ms([&] { inv = load_inventory(path.c_str()); });
+    double scan_index = best_ms([&] {
+        for (const book& b : inv->books) {
+            sink += b.qty;
+        }
+        for (const movie& m : inv->movies) {
+            sink += m.qty;
         }
-        std::cout << std::endl;
-    } catch (const libconfig::SettingNotFoundException& nfex) {
-        // Ignore.
+    });
+    double find_index = best_ms([&] {
+        for (int k = 0; k < keyed; k++) {
+            string wanted = "Book " + std::to_string((k * 7919) % n);
+            sink += inv->find_book(wanted) != nullptr;
+        }
+    });
+    std::filesystem::remove(path);
+
+    printf("%d books and %d movies\n", n, n);
+    printf("%-44s %10.3f ms\n", "readFile", parse);
+    printf("%-44s %10.3f ms\n", "readFile and walk into an inventory, once", load);
+    printf("%-44s %10.3f ms\n", "all records, with lookupValue per field", scan_lookup);
+    printf("%-44s %10.3f ms\n", "all records, from the inventory", scan_index);
+    printf("%-44s %10.3f ms\n", "1000 books by title, with lookupValue", find_lookup);
+    printf("%-44s %10.3f ms\n", "1000 books by title, from the index", find_index);
+    return sink >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[])
+{
+    auto filename = "example.cfg";
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return benchmark(argc > 2 ? std::max(1, atoi(argv[2])) : 10000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--watch") == 0) {
+        return watch(argc > 2 ? argv[2] : filename);
+    }
+    if (argc > 1) {
+        filename = argv[1];
     }
 
+    // Read the file. If there is an error, report it and exit.
+    auto inv = load_or_report(filename);
+    if (!inv) {
+        return EXIT_FAILURE;
+    }
+    display(*inv);
     return EXIT_SUCCESS;
 }
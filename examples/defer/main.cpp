@@ -1,15 +1,163 @@
 // Example of similar functionality to "defer" in Go
 // Thanks @pepper_chico: https://stackoverflow.com/a/33055669/131264
+//
+// The shared_ptr trick allocates a control block and counts references
+// atomically for every deferred call. defer below is a template that holds
+// the lambda by value, and costs nothing more than calling it at the end of
+// the scope. Run with --bench [n] to compare the two with a hand-written
+// destructor. Every result is printed as a line of JSON, for tracking it
+// across compilers and build modes such as oh, oh opt and oh clang.
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <utility>
+
+#ifdef __linux__
+#include <elf.h>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#endif
 
 using namespace std::string_literals;
 
+// Calls f when it goes out of scope
+template <typename F> class defer {
+    F f;
+
+public:
+    explicit defer(F f_)
+        : f(std::move(f_))
+    {
+    }
+    defer(const defer&) = delete;
+    defer& operator=(const defer&) = delete;
+    ~defer() { f(); }
+};
+
+// What the benchmarked guards do when they go out of scope
+static volatile long deferred_calls = 0;
+
+struct count_on_exit {
+    ~count_on_exit() { deferred_calls = deferred_calls + 1; }
+};
+
+// The benchmark loops. They are extern "C" and never inlined, so that their
+// size can be looked up by name in the symbol table of the executable.
+extern "C" {
+[[gnu::noinline]] void defer_bench_shared_ptr(long n)
+{
+    for (long i = 0; i < n; i++) {
+        std::shared_ptr<void> guard(nullptr, [](...) { deferred_calls = deferred_calls + 1; });
+    }
+}
+
+[[gnu::noinline]] void defer_bench_template(long n)
+{
+    for (long i = 0; i < n; i++) {
+        defer guard([] { deferred_calls = deferred_calls + 1; });
+    }
+}
+
+[[gnu::noinline]] void defer_bench_destructor(long n)
+{
+    for (long i = 0; i < n; i++) {
+        count_on_exit guard;
+    }
+}
+}
+
+// Returns the size in bytes of the function with the given name, from the
+// symbol table of this executable, or -1 if it can not be found, as when the
+// executable is stripped. Only the function itself is counted, not what it
+// calls, such as the out-of-line parts of shared_ptr.
+static long code_size(const char* name)
+{
+#ifdef __linux__
+    std::ifstream f("/proc/self/exe", std::ios::binary);
+    std::vector<char> exe((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (exe.size() < sizeof(Elf64_Ehdr) || memcmp(exe.data(), ELFMAG, SELFMAG) != 0 || exe[EI_CLASS] != ELFCLASS64) {
+        return -1;
+    }
+    const auto* eh = reinterpret_cast<const Elf64_Ehdr*>(exe.data());
+    const auto* sections = reinterpret_cast<const Elf64_Shdr*>(exe.data() + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB) {
+            continue;
+        }
+        const char* strings = exe.data() + sections[sections[i].sh_link].sh_offset;
+        const auto* syms = reinterpret_cast<const Elf64_Sym*>(exe.data() + sections[i].sh_offset);
+        for (std::size_t j = 0; j < sections[i].sh_size / sizeof(Elf64_Sym); j++) {
+            if (ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && strcmp(strings + syms[j].st_name, name) == 0) {
+                return long(syms[j].st_size);
+            }
+        }
+    }
+#else
+    (void)name;
+#endif
+    return -1;
+}
+
+static std::string compiler_name()
+{
+#if defined(__clang__)
+    return "clang "s + __clang_version__;
+#elif defined(__GNUC__)
+    return "gcc "s + __VERSION__;
+#else
+    return "unknown"s;
+#endif
+}
+
+static void benchmark(long n)
+{
+#ifdef __FAST_MATH__
+    const char* fast_math = "true";
+#else
+    const char* fast_math = "false";
+#endif
+#ifdef __OPTIMIZE__
+    const char* optimized = "true";
+#else
+    const char* optimized = "false";
+#endif
+    struct variant {
+        const char* name;
+        const char* symbol;
+        void (*run)(long);
+    };
+    const variant variants[] = {
+        { "shared_ptr", "defer_bench_shared_ptr", defer_bench_shared_ptr },
+        { "template", "defer_bench_template", defer_bench_template },
+        { "destructor", "defer_bench_destructor", defer_bench_destructor },
+    };
+    for (const variant& v : variants) {
+        double best = 1e300;
+        for (int run = 0; run < 5; run++) {
+            auto start = std::chrono::steady_clock::now();
+            v.run(n);
+            best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        }
+        printf("{\"variant\":\"%s\",\"ns_per_op\":%.3f,\"code_bytes\":%ld,\"iterations\":%ld,\"compiler\":\"%s\","
+               "\"optimized\":%s,\"fast_math\":%s}\n",
+            v.name, best / double(n), code_size(v.symbol), n, compiler_name().c_str(), optimized, fast_math);
+    }
+}
+
 int main(int argc, char** argv)
 {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        benchmark(argc > 2 ? std::max(1L, atol(argv[2])) : 10000000L);
+        return EXIT_SUCCESS;
+    }
+
     std::cout << "Start of main function"s << std::endl;
 
     std::shared_ptr<void> defer1(
@@ -19,6 +167,8 @@ int main(int argc, char** argv)
         std::cout << "DEFER 2: This should come right before the last one"s << std::endl;
     });
 
+    defer defer3([] { std::cout << "DEFER 3: This should come first, and allocates nothing"s << std::endl; });
+
     std::cout << "End of main function"s << std::endl;
 
     return EXIT_SUCCESS;
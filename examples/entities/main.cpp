@@ -7,12 +7,20 @@
  *
  * 500 coloured circles bounce around the screen. When two collide
  * they are destroyed and replaced by a shower of fading particles.
- * An FPS / entity counter is drawn in the top-left corner.
+ * The number of circles can be given on the command line, such as
+ * "./entities 5000". An FPS / entity counter and the time that each
+ * system takes are drawn in the top-left corner.
+ *
+ * "./entities 5000 --bench 600" runs 600 frames without a window,
+ * and prints the time that each system took per frame.
  */
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <raylib.h>
 #include <string>
@@ -24,174 +32,400 @@ static float randf(float lo, float hi)
     return lo + static_cast<float>(std::rand()) / static_cast<float>(RAND_MAX) * (hi - lo);
 }
 
-// ── Components stored as parallel vectors (struct-of-arrays) ────────────────
+// ── Components stored as parallel arrays (struct-of-arrays) ─────────────────
+
+// Every field has an array of its own, so that a system only streams
+// through the fields it uses, and its loop can be vectorized.
+struct Circles {
+    std::vector<float> x, y, vx, vy, radius;
+    std::vector<float> alpha; // fade-in: 0 → 1
+    std::vector<Color> color;
 
-struct Circle {
-    Vector2 pos;
-    Vector2 vel;
-    float radius;
-    Color color;
-    float alpha; // fade-in: 0 → 1
+    std::size_t size() const { return x.size(); }
+
+    void add(float px, float py, float pvx, float pvy, float r, Color col)
+    {
+        x.push_back(px);
+        y.push_back(py);
+        vx.push_back(pvx);
+        vy.push_back(pvy);
+        radius.push_back(r);
+        alpha.push_back(0.0f);
+        color.push_back(col);
+    }
+
+    // Removes circle i by moving the last circle into its place
+    void remove(std::size_t i)
+    {
+        auto swap_pop = [i](auto& v) {
+            v[i] = v.back();
+            v.pop_back();
+        };
+        swap_pop(x);
+        swap_pop(y);
+        swap_pop(vx);
+        swap_pop(vy);
+        swap_pop(radius);
+        swap_pop(alpha);
+        swap_pop(color);
+    }
 };
 
-struct Particle {
-    Vector2 pos;
-    Vector2 vel;
-    float rotation;
-    float rotationd;
-    float radius;
-    Color color;
-    float alpha;
-    float decay; // alpha units lost per second
+// The live particles are packed at the front of the arrays. The arrays
+// only ever grow, and new particles take the slots of dead ones, so a
+// steady stream of explosions does not allocate.
+struct Particles {
+    std::vector<float> x, y, vx, vy, rotation, rotationd, radius, alpha;
+    std::vector<float> decay; // alpha units lost per second
+    std::vector<Color> color;
+    std::size_t count = 0;
+
+    void add(float px, float py, float pvx, float pvy, float rotd, float r, Color col)
+    {
+        if (count == x.size())
+            grow();
+        std::size_t i = count++;
+        x[i] = px;
+        y[i] = py;
+        vx[i] = pvx;
+        vy[i] = pvy;
+        rotation[i] = 0.0f;
+        rotationd[i] = rotd;
+        radius[i] = r;
+        alpha[i] = 200.0f;
+        decay[i] = 200.0f / (r / 2.0f);
+        color[i] = col;
+    }
+
+    // Removes particle i by moving the last live particle into its slot
+    void remove(std::size_t i)
+    {
+        std::size_t last = --count;
+        x[i] = x[last];
+        y[i] = y[last];
+        vx[i] = vx[last];
+        vy[i] = vy[last];
+        rotation[i] = rotation[last];
+        rotationd[i] = rotationd[last];
+        radius[i] = radius[last];
+        alpha[i] = alpha[last];
+        decay[i] = decay[last];
+        color[i] = color[last];
+    }
+
+private:
+    void grow()
+    {
+        std::size_t n = std::max<std::size_t>(1024, x.size() * 2);
+        for (auto* v : { &x, &y, &vx, &vy, &rotation, &rotationd, &radius, &alpha, &decay })
+            v->resize(n);
+        color.resize(n);
+    }
 };
 
 // ── World state ─────────────────────────────────────────────────────────────
 
-static std::vector<Circle> circles;
-static std::vector<Particle> particles;
-static constexpr int TARGET_CIRCLES = 500;
+static Circles circles;
+static Particles particles;
+static int target_circles = 500;
+static constexpr float MAX_RADIUS = 15;
 
 // ── Systems ─────────────────────────────────────────────────────────────────
 
 static void spawn_circles(int screenW, int screenH)
 {
-    while (static_cast<int>(circles.size()) < TARGET_CIRCLES) {
-        float r = randf(5, 15);
-        circles.push_back(Circle { { randf(r, screenW - r), randf(r, screenH - r) },
-            { randf(-100, 100), randf(-100, 100) }, r,
+    while (static_cast<int>(circles.size()) < target_circles) {
+        float r = randf(5, MAX_RADIUS);
+        float x = randf(r, screenW - r);
+        float y = randf(r, screenH - r);
+        float vx = randf(-100, 100);
+        float vy = randf(-100, 100);
+        circles.add(x, y, vx, vy, r,
             { static_cast<unsigned char>(std::rand() % 128 + 127),
                 static_cast<unsigned char>(std::rand() % 128 + 127),
-                static_cast<unsigned char>(std::rand() % 128 + 127), 0 },
-            0.0f });
+                static_cast<unsigned char>(std::rand() % 128 + 127), 0 });
     }
 }
 
+// Adds rate * dt to every value. The systems call this once per field,
+// since the compiler vectorizes a loop over two arrays that are known not
+// to overlap, but gives up on the alias checks of a loop over eight.
+static void integrate(std::size_t n, float dt, float* __restrict value, const float* __restrict rate)
+{
+    for (std::size_t i = 0; i < n; ++i)
+        value[i] += rate[i] * dt;
+}
+
 static void move_circles(float dt)
 {
-    for (auto& c : circles) {
-        c.pos.x += c.vel.x * dt;
-        c.pos.y += c.vel.y * dt;
-        c.alpha = std::min(1.0f, c.alpha + dt);
-    }
+    const std::size_t n = circles.size();
+    integrate(n, dt, circles.x.data(), circles.vx.data());
+    integrate(n, dt, circles.y.data(), circles.vy.data());
+    for (float& a : circles.alpha)
+        a = std::min(1.0f, a + dt);
 }
 
 static void bounce_circles(int screenW, int screenH)
 {
-    for (auto& c : circles) {
-        if (c.pos.x - c.radius < 0 || c.pos.x + c.radius > screenW)
-            c.vel.x = -c.vel.x;
-        if (c.pos.y - c.radius < 0 || c.pos.y + c.radius > screenH)
-            c.vel.y = -c.vel.y;
-        c.pos.x = std::clamp(c.pos.x, c.radius, static_cast<float>(screenW) - c.radius);
-        c.pos.y = std::clamp(c.pos.y, c.radius, static_cast<float>(screenH) - c.radius);
+    const std::size_t n = circles.size();
+    float* __restrict x = circles.x.data();
+    float* __restrict y = circles.y.data();
+    float* __restrict vx = circles.vx.data();
+    float* __restrict vy = circles.vy.data();
+    const float* __restrict radius = circles.radius.data();
+    const float w = static_cast<float>(screenW), h = static_cast<float>(screenH);
+    for (std::size_t i = 0; i < n; ++i) {
+        float r = radius[i];
+        vx[i] = (x[i] - r < 0 || x[i] + r > w) ? -vx[i] : vx[i];
+        vy[i] = (y[i] - r < 0 || y[i] + r > h) ? -vy[i] : vy[i];
+        x[i] = std::min(std::max(x[i], r), w - r);
+        y[i] = std::min(std::max(y[i], r), h - r);
     }
 }
 
-static void emit_particles(const Circle& c)
+static void emit_particles(std::size_t c)
 {
-    float area = (PI * c.radius * c.radius) / 3.0f;
+    float cr = circles.radius[c];
+    float area = (PI * cr * cr) / 3.0f;
     int count = static_cast<int>(area);
     for (int i = 0; i < count; ++i) {
         float angle = randf(0, 2 * PI);
-        float offset = randf(1, c.radius);
+        float offset = randf(1, cr);
         float r = randf(1, 4);
         float rotd = randf(180, 720);
         if (std::rand() % 2)
             rotd = -rotd;
 
-        Color col = c.color;
+        Color col = circles.color[c];
         col.a = 200;
-        particles.push_back(
-            Particle { { c.pos.x + offset * std::cos(angle), c.pos.y + offset * std::sin(angle) },
-                { c.vel.x + offset * 2 * std::cos(angle), c.vel.y + offset * 2 * std::sin(angle) },
-                0.0f, rotd, r, col, 200.0f, 200.0f / (r / 2.0f) });
+        particles.add(circles.x[c] + offset * std::cos(angle), circles.y[c] + offset * std::sin(angle),
+            circles.vx[c] + offset * 2 * std::cos(angle), circles.vy[c] + offset * 2 * std::sin(angle),
+            rotd, r, col);
     }
 }
 
-static void detect_collisions()
+// ── Broadphase ──────────────────────────────────────────────────────────────
+
+// A uniform grid with cells as wide as the largest circle, so that two
+// circles can only touch if they are in the same or in neighbouring cells.
+// It is rebuilt every frame with a counting sort of the circles by cell.
+struct Grid {
+    int cols = 0, rows = 0;
+    std::vector<int> start; // cell -> first entry, and start[cells] is the end
+    std::vector<int> entries; // circle indices, sorted by cell
+    std::vector<int> cell_of; // circle -> cell
+};
+
+static Grid grid;
+
+static void build_grid(int screenW, int screenH)
 {
+    constexpr float cell = 2 * MAX_RADIUS;
+    grid.cols = std::max(1, static_cast<int>(std::ceil(screenW / cell)));
+    grid.rows = std::max(1, static_cast<int>(std::ceil(screenH / cell)));
+    grid.start.assign(grid.cols * grid.rows + 1, 0);
+    grid.entries.resize(circles.size());
+    grid.cell_of.resize(circles.size());
+    for (std::size_t i = 0; i < circles.size(); ++i) {
+        int cx = std::clamp(static_cast<int>(circles.x[i] / cell), 0, grid.cols - 1);
+        int cy = std::clamp(static_cast<int>(circles.y[i] / cell), 0, grid.rows - 1);
+        grid.cell_of[i] = cy * grid.cols + cx;
+        ++grid.start[grid.cell_of[i] + 1];
+    }
+    for (std::size_t c = 1; c < grid.start.size(); ++c)
+        grid.start[c] += grid.start[c - 1];
+    std::vector<int> next(grid.start.begin(), grid.start.end() - 1);
+    for (std::size_t i = 0; i < circles.size(); ++i)
+        grid.entries[next[grid.cell_of[i]]++] = static_cast<int>(i);
+}
+
+static void detect_collisions(int screenW, int screenH)
+{
+    build_grid(screenW, screenH);
     std::vector<bool> dead(circles.size(), false);
     for (std::size_t i = 0; i < circles.size(); ++i) {
         if (dead[i])
             continue;
-        for (std::size_t j = i + 1; j < circles.size(); ++j) {
-            if (dead[j])
-                continue;
-            float dx = circles[i].pos.x - circles[j].pos.x;
-            float dy = circles[i].pos.y - circles[j].pos.y;
-            float dist = std::sqrt(dx * dx + dy * dy);
-            if (dist < circles[i].radius + circles[j].radius) {
-                emit_particles(circles[i]);
-                emit_particles(circles[j]);
-                dead[i] = dead[j] = true;
+        int cx = grid.cell_of[i] % grid.cols, cy = grid.cell_of[i] / grid.cols;
+        for (int y = std::max(0, cy - 1); y <= std::min(grid.rows - 1, cy + 1) && !dead[i]; ++y) {
+            for (int x = std::max(0, cx - 1); x <= std::min(grid.cols - 1, cx + 1) && !dead[i]; ++x) {
+                int c = y * grid.cols + x;
+                for (int e = grid.start[c]; e < grid.start[c + 1]; ++e) {
+                    std::size_t j = grid.entries[e];
+                    if (j <= i || dead[j]) // every pair is checked once, from the lower index
+                        continue;
+                    float dx = circles.x[i] - circles.x[j];
+                    float dy = circles.y[i] - circles.y[j];
+                    float reach = circles.radius[i] + circles.radius[j];
+                    if (dx * dx + dy * dy < reach * reach) {
+                        emit_particles(i);
+                        emit_particles(j);
+                        dead[i] = dead[j] = true;
+                        break;
+                    }
+                }
             }
         }
     }
-    // Remove dead circles (stable, back-to-front)
-    for (auto it = static_cast<int>(circles.size()) - 1; it >= 0; --it)
-        if (dead[it])
-            circles.erase(circles.begin() + it);
+    // Remove dead circles by moving the last one into their place
+    for (std::size_t i = 0; i < circles.size();) {
+        if (dead[i]) {
+            circles.remove(i);
+            dead[i] = dead[circles.size()];
+            dead.pop_back();
+        } else {
+            ++i;
+        }
+    }
 }
 
 static void update_particles(float dt)
 {
-    for (auto& p : particles) {
-        p.pos.x += p.vel.x * dt;
-        p.pos.y += p.vel.y * dt;
-        p.rotation += p.rotationd * dt;
-        p.alpha -= p.decay * dt;
-    }
-    std::erase_if(particles, [](const Particle& p) { return p.alpha <= 0; });
+    const std::size_t n = particles.count;
+    integrate(n, dt, particles.x.data(), particles.vx.data());
+    integrate(n, dt, particles.y.data(), particles.vy.data());
+    integrate(n, dt, particles.rotation.data(), particles.rotationd.data());
+    integrate(n, -dt, particles.alpha.data(), particles.decay.data());
+    // Back to front, so that the particle that is moved into a dead slot
+    // has already been checked
+    for (std::size_t i = n; i-- > 0;)
+        if (particles.alpha[i] <= 0)
+            particles.remove(i);
 }
 
 static void draw_particles()
 {
-    for (const auto& p : particles) {
-        Color col = p.color;
-        col.a = static_cast<unsigned char>(std::clamp(p.alpha, 0.0f, 255.0f));
+    for (std::size_t i = 0; i < particles.count; ++i) {
+        Color col = particles.color[i];
+        col.a = static_cast<unsigned char>(std::clamp(particles.alpha[i], 0.0f, 255.0f));
         // Draw a small rotated rectangle as a particle
-        Rectangle rec { p.pos.x, p.pos.y, p.radius * 2, p.radius * 2 };
-        DrawRectanglePro(rec, { p.radius, p.radius }, p.rotation, col);
+        float r = particles.radius[i];
+        Rectangle rec { particles.x[i], particles.y[i], r * 2, r * 2 };
+        DrawRectanglePro(rec, { r, r }, particles.rotation[i], col);
     }
 }
 
 static void draw_circles()
 {
-    for (const auto& c : circles) {
-        Color col = c.color;
-        col.a = static_cast<unsigned char>(c.alpha * 255);
-        DrawCircleV(c.pos, c.radius, col);
+    for (std::size_t i = 0; i < circles.size(); ++i) {
+        Color col = circles.color[i];
+        col.a = static_cast<unsigned char>(circles.alpha[i] * 255);
+        DrawCircleV({ circles.x[i], circles.y[i] }, circles.radius[i], col);
     }
 }
 
+// ── Frame timing ────────────────────────────────────────────────────────────
+
+// The milliseconds that each system takes, smoothed over the last frames,
+// and in total
+struct SystemTimes {
+    static constexpr const char* names[] = { "spawn", "move", "bounce", "collide", "particles", "draw" };
+    static constexpr int count = sizeof(names) / sizeof(names[0]);
+    double ms[count] = {};
+    double total[count] = {};
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+    // Records the time since the previous lap as the time of system i
+    void lap(int i)
+    {
+        auto now = std::chrono::steady_clock::now();
+        double d = std::chrono::duration<double, std::milli>(now - last).count();
+        ms[i] += (d - ms[i]) * 0.05;
+        total[i] += d;
+        last = now;
+    }
+};
+
+static void draw_readout(const SystemTimes& times)
+{
+    std::string info = std::to_string(circles.size() + particles.count) + " entities ("
+        + std::to_string(GetFPS()) + " fps)";
+    DrawText(info.c_str(), 4, 4, 20, WHITE);
+    for (int i = 0; i < SystemTimes::count; ++i) {
+        std::string line = std::string(SystemTimes::names[i]) + ": "
+            + TextFormat("%.2f ms", times.ms[i]);
+        DrawText(line.c_str(), 4, 28 + i * 16, 14, LIGHTGRAY);
+    }
+}
+
+// Runs the systems for a number of frames of 1/60 s each, without a window
+// and without drawing, and prints how long each system took per frame
+static void run_benchmark(int frames)
+{
+    const int sw = 1280, sh = 720;
+    const float dt = 1.0f / 60.0f;
+    std::srand(1);
+    SystemTimes times;
+    std::size_t entities = 0;
+    for (int frame = 0; frame < frames; ++frame) {
+        times.last = std::chrono::steady_clock::now();
+        spawn_circles(sw, sh);
+        times.lap(0);
+        move_circles(dt);
+        times.lap(1);
+        bounce_circles(sw, sh);
+        times.lap(2);
+        detect_collisions(sw, sh);
+        times.lap(3);
+        update_particles(dt);
+        times.lap(4);
+        entities += circles.size() + particles.count;
+    }
+    std::printf("%d frames, %d circles, %zu entities per frame on average\n", frames, target_circles,
+        entities / std::max(1, frames));
+    double sum = 0;
+    for (int i = 0; i < SystemTimes::count - 1; ++i) {
+        std::printf("%-10s %8.3f ms/frame\n", SystemTimes::names[i], times.total[i] / frames);
+        sum += times.total[i];
+    }
+    std::printf("%-10s %8.3f ms/frame\n", "total", sum / frames);
+}
+
 // ── Main ────────────────────────────────────────────────────────────────────
 
-int main()
+int main(int argc, char* argv[])
 {
+    int bench_frames = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            bench_frames = std::max(1, std::atoi(argv[++i]));
+        else
+            target_circles = std::max(0, std::atoi(argv[i]));
+    }
+    if (bench_frames > 0) {
+        run_benchmark(bench_frames);
+        return 0;
+    }
+
     std::srand(static_cast<unsigned>(std::time(nullptr)));
 
     SetConfigFlags(FLAG_WINDOW_RESIZABLE | FLAG_VSYNC_HINT);
     InitWindow(1280, 720, "Raylib 5 — Bouncing Circles");
 
+    SystemTimes times;
     while (!WindowShouldClose()) {
         int sw = GetScreenWidth();
         int sh = GetScreenHeight();
         float dt = GetFrameTime();
 
+        times.last = std::chrono::steady_clock::now();
         spawn_circles(sw, sh);
+        times.lap(0);
         move_circles(dt);
+        times.lap(1);
         bounce_circles(sw, sh);
-        detect_collisions();
+        times.lap(2);
+        detect_collisions(sw, sh);
+        times.lap(3);
         update_particles(dt);
+        times.lap(4);
 
         BeginDrawing();
         ClearBackground(BLACK);
         draw_particles();
         draw_circles();
-
-        std::string info = std::to_string(circles.size() + particles.size()) + " entities ("
-            + std::to_string(GetFPS()) + " fps)";
-        DrawText(info.c_str(), 4, 4, 20, WHITE);
+        times.lap(5); // the draw calls are queued here, and are flushed by EndDrawing
+        draw_readout(times);
         EndDrawing();
     }
 
@@ -1,36 +1,45 @@
+// A FastCGI responder that serves requests from a pool of threads, each with
+// its own FCGX_Request, and a load test client for it.
+//
+//     fastcgi [-j threads] [--listen address]
+//     fastcgi --load address [requests] [connections]
+//
+// Without --listen, the requests are accepted on the socket that the web
+// server passes as stdin, as lighttpd does with serve.conf. With --listen,
+// such as --listen 127.0.0.1:9000 or --listen /tmp/hello.socket, fastcgi
+// listens by itself, which is what nginx expects:
+//
+//     location / { include fastcgi_params; fastcgi_pass 127.0.0.1:9000; }
+//
+// --load sends requests over the given number of connections (1000 and 8 by
+// default) to a running fastcgi, and reports the requests per second and the
+// latency percentiles.
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
-#include <iostream>
+#include <cstring>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-#include "fcgio.h"
+#include <fcgiapp.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std::string_literals;
 
-auto main() -> int
-{
-    // Save the stdio streambufs
-    auto cin_streambuf = std::cin.rdbuf();
-    auto cout_streambuf = std::cout.rdbuf();
-    auto cerr_streambuf = std::cerr.rdbuf();
-
-    FCGX_Init();
-
-    FCGX_Request request;
-    FCGX_InitRequest(&request, 0, 0);
-
-    while (FCGX_Accept_r(&request) == 0) {
-        fcgi_streambuf cin_fcgi_streambuf(request.in);
-        fcgi_streambuf cout_fcgi_streambuf(request.out);
-        fcgi_streambuf cerr_fcgi_streambuf(request.err);
-
-        std::cin.rdbuf(&cin_fcgi_streambuf);
-        std::cout.rdbuf(&cout_fcgi_streambuf);
-        std::cerr.rdbuf(&cerr_fcgi_streambuf);
-
-        // The fcgi_streambuf destructor will flush automatically
-        std::cout << "Content-type: text/html; charset=utf-8\r\n\r"s
-                  << R"(
-<!doctype html>
+static constexpr std::string_view page_head = "Content-type: text/html; charset=utf-8\r\n\r\n"
+                                              R"(<!doctype html>
 <html>
   <head>
     <title>FastCGI</title>
@@ -39,15 +48,295 @@ auto main() -> int
   <body>
     <h1>FastCGI works</h1>
     <p>Here are some UTF-8 characters: æøå ÆØÅ</p>
+    <p>Served by worker )";
+
+static constexpr std::string_view page_tail = R"(</p>
   </body>
 </html>
-)"s;
+)";
+
+// Some platforms need the accept calls on a shared socket to not overlap,
+// as in the threaded.c example of libfcgi
+static std::mutex accept_mutex;
+
+// Appends the number n to out, without allocating
+static void append_number(std::string& out, unsigned long n)
+{
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    out.append(digits, end);
+}
+
+static void serve(int listen_fd, unsigned worker)
+{
+    FCGX_Request request;
+    FCGX_InitRequest(&request, listen_fd, 0);
+
+    // The response is built in the same buffer for every request, which
+    // keeps its capacity, and is written with a single FCGX_PutStr
+    std::string response;
+    response.reserve(4096);
+    unsigned long served = 0;
+
+    for (;;) {
+        int accepted;
+        {
+            // Only accepting a new connection is serialized. A connection
+            // that the web server keeps open is read by this worker alone,
+            // which may wait a long time for its next request there, and
+            // the other workers must not wait with it
+            std::unique_lock<std::mutex> lock(accept_mutex, std::defer_lock);
+            if (request.ipcFd < 0) {
+                lock.lock();
+            }
+            accepted = FCGX_Accept_r(&request);
+        }
+        if (accepted < 0) {
+            break;
+        }
+        response.clear();
+        response.append(page_head);
+        append_number(response, worker);
+        response.append(", which has served ");
+        append_number(response, ++served);
+        response.append(" requests");
+        response.append(page_tail);
+        FCGX_PutStr(response.data(), int(response.size()), request.out);
+        FCGX_Finish_r(&request);
+    }
+}
+
+// The FastCGI records that the load test client sends and reads, from the
+// FastCGI specification
+namespace fcgi {
+enum : unsigned char { begin_request = 1, end_request = 3, params_record = 4, stdin_record = 5, stdout_record = 6 };
+constexpr unsigned char responder = 1;
+constexpr unsigned char keep_conn = 1;
+
+static void append_record(std::string& out, unsigned char type, std::string_view content)
+{
+    const unsigned char header[8] = { 1, type, 0, 1, (unsigned char)(content.size() >> 8),
+        (unsigned char)(content.size() & 0xff), 0, 0 };
+    out.append(reinterpret_cast<const char*>(header), sizeof(header));
+    out.append(content);
+}
+
+static void append_length(std::string& out, std::size_t n)
+{
+    if (n < 128) {
+        out += char(n);
+        return;
     }
+    out += char((n >> 24) | 0x80);
+    out += char((n >> 16) & 0xff);
+    out += char((n >> 8) & 0xff);
+    out += char(n & 0xff);
+}
+
+// Returns the bytes of a complete GET request with request id 1
+static std::string request(std::string_view uri)
+{
+    std::string params;
+    auto add = [&](std::string_view name, std::string_view value) {
+        append_length(params, name.size());
+        append_length(params, value.size());
+        params.append(name);
+        params.append(value);
+    };
+    add("REQUEST_METHOD", "GET");
+    add("REQUEST_URI", uri);
+    add("SCRIPT_NAME", uri);
+    add("QUERY_STRING", "");
+    add("SERVER_PROTOCOL", "HTTP/1.1");
+    add("GATEWAY_INTERFACE", "CGI/1.1");
 
-    // Restore the stdio streambufs
-    std::cin.rdbuf(cin_streambuf);
-    std::cout.rdbuf(cout_streambuf);
-    std::cerr.rdbuf(cerr_streambuf);
+    std::string out;
+    const char begin[8] = { 0, char(responder), char(keep_conn), 0, 0, 0, 0, 0 };
+    append_record(out, begin_request, std::string_view(begin, sizeof(begin)));
+    append_record(out, params_record, params);
+    append_record(out, params_record, "");
+    append_record(out, stdin_record, "");
+    return out;
+}
+}
 
+// Connects to host:port, or to a unix socket if the address contains a slash
+static int connect_to(const std::string& address)
+{
+    if (address.find('/') != std::string::npos) {
+        sockaddr_un sa {};
+        sa.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(sa.sun_path)) {
+            return -1;
+        }
+        memcpy(sa.sun_path, address.c_str(), address.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+    std::string host = colon == 0 ? "127.0.0.1"s : address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* ai = found; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static bool read_full(int fd, unsigned char* buf, std::size_t n)
+{
+    while (n > 0) {
+        ssize_t got = read(fd, buf, n);
+        if (got <= 0) {
+            return false;
+        }
+        buf += got;
+        n -= std::size_t(got);
+    }
+    return true;
+}
+
+// Sends one request on fd, and reads records until the end of the request.
+// Returns false if the connection failed, or if there was no output.
+static bool round_trip(int fd, const std::string& request)
+{
+    for (std::size_t sent = 0; sent < request.size();) {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += std::size_t(n);
+    }
+    bool got_output = false;
+    unsigned char header[8];
+    static thread_local unsigned char content[65536 + 256];
+    for (;;) {
+        if (!read_full(fd, header, sizeof(header))) {
+            return false;
+        }
+        std::size_t length = (std::size_t(header[4]) << 8 | header[5]) + header[6];
+        if (!read_full(fd, content, length)) {
+            return false;
+        }
+        if (header[1] == fcgi::stdout_record && length > header[6]) {
+            got_output = true;
+        } else if (header[1] == fcgi::end_request) {
+            return got_output;
+        }
+    }
+}
+
+static int load_test(const std::string& address, long requests, unsigned connections)
+{
+    const std::string request = fcgi::request("/");
+    std::vector<std::vector<double>> latencies(connections); // in microseconds, per connection
+    std::atomic<long> next { 0 };
+    std::atomic<long> failed { 0 };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (unsigned c = 0; c < connections; c++) {
+        clients.emplace_back([&, c] {
+            int fd = connect_to(address);
+            latencies[c].reserve(std::size_t(requests / connections + 1));
+            while (next++ < requests) {
+                auto t0 = std::chrono::steady_clock::now();
+                if (fd < 0 || !round_trip(fd, request)) {
+                    // The server may close the connection instead of keeping it, so try again once
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                    fd = connect_to(address);
+                    if (fd < 0 || !round_trip(fd, request)) {
+                        failed++;
+                        continue;
+                    }
+                }
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        });
+    }
+    for (std::thread& t : clients) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> all;
+    for (const auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    if (all.empty()) {
+        fprintf(stderr, "no requests to %s succeeded\n", address.c_str());
+        return EXIT_FAILURE;
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all[std::min(all.size() - 1, std::size_t(p * double(all.size())))]; };
+    printf("%zu requests over %u connections in %.3f s, %ld failed\n", all.size(), connections, seconds, failed.load());
+    printf("%.0f req/s, latency p50 %.1f us, p99 %.1f us, max %.1f us\n", double(all.size()) / seconds, percentile(0.50),
+        percentile(0.99), all.back());
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+auto main(int argc, char* argv[]) -> int
+{
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    const char* listen_address = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            long requests = i + 2 < argc ? atol(argv[i + 2]) : 1000;
+            unsigned connections = i + 3 < argc ? unsigned(std::max(1, atoi(argv[i + 3]))) : 8;
+            return load_test(argv[i + 1], requests, connections);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = unsigned(std::max(1, atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_address = argv[++i];
+        }
+    }
+
+    if (FCGX_Init() != 0) {
+        fprintf(stderr, "could not initialize libfcgi\n");
+        return EXIT_FAILURE;
+    }
+    int listen_fd = 0; // the socket that the web server passes as stdin
+    if (listen_address) {
+        listen_fd = FCGX_OpenSocket(listen_address, 1024);
+        if (listen_fd < 0) {
+            fprintf(stderr, "could not listen on %s\n", listen_address);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < threads; w++) {
+        workers.emplace_back(serve, listen_fd, w);
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
     return EXIT_SUCCESS;
 }
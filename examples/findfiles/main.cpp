@@ -1,14 +1,251 @@
+// findfiles walks a directory tree with a pool of threads, and prints the
+// entries whose names match one of the given patterns, or all of them.
+//
+//     findfiles [-j threads] [directory] [pattern...]
+//
+// A pattern is a glob such as "*.cpp" or "test_?.h", or an extension such as
+// ".hpp". The directory is ".." by default.
+//
+// The directories that are found go on a shared work queue, and any idle
+// thread takes the next one. On Linux the directories are read with
+// getdents64 into a large buffer, and opened with openat from their parent,
+// which saves a path lookup and a stat per entry. The output is collected
+// per thread and written in large batches.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
-#include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace std::string_literals;
 
-auto main() -> int
+// Matches a name against a glob with * and ?
+static bool glob_match(const char* pattern, const char* name)
+{
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*name) {
+        if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+class walker {
+    struct job {
+        std::string path;
+        int fd; // opened with openat from the parent, or -1 to open path
+    };
+
+    std::vector<std::string> patterns; // globs, with extensions turned into "*.ext"
+    std::deque<job> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    int pending = 0; // directories that are queued or being read, under queue_mutex
+    std::atomic<int> open_dirs { 0 };
+    std::mutex output_mutex;
+
+    static constexpr int max_open_dirs = 256; // queued directories beyond this are opened by path
+    static constexpr std::size_t batch_size = 64 * 1024;
+
+    bool matches(const char* name) const
+    {
+        if (patterns.empty()) {
+            return true;
+        }
+        return std::any_of(patterns.begin(), patterns.end(),
+            [name](const std::string& p) { return glob_match(p.c_str(), name); });
+    }
+
+    void push(std::string path, int fd)
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(job { std::move(path), fd });
+        pending++;
+        queue_ready.notify_one();
+    }
+
+    // Adds a found entry to the output of this thread, and queues it if it is a directory
+    void found(const std::string& dir, const char* name, bool is_dir, int parent_fd, std::string& out)
+    {
+        std::string path = dir == "/" ? "/"s + name : dir + "/" + name;
+        if (matches(name)) {
+            out += path;
+            out += '\n';
+        }
+        if (!is_dir) {
+            return;
+        }
+        int fd = -1;
+#ifdef __linux__
+        if (parent_fd >= 0 && open_dirs < max_open_dirs) {
+            fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                open_dirs++;
+            }
+        }
+#else
+        (void)parent_fd;
+#endif
+        push(std::move(path), fd);
+    }
+
+    void read_dir(job& j, std::string& out)
+    {
+#ifdef __linux__
+        int fd = j.fd;
+        if (fd < 0) {
+            fd = open(j.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            open_dirs++;
+        }
+        struct linux_dirent64 {
+            ino64_t d_ino;
+            off64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[1]; // NUL terminated, and d_reclen long
+        };
+        alignas(8) static thread_local char buffer[256 * 1024];
+        for (;;) {
+            long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                break;
+            }
+            for (long pos = 0; pos < n;) {
+                auto* d = reinterpret_cast<linux_dirent64*>(buffer + pos);
+                pos += d->d_reclen;
+                const char* name = d->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+                bool is_dir = d->d_type == DT_DIR;
+                if (d->d_type == DT_UNKNOWN) { // some file systems do not fill in the type
+                    struct stat st;
+                    is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+                }
+                found(j.path, name, is_dir, fd, out);
+            }
+        }
+        close(fd);
+        open_dirs--;
+#else
+        std::error_code ec;
+        for (auto& entry : std::filesystem::directory_iterator(j.path, ec)) {
+            std::string name = entry.path().filename().string();
+            found(j.path, name.c_str(), entry.is_directory(ec) && !entry.is_symlink(ec), -1, out);
+        }
+#endif
+    }
+
+    void flush(std::string& out)
+    {
+        if (out.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(output_mutex);
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+
+    void work()
+    {
+        std::string out;
+        out.reserve(batch_size + 4096);
+        for (;;) {
+            job j;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return !queue.empty() || pending == 0; });
+                if (queue.empty()) {
+                    break; // every directory has been read
+                }
+                j = std::move(queue.front());
+                queue.pop_front();
+            }
+            read_dir(j, out);
+            if (out.size() >= batch_size) {
+                flush(out);
+            }
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (--pending == 0) {
+                queue_ready.notify_all();
+            }
+        }
+        flush(out);
+    }
+
+public:
+    explicit walker(const std::vector<std::string>& args)
+    {
+        for (const std::string& p : args) {
+            bool glob = p.find_first_of("*?") != std::string::npos;
+            patterns.push_back(!glob && p[0] == '.' ? "*" + p : p);
+        }
+    }
+
+    void run(const std::string& root, unsigned threads)
+    {
+        std::string dir = root.size() > 1 && root.back() == '/' ? root.substr(0, root.size() - 1) : root;
+        push(dir, -1);
+        std::vector<std::thread> pool;
+        for (unsigned i = 0; i < threads; i++) {
+            pool.emplace_back([this] { work(); });
+        }
+        for (std::thread& t : pool) {
+            t.join();
+        }
+        fflush(stdout);
+    }
+};
+
+auto main(int argc, char* argv[]) -> int
 {
     auto path = ".."s;
-    for (auto& found : std::filesystem::directory_iterator(path)) {
-        std::cout << found << std::endl;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> patterns;
+    bool have_path = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (!have_path && std::filesystem::is_directory(argv[i])) {
+            path = argv[i];
+            have_path = true;
+        } else {
+            patterns.push_back(argv[i]);
+        }
     }
+    walker(patterns).run(path, threads);
     return 0;
 }
@@ -1,11 +1,24 @@
 // Based on https://github.com/hikiko/gl4 (public domain)
 // by Eleni Maria Stea <elene.mst@gmail.com>
-
+//
+//     gl4_spirv [--instances n] [--draw loop|instanced|indirect]
+//
+// Draws n tori in a grid (1 by default), with one glDrawElements per torus,
+// with a single glDrawElementsInstanced, or with a single
+// glMultiDrawElementsIndirect. Press m to switch between them. The matrices
+// are written to a persistently mapped uniform buffer with a slot for each
+// of the frames in flight, and the GPU time of every frame is measured with
+// GL_TIME_ELAPSED queries. The frame rate and the CPU and GPU times are
+// printed every second.
+
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
 
 #include <cassert> // for assert
 #include <cmath> // for M_PI
+#include <cstdio> // for printf
 #include <cstring> // for memset
 
 #define GL_GLEXT_PROTOTYPES
@@ -23,7 +36,15 @@ enum {
     UBLOCK_MATRIX,
 };
 
-enum { VATTR_VERTEX, VATTR_NORMAL, VATTR_TEXCOORD };
+enum { VATTR_VERTEX, VATTR_NORMAL, VATTR_TEXCOORD, VATTR_INSTANCE = 7 };
+
+enum { DRAW_LOOP, DRAW_INSTANCED, DRAW_INDIRECT, DRAW_MODES };
+
+const char* draw_mode_names[DRAW_MODES] = { "loop", "instanced", "indirect" };
+
+// How many frames the CPU may be ahead of the GPU, which is how many slots
+// the uniform buffer and the timer queries have
+#define FRAMES_IN_FLIGHT 3
 
 struct vertex {
     float x, y, z;
@@ -37,6 +58,19 @@ struct mesh {
     int vcount, icount;
 
     unsigned int vbo, ibo, vao;
+
+    float* instarr; // offset and scale, 4 floats per instance
+    int instcount;
+    unsigned int instbo, cmdbo;
+};
+
+// The layout of a command in GL_DRAW_INDIRECT_BUFFER
+struct draw_elements_command {
+    unsigned int count;
+    unsigned int instance_count;
+    unsigned int first_index;
+    int base_vertex;
+    unsigned int base_instance;
 };
 
 struct matrix_state {
@@ -55,6 +89,20 @@ struct matrix_state matrix_state;
 unsigned int g_tex;
 unsigned int g_sdr;
 unsigned int ubo_matrix;
+unsigned char* ubo_matrix_ptr; // persistently mapped
+int ubo_matrix_stride; // the size of a slot, a multiple of GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+GLsync frame_fence[FRAMES_IN_FLIGHT];
+unsigned int gpu_timer[FRAMES_IN_FLIGHT];
+bool gpu_timer_used[FRAMES_IN_FLIGHT];
+unsigned long frame_count;
+
+int num_instances = 1;
+int draw_mode = DRAW_INSTANCED;
+
+// Totals since the last report
+int stat_frames;
+double stat_cpu_ms, stat_gpu_ms;
+int stat_start_ms;
 
 static PFNGLSPECIALIZESHADERPROC gl_specialize_shader;
 
@@ -64,6 +112,7 @@ int prev_x, prev_y, bnstate[8];
 // Forward declarations
 
 void draw_mesh(struct mesh* mesh);
+void set_draw_mode(struct mesh* mesh, int mode);
 int link_program(unsigned int prog);
 void GLAPIENTRY gldebug(GLenum src, GLenum type, GLuint id, GLenum severity, GLsizei len,
     const char* msg, const void* cls);
@@ -167,12 +216,62 @@ void cleanup(void)
     if (torus.vao) {
         glDeleteVertexArrays(1, &torus.vao);
     }
+    free(torus.instarr);
+    if (torus.instbo) {
+        glDeleteBuffers(1, &torus.instbo);
+        glDeleteBuffers(1, &torus.cmdbo);
+    }
     glDeleteTextures(1, &g_tex);
-    glDeleteBuffers(1, &ubo_matrix);
+    glDeleteBuffers(1, &ubo_matrix); // which also unmaps it
+    for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+        if (frame_fence[i]) {
+            glDeleteSync(frame_fence[i]);
+        }
+    }
+    glDeleteQueries(FRAMES_IN_FLIGHT, gpu_timer);
+}
+
+// Waits until the GPU is done with the frame that last used the given slot,
+// and adds the GPU time of that frame to the statistics
+void finish_slot(int slot)
+{
+    if (frame_fence[slot]) {
+        while (glClientWaitSync(frame_fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)
+            == GL_TIMEOUT_EXPIRED) { }
+        glDeleteSync(frame_fence[slot]);
+        frame_fence[slot] = 0;
+    }
+    if (gpu_timer_used[slot]) {
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(gpu_timer[slot], GL_QUERY_RESULT, &ns);
+        stat_gpu_ms += ns / 1e6;
+        gpu_timer_used[slot] = false;
+    }
+}
+
+void report_stats(void)
+{
+    int now = glutGet(GLUT_ELAPSED_TIME);
+    if (now - stat_start_ms < 1000 || !stat_frames) {
+        return;
+    }
+    char buf[256];
+    snprintf(buf, sizeof buf, "%d instances, %s: %.1f fps, cpu %.3f ms, gpu %.3f ms",
+        num_instances, draw_mode_names[draw_mode], stat_frames * 1000.0 / (now - stat_start_ms),
+        stat_cpu_ms / stat_frames, stat_gpu_ms / stat_frames);
+    printf("%s\n", buf);
+    glutSetWindowTitle(("GL4 test - "s + buf).c_str());
+    stat_frames = 0;
+    stat_cpu_ms = stat_gpu_ms = 0;
+    stat_start_ms = now;
 }
 
 void display(void)
 {
+    auto cpu_start = std::chrono::steady_clock::now();
+    int slot = frame_count++ % FRAMES_IN_FLIGHT;
+    finish_slot(slot);
+
     matrix_state.lpos[0] = -10;
     matrix_state.lpos[1] = 10;
     matrix_state.lpos[2] = 10;
@@ -194,14 +293,23 @@ void display(void)
 
     glUseProgram(g_sdr);
 
-    glBindBuffer(GL_UNIFORM_BUFFER, ubo_matrix);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof matrix_state, &matrix_state);
-    glBindBufferBase(GL_UNIFORM_BUFFER, UBLOCK_MATRIX, ubo_matrix);
+    // The GPU is done with this slot, so it can be written to without a copy or a sync
+    memcpy(ubo_matrix_ptr + slot * ubo_matrix_stride, &matrix_state, sizeof matrix_state);
+    glBindBufferRange(GL_UNIFORM_BUFFER, UBLOCK_MATRIX, ubo_matrix, slot * ubo_matrix_stride,
+        (sizeof matrix_state + 15) & ~15);
 
+    glBeginQuery(GL_TIME_ELAPSED, gpu_timer[slot]);
     glBindTexture(GL_TEXTURE_2D, g_tex);
     draw_mesh(&torus);
+    glEndQuery(GL_TIME_ELAPSED);
+    gpu_timer_used[slot] = true;
+    frame_fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
     assert(glGetError() == GL_NO_ERROR);
+    stat_cpu_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - cpu_start).count();
+    stat_frames++;
+    report_stats();
     glutSwapBuffers();
 }
 
@@ -218,6 +326,9 @@ void keypress(unsigned char key, int x, int y)
     switch (key) {
     case 27:
         exit(0);
+    case 'm':
+        set_draw_mode(&torus, (draw_mode + 1) % DRAW_MODES);
+        break;
     }
 }
 
@@ -371,12 +482,100 @@ int gen_torus(struct mesh* mesh, float rad, float rrad, int usub, int vsub)
     return 0;
 }
 
+// Places count instances of the mesh in a cube shaped grid that is about as
+// large as a single instance, and creates the per-instance vertex buffer and
+// the buffer of indirect draw commands, one per instance
+int gen_instances(struct mesh* mesh, int count)
+{
+    int i, side = 1;
+    float scale, spacing;
+    struct draw_elements_command* cmds;
+
+    while (side * side * side < count)
+        side++;
+    scale = 1.0f / side;
+    spacing = 3.0f * scale;
+
+    if (!(mesh->instarr = (float*)malloc(count * 4 * sizeof *mesh->instarr))) {
+        std::cerr << "failed to allocate instance array for "s << count << " instances"s
+                  << std::endl;
+        return -1;
+    }
+    mesh->instcount = count;
+    for (i = 0; i < count; i++) {
+        float* inst = mesh->instarr + i * 4;
+        inst[0] = (i % side - (side - 1) * 0.5f) * spacing;
+        inst[1] = (i / side % side - (side - 1) * 0.5f) * spacing;
+        inst[2] = (i / (side * side) - (side - 1) * 0.5f) * spacing;
+        inst[3] = scale;
+    }
+
+    glGenBuffers(1, &mesh->instbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->instbo);
+    glBufferStorage(GL_ARRAY_BUFFER, count * 4 * sizeof *mesh->instarr, mesh->instarr, 0);
+
+    glBindVertexArray(mesh->vao);
+    glVertexAttribPointer(VATTR_INSTANCE, 4, GL_FLOAT, GL_FALSE, 4 * sizeof *mesh->instarr, 0);
+    glVertexAttribDivisor(VATTR_INSTANCE, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (!(cmds = (draw_elements_command*)malloc(count * sizeof *cmds))) {
+        std::cerr << "failed to allocate "s << count << " draw commands"s << std::endl;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        cmds[i].count = mesh->icount;
+        cmds[i].instance_count = 1;
+        cmds[i].first_index = 0;
+        cmds[i].base_vertex = 0;
+        cmds[i].base_instance = i; // which picks the instance attribute
+    }
+    glGenBuffers(1, &mesh->cmdbo);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh->cmdbo);
+    glBufferStorage(GL_DRAW_INDIRECT_BUFFER, count * sizeof *cmds, cmds, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    free(cmds);
+    return 0;
+}
+
+// The loop mode sets the instance attribute for each draw call, instead of
+// reading it from the instance buffer
+void set_draw_mode(struct mesh* mesh, int mode)
+{
+    draw_mode = mode;
+    glBindVertexArray(mesh->vao);
+    if (mode == DRAW_LOOP) {
+        glDisableVertexAttribArray(VATTR_INSTANCE);
+    } else {
+        glEnableVertexAttribArray(VATTR_INSTANCE);
+    }
+    glBindVertexArray(0);
+}
+
 void draw_mesh(struct mesh* mesh)
 {
+    int i;
+
     glBindVertexArray(mesh->vao);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-    glDrawElements(GL_TRIANGLES, mesh->icount, GL_UNSIGNED_INT, 0);
+    switch (draw_mode) {
+    case DRAW_LOOP:
+        for (i = 0; i < mesh->instcount; i++) {
+            glVertexAttrib4fv(VATTR_INSTANCE, mesh->instarr + i * 4);
+            glDrawElements(GL_TRIANGLES, mesh->icount, GL_UNSIGNED_INT, 0);
+        }
+        break;
+    case DRAW_INSTANCED:
+        glDrawElementsInstanced(GL_TRIANGLES, mesh->icount, GL_UNSIGNED_INT, 0, mesh->instcount);
+        break;
+    case DRAW_INDIRECT:
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh->cmdbo);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, mesh->instcount, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        break;
+    }
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
     glBindVertexArray(0);
@@ -599,6 +798,10 @@ int init(void)
     if (gen_torus(&torus, 1.0, 0.25, 32, 12) == -1) {
         return -1;
     }
+    if (gen_instances(&torus, num_instances) == -1) {
+        return -1;
+    }
+    set_draw_mode(&torus, draw_mode);
 
 #ifdef SPIRV
     if (!(g_sdr = load_program(SHADERDIR "vertex.spv", SHADERDIR "pixel.spv"))) {
@@ -612,9 +815,23 @@ int init(void)
 
     glUseProgram(g_sdr);
 
+    // One slot per frame in flight, mapped once for the lifetime of the program
+    int align = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    ubo_matrix_stride = ((int)sizeof matrix_state + align - 1) / align * align;
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
     glGenBuffers(1, &ubo_matrix);
     glBindBuffer(GL_UNIFORM_BUFFER, ubo_matrix);
-    glBufferData(GL_UNIFORM_BUFFER, sizeof matrix_state, &matrix_state, GL_STREAM_DRAW);
+    glBufferStorage(GL_UNIFORM_BUFFER, FRAMES_IN_FLIGHT * ubo_matrix_stride, 0, flags);
+    ubo_matrix_ptr = (unsigned char*)glMapBufferRange(
+        GL_UNIFORM_BUFFER, 0, FRAMES_IN_FLIGHT * ubo_matrix_stride, flags);
+    if (!ubo_matrix_ptr) {
+        std::cerr << "failed to map the uniform buffer"s << std::endl;
+        return -1;
+    }
+
+    glGenQueries(FRAMES_IN_FLIGHT, gpu_timer);
+    stat_start_ms = glutGet(GLUT_ELAPSED_TIME);
 
     return 0;
 }
@@ -628,11 +845,25 @@ int main(int argc, char** argv)
     glutInitContextVersion(4, 4);
     glutCreateWindow("GL4 test");
 
+    for (int i = 1; i < argc; i++) {
+        if ((!strcmp(argv[i], "--instances") || !strcmp(argv[i], "-n")) && i + 1 < argc) {
+            num_instances = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--draw") && i + 1 < argc) {
+            i++;
+            for (int mode = 0; mode < DRAW_MODES; mode++) {
+                if (!strcmp(argv[i], draw_mode_names[mode])) {
+                    draw_mode = mode;
+                }
+            }
+        }
+    }
+
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keypress);
     glutMouseFunc(mouse);
     glutMotionFunc(motion);
+    glutIdleFunc(glutPostRedisplay); // keep drawing, for the frame times
 
     if (init() == -1) {
         return 1;
@@ -13,6 +13,7 @@ layout(std140, binding = 0) uniform matrix_state {
 layout(location = 0) in vec4 attr_vertex;
 layout(location = 1) in vec3 attr_normal;
 layout(location = 2) in vec2 attr_texcoord;
+layout(location = 7) in vec4 attr_instance; // xyz is the offset and w the scale
 
 layout(location = 3) out vec3 vpos;
 layout(location = 4) out vec3 norm;
@@ -21,8 +22,10 @@ layout(location = 6) out vec2 texcoord;
 
 void main()
 {
-	gl_Position = matrix.mvpmat * attr_vertex;
-	vpos = (matrix.mvmat * attr_vertex).xyz;
+	vec4 pos = attr_vertex * vec4(vec3(attr_instance.w), 1.0) + vec4(attr_instance.xyz, 0.0);
+
+	gl_Position = matrix.mvpmat * pos;
+	vpos = (matrix.mvmat * pos).xyz;
 	norm = mat3(matrix.mvmat) * attr_normal;
 
 	texcoord = attr_texcoord * vec2(2.0, 1.0);
@@ -0,0 +1,8 @@
+#include "bench.h"
+#include "hello.h"
+
+int main()
+{
+    bench::run("hello", [] { bench::do_not_optimize(hello()); });
+    return 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+// A small benchmark harness, for the *_bench.cpp files that "oh bench" runs.
+// bench::run warms the function up, finds how many calls fill a run of about
+// 10 ms, and times a number of such runs, pinned to one CPU. The median time
+// per call is printed as "bench <name> <ns> ns/op", which oh compares with
+// the baseline, so the name can not contain spaces. Programs built with
+// OpenMP, and runs with OH_BENCH_NOPIN set, as during "oh bench --omp-sweep",
+// are not pinned, since the OpenMP threads would inherit the single CPU.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace bench {
+
+// Makes the compiler assume that value is used, so that it is computed
+template <typename T> inline void do_not_optimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Makes the compiler assume that all memory is read and written, so that
+// stores are not optimized away or moved out of the timed loop
+inline void clobber_memory() { asm volatile("" : : : "memory"); }
+
+// Pins the process to the CPU it is running on, so that the runs are not
+// moved between CPUs with different caches and clock speeds
+inline void pin_cpu()
+{
+#if defined(__linux__) && !defined(_OPENMP)
+    if (std::getenv("OH_BENCH_NOPIN")) {
+        return;
+    }
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+#endif
+}
+
+struct options {
+    int runs = 15;
+    std::chrono::nanoseconds run_time = std::chrono::milliseconds(10);
+    std::chrono::nanoseconds warmup = std::chrono::milliseconds(100);
+};
+
+template <typename F> void run(const char* name, F&& fn, const options& opts = {})
+{
+    using clock = std::chrono::steady_clock;
+    static const bool pinned = (pin_cpu(), true);
+    (void)pinned;
+
+    auto time = [&fn](long calls) {
+        auto start = clock::now();
+        for (long i = 0; i < calls; i++) {
+            fn();
+            clobber_memory();
+        }
+        return clock::now() - start;
+    };
+
+    // Double the number of calls until they fill a run, and keep running
+    // until the warmup time is over
+    long calls = 1;
+    const auto warmed = clock::now() + opts.warmup;
+    while (time(calls) < opts.run_time && calls < (1L << 40)) {
+        calls *= 2;
+    }
+    while (clock::now() < warmed) {
+        time(calls);
+    }
+
+    std::vector<double> ns(std::max(1, opts.runs));
+    for (double& t : ns) {
+        t = std::chrono::duration<double, std::nano>(time(calls)).count() / double(calls);
+    }
+    std::sort(ns.begin(), ns.end());
+    std::printf("bench %s %.3f ns/op (fastest %.3f, %zu runs of %ld calls)\n", name,
+        ns[ns.size() / 2], ns.front(), ns.size(), calls);
+    std::fflush(stdout);
+}
+
+} // namespace bench
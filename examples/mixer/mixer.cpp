@@ -1,12 +1,39 @@
 // Based on https://gist.github.com/armornick/3497064 and
 // https://stackoverflow.com/a/1641223/131264
+//
+//     mixer [-r rate] [-b buffer] [sample.wav...]
+//
+// The sound effects are not decoded with Mix_LoadWAV, which converts the
+// whole file into heap memory before anything plays. Instead, every WAV file
+// is memory mapped into a sample bank, and only the frames that the playing
+// voices need for the current audio buffer are converted, in a post-mix
+// callback. The pages of a clip are read in by the kernel when first played,
+// and are shared by all the voices that play it, so that a bank of hundreds
+// of clips costs little until they are used. The music is streamed by
+// SDL_mixer, as before.
+//
+// The sample rate (22050 Hz by default) and the size of the audio buffer
+// (4096 sample frames by default) trade latency against CPU use. The time it
+// took to load the bank, and the resident memory of the process and of the
+// bank, are reported at startup and at exit.
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <csignal>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 
 // RESOURCEDIR is defined by cxx, so that the path will be correct both at development-time
 // and at installation-time
@@ -14,20 +41,308 @@
 #define WAV_PATH RESOURCEDIR "Roland-GR-1-Trumpet-C5.wav"
 #define MUS_PATH RESOURCEDIR "HR2_Friska.ogg"
 
-// Wave file
-Mix_Chunk* wave = nullptr;
+// A memory mapped WAV file with 8 or 16 bit PCM samples
+struct clip {
+    std::string path;
+    void* map = nullptr;
+    size_t map_size = 0;
+    const unsigned char* data = nullptr; // the first frame
+    size_t frames = 0;
+    int channels = 0;
+    int bytes_per_sample = 0;
+    int rate = 0;
+};
+
+// A clip that is being played, from a position in frames of the clip
+struct voice {
+    const clip* c = nullptr;
+    double pos = 0;
+    double step = 0; // clip frames per output frame
+    float gain = 1;
+};
+
+constexpr int max_voices = 64;
+
+// A clip that the main thread has asked the audio callback to start
+struct start_request {
+    int clip = 0;
+    float gain = 1;
+};
+
+class sample_bank {
+    std::vector<clip> clips;
+    voice voices[max_voices]; // only used by the audio callback
+    int device_rate = 0;
+    int device_channels = 2;
+
+    // The voices are started through a single producer, single consumer
+    // queue, since SDL_LockAudio does not lock the device that SDL_mixer
+    // opens, and SDL_mixer 2 has no public lock of its own
+    start_request requests[max_voices];
+    std::atomic<unsigned> requests_head { 0 }; // written by the main thread
+    std::atomic<unsigned> requests_tail { 0 }; // written by the audio callback
+    std::atomic<int> active { 0 }; // the playing voices, as of the last callback
+
+    static uint32_t le32(const unsigned char* p)
+    {
+        return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+    }
+
+    static uint16_t le16(const unsigned char* p) { return uint16_t(p[0] | p[1] << 8); }
+
+    // Returns channel ch of frame i of the clip, from -1 to 1
+    static float sample(const clip& c, size_t i, int ch)
+    {
+        const unsigned char* p = c.data + (i * c.channels + ch) * c.bytes_per_sample;
+        if (c.bytes_per_sample == 1) {
+            return (int(p[0]) - 128) / 128.0f;
+        }
+        return int16_t(le16(p)) / 32768.0f;
+    }
+
+    // Finds the fmt and data chunks of a mapped WAV file
+    static bool parse(clip& c)
+    {
+        const auto* p = static_cast<const unsigned char*>(c.map);
+        const unsigned char* end = p + c.map_size;
+        if (c.map_size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+            return false;
+        }
+        int bits = 0;
+        for (p += 12; end - p >= 8;) {
+            uint32_t size = le32(p + 4);
+            const unsigned char* body = p + 8;
+            if (size > size_t(end - body)) {
+                size = uint32_t(end - body); // a truncated file, or a bogus data chunk size
+            }
+            if (memcmp(p, "fmt ", 4) == 0 && size >= 16) {
+                uint16_t format = le16(body);
+                if (format == 0xFFFE && size >= 26) {
+                    format = le16(body + 24); // WAVE_FORMAT_EXTENSIBLE, from the GUID
+                }
+                if (format != 1) {
+                    return false; // only PCM
+                }
+                c.channels = le16(body + 2);
+                c.rate = int(le32(body + 4));
+                bits = le16(body + 14);
+            } else if (memcmp(p, "data", 4) == 0 && c.channels > 0) {
+                if ((bits != 8 && bits != 16) || c.channels > 2 || c.rate <= 0) {
+                    return false;
+                }
+                c.bytes_per_sample = bits / 8;
+                c.data = body;
+                c.frames = size / (c.channels * c.bytes_per_sample);
+                return c.frames > 0;
+            }
+            p = body + size + (size & 1);
+        }
+        return false;
+    }
+
+public:
+    ~sample_bank()
+    {
+        for (clip& c : clips) {
+            munmap(c.map, c.map_size);
+        }
+    }
+
+    // Maps a WAV file, and returns its number, or -1. Nothing is read yet,
+    // other than the header. All the clips are loaded before any is played,
+    // since the voices point into the vector of clips.
+    int load(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        clip c;
+        c.path = path;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            c.map_size = size_t(st.st_size);
+            c.map = mmap(nullptr, c.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (c.map == nullptr || c.map == MAP_FAILED) {
+            return -1;
+        }
+        if (!parse(c)) {
+            munmap(c.map, c.map_size);
+            return -1;
+        }
+        // Playback reads forward, so let the kernel read ahead, and start
+        // reading the beginning now, so that it is not the audio callback
+        // that waits for the disk when the clip is first played
+        madvise(c.map, c.map_size, MADV_SEQUENTIAL);
+        madvise(c.map, std::min<size_t>(c.map_size, 64 * 1024), MADV_WILLNEED);
+        clips.push_back(c);
+        return int(clips.size()) - 1;
+    }
+
+    void set_device_rate(int rate) { device_rate = rate; }
+    void set_device_channels(int channels) { device_channels = channels; }
+    int get_device_channels() const { return device_channels; }
+
+    // Asks the audio callback to start playing a clip on a free voice.
+    // Called from the main thread. Returns false if too many are waiting.
+    bool play(int n, float gain = 1)
+    {
+        unsigned head = requests_head.load(std::memory_order_relaxed);
+        if (head - requests_tail.load(std::memory_order_acquire) == max_voices) {
+            return false;
+        }
+        requests[head % max_voices] = { n, gain };
+        requests_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The voices that are playing, or waiting for the audio callback to start them
+    int playing() const
+    {
+        unsigned waiting = requests_head.load(std::memory_order_acquire)
+            - requests_tail.load(std::memory_order_acquire);
+        return active.load(std::memory_order_acquire) + int(waiting);
+    }
+
+    // Adds the playing voices to a buffer of interleaved 16 bit samples.
+    // The clips are resampled with linear interpolation, from the mapped
+    // pages, as they are played. Called from the audio callback.
+    void mix(int16_t* out, int frames, int out_channels)
+    {
+        // Start the voices that the main thread has asked for. The number of
+        // playing voices is stored before they are taken off the queue, so
+        // that playing() always counts them, as waiting or as playing
+        unsigned tail = requests_tail.load(std::memory_order_relaxed);
+        unsigned head = requests_head.load(std::memory_order_acquire);
+        int started = 0;
+        for (unsigned i = tail; i != head; i++) {
+            const start_request& r = requests[i % max_voices];
+            for (voice& v : voices) {
+                if (v.c == nullptr) {
+                    v.c = &clips[size_t(r.clip)];
+                    v.pos = 0;
+                    v.step = double(v.c->rate) / device_rate;
+                    v.gain = r.gain;
+                    started++;
+                    break;
+                }
+            }
+        }
+        active.fetch_add(started, std::memory_order_release);
+        requests_tail.store(head, std::memory_order_release);
+
+        for (voice& v : voices) {
+            if (v.c == nullptr) {
+                continue;
+            }
+            const clip& c = *v.c;
+            for (int f = 0; f < frames; f++) {
+                auto i = size_t(v.pos);
+                if (i + 1 >= c.frames) {
+                    v.c = nullptr;
+                    active.fetch_sub(1, std::memory_order_release);
+                    break;
+                }
+                float t = float(v.pos - double(i));
+                for (int ch = 0; ch < out_channels; ch++) {
+                    int src = std::min(ch, c.channels - 1);
+                    float s = sample(c, i, src) * (1 - t) + sample(c, i + 1, src) * t;
+                    int16_t& o = out[f * out_channels + ch];
+                    o = int16_t(std::clamp(o + int(s * v.gain * 32767.0f), -32768, 32767));
+                }
+                v.pos += v.step;
+            }
+        }
+    }
+
+    size_t mapped_bytes() const
+    {
+        size_t total = 0;
+        for (const clip& c : clips) {
+            total += c.map_size;
+        }
+        return total;
+    }
+
+    // How many bytes of the mapped clips are in memory now
+    size_t resident_bytes() const
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t total = 0;
+        std::vector<unsigned char> pages;
+        for (const clip& c : clips) {
+            pages.resize((c.map_size + size_t(page) - 1) / size_t(page));
+            if (mincore(c.map, c.map_size, pages.data()) == 0) {
+                auto in_memory = [](unsigned char p) { return (p & 1) != 0; };
+                total += size_t(std::count_if(pages.begin(), pages.end(), in_memory))
+                    * size_t(page);
+            }
+        }
+        return total;
+    }
+};
+
+// Wave files
+sample_bank bank;
 
 // Music file
 Mix_Music* music = nullptr;
 
 // Interrupted?
-bool interrupted = false;
+volatile sig_atomic_t interrupted = false;
 
 // Signal handler
 void my_handler(int s) { interrupted = true; }
 
+// The post-mix callback, which adds the voices of the sample bank to what SDL_mixer has mixed
+void mix_bank(void* udata, Uint8* stream, int len)
+{
+    auto* b = static_cast<sample_bank*>(udata);
+    int channels = b->get_device_channels();
+    b->mix(reinterpret_cast<int16_t*>(stream), len / (2 * channels), channels);
+}
+
+// The resident memory of the whole process, from /proc/self/statm
+size_t process_resident_bytes()
+{
+    unsigned long size = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+void report_memory(const char* when)
+{
+    printf("%s: process resident %.1f MiB, sample bank resident %.1f of %.1f MiB\n", when,
+        process_resident_bytes() / 1048576.0, bank.resident_bytes() / 1048576.0,
+        bank.mapped_bytes() / 1048576.0);
+}
+
 int main(int argc, char* argv[])
 {
+    int rate = 22050;
+    int buffer = 4096;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rate = std::max(8000, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            buffer = std::clamp(atoi(argv[++i]), 64, 65536);
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty()) {
+        paths.push_back(WAV_PATH);
+    }
 
     // Initialize SDL2
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
@@ -43,16 +358,38 @@ int main(int argc, char* argv[])
     // Set up a signal handler for ctrl-c
     sigaction(SIGINT, &sigIntHandler, nullptr);
 
-    // Initialize SDL_mixer
-    if (Mix_OpenAudio(22050, MIX_DEFAULT_FORMAT, 2, 4096) == -1) {
+    // Initialize SDL_mixer. The format is kept, but the device may pick
+    // another rate or number of channels.
+    if (Mix_OpenAudio(rate, AUDIO_S16SYS, 2, buffer) == -1) {
         return -1;
     }
+    Uint16 format;
+    int channels = 2;
+    Mix_QuerySpec(&rate, &format, &channels);
+    printf("Audio at %d Hz, %d channels, with a buffer of %d frames (%.1f ms)\n", rate, channels,
+        buffer, 1000.0 * buffer / rate);
 
-    // Load the sound effect sample
-    wave = Mix_LoadWAV(WAV_PATH);
-    if (wave == nullptr) {
+    // Map the sound effect samples
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> clips;
+    for (const std::string& path : paths) {
+        int n = bank.load(path);
+        if (n < 0) {
+            std::cerr << "Could not load " << path << " as 8 or 16 bit PCM WAV" << std::endl;
+            continue;
+        }
+        clips.push_back(n);
+    }
+    if (clips.empty()) {
         return -1;
     }
+    auto load_time = std::chrono::steady_clock::now() - start;
+    printf("Loaded %zu samples in %.3f ms\n", clips.size(),
+        std::chrono::duration<double, std::milli>(load_time).count());
+    report_memory("After loading");
+    bank.set_device_rate(rate);
+    bank.set_device_channels(channels);
+    Mix_SetPostMix(mix_bank, &bank);
 
     // Load the music sample
     music = Mix_LoadMUS(MUS_PATH);
@@ -60,8 +397,9 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    if (Mix_PlayChannel(-1, wave, 0) == -1) {
-        return -1;
+    // Play all the samples at once
+    for (int n : clips) {
+        bank.play(n, 1.0f / float(std::min<size_t>(clips.size(), 4)));
     }
 
     if (Mix_PlayMusic(music, -1) == -1) {
@@ -69,15 +407,25 @@ int main(int argc, char* argv[])
     }
 
     // Play while not interrupted by ctrl-c
+    bool reported = false;
     while (Mix_PlayingMusic()) {
         if (interrupted) {
             std::cout << std::endl;
             break;
         }
+        int playing = bank.playing();
+        if (playing == 0 && !reported) {
+            report_memory("After playing the samples");
+            reported = true;
+        }
+        SDL_Delay(50);
+    }
+    if (!reported) {
+        report_memory("At exit");
     }
 
     // Free the memory
-    Mix_FreeChunk(wave);
+    Mix_SetPostMix(nullptr, nullptr);
     Mix_FreeMusic(music);
 
     // Quit SDL_Mixer
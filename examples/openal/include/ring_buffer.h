@@ -0,0 +1,94 @@
+#pragma once
+
+// A ring buffer of samples for audio, with one producer thread that renders
+// ahead and one consumer, the audio callback. Neither side locks, allocates
+// or waits, so the callback always returns in time, and if the producer has
+// fallen behind, the callback plays silence and counts an underrun instead.
+//
+// The same file is used by the rtaudio and openal examples.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+template <typename T> class spsc_ring {
+    // The positions only grow, and are masked when indexing, so that a full
+    // ring can be told apart from an empty one. Each is written by one side
+    // only, and lives on its own cache line, together with that side's copy
+    // of the other position, which is only reloaded when it looks too small.
+    struct alignas(64) side {
+        std::atomic<size_t> pos { 0 };
+        size_t other = 0;
+    };
+
+    const size_t capacity;
+    const size_t mask;
+    std::unique_ptr<T[]> items;
+    side reader; // pos is the next item to read
+    side writer; // pos is the next slot to write
+
+    static size_t round_up(size_t n)
+    {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+public:
+    // The capacity is rounded up to a power of two. All of the memory is
+    // allocated here, before the audio starts.
+    explicit spsc_ring(size_t capacity_)
+        : capacity(round_up(capacity_))
+        , mask(capacity - 1)
+        , items(new T[capacity]())
+    {
+    }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    size_t size() const { return capacity; }
+
+    // How many items the producer can write now
+    size_t write_available()
+    {
+        size_t w = writer.pos.load(std::memory_order_relaxed);
+        writer.other = reader.pos.load(std::memory_order_acquire);
+        return capacity - (w - writer.other);
+    }
+
+    // Copies up to n items from src into the ring, and returns how many.
+    // Only called by the producer.
+    size_t write(const T* src, size_t n)
+    {
+        size_t w = writer.pos.load(std::memory_order_relaxed);
+        if (capacity - (w - writer.other) < n) {
+            writer.other = reader.pos.load(std::memory_order_acquire);
+        }
+        n = std::min(n, capacity - (w - writer.other));
+        size_t first = std::min(n, capacity - (w & mask));
+        std::copy(src, src + first, items.get() + (w & mask));
+        std::copy(src + first, src + n, items.get());
+        writer.pos.store(w + n, std::memory_order_release);
+        return n;
+    }
+
+    // Copies up to n items from the ring into dst, and returns how many.
+    // Only called by the consumer.
+    size_t read(T* dst, size_t n)
+    {
+        size_t r = reader.pos.load(std::memory_order_relaxed);
+        if (reader.other - r < n) {
+            reader.other = writer.pos.load(std::memory_order_acquire);
+        }
+        n = std::min(n, reader.other - r);
+        size_t first = std::min(n, capacity - (r & mask));
+        std::copy(items.get() + (r & mask), items.get() + (r & mask) + first, dst);
+        std::copy(items.get(), items.get() + (n - first), dst + first);
+        reader.pos.store(r + n, std::memory_order_release);
+        return n;
+    }
+};
@@ -1,11 +1,25 @@
 // Based on: https://stackoverflow.com/a/5469561/131264
-
+//
+//     openal [buffer frames] [buffers] [ring frames]
+//
+// A sine wave is streamed through a queue of OpenAL buffers (4 of 1024
+// frames by default), instead of being rendered into one long buffer up
+// front. A producer thread renders ahead into a lock-free ring buffer (4096
+// frames by default), and the thread that refills the processed buffers
+// only copies from it, so it never waits for the rendering. The underruns
+// are counted, and printed at exit, so that the sizes can be tuned down.
+
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <thread>
+#include <vector>
 
 #ifdef __APPLE__
 #include <OpenAL.h>
@@ -60,44 +74,112 @@ void exit_al()
     alcCloseDevice(dev);
 }
 
-int main()
+// Renders a sine wave into the ring, as much as fits, and then sleeps for
+// a fraction of the time the ring lasts
+void produce(
+    spsc_ring<short>& ring, std::atomic<bool>& running, float freq, unsigned int sample_rate)
 {
+    constexpr size_t block_frames = 64;
+    short block[block_frames];
+    size_t i = 0;
+    const float step = (2.f * float(M_PI) * freq) / sample_rate;
+    auto pause = std::chrono::microseconds(
+        std::max<long long>(100, 250000LL * (long long)ring.size() / sample_rate));
+    while (running) {
+        while (ring.write_available() >= block_frames) {
+            for (size_t j = 0; j < block_frames; ++j, ++i) {
+                // i wraps every second, which is a whole number of periods at 440 Hz
+                block[j] = 32760 * sin(step * (i % sample_rate));
+            }
+            ring.write(block, block_frames);
+        }
+        std::this_thread::sleep_for(pause);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t buffer_frames = argc > 1 ? (size_t)std::max(64, atoi(argv[1])) : 1024;
+    int buffer_count = argc > 2 ? std::max(2, atoi(argv[2])) : 4;
+    size_t ring_frames = argc > 3 ? (size_t)std::max(64, atoi(argv[3])) : 4096;
+
     /* initialize OpenAL */
     init_al();
 
-    /* Create buffer to store samples */
-    ALuint buf;
-    alGenBuffers(1, &buf);
+    /* Create the buffers that are queued on the source */
+    std::vector<ALuint> bufs(buffer_count);
+    alGenBuffers(buffer_count, bufs.data());
     al_check_error();
 
-    /* Fill buffer with Sine-Wave */
+    /* Start rendering the sine wave ahead */
     auto freq = 440.f;
     auto seconds = 4;
     unsigned int sample_rate = 22050;
-    size_t buf_size = seconds * sample_rate;
-
-    auto samples = new short[buf_size];
-    for (size_t i = 0; i < buf_size; ++i) {
-        samples[i] = 32760 * sin((2.f * float(M_PI) * freq) / sample_rate * i);
+    spsc_ring<short> ring(std::max(ring_frames, buffer_frames));
+    std::atomic<bool> running { true };
+    std::thread producer(produce, std::ref(ring), std::ref(running), freq, sample_rate);
+    while (ring.write_available() >= 64) {
+        std::this_thread::yield();
     }
 
-    /* Download buffer to OpenAL */
-    alBufferData(buf, AL_FORMAT_MONO16, samples, buf_size, sample_rate);
-    al_check_error();
-
-    /* Set-up sound source and play buffer */
+    /* Fills a buffer from the ring, with silence for what is missing */
+    std::vector<short> samples(buffer_frames);
+    unsigned long ring_underruns = 0, source_underruns = 0;
+    auto fill = [&](ALuint buf) {
+        size_t got = ring.read(samples.data(), buffer_frames);
+        if (got < buffer_frames) {
+            std::fill(samples.begin() + got, samples.end(), 0);
+            ring_underruns++;
+        }
+        alBufferData(
+            buf, AL_FORMAT_MONO16, samples.data(), buffer_frames * sizeof(short), sample_rate);
+    };
+
+    /* Set-up sound source and play the queued buffers */
     ALuint src = 0;
     alGenSources(1, &src);
-    alSourcei(src, AL_BUFFER, buf);
+    for (ALuint buf : bufs) {
+        fill(buf);
+    }
+    alSourceQueueBuffers(src, buffer_count, bufs.data());
     alSourcePlay(src);
+    al_check_error();
 
-    /* While sound is playing, sleep */
+    /* Refill the buffers as they are played, checking 4 times per buffer */
+    auto poll = std::chrono::microseconds(250000LL * (long long)buffer_frames / sample_rate);
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        ALint processed = 0;
+        alGetSourcei(src, AL_BUFFERS_PROCESSED, &processed);
+        while (processed-- > 0) {
+            ALuint buf;
+            alSourceUnqueueBuffers(src, 1, &buf);
+            fill(buf);
+            alSourceQueueBuffers(src, 1, &buf);
+        }
+        /* The source stops if it played all of the queue before it was refilled */
+        ALint state = AL_PLAYING;
+        alGetSourcei(src, AL_SOURCE_STATE, &state);
+        if (state != AL_PLAYING) {
+            source_underruns++;
+            alSourcePlay(src);
+        }
+        std::this_thread::sleep_for(poll);
+    }
     al_check_error();
-    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    running = false;
+    producer.join();
 
     /* Deallocate OpenAL */
+    alSourceStop(src);
+    alDeleteSources(1, &src);
+    alDeleteBuffers(buffer_count, bufs.data());
     exit_al();
     al_check_error();
 
+    std::cout << "Underruns: " << ring_underruns << " in the ring, " << source_underruns
+              << " of the source queue" << std::endl;
+
     return 0;
 }
@@ -1,33 +1,87 @@
 // Example from the RtAudio documentation (updated for RtAudio 6)
+//
+//     rtaudio [buffer frames] [ring frames]
+//
+// The sawtooth is rendered ahead by a producer thread, into a lock-free ring
+// buffer (1024 frames by default) that the audio callback reads from, so that
+// the callback never computes, allocates or locks anything. The callback
+// buffer is 256 frames by default. The underruns are counted, and printed at
+// exit, so that both sizes can be tuned down until underruns appear.
+
+#include "ring_buffer.h"
 
 #include <rtaudio/RtAudio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <thread>
 
-// Two-channel sawtooth wave generator.
-int saw(void* outputBuffer, void* /*inputBuffer*/, unsigned int nBufferFrames, double /*streamTime*/,
-    RtAudioStreamStatus status, void* userData)
+constexpr unsigned int channels = 2;
+
+struct stream_state {
+    spsc_ring<double> ring; // interleaved frames
+    std::atomic<unsigned long> ring_underruns { 0 }; // the producer was behind
+    std::atomic<unsigned long> device_underruns { 0 }; // reported by RtAudio
+    std::atomic<bool> running { true };
+
+    explicit stream_state(std::size_t frames)
+        : ring(frames * channels)
+    {
+    }
+};
+
+// Two-channel sawtooth wave generator, which renders as much as fits in the
+// ring, and then sleeps for a fraction of the time the ring lasts
+void produce(stream_state& state, unsigned int sampleRate)
 {
-    unsigned int i, j;
-    double* buffer = (double*)outputBuffer;
-    double* lastValues = (double*)userData;
-    if (status)
-        std::cout << "Stream underflow detected!" << std::endl;
-
-    for (i = 0; i < nBufferFrames; i++) {
-        for (j = 0; j < 2; j++) {
-            *buffer++ = lastValues[j];
-            lastValues[j] += 0.005 * (j + 1 + (j * 0.1));
-            if (lastValues[j] >= 1.0)
-                lastValues[j] -= 2.0;
+    constexpr std::size_t block_frames = 64;
+    double block[block_frames * channels];
+    double lastValues[channels] = {};
+    auto pause = std::chrono::microseconds(
+        std::max<long long>(100, 250000LL * (long long)(state.ring.size() / channels) / sampleRate));
+    while (state.running) {
+        while (state.ring.write_available() >= block_frames * channels) {
+            double* buffer = block;
+            for (std::size_t i = 0; i < block_frames; i++) {
+                for (unsigned int j = 0; j < channels; j++) {
+                    *buffer++ = lastValues[j];
+                    lastValues[j] += 0.005 * (j + 1 + (j * 0.1));
+                    if (lastValues[j] >= 1.0)
+                        lastValues[j] -= 2.0;
+                }
+            }
+            state.ring.write(block, block_frames * channels);
         }
+        std::this_thread::sleep_for(pause);
     }
+}
 
+// Copies what the producer has rendered to the output, and fills the rest
+// with silence if it was not enough
+int play(void* outputBuffer, void* /*inputBuffer*/, unsigned int nBufferFrames, double /*streamTime*/,
+    RtAudioStreamStatus status, void* userData)
+{
+    double* buffer = (double*)outputBuffer;
+    auto* state = (stream_state*)userData;
+    if (status & RTAUDIO_OUTPUT_UNDERFLOW)
+        state->device_underruns.fetch_add(1, std::memory_order_relaxed);
+
+    std::size_t wanted = std::size_t(nBufferFrames) * channels;
+    std::size_t got = state->ring.read(buffer, wanted);
+    if (got < wanted) {
+        std::fill(buffer + got, buffer + wanted, 0.0);
+        state->ring_underruns.fetch_add(1, std::memory_order_relaxed);
+    }
     return 0;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    unsigned int bufferFrames = argc > 1 ? (unsigned int)std::max(16, atoi(argv[1])) : 256;
+    std::size_t ringFrames = argc > 2 ? (std::size_t)std::max(64, atoi(argv[2])) : 1024;
+
     RtAudio dac;
     if (dac.getDeviceCount() < 1) {
         std::cout << "\nNo audio devices found!\n";
@@ -35,28 +89,43 @@ int main()
     }
     RtAudio::StreamParameters parameters;
     parameters.deviceId = dac.getDefaultOutputDevice();
-    parameters.nChannels = 2;
+    parameters.nChannels = channels;
     parameters.firstChannel = 0;
     unsigned int sampleRate = 44100;
-    unsigned int bufferFrames = 256;
-    double data[2] = {};
 
-    if (dac.openStream(&parameters, nullptr, RTAUDIO_FLOAT64, sampleRate, &bufferFrames, &saw, (void*)&data) != RTAUDIO_NO_ERROR) {
+    stream_state state(std::max<std::size_t>(ringFrames, bufferFrames));
+    std::thread producer(produce, std::ref(state), sampleRate);
+    // Let the producer fill the ring before the first callback
+    while (state.ring.write_available() >= 64 * channels)
+        std::this_thread::yield();
+
+    auto stop = [&] {
+        state.running = false;
+        producer.join();
+    };
+    if (dac.openStream(&parameters, nullptr, RTAUDIO_FLOAT64, sampleRate, &bufferFrames, &play, (void*)&state) != RTAUDIO_NO_ERROR) {
         std::cerr << "Failed to open stream\n";
+        stop();
         return 1;
     }
     if (dac.startStream() != RTAUDIO_NO_ERROR) {
         std::cerr << "Failed to start stream\n";
+        stop();
         return 1;
     }
 
     char input;
-    std::cout << "\nPlaying ... press <enter> to quit.\n";
+    std::cout << "\nPlaying with " << bufferFrames << " frames per callback and " << state.ring.size() / channels
+              << " frames in the ring ... press <enter> to quit.\n";
     std::cin.get(input);
 
     if (dac.isStreamRunning())
         dac.stopStream();
     if (dac.isStreamOpen())
         dac.closeStream();
+    stop();
+
+    std::cout << "Underruns: " << state.ring_underruns << " in the ring, " << state.device_underruns
+              << " reported by the device\n";
     return 0;
 }
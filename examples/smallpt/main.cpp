@@ -30,9 +30,20 @@
  */
 
 #include "png.h"
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 struct Vec { // Usage: time ./smallpt 5000 && xv image.ppm
     double x, y, z; // position, also color (r,g,b)
@@ -53,6 +64,7 @@ struct Vec { // Usage: time ./smallpt 5000 && xv image.ppm
 
 struct Ray {
     Vec o, d;
+    Ray() = default;
     Ray(Vec o_, Vec d_)
         : o(o_)
         , d(d_)
@@ -100,6 +112,26 @@ Sphere spheres[] = {
     Sphere(600, Vec(50, 681.6 - .27, 81.6), Vec(12, 12, 12), Vec(), DIFF) // Lite
 };
 
+// Rng is a counter-based random number generator. Every number is a hash of
+// the key, which is given by the subpixel and the sample, and of how many
+// numbers were drawn before it, so a sample gets the same numbers no matter
+// which thread traces it, and the image does not depend on the thread count.
+struct Rng {
+    uint64_t key, counter = 0;
+    Rng(uint64_t subpixel, uint64_t sample)
+        : key(mix(mix(subpixel) + sample))
+    {
+    }
+    static uint64_t mix(uint64_t z)
+    { // the SplitMix64 finalizer
+        z += 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+    double operator()() { return (mix(key ^ ++counter) >> 11) * 0x1.0p-53; } // [0, 1)
+};
+
 inline double clamp(double x) { return x < 0 ? 0 : x > 1 ? 1 : x; }
 
 inline int toInt(double x) { return int(pow(clamp(x), 1 / 2.2) * 255 + .5); }
@@ -115,7 +147,7 @@ inline bool intersect(const Ray& r, double& t, int& id)
     return t < inf;
 }
 
-Vec radiance(const Ray& r, int depth, unsigned short* Xi)
+Vec radiance(const Ray& r, int depth, Rng& rng)
 {
     double t; // distance to intersection
     int id = 0; // id of intersected object
@@ -125,65 +157,353 @@ Vec radiance(const Ray& r, int depth, unsigned short* Xi)
     Vec x = r.o + r.d * t, n = (x - obj.p).norm(), nl = n.dot(r.d) < 0 ? n : n * -1, f = obj.c;
     double p = f.x > f.y && f.x > f.z ? f.x : f.y > f.z ? f.y : f.z; // max refl
     if (++depth > 5)
-        if (erand48(Xi) < p) {
+        if (rng() < p) {
             f = f * (1 / p);
         } else {
             return obj.e; // R.R.
         }
     if (obj.refl == DIFF) { // Ideal DIFFUSE reflection
-        double r1 = 2 * M_PI * erand48(Xi), r2 = erand48(Xi), r2s = sqrt(r2);
+        double r1 = 2 * M_PI * rng(), r2 = rng(), r2s = sqrt(r2);
         Vec w = nl, u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)) % w).norm(), v = w % u;
         Vec d = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).norm();
-        return obj.e + f.mult(radiance(Ray(x, d), depth, Xi));
+        return obj.e + f.mult(radiance(Ray(x, d), depth, rng));
     } else if (obj.refl == SPEC) { // Ideal SPECULAR reflection
-        return obj.e + f.mult(radiance(Ray(x, r.d - n * 2 * n.dot(r.d)), depth, Xi));
+        return obj.e + f.mult(radiance(Ray(x, r.d - n * 2 * n.dot(r.d)), depth, rng));
     }
     Ray reflRay(x, r.d - n * 2 * n.dot(r.d)); // Ideal dielectric REFRACTION
     bool into = n.dot(nl) > 0; // Ray from outside going in?
     double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = r.d.dot(nl), cos2t;
     if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) // Total internal reflection
-        return obj.e + f.mult(radiance(reflRay, depth, Xi));
+        return obj.e + f.mult(radiance(reflRay, depth, rng));
     Vec tdir = (r.d * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
     double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : tdir.dot(n));
     double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = .25 + .5 * Re, RP = Re / P,
            TP = Tr / (1 - P);
     return obj.e
         + f.mult(depth > 2
-                ? (erand48(Xi) < P ? // Russian roulette
-                          radiance(reflRay, depth, Xi) * RP
-                                   : radiance(Ray(x, tdir), depth, Xi) * TP)
-                : radiance(reflRay, depth, Xi) * Re + radiance(Ray(x, tdir), depth, Xi) * Tr);
+                ? (rng() < P ? // Russian roulette
+                          radiance(reflRay, depth, rng) * RP
+                                   : radiance(Ray(x, tdir), depth, rng) * TP)
+                : radiance(reflRay, depth, rng) * Re + radiance(Ray(x, tdir), depth, rng) * Tr);
 }
 
-int main(int argc, char* argv[])
+// Packet tracing traces W rays at a time, and intersects all of them with
+// one sphere at a time, with the spheres in a structure of arrays. The rays
+// are held in GCC/Clang vector types, which are lowered to AVX-512, AVX2,
+// SSE2 or NEON instructions, depending on what the target has.
+
+#if defined(__AVX512F__)
+constexpr int W = 8;
+#elif defined(__AVX__)
+constexpr int W = 4;
+#else
+constexpr int W = 2; // SSE2 or NEON
+#endif
+
+typedef double vdouble __attribute__((vector_size(W * sizeof(double))));
+typedef long long vmask __attribute__((vector_size(W * sizeof(long long)))); // -1 or 0 per lane
+
+constexpr int numSpheres = sizeof(spheres) / sizeof(Sphere);
+
+struct SphereArrays {
+    double px[numSpheres], py[numSpheres], pz[numSpheres], rad2[numSpheres];
+};
+
+SphereArrays sphereArrays()
+{
+    SphereArrays a;
+    for (int i = 0; i < numSpheres; i++) {
+        a.px[i] = spheres[i].p.x;
+        a.py[i] = spheres[i].p.y;
+        a.pz[i] = spheres[i].p.z;
+        a.rad2[i] = spheres[i].rad * spheres[i].rad;
+    }
+    return a;
+}
+
+const SphereArrays sphereSoA = sphereArrays();
+
+inline vdouble select(vmask m, vdouble a, vdouble b)
 {
-    int w = 320, h = 200, samps = argc == 2 ? atoi(argv[1]) / 4 : 75; // # samples
-    Ray cam(Vec(50, 52, 295.6), Vec(0, -0.042612, -1).norm()); // cam pos, dir
-    Vec cx = Vec(w * .5135 / h), cy = (cx % cam.d).norm() * .5135, r, *c = new Vec[w * h];
-
-#pragma omp parallel for schedule(dynamic, 1) private(r) // OpenMP
-    for (int y = 0; y < h; y++) { // Loop over image rows
-        fprintf(stderr, "\rRendering (%d spp) %5.2f%%", samps * 4, 100. * y / (h - 1));
-        for (unsigned short x = 0, Xi[3] = { 0, 0, (short unsigned int)(y * y * y) }; x < w;
-            x++) // Loop cols
-            for (int sy = 0, i = (h - y - 1) * w + x; sy < 2; sy++) // 2x2 subpixel rows
-                for (int sx = 0; sx < 2; sx++, r = Vec()) { // 2x2 subpixel cols
-                    for (int s = 0; s < samps; s++) {
-                        double r1 = 2 * erand48(Xi), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-                        double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-                        Vec d = cx * (((sx + .5 + dx) / 2 + x) / w - .5)
-                            + cy * (((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
-                        r = r + radiance(Ray(cam.o + d * 140, d.norm()), 0, Xi) * (1. / samps);
-                    } // Camera rays are pushed ^^^^^ forward to start in interior
-                    c[i] = c[i] + Vec(clamp(r.x), clamp(r.y), clamp(r.z)) * .25;
+    return (vdouble)(((vmask)a & m) | ((vmask)b & ~m));
+}
+
+inline vdouble vsqrt(vdouble v)
+{
+    for (int l = 0; l < W; l++)
+        v[l] = sqrt(v[l]);
+    return v;
+}
+
+struct RayPacket {
+    vdouble ox, oy, oz, dx, dy, dz;
+};
+
+// Finds the nearest sphere that each ray of the packet hits, like
+// intersect() does for one ray. id is -1 for the rays that hit nothing.
+inline void intersectPacket(const RayPacket& r, vdouble& t, vmask& id)
+{
+    const double eps = 1e-4;
+    t = vdouble {} + 1e20;
+    id = vmask {} - 1;
+    for (int i = 0; i < numSpheres; i++) {
+        vdouble opx = sphereSoA.px[i] - r.ox, opy = sphereSoA.py[i] - r.oy, opz = sphereSoA.pz[i] - r.oz;
+        vdouble b = opx * r.dx + opy * r.dy + opz * r.dz;
+        vdouble det = b * b - (opx * opx + opy * opy + opz * opz) + sphereSoA.rad2[i];
+        vmask hit = (vmask)(det >= 0);
+        det = vsqrt(select(hit, det, vdouble {}));
+        vdouble t1 = b - det, t2 = b + det;
+        vdouble d = select((vmask)(t1 > eps), t1, select((vmask)(t2 > eps), t2, vdouble {}));
+        hit &= (vmask)(d > 0) & (vmask)(d < t);
+        t = select(hit, d, t);
+        id = (id & ~hit) | (hit & (long long)i);
+    }
+}
+
+// Traces the first n rays of a packet, and returns the radiance along each
+// of them in out. The recursion of radiance() is an iterative bounce loop
+// here, so that the rays stay together in a packet until they are absorbed.
+// Refractions always pick one of the two rays by Russian roulette, and do
+// not split in two for the first bounces, which gives the same expected color.
+void tracePacket(Ray* rays, int n, Rng& rng, Vec* out)
+{
+    Vec weight[W];
+    int depth[W];
+    bool alive[W];
+    for (int l = 0; l < W; l++) {
+        out[l] = Vec();
+        weight[l] = Vec(1, 1, 1);
+        depth[l] = 0;
+        alive[l] = l < n;
+    }
+    for (bool any = n > 0; any;) {
+        RayPacket p {};
+        for (int l = 0; l < W; l++) {
+            const Ray& r = rays[alive[l] ? l : 0];
+            p.ox[l] = r.o.x;
+            p.oy[l] = r.o.y;
+            p.oz[l] = r.o.z;
+            p.dx[l] = r.d.x;
+            p.dy[l] = r.d.y;
+            p.dz[l] = r.d.z;
+        }
+        vdouble t;
+        vmask id;
+        intersectPacket(p, t, id);
+        any = false;
+        for (int l = 0; l < W; l++) {
+            if (!alive[l] || id[l] < 0) {
+                alive[l] = false; // if miss, add black
+                continue;
+            }
+            Ray& r = rays[l];
+            const Sphere& obj = spheres[id[l]];
+            Vec x = r.o + r.d * t[l], nrm = (x - obj.p).norm(), nl = nrm.dot(r.d) < 0 ? nrm : nrm * -1, f = obj.c;
+            double maxRefl = f.x > f.y && f.x > f.z ? f.x : f.y > f.z ? f.y : f.z;
+            out[l] = out[l] + weight[l].mult(obj.e);
+            if (++depth[l] > 5) {
+                if (rng() < maxRefl) {
+                    f = f * (1 / maxRefl);
+                } else {
+                    alive[l] = false; // R.R.
+                    continue;
                 }
+            }
+            weight[l] = weight[l].mult(f);
+            any = true;
+            Vec refl = r.d - nrm * 2 * nrm.dot(r.d);
+            if (obj.refl == DIFF) { // Ideal DIFFUSE reflection
+                double r1 = 2 * M_PI * rng(), r2 = rng(), r2s = sqrt(r2);
+                Vec w = nl, u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)) % w).norm(), v = w % u;
+                r = Ray(x, (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).norm());
+                continue;
+            }
+            if (obj.refl == SPEC) { // Ideal SPECULAR reflection
+                r = Ray(x, refl);
+                continue;
+            }
+            bool into = nrm.dot(nl) > 0; // Ideal dielectric REFRACTION
+            double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = r.d.dot(nl), cos2t;
+            if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) { // Total internal reflection
+                r = Ray(x, refl);
+                continue;
+            }
+            Vec tdir = (r.d * nnt - nrm * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).norm();
+            double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : tdir.dot(nrm));
+            double Re = R0 + (1 - R0) * c * c * c * c * c, P = .25 + .5 * Re;
+            if (rng() < P) { // Russian roulette
+                weight[l] = weight[l] * (Re / P);
+                r = Ray(x, refl);
+            } else {
+                weight[l] = weight[l] * ((1 - Re) / (1 - P));
+                r = Ray(x, tdir);
+            }
+        }
     }
+}
 
-    // Prepare and write to PNG
-    const char* fn = "output.png";
+// The image is rendered in tiles, in passes of passSamps samples per
+// subpixel, so that an image with fewer samples can be written while the
+// rest are traced. A job is one pass over one tile.
+
+constexpr int tileSize = 16;
+constexpr int passSamps = 8; // a whole number of packets
+constexpr auto flushInterval = std::chrono::seconds(2);
+
+struct Job {
+    int tile, pass;
+};
+
+struct Tile {
+    int x0, y0, x1, y1;
+    std::mutex mutex;
+    int passes = 0; // the passes that are added to sum
+    std::map<int, std::vector<Vec>> pending; // passes that finished before the one before them
+};
 
-    printf("\nSaving %s\n", fn);
-    FILE* fp = fopen(fn, "wb");
+// WorkQueues holds a deque of jobs per worker. A worker takes jobs from the
+// front of its own deque, and when that is empty, steals from the back of
+// the others, so that no worker is idle while there are jobs left.
+class WorkQueues {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    std::vector<Queue> queues;
+
+public:
+    explicit WorkQueues(int workers)
+        : queues(workers)
+    {
+    }
+    void push(int worker, Job job) { queues[worker].jobs.push_back(job); } // before the workers start
+    bool pop(int worker, Job& job)
+    {
+        for (int k = 0; k < int(queues.size()); k++) {
+            Queue& q = queues[(worker + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                job = k == 0 ? q.jobs.front() : q.jobs.back();
+                k == 0 ? q.jobs.pop_front() : q.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct Renderer {
+    int w, h, samps;
+    bool packet;
+    Ray cam;
+    Vec cx, cy;
+    std::vector<Tile> tiles;
+    std::vector<Vec> sum; // the radiance of every sample, per subpixel
+
+    Renderer(int w_, int h_, int samps_, bool packet_)
+        : w(w_)
+        , h(h_)
+        , samps(samps_)
+        , packet(packet_)
+        , cam(Vec(50, 52, 295.6), Vec(0, -0.042612, -1).norm()) // cam pos, dir
+        , tiles(((w_ + tileSize - 1) / tileSize) * ((h_ + tileSize - 1) / tileSize))
+        , sum(w_ * h_ * 4)
+    {
+        cx = Vec(w * .5135 / h);
+        cy = (cx % cam.d).norm() * .5135;
+        for (int i = 0, y = 0; y < h; y += tileSize)
+            for (int x = 0; x < w; x += tileSize, i++) {
+                tiles[i].x0 = x;
+                tiles[i].y0 = y;
+                tiles[i].x1 = x + tileSize < w ? x + tileSize : w;
+                tiles[i].y1 = y + tileSize < h ? y + tileSize : h;
+            }
+    }
+
+    int passes() const { return (samps + passSamps - 1) / passSamps; }
+
+    // Traces one pass over one tile, and adds it to sum. The passes of a
+    // tile are added in order, so that the sums do not depend on which of
+    // them finished first.
+    void render(Job job)
+    {
+        Tile& tile = tiles[job.tile];
+        int s0 = job.pass * passSamps, s1 = s0 + passSamps < samps ? s0 + passSamps : samps;
+        std::vector<Vec> pass;
+        pass.reserve((tile.x1 - tile.x0) * (tile.y1 - tile.y0) * 4);
+        Ray rays[W];
+        Vec out[W];
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+                for (int sy = 0; sy < 2; sy++) // 2x2 subpixel rows
+                    for (int sx = 0; sx < 2; sx++) { // 2x2 subpixel cols
+                        Vec r;
+                        for (int s = s0; s < s1;) {
+                            int n = packet ? (s1 - s < W ? s1 - s : W) : 1;
+                            Rng rng(((uint64_t(y) * w + x) * 2 + sy) * 2 + sx, s);
+                            for (int l = 0; l < n; l++) {
+                                double r1 = 2 * rng(), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+                                double r2 = 2 * rng(), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+                                Vec d = cx * (((sx + .5 + dx) / 2 + x) / w - .5)
+                                    + cy * (((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
+                                rays[l] = Ray(cam.o + d * 140, d.norm()); // Camera rays are pushed forward to start in interior
+                            }
+                            if (packet) {
+                                tracePacket(rays, n, rng, out);
+                            } else {
+                                out[0] = radiance(rays[0], 0, rng);
+                            }
+                            for (int l = 0; l < n; l++) {
+                                r = r + out[l];
+                            }
+                            s += n;
+                        }
+                        pass.push_back(r);
+                    }
+
+        std::lock_guard<std::mutex> lock(tile.mutex);
+        tile.pending[job.pass] = std::move(pass);
+        for (auto it = tile.pending.begin(); it != tile.pending.end() && it->first == tile.passes;
+             it = tile.pending.erase(it), tile.passes++) {
+            const Vec* v = it->second.data();
+            for (int y = tile.y0; y < tile.y1; y++)
+                for (int x = tile.x0; x < tile.x1; x++)
+                    for (int k = 0; k < 4; k++) {
+                        Vec& total = sum[(y * w + x) * 4 + k];
+                        total = total + *v++;
+                    }
+        }
+    }
+
+    // Returns the image with the samples that are traced so far, which
+    // differs between the tiles while they are being rendered.
+    std::vector<Vec> image()
+    {
+        std::vector<Vec> c(w * h);
+        for (Tile& tile : tiles) {
+            std::lock_guard<std::mutex> lock(tile.mutex);
+            int n = tile.passes * passSamps < samps ? tile.passes * passSamps : samps;
+            if (n == 0) {
+                continue;
+            }
+            for (int y = tile.y0; y < tile.y1; y++)
+                for (int x = tile.x0; x < tile.x1; x++)
+                    for (int k = 0; k < 4; k++) {
+                        Vec r = sum[(y * w + x) * 4 + k] * (1. / n);
+                        Vec& p = c[(h - y - 1) * w + x];
+                        p = p + Vec(clamp(r.x), clamp(r.y), clamp(r.z)) * .25;
+                    }
+        }
+        return c;
+    }
+};
+
+// Writes the image to a temporary file first, and then renames it, so that
+// an image viewer that reloads it never gets half an image.
+void writePNG(const char* fn, int w, int h, const std::vector<Vec>& c)
+{
+    std::string tmp = std::string(fn) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
     if (!fp) {
         abort();
     }
@@ -209,8 +529,8 @@ int main(int argc, char* argv[])
         PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
     png_write_info(png, info);
 
-    // Allocate memory for one row (3 bytes per pixel - RGB)
-    png_bytep row = (png_bytep)malloc(w * 3 * sizeof(png_byte));
+    // One row, 3 bytes per pixel - RGB
+    std::vector<png_byte> row(w * 3);
 
     // Write the image data to the png structure
     for (int y = 0; y < h; y++) {
@@ -219,17 +539,84 @@ int main(int argc, char* argv[])
             row[x * 3 + 1] = toInt(c[y * w + x].y);
             row[x * 3 + 2] = toInt(c[y * w + x].z);
         }
-        png_write_row(png, row);
+        png_write_row(png, row.data());
     }
 
     // End write
     png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    if (rename(tmp.c_str(), fn) != 0) {
+        abort();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    // Usage: smallpt [samples] [--packet] [--threads n], where --packet uses
+    // packet tracing, so that the scalar and the packet path can be timed
+    // against each other. The image is the same for any number of threads.
+    bool packet = false;
+    int w = 320, h = 200, samps = 75; // # samples
+    int threads = int(std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--packet") == 0) {
+            packet = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            samps = atoi(argv[i]) / 4;
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    const char* fn = "output.png";
+    Renderer renderer(w, h, samps, packet);
+    auto start = std::chrono::steady_clock::now();
+
+    // The jobs are dealt out pass by pass, so the passes are done roughly in
+    // order, and every flush has about the same number of samples everywhere
+    WorkQueues queues(threads);
+    int total = renderer.passes() * int(renderer.tiles.size());
+    for (int i = 0; i < total; i++) {
+        queues.push(i % threads, Job { i % int(renderer.tiles.size()), i / int(renderer.tiles.size()) });
+    }
+    std::atomic<int> done { 0 };
+    std::mutex doneMutex;
+    std::condition_variable allDone;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            for (Job job; queues.pop(t, job);) {
+                renderer.render(job);
+                if (++done == total) {
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    allDone.notify_all();
+                }
+            }
+        });
+    }
 
-    // Free memory
-    if (row != nullptr) {
-        free(row);
+    // Report the progress, and write the image so far now and then
+    auto flushed = start;
+    {
+        std::unique_lock<std::mutex> lock(doneMutex);
+        while (!allDone.wait_for(lock, std::chrono::milliseconds(250), [&] { return done == total; })) {
+            fprintf(stderr, "\rRendering (%d spp) %5.2f%%", samps * 4, 100. * done / total);
+            if (std::chrono::steady_clock::now() - flushed >= flushInterval) {
+                writePNG(fn, w, h, renderer.image());
+                flushed = std::chrono::steady_clock::now();
+            }
+        }
     }
-    if (png != nullptr) {
-        free(png);
+    for (std::thread& worker : workers) {
+        worker.join();
     }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "\rRendering (%d spp) 100.00%%\nRendered %d spp with the %s path on %d threads in %.3f s\n",
+        samps * 4, samps * 4, packet ? "packet" : "scalar", threads, seconds);
+
+    printf("Saving %s\n", fn);
+    writePNG(fn, w, h, renderer.image());
 }
@@ -2,48 +2,54 @@
 // https://github.com/lundstroem/synth-samples-sdl2
 
 #include "synth.h"
-
-static Sint32 last_key = 0;
+#include <algorithm>
+#include <chrono>
+#include <map>
 
 // SDL
-static uint16_t buffer_size = 4096; // must be a power of two, decrease to allow for a lower
-                                    // latency, increase to reduce risk of underrun.
+static uint16_t buffer_size = 512; // must be a power of two, decrease to allow for a lower
+                                   // latency, increase to reduce risk of underrun.
 
 static SDL_AudioSpec audio_spec;
 static SDL_Window* window = nullptr;
 
-static int sample_rate = 44100;
-const int table_length = 1024;
-static bool key_pressed = false;
-static int last_note = 0;
+static int sample_rate = 48000;
+constexpr int table_bits = 10;
+constexpr int table_length = 1 << table_bits;
 
-// voice
-static double phase_double = 0;
-static int phase_int = 0;
-static int16_t* sine_wave_table;
-static int note = -1; // integer representing halfnotes.
+// UI thread
 static int octave = 2;
 static int max_note = 131;
 static int min_note = 12;
+static std::map<Sint32, int> held_keys; // the note keys that are down, and the note of each
+
+// The note events go from the UI thread to the audio thread through this
+// queue, and everything below it is only touched by the audio thread.
+static spsc_queue<synth_event, 256> events;
+
+// voices
+static float* sine_wave_table; // table_length samples, and the first one again for interpolation
+static memory_arena voice_memory;
+static voice_bank voices;
+static uint32_t voice_clock = 0; // counts the notes, to find the oldest voice
 
-static double envelope_cursor = 0;
 static double envelope_speed_scale = 1; // set envelope speed 1-8
 static double envelope_increment_base
     = 0; // this will be set in init_data based on current samplingrate.
 
 // amplitude smoothing
-static double current_amp = 0;
-static double target_amp = 0;
-static double smoothing_amp_speed = 0.01;
-static double smoothing_enabled = true;
+static float smoothing_amp_speed = 0.01f; // the most the amp of a voice can change per sample
+static float master_gain = 0.25f; // leaves headroom for a few voices at full amp
 
 using namespace std::string_literals;
 
-void build_sine_table(int16_t* data, int wave_length)
+void build_sine_table(float* data, int wave_length)
 {
     /*
         Build sine table to use as oscillator:
-        Generate a 16bit signed integer sinewave table with 1024 samples.
+        Generate a sinewave table with 1024 samples, in the range -1 to 1,
+        and one more sample that is the first one again, so that
+        interpolation never has to wrap around.
         This table will be used to produce the notes.
         Different notes will be created by stepping through
         the table at different intervals (phase).
@@ -51,10 +57,10 @@ void build_sine_table(int16_t* data, int wave_length)
     double phase_increment = (2.0f * pi) / (double)wave_length;
     double current_phase = 0;
     for (int i = 0; i < wave_length; i++) {
-        int sample = (int)(sin(current_phase) * INT16_MAX);
-        data[i] = (int16_t)sample;
+        data[i] = (float)sin(current_phase);
         current_phase += phase_increment;
     }
+    data[wave_length] = data[0];
 }
 
 /*
@@ -89,51 +95,113 @@ void audio_callback(void* unused, Uint8* byte_stream, int byte_stream_length)
     }
 }
 
-void write_samples(int16_t* s_byteStream, long begin, long end, long length)
+// sends an event to the audio thread, and drops it if the queue is full
+static void send_event(synth_event::type_t type, int n)
 {
-    if (note > 0) {
-        double d_sample_rate = sample_rate;
-        double d_table_length = table_length;
-        double d_note = note;
-
-        // get correct phase increment for note depending on sample rate and table length.
-        double phase_increment = (get_pitch(d_note) / d_sample_rate) * d_table_length;
-
-        // loop through the buffer and write samples.
-        for (int i = 0; i < length; i += 2) {
-            phase_double += phase_increment;
-            phase_int = (int)phase_double;
-            if (phase_double >= table_length) {
-                double diff = phase_double - table_length;
-                phase_double = diff;
-                phase_int = (int)diff;
-            }
+    if (!events.push(synth_event { type, n })) {
+        printf("event queue is full, dropping a key event\n");
+    }
+}
 
-            if (phase_int < table_length && phase_int > -1) {
-                if (s_byteStream != nullptr) {
-                    int16_t sample = sine_wave_table[phase_int];
-                    target_amp = update_envelope();
-                    if (smoothing_enabled) {
-                        // move current amp towards target amp for a smoother transition.
-                        if (current_amp < target_amp) {
-                            current_amp += smoothing_amp_speed;
-                            if (current_amp > target_amp) {
-                                current_amp = target_amp;
-                            }
-                        } else if (current_amp > target_amp) {
-                            current_amp -= smoothing_amp_speed;
-                            if (current_amp < target_amp) {
-                                current_amp = target_amp;
-                            }
-                        }
-                    } else {
-                        current_amp = target_amp;
-                    }
-                    sample *= current_amp; // scale volume.
-                    s_byteStream[i + begin] = sample; // left channel
-                    s_byteStream[i + begin + 1] = sample; // right channel
+// Returns a voice for a new note: a silent one if there is one, or else the
+// oldest released one, or else the oldest one.
+static int allocate_voice(void)
+{
+    int best = 0;
+    for (int v = 0; v < max_voices; v++) {
+        if (!voices.active[v]) {
+            return v;
+        }
+        bool released = !voices.gate[v], best_released = !voices.gate[best];
+        if (released != best_released ? released : voices.age[v] < voices.age[best]) {
+            best = v;
+        }
+    }
+    return best;
+}
+
+// applies the events that the UI thread has sent since the last block
+static void receive_events(void)
+{
+    synth_event e;
+    while (events.pop(e)) {
+        switch (e.type) {
+        case synth_event::note_on: {
+            int v = allocate_voice();
+            if (!voices.active[v]) {
+                voices.phase[v] = 0;
+                voices.amp[v] = 0;
+            } // a stolen voice ramps from its current amp, so it does not click
+            // get correct phase increment for note depending on sample rate, as a
+            // fraction of the whole table in 32 bit fixed point.
+            voices.increment[v] = (uint32_t)(get_pitch(e.note) / sample_rate * 4294967296.0);
+            voices.cursor[v] = 0; // start of the envelope
+            voices.note[v] = e.note;
+            voices.gate[v] = 1;
+            voices.active[v] = 1;
+            voices.age[v] = ++voice_clock;
+            break;
+        }
+        case synth_event::note_off:
+            for (int v = 0; v < max_voices; v++) {
+                if (voices.active[v] && voices.gate[v] && voices.note[v] == e.note) {
+                    voices.gate[v] = 0;
                 }
             }
+            break;
+        }
+    }
+}
+
+// Adds one voice to a block of frames. The phase is a 32 bit fixed point
+// fraction of the table, which wraps around by itself, and every sample is
+// interpolated between two table entries. Each sample only depends on its
+// index, so the compiler can vectorize the loop, with gathers for the table
+// lookups where the target has them.
+static void render_voice(float* __restrict mix, const float* __restrict table, int frames, uint32_t phase,
+    uint32_t increment, float amp, float amp_step)
+{
+    constexpr int frac_bits = 32 - table_bits;
+    constexpr float frac_scale = 1.0f / (1u << frac_bits);
+    for (int i = 0; i < frames; i++) {
+        uint32_t p = phase + (uint32_t)i * increment;
+        uint32_t index = p >> frac_bits;
+        float frac = (float)(p & ((1u << frac_bits) - 1)) * frac_scale;
+        float a = table[index], b = table[index + 1];
+        mix[i] += (a + (b - a) * frac) * (amp + amp_step * (float)i);
+    }
+}
+
+void write_samples(int16_t* s_byteStream, long begin, long end, long length)
+{
+    receive_events();
+
+    // length is interleaved, so there are length / 2 frames.
+    const int frames = (int)(length / 2);
+    alignas(64) float mix[max_chunk_frames] = {};
+    for (int v = 0; v < max_voices; v++) {
+        if (!voices.active[v]) {
+            continue;
+        }
+        // the envelope is advanced once per block, and the amp moves in a
+        // straight line to it, at most smoothing_amp_speed per sample.
+        float target = (float)update_envelope(voices.cursor[v], voices.gate[v], frames);
+        float max_change = smoothing_amp_speed * frames;
+        float change = std::clamp(target - voices.amp[v], -max_change, max_change);
+        render_voice(mix, sine_wave_table, frames, voices.phase[v], voices.increment[v], voices.amp[v],
+            change / frames);
+        voices.phase[v] += (uint32_t)frames * voices.increment[v];
+        voices.amp[v] += change;
+        if (!voices.gate[v] && voices.cursor[v] >= 3 && voices.amp[v] <= 0) {
+            voices.active[v] = 0; // the release is over
+        }
+    }
+
+    if (s_byteStream != nullptr) {
+        for (int i = 0; i < frames; i++) {
+            float sample = std::clamp(mix[i] * master_gain, -1.0f, 1.0f) * INT16_MAX;
+            s_byteStream[begin + i * 2] = (int16_t)sample; // left channel
+            s_byteStream[begin + i * 2 + 1] = (int16_t)sample; // right channel
         }
     }
 }
@@ -141,6 +209,7 @@ void write_samples(int16_t* s_byteStream, long begin, long end, long length)
 void cleanup_data(void)
 {
     free_memory(sine_wave_table);
+    voice_memory.release();
     std::cout << "alloc count:" << alloc_count << std::endl;
 }
 
@@ -247,9 +316,20 @@ void destroy_sdl(void) { SDL_DestroyWindow(window); }
 void init_data(void)
 {
     // allocate memory for sine table and build it.
-    sine_wave_table = (int16_t*)alloc_memory(sizeof(int16_t) * table_length, "PCM table");
+    sine_wave_table = (float*)alloc_memory(sizeof(float) * (table_length + 1), "PCM table");
     build_sine_table(sine_wave_table, table_length);
 
+    // the voice state is one array per field, each on cache lines of its own.
+    voice_memory.init(voice_bank::field_count * (max_voices * sizeof(double) + 64), "voices");
+    voices.phase = voice_memory.take<uint32_t>(max_voices);
+    voices.increment = voice_memory.take<uint32_t>(max_voices);
+    voices.amp = voice_memory.take<float>(max_voices);
+    voices.cursor = voice_memory.take<double>(max_voices);
+    voices.note = voice_memory.take<int>(max_voices);
+    voices.age = voice_memory.take<uint32_t>(max_voices);
+    voices.gate = voice_memory.take<uint8_t>(max_voices);
+    voices.active = voice_memory.take<uint8_t>(max_voices);
+
     // set envelope increment size based on samplerate.
     envelope_increment_base = 1 / (double)(sample_rate / 2);
 }
@@ -262,10 +342,10 @@ bool handle_key_up(SDL_Keysym* keysym)
     case SDLK_MINUS:
         break;
     default:
-        // if the last notekey pressed is released
-        if (last_key == keysym->sym) {
-            key_pressed = false;
-            last_note = -1;
+        // release the note that the key started, even if the octave has changed since
+        if (auto it = held_keys.find(keysym->sym); it != held_keys.end()) {
+            send_event(synth_event::note_off, it->second);
+            held_keys.erase(it);
         }
         break;
     }
@@ -291,33 +371,32 @@ bool handle_key_down(SDL_Keysym* keysym)
     case SDLK_q:
         return true;
     default:
-        last_key = keysym->sym;
         handle_note_keys(keysym);
-        key_pressed = true;
         break;
     }
     return false;
 }
 
-double update_envelope(void)
+double update_envelope(double& cursor, bool gate, long frames)
 {
 
-    // advance envelope cursor and return the target amplitude value.
+    // advance the envelope cursor of a voice by a block of frames and return the target
+    // amplitude value.
 
     double amp = 0;
-    if (key_pressed && envelope_cursor < 3 && envelope_cursor > 2) {
+    if (gate && cursor < 3 && cursor > 2) {
         // if a note key is longpressed and cursor is in range, stay for sustain.
-        amp = get_envelope_amp_by_node(2, envelope_cursor);
+        amp = get_envelope_amp_by_node(2, cursor);
     } else {
         double speed_multiplier = pow(2, envelope_speed_scale);
         double cursor_inc = envelope_increment_base * speed_multiplier;
-        envelope_cursor += cursor_inc;
-        if (envelope_cursor < 1) {
-            amp = get_envelope_amp_by_node(0, envelope_cursor);
-        } else if (envelope_cursor < 2) {
-            amp = get_envelope_amp_by_node(1, envelope_cursor);
-        } else if (envelope_cursor < 3) {
-            amp = get_envelope_amp_by_node(2, envelope_cursor);
+        cursor += cursor_inc * frames;
+        if (cursor < 1) {
+            amp = get_envelope_amp_by_node(0, cursor);
+        } else if (cursor < 2) {
+            amp = get_envelope_amp_by_node(1, cursor);
+        } else if (cursor < 3) {
+            amp = get_envelope_amp_by_node(2, cursor);
         } else {
             amp = envelope_data[3];
         }
@@ -328,9 +407,12 @@ double update_envelope(void)
 void handle_note_keys(SDL_Keysym* keysym)
 {
 
-    // change note depending on which key is pressed.
+    // start a note depending on which key is pressed, unless the key is already down.
 
-    int new_note = note;
+    if (held_keys.count(keysym->sym)) {
+        return;
+    }
+    int new_note = -1;
     switch (keysym->sym) {
     case SDLK_z:
         new_note = 12;
@@ -434,25 +516,19 @@ void handle_note_keys(SDL_Keysym* keysym)
 
     if (new_note > -1) {
 
-        note = new_note;
-        note += (octave * 12);
-        if (note > max_note) {
-            note = max_note;
+        new_note += (octave * 12);
+        if (new_note > max_note) {
+            new_note = max_note;
         }
-        if (note < min_note) {
-            note = min_note;
+        if (new_note < min_note) {
+            new_note = min_note;
         }
 
-        // if note is the same as last note, it's still held on sustain. Only set a new note if it
-        // differs from the last one.
-
-        if (note != last_note) {
-            print_note(note);
-            last_note = note;
+        print_note(new_note);
+        held_keys[keysym->sym] = new_note;
 
-            // reset envelope cursor
-            envelope_cursor = 0;
-        }
+        // play it on a voice of its own, from the start of the envelope
+        send_event(synth_event::note_on, new_note);
     }
 }
 
@@ -501,3 +577,35 @@ void print_note(int n)
     }
     printf("note: %s%d pitch: %fHz\n", note_chars.c_str(), note_octave, get_pitch(n));
 }
+
+/*
+ * Renders audio without a device, with every voice playing, and prints how
+ * long a buffer of 64 frames takes against the time it has at the sample
+ * rate. Run it with "synth --bench".
+ */
+void benchmark_voices(void)
+{
+    init_data();
+    for (int v = 0; v < max_voices; v++) {
+        send_event(synth_event::note_on, 36 + v);
+    }
+    constexpr int buffer_frames = 64;
+    const int buffers = sample_rate / buffer_frames * 10; // 10 seconds of audio
+    static Uint8 buffer[buffer_frames * 2 * sizeof(int16_t)];
+    double total = 0, worst = 0;
+    for (int i = 0; i < buffers; i++) {
+        auto start = std::chrono::steady_clock::now();
+        audio_callback(nullptr, buffer, sizeof(buffer));
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        total += us;
+        worst = std::max(worst, us);
+    }
+    int playing = 0;
+    for (int v = 0; v < max_voices; v++) {
+        playing += voices.active[v];
+    }
+    double budget = 1e6 * buffer_frames / sample_rate;
+    printf("%d voices, %d frames at %d Hz: %.2f us per buffer on average, %.2f us at most, of %.2f us\n",
+        playing, buffer_frames, sample_rate, total / buffers, worst, budget);
+    cleanup_data();
+}
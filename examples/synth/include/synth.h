@@ -1,6 +1,10 @@
 #pragma once
 
 #include <SDL2/SDL.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <string>
 
@@ -9,13 +13,71 @@ constexpr double chromatic_ratio = 1.059463094359295264562;
 
 // general
 static int alloc_count = 0;
-static bool quit_audio = false;
+inline std::atomic<bool> quit_audio { false }; // shared by main and the audio callback
 
 static SDL_AudioDeviceID audio_device;
 static double envelope_data[4] = { 1.0, 0.5, 0.5, 0.0 }; // ADSR amp range 0.0-1.0
 
+// A single-producer, single-consumer queue that needs no locks. The UI
+// thread pushes and the audio thread pops, and neither waits for the other,
+// so the audio callback can never be held up by a key press.
+template <typename T, size_t capacity> class spsc_queue {
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+    T items[capacity];
+    alignas(64) std::atomic<size_t> head { 0 }; // the next item to pop, only written by the consumer
+    alignas(64) std::atomic<size_t> tail { 0 }; // the next slot to push to, only written by the producer
+
+public:
+    // returns false if the queue is full
+    bool push(const T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == capacity) {
+            return false;
+        }
+        items[t & (capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // returns false if the queue is empty
+    bool pop(T& item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[h & (capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// what the UI thread tells the audio thread
+struct synth_event {
+    enum type_t { note_on, note_off } type;
+    int note;
+};
+
+constexpr int max_voices = 32;
+constexpr int max_chunk_frames = 32; // the audio callback renders blocks of this many frames
+
+// The state of all the voices, as one array per field, so that the renderer
+// can go through the voices without touching the fields it does not need.
+struct voice_bank {
+    static constexpr int field_count = 8;
+    uint32_t* phase; // 32 bit fixed point, the whole range is one period of the table
+    uint32_t* increment; // added to the phase per sample
+    float* amp; // the current amplitude
+    double* cursor; // the position in the envelope
+    int* note;
+    uint32_t* age; // when the note started, to find the oldest voice
+    uint8_t* gate; // 1 while the key is held
+    uint8_t* active; // 0 when the voice is silent and free
+};
+
 // functions
-void build_sine_table(int16_t* data, int wave_length);
+void build_sine_table(float* data, int wave_length);
 void write_samples(int16_t* s_byteStream, long begin, long end, long length);
 void cleanup_data(void);
 void setup_sdl(void);
@@ -23,6 +85,7 @@ int setup_sdl_audio(void);
 bool check_sdl_events(SDL_Event event);
 void destroy_sdl(void);
 void init_data(void);
+void benchmark_voices(void);
 
 bool handle_key_up(SDL_Keysym* keysym);
 bool handle_key_down(SDL_Keysym* keysym);
@@ -31,7 +94,7 @@ void handle_note_keys(SDL_Keysym* keysym);
 void print_note(int n);
 
 // amplitude envelope
-double update_envelope(void);
+double update_envelope(double& cursor, bool gate, long frames);
 
 // Calculate pitch from note value. Offset note by 57 halfnotes to get
 // correct pitch from the range we have chosen for the notes.
@@ -49,9 +112,14 @@ inline double get_envelope_amp_by_node(const int base_node, const double cursor)
     return amp;
 }
 
+// Memory is 64 byte aligned, so that arrays start on a cache line and SIMD
+// loads of them never straddle two.
+constexpr size_t memory_alignment = 64;
+
 inline void* alloc_memory(size_t size, const std::string& name)
 {
-    if (void* ptr = malloc(size); ptr != nullptr) {
+    size_t aligned_size = (size + memory_alignment - 1) & ~(memory_alignment - 1);
+    if (void* ptr = std::aligned_alloc(memory_alignment, aligned_size); ptr != nullptr) {
         alloc_count++;
         return ptr;
     }
@@ -68,3 +136,40 @@ inline void* free_memory(void* ptr)
     }
     return nullptr;
 }
+
+// An arena hands out aligned arrays from a single allocation, which is freed
+// all at once. The voice state lives in one, so that it is allocated before
+// the audio starts, and the audio callback never allocates.
+struct memory_arena {
+    char* base = nullptr;
+    size_t size = 0;
+    size_t used = 0;
+
+    bool init(size_t arena_size, const std::string& name)
+    {
+        base = (char*)alloc_memory(arena_size, name);
+        size = base != nullptr ? arena_size : 0;
+        used = 0;
+        return base != nullptr;
+    }
+
+    // returns count zeroed values of T, or nullptr if the arena is full
+    template <typename T> T* take(size_t count)
+    {
+        size_t bytes = (sizeof(T) * count + memory_alignment - 1) & ~(memory_alignment - 1);
+        if (used + bytes > size) {
+            std::cout << "memory_arena error: out of space" << std::endl;
+            return nullptr;
+        }
+        T* ptr = (T*)(base + used);
+        memset(ptr, 0, bytes);
+        used += bytes;
+        return ptr;
+    }
+
+    void release(void)
+    {
+        base = (char*)free_memory(base);
+        size = used = 0;
+    }
+};
@@ -4,8 +4,13 @@
 #include "synth.h"
 #include <SDL2/SDL.h>
 
-int main()
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        benchmark_voices();
+        return 0;
+    }
+
     init_data();
     setup_sdl();
     setup_sdl_audio();
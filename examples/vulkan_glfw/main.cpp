@@ -1,17 +1,47 @@
 // From https://vulkan-tutorial.com/code/15_hello_triangle.cpp
+//
+// Extended to be a skeleton for measuring with:
+//
+//     vulkan_glfw [--frames n] [--instances n] [--draws] [--threads n]
+//
+// --frames sets how many frames can be in flight (2 by default), and
+// --instances how many triangles are drawn, in a grid. They are drawn with one
+// instanced draw call, or with one draw call each with --draws, which shows
+// the CPU cost of recording and submitting draw calls. The geometry is in a
+// device local vertex buffer, and the instance data is uploaded to it every
+// frame, through a staging ring buffer that stays mapped. The CPU and GPU
+// frame times, the latter from timestamp queries, are printed every second.
+//
+// With --threads, the draw calls are split between secondary command buffers
+// that are recorded in parallel by that many threads, each with command pools
+// of its own, instead of inline in the primary command buffer. The pipeline
+// cache is saved in $XDG_CACHE_HOME or ~/.cache between runs, so that the
+// pipeline is only compiled the first time.
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 using namespace std::string_literals;
@@ -19,7 +49,34 @@ using namespace std::string_literals;
 const int WIDTH = 800;
 const int HEIGHT = 600;
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+const uint32_t MAX_FRAMES_IN_FLIGHT = 8;
+
+// The smallest staging ring buffer, in bytes
+const VkDeviceSize MIN_STAGING_SIZE = 1 << 20;
+
+struct Settings {
+    uint32_t framesInFlight = 2;
+    uint32_t instances = 1;
+    bool separateDraws = false; // one draw call per instance, instead of one instanced draw call
+    uint32_t recordThreads = 0; // threads that record secondary command buffers, 0 for inline
+};
+
+struct Vertex {
+    float pos[2];
+    float color[3];
+};
+
+// Where each triangle is drawn, read per instance by the vertex shader
+struct Instance {
+    float offset[2];
+    float scale;
+};
+
+const std::vector<Vertex> vertices = {
+    { { 0.0f, -0.5f }, { 1.0f, 0.0f, 0.0f } },
+    { { 0.5f, 0.5f }, { 0.0f, 1.0f, 0.0f } },
+    { { -0.5f, 0.5f }, { 0.0f, 0.0f, 1.0f } },
+};
 
 const std::vector<const char*> validationLayers = { "VK_LAYER_LUNARG_standard_validation" };
 
@@ -78,8 +135,103 @@ void key_callback(GLFWwindow* win, int key, int scancode, int action, int mods)
     }
 }
 
+// WorkerPool runs a job in parts, one per thread, and waits for all of them
+// to finish. Part 0 runs on the calling thread.
+class WorkerPool {
+public:
+    explicit WorkerPool(uint32_t count)
+    {
+        for (uint32_t part = 1; part < count; part++) {
+            threads.emplace_back([this, part] { work(part); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        started.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void run(const std::function<void(uint32_t)>& f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &f;
+            remaining = (uint32_t)threads.size();
+            generation++;
+        }
+        started.notify_all();
+        std::exception_ptr mainError;
+        try {
+            f(0);
+        } catch (...) {
+            mainError = std::current_exception();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return remaining == 0; });
+        job = nullptr;
+        if (mainError) {
+            std::rethrow_exception(mainError);
+        }
+        if (error) {
+            std::rethrow_exception(std::exchange(error, nullptr));
+        }
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable started, finished;
+    const std::function<void(uint32_t)>* job = nullptr;
+    uint64_t generation = 0;
+    uint32_t remaining = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    void work(uint32_t part)
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            const std::function<void(uint32_t)>* f;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                started.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                f = job;
+            }
+            std::exception_ptr partError;
+            try {
+                (*f)(part);
+            } catch (...) {
+                partError = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (partError && !error) {
+                error = partError;
+            }
+            if (--remaining == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+};
+
 class HelloTriangleApplication {
 public:
+    explicit HelloTriangleApplication(const Settings& s)
+        : settings(s)
+    {
+    }
+
     void run()
     {
         initWindow();
@@ -89,6 +241,8 @@ public:
     }
 
 private:
+    Settings settings;
+
     GLFWwindow* window;
 
     VkInstance instance;
@@ -111,6 +265,7 @@ private:
     VkRenderPass renderPass;
     VkPipelineLayout pipelineLayout;
     VkPipeline graphicsPipeline;
+    VkPipelineCache pipelineCache;
 
     VkCommandPool commandPool;
     std::vector<VkCommandBuffer> commandBuffers;
@@ -120,6 +275,43 @@ private:
     std::vector<VkFence> inFlightFences;
     size_t currentFrame = 0;
 
+    // The device local vertex buffer holds the vertices, and then the
+    // instances of each frame in flight, so that a frame can be uploaded
+    // while the previous one is being drawn
+    VkBuffer vertexBuffer;
+    VkDeviceMemory vertexBufferMemory;
+    VkDeviceSize instancesOffset; // where the instances of frame 0 start
+    VkDeviceSize instancesSize; // the size of the instances of one frame
+
+    // The staging ring buffer. stagingHead and stagingTail count bytes from
+    // the start, and wrap around at stagingSize. Everything from the tail to
+    // the head may still be read by the GPU.
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    char* stagingMapped;
+    VkDeviceSize stagingSize;
+    VkDeviceSize stagingHead = 0;
+    VkDeviceSize stagingTail = 0;
+    std::vector<VkDeviceSize> stagingFrameEnd; // the head when each frame in flight was submitted
+
+    // Two timestamps per frame in flight, at the start and the end of the frame
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    double timestampPeriod = 0; // nanoseconds per tick
+    uint64_t timestampMask = 0;
+    std::vector<bool> queriesWritten;
+
+    // Frame timing, summed up until it is printed
+    std::chrono::steady_clock::time_point lastReport;
+    double cpuUploadSum = 0, cpuSubmitSum = 0, gpuFrameSum = 0;
+    uint32_t timedFrames = 0, gpuTimedFrames = 0;
+    std::vector<Instance> instanceData;
+
+    // With --threads, a command pool with a secondary command buffer per
+    // thread and frame in flight, at [frame * threads + thread]
+    std::vector<VkCommandPool> secondaryPools;
+    std::vector<VkCommandBuffer> secondaryBuffers;
+    std::unique_ptr<WorkerPool> workers;
+
     void initWindow()
     {
         glfwInit();
@@ -140,16 +332,22 @@ private:
         createSwapChain();
         createImageViews();
         createRenderPass();
+        createPipelineCache();
         createGraphicsPipeline();
         createFramebuffers();
         createCommandPool();
+        createStagingBuffer();
+        createVertexBuffer();
+        createQueryPool();
         createCommandBuffers();
+        createSecondaryCommandBuffers();
         createSyncObjects();
     }
 
     void mainLoop()
     {
         glfwSetKeyCallback(window, key_callback);
+        lastReport = std::chrono::steady_clock::now();
 
         while (!glfwWindowShouldClose(window) && !quit_loop) {
             glfwPollEvents();
@@ -161,18 +359,36 @@ private:
 
     void cleanup()
     {
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < settings.framesInFlight; i++) {
             vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
             vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
             vkDestroyFence(device, inFlightFences[i], nullptr);
         }
 
+        if (queryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(device, queryPool, nullptr);
+        }
+
+        vkDestroyBuffer(device, vertexBuffer, nullptr);
+        vkFreeMemory(device, vertexBufferMemory, nullptr);
+
+        vkUnmapMemory(device, stagingBufferMemory);
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+        workers.reset();
+        for (auto pool : secondaryPools) {
+            vkDestroyCommandPool(device, pool, nullptr);
+        }
+
         vkDestroyCommandPool(device, commandPool, nullptr);
 
         for (auto framebuffer : swapChainFramebuffers) {
             vkDestroyFramebuffer(device, framebuffer, nullptr);
         }
 
+        savePipelineCache();
+        vkDestroyPipelineCache(device, pipelineCache, nullptr);
         vkDestroyPipeline(device, graphicsPipeline, nullptr);
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
         vkDestroyRenderPass(device, renderPass, nullptr);
@@ -449,6 +665,67 @@ private:
         }
     }
 
+    static std::string pipelineCachePath()
+    {
+        const char* xdg = std::getenv("XDG_CACHE_HOME");
+        const char* home = std::getenv("HOME");
+        std::string dir = xdg && *xdg ? xdg : (home && *home ? home + "/.cache"s : "."s);
+        return dir + "/vulkan_glfw_pipeline_cache.bin";
+    }
+
+    // Creates the pipeline cache from the data that was saved by the last run,
+    // if it was saved by the same driver and device
+    void createPipelineCache()
+    {
+        std::ifstream file(pipelineCachePath(), std::ios::binary);
+        std::vector<char> data(
+            (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+        // The header is the length of the header, the header version, the
+        // vendor ID, the device ID and the pipeline cache UUID
+        const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+        uint32_t header[4] = {};
+        if (data.size() >= headerSize) {
+            memcpy(header, data.data(), sizeof(header));
+        }
+        if (data.size() < headerSize || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            || header[2] != properties.vendorID || header[3] != properties.deviceID
+            || memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            data.clear();
+        }
+
+        VkPipelineCacheCreateInfo cacheInfo = {};
+        cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        cacheInfo.initialDataSize = data.size();
+        cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+        if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create pipeline cache!");
+        }
+    }
+
+    void savePipelineCache()
+    {
+        size_t size = 0;
+        if (vkGetPipelineCacheData(device, pipelineCache, &size, nullptr) != VK_SUCCESS) {
+            return;
+        }
+        std::vector<char> data(size);
+        if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS) {
+            return;
+        }
+        std::string path = pipelineCachePath();
+        std::ofstream file(path + ".tmp", std::ios::binary);
+        file.write(data.data(), (std::streamsize)size);
+        file.close();
+        if (!file || std::rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+            std::cerr << "could not save the pipeline cache to "s << path << std::endl;
+        }
+    }
+
     void createGraphicsPipeline()
     {
         auto vertShaderCode = readFile(SHADERDIR "vert.spv");
@@ -472,10 +749,27 @@ private:
         VkPipelineShaderStageCreateInfo shaderStages[]
             = { vertShaderStageInfo, fragShaderStageInfo };
 
+        // Binding 0 is the vertices, and binding 1 the instances
+        VkVertexInputBindingDescription bindingDescriptions[2] = {};
+        bindingDescriptions[0].binding = 0;
+        bindingDescriptions[0].stride = sizeof(Vertex);
+        bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        bindingDescriptions[1].binding = 1;
+        bindingDescriptions[1].stride = sizeof(Instance);
+        bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+        VkVertexInputAttributeDescription attributeDescriptions[4] = {};
+        attributeDescriptions[0] = { 0, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, pos) };
+        attributeDescriptions[1] = { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color) };
+        attributeDescriptions[2] = { 2, 1, VK_FORMAT_R32G32_SFLOAT, offsetof(Instance, offset) };
+        attributeDescriptions[3] = { 3, 1, VK_FORMAT_R32_SFLOAT, offsetof(Instance, scale) };
+
         VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
         vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-        vertexInputInfo.vertexBindingDescriptionCount = 0;
-        vertexInputInfo.vertexAttributeDescriptionCount = 0;
+        vertexInputInfo.vertexBindingDescriptionCount = 2;
+        vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions;
+        vertexInputInfo.vertexAttributeDescriptionCount = 4;
+        vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
 
         VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
         inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -557,11 +851,14 @@ private:
         pipelineInfo.subpass = 0;
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
+        auto start = std::chrono::steady_clock::now();
         if (vkCreateGraphicsPipelines(
-                device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline)
+                device, pipelineCache, 1, &pipelineInfo, nullptr, &graphicsPipeline)
             != VK_SUCCESS) {
             throw std::runtime_error("failed to create graphics pipeline!");
         }
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        std::cout << "Creating the pipeline took "s << took.count() << " ms"s << std::endl;
 
         vkDestroyShaderModule(device, fragShaderModule, nullptr);
         vkDestroyShaderModule(device, vertShaderModule, nullptr);
@@ -596,6 +893,7 @@ private:
 
         VkCommandPoolCreateInfo poolInfo = {};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // recorded every frame
         poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily;
 
         if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
@@ -603,9 +901,162 @@ private:
         }
     }
 
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties)
+    {
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+            if ((typeFilter & (1 << i))
+                && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+        VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory)
+    {
+        VkBufferCreateInfo bufferInfo = {};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create buffer!");
+        }
+
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+        VkMemoryAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = memRequirements.size;
+        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+
+        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate buffer memory!");
+        }
+
+        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    }
+
+    void createStagingBuffer()
+    {
+        // Room for the uploads of every frame in flight, and one more, since
+        // an upload that does not fit before the end of the ring starts over
+        // at the beginning and leaves the rest unused
+        instancesSize = (sizeof(Instance) * settings.instances + 255) & ~VkDeviceSize(255);
+        stagingSize
+            = std::max(MIN_STAGING_SIZE, (instancesSize + 256) * (settings.framesInFlight + 2));
+
+        createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            stagingBuffer, stagingBufferMemory);
+
+        void* data;
+        vkMapMemory(device, stagingBufferMemory, 0, stagingSize, 0, &data);
+        stagingMapped = static_cast<char*>(data);
+    }
+
+    // Returns the offset in the staging buffer of size free bytes, which are
+    // in use until the frame that they are copied in has finished
+    VkDeviceSize allocateStaging(VkDeviceSize size)
+    {
+        VkDeviceSize start = (stagingHead + 15) & ~VkDeviceSize(15);
+        if (start % stagingSize + size > stagingSize) {
+            start += stagingSize - start % stagingSize;
+        }
+        if (start + size - stagingTail > stagingSize) {
+            throw std::runtime_error("the staging ring buffer is full!");
+        }
+        stagingHead = start + size;
+        return start % stagingSize;
+    }
+
+    void createVertexBuffer()
+    {
+        VkDeviceSize verticesSize = sizeof(Vertex) * vertices.size();
+        instancesOffset = (verticesSize + 255) & ~VkDeviceSize(255);
+        createBuffer(instancesOffset + instancesSize * settings.framesInFlight,
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+
+        // The vertices are uploaded once, and waited for
+        VkDeviceSize src = allocateStaging(verticesSize);
+        memcpy(stagingMapped + src, vertices.data(), verticesSize);
+
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = commandPool;
+        allocInfo.commandBufferCount = 1;
+
+        VkCommandBuffer commandBuffer;
+        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        VkBufferCopy copyRegion = { src, 0, verticesSize };
+        vkCmdCopyBuffer(commandBuffer, stagingBuffer, vertexBuffer, 1, &copyRegion);
+
+        vkEndCommandBuffer(commandBuffer);
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+
+        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        vkQueueWaitIdle(graphicsQueue);
+        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+        stagingTail = stagingHead;
+        stagingFrameEnd.assign(settings.framesInFlight, stagingHead);
+
+        instanceData.resize(settings.instances);
+    }
+
+    void createQueryPool()
+    {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(
+            physicalDevice, &queueFamilyCount, queueFamilies.data());
+        uint32_t validBits
+            = queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily].timestampValidBits;
+
+        queriesWritten.assign(settings.framesInFlight, false);
+        if (validBits == 0) {
+            std::cerr << "timestamps are not supported, the GPU time is not measured" << std::endl;
+            return;
+        }
+        timestampPeriod = properties.limits.timestampPeriod;
+        timestampMask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2 * settings.framesInFlight;
+
+        if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create query pool!");
+        }
+    }
+
     void createCommandBuffers()
     {
-        commandBuffers.resize(swapChainFramebuffers.size());
+        // One per frame in flight, recorded again every frame
+        commandBuffers.resize(settings.framesInFlight);
 
         VkCommandBufferAllocateInfo allocInfo = {};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -616,47 +1067,227 @@ private:
         if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
             throw std::runtime_error("failed to allocate command buffers!");
         }
+    }
 
-        for (size_t i = 0; i < commandBuffers.size(); i++) {
-            VkCommandBufferBeginInfo beginInfo = {};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    void createSecondaryCommandBuffers()
+    {
+        uint32_t threads = settings.recordThreads;
+        if (threads == 0) {
+            return;
+        }
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+        secondaryPools.resize(settings.framesInFlight * threads);
+        secondaryBuffers.resize(settings.framesInFlight * threads);
+
+        for (size_t i = 0; i < secondaryPools.size(); i++) {
+            // Command pools can only be used by one thread at a time, so every
+            // thread has its own, which it resets before recording again
+            VkCommandPoolCreateInfo poolInfo = {};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily;
+
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &secondaryPools[i]) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create command pool!");
+            }
+
+            VkCommandBufferAllocateInfo allocInfo = {};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = secondaryPools[i];
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocInfo.commandBufferCount = 1;
 
-            if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) {
-                throw std::runtime_error("failed to begin recording command buffer!");
+            if (vkAllocateCommandBuffers(device, &allocInfo, &secondaryBuffers[i]) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate command buffers!");
             }
+        }
+
+        workers = std::make_unique<WorkerPool>(threads);
+    }
+
+    // Writes the instances of this frame to the staging ring buffer, and
+    // returns where they are
+    VkDeviceSize uploadInstances()
+    {
+        // A grid of triangles, with one triangle as large as the original
+        uint32_t columns = (uint32_t)std::ceil(std::sqrt((double)settings.instances));
+        float cell = 2.0f / columns;
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        double t = std::chrono::duration<double>(now).count();
+        float sway = 0.25f * cell * (float)std::sin(t);
+        for (uint32_t i = 0; i < settings.instances; i++) {
+            Instance& instance = instanceData[i];
+            instance.offset[0] = -1.0f + cell * (i % columns + 0.5f) + sway;
+            instance.offset[1] = -1.0f + cell * (i / columns + 0.5f);
+            instance.scale = cell / 2.0f;
+        }
+        VkDeviceSize size = sizeof(Instance) * settings.instances;
+        VkDeviceSize src = allocateStaging(size);
+        memcpy(stagingMapped + src, instanceData.data(), size);
+        return src;
+    }
+
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, VkDeviceSize src)
+    {
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+
+        uint32_t firstQuery = 2 * (uint32_t)currentFrame;
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, queryPool, firstQuery, 2);
+            vkCmdWriteTimestamp(
+                commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, firstQuery);
+        }
 
-            VkRenderPassBeginInfo renderPassInfo = {};
-            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            renderPassInfo.renderPass = renderPass;
-            renderPassInfo.framebuffer = swapChainFramebuffers[i];
-            renderPassInfo.renderArea.offset = { 0, 0 };
-            renderPassInfo.renderArea.extent = swapChainExtent;
+        // Copy the instances of this frame from the staging ring buffer
+        VkDeviceSize dst = instancesOffset + instancesSize * currentFrame;
+        VkBufferCopy copyRegion = { src, dst, sizeof(Instance) * settings.instances };
+        vkCmdCopyBuffer(commandBuffer, stagingBuffer, vertexBuffer, 1, &copyRegion);
+
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        VkRenderPassBeginInfo renderPassInfo = {};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+        renderPassInfo.renderArea.offset = { 0, 0 };
+        renderPassInfo.renderArea.extent = swapChainExtent;
+
+        VkClearValue clearColor = { 0.0f, 0.0f, 0.0f, 1.0f };
+        renderPassInfo.clearValueCount = 1;
+        renderPassInfo.pClearValues = &clearColor;
+
+        uint32_t threads = settings.recordThreads;
+        if (threads == 0) {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+            recordDraws(commandBuffer, dst, 0, settings.instances);
+        } else {
+            vkCmdBeginRenderPass(
+                commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            workers->run([&](uint32_t t) { recordSecondary(t, imageIndex, dst); });
+            vkCmdExecuteCommands(commandBuffer, threads, &secondaryBuffers[currentFrame * threads]);
+        }
 
-            VkClearValue clearColor = { 0.0f, 0.0f, 0.0f, 1.0f };
-            renderPassInfo.clearValueCount = 1;
-            renderPassInfo.pClearValues = &clearColor;
+        vkCmdEndRenderPass(commandBuffer);
 
-            vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(
+                commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, firstQuery + 1);
+        }
 
-            vkCmdBindPipeline(
-                commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record command buffer!");
+        }
+    }
 
-            vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
+    // Records the draw calls of the instances [first, end)
+    void recordDraws(VkCommandBuffer commandBuffer, VkDeviceSize dst, uint32_t first, uint32_t end)
+    {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
-            vkCmdEndRenderPass(commandBuffers[i]);
+        VkBuffer buffers[] = { vertexBuffer, vertexBuffer };
+        VkDeviceSize offsets[] = { 0, dst };
+        vkCmdBindVertexBuffers(commandBuffer, 0, 2, buffers, offsets);
 
-            if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-                throw std::runtime_error("failed to record command buffer!");
+        if (settings.separateDraws) {
+            for (uint32_t i = first; i < end; i++) {
+                vkCmdDraw(commandBuffer, (uint32_t)vertices.size(), 1, 0, i);
             }
+        } else if (end > first) {
+            vkCmdDraw(commandBuffer, (uint32_t)vertices.size(), end - first, 0, first);
+        }
+    }
+
+    // Records part t of the draw calls into its secondary command buffer.
+    // Runs on thread t of the worker pool.
+    void recordSecondary(uint32_t t, uint32_t imageIndex, VkDeviceSize dst)
+    {
+        uint32_t threads = settings.recordThreads;
+        size_t i = currentFrame * threads + t;
+        vkResetCommandPool(device, secondaryPools[i], 0);
+
+        VkCommandBufferInheritanceInfo inheritanceInfo = {};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritanceInfo.renderPass = renderPass;
+        inheritanceInfo.subpass = 0;
+        inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex];
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+            | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+        if (vkBeginCommandBuffer(secondaryBuffers[i], &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+
+        uint64_t instances = settings.instances;
+        recordDraws(secondaryBuffers[i], dst, (uint32_t)(instances * t / threads),
+            (uint32_t)(instances * (t + 1) / threads));
+
+        if (vkEndCommandBuffer(secondaryBuffers[i]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record command buffer!");
+        }
+    }
+
+    // Adds the GPU time of the last frame that used this frame in flight,
+    // which has finished, since its fence has been waited for
+    void readTimestamps()
+    {
+        if (queryPool == VK_NULL_HANDLE || !queriesWritten[currentFrame]) {
+            return;
+        }
+        uint64_t timestamps[2];
+        if (vkGetQueryPoolResults(device, queryPool, 2 * (uint32_t)currentFrame, 2,
+                sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT)
+            == VK_SUCCESS) {
+            uint64_t ticks = (timestamps[1] - timestamps[0]) & timestampMask;
+            gpuFrameSum += ticks * timestampPeriod * 1e-6;
+            gpuTimedFrames++;
+        }
+    }
+
+    void reportTimes()
+    {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double, std::milli>(now - lastReport).count();
+        if (elapsed < 1000.0 || timedFrames == 0) {
+            return;
+        }
+        char report[256];
+        int n = snprintf(report, sizeof(report),
+            "%u frames in flight, %u instances%s, recorded on %u threads: %.1f fps, CPU %.3f ms "
+            "per frame (upload %.3f ms, record and submit %.3f ms)",
+            settings.framesInFlight, settings.instances,
+            settings.separateDraws ? " in separate draws" : "",
+            std::max(1u, settings.recordThreads), timedFrames * 1e3 / elapsed,
+            elapsed / timedFrames, cpuUploadSum / timedFrames, cpuSubmitSum / timedFrames);
+        if (gpuTimedFrames > 0 && n > 0 && n < (int)sizeof(report)) {
+            snprintf(report + n, sizeof(report) - n, ", GPU %.3f ms", gpuFrameSum / gpuTimedFrames);
         }
+        std::cout << report << std::endl;
+        glfwSetWindowTitle(window, report);
+        cpuUploadSum = cpuSubmitSum = gpuFrameSum = 0;
+        timedFrames = gpuTimedFrames = 0;
+        lastReport = now;
     }
 
     void createSyncObjects()
     {
-        imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+        imageAvailableSemaphores.resize(settings.framesInFlight);
+        renderFinishedSemaphores.resize(settings.framesInFlight);
+        inFlightFences.resize(settings.framesInFlight);
 
         VkSemaphoreCreateInfo semaphoreInfo = {};
         semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -665,7 +1296,7 @@ private:
         fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
         fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (size_t i = 0; i < settings.framesInFlight; i++) {
             if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i])
                     != VK_SUCCESS
                 || vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i])
@@ -678,14 +1309,26 @@ private:
 
     void drawFrame()
     {
+        using clock = std::chrono::steady_clock;
+
         vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
             std::numeric_limits<uint64_t>::max());
         vkResetFences(device, 1, &inFlightFences[currentFrame]);
 
+        // The frame that last used this frame in flight is done, and so are
+        // the ones before it, along with what they used of the staging buffer
+        readTimestamps();
+        stagingTail = stagingFrameEnd[currentFrame];
+
         uint32_t imageIndex;
         vkAcquireNextImageKHR(device, swapChain, std::numeric_limits<uint64_t>::max(),
             imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
 
+        auto uploadStart = clock::now();
+        VkDeviceSize src = uploadInstances();
+        auto submitStart = clock::now();
+        recordCommandBuffer(commandBuffers[currentFrame], imageIndex, src);
+
         VkSubmitInfo submitInfo = {};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
@@ -696,7 +1339,7 @@ private:
         submitInfo.pWaitDstStageMask = waitStages;
 
         submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
 
         VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
         submitInfo.signalSemaphoreCount = 1;
@@ -706,6 +1349,9 @@ private:
             != VK_SUCCESS) {
             throw std::runtime_error("failed to submit draw command buffer!");
         }
+        stagingFrameEnd[currentFrame] = stagingHead;
+        queriesWritten[currentFrame] = queryPool != VK_NULL_HANDLE;
+        auto submitEnd = clock::now();
 
         VkPresentInfoKHR presentInfo = {};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -721,7 +1367,13 @@ private:
 
         vkQueuePresentKHR(presentQueue, &presentInfo);
 
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        using ms = std::chrono::duration<double, std::milli>;
+        cpuUploadSum += ms(submitStart - uploadStart).count();
+        cpuSubmitSum += ms(submitEnd - submitStart).count();
+        timedFrames++;
+        reportTimes();
+
+        currentFrame = (currentFrame + 1) % settings.framesInFlight;
     }
 
     VkShaderModule createShaderModule(const std::vector<char>& code)
@@ -952,11 +1604,29 @@ private:
     }
 };
 
-int main()
+int main(int argc, char** argv)
 {
+    Settings settings;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            settings.framesInFlight
+                = (uint32_t)std::clamp(atoi(argv[++i]), 1, (int)MAX_FRAMES_IN_FLIGHT);
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            settings.instances = (uint32_t)std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--draws") == 0) {
+            settings.separateDraws = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            settings.recordThreads = (uint32_t)std::clamp(atoi(argv[++i]), 1, 64);
+        } else {
+            std::cerr << "usage: "s << argv[0]
+                      << " [--frames n] [--instances n] [--draws] [--threads n]"s << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
     std::cout << "Please make sure Vulkan is supported on your system before running."s
               << std::endl;
-    HelloTriangleApplication app;
+    HelloTriangleApplication app(settings);
 
     try {
         app.run();
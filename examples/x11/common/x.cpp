@@ -1,10 +1,18 @@
 #include "x.h"
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <thread>
+#include <utility>
 
 using namespace std::string_literals;
 
@@ -14,7 +22,19 @@ namespace X {
 // #define RootWindow(dpy, scr)  (ScreenOfDisplay(dpy,scr)->root)
 #undef RootWindow
 
-Window::Window(int x, int y, unsigned int w, unsigned int h, std::string name)
+// Set by trapErrors while checking if XShmAttach worked, since the server
+// refuses it asynchronously, for instance when it is on another machine
+static bool shmFailed = false;
+
+static int trapErrors(::Display*, XErrorEvent*)
+{
+    shmFailed = true;
+    return 0;
+}
+
+Window::Window(int x, int y, unsigned int w, unsigned int h, std::string name, bool useShm)
+    : _w(w)
+    , _h(h)
 {
     if (name.length() > 0) {
         _d = XOpenDisplay(name.c_str());
@@ -24,26 +44,96 @@ Window::Window(int x, int y, unsigned int w, unsigned int h, std::string name)
     if (_d == nullptr) {
         throw std::runtime_error("failed to construct an X11 Display"s);
     }
+    _useShm = useShm && XShmQueryExtension(_d);
+    _color = BlackPixel(_d, this->Screen());
 
     // Create a window too.
     // TODO: Error handling
     _window = XCreateSimpleWindow(_d, this->RootWindow(), x, y, w, h, 1,
         BlackPixel(_d, this->Screen()), WhitePixel(_d, this->Screen()));
 
+    // The whole window is drawn by Present, so the server does not need to clear it first
+    XSetWindowBackgroundPixmap(_d, _window, None);
+
     // Listen for window close events
     _wmDeleteMessage = XInternAtom(_d, "WM_DELETE_WINDOW", false);
     XSetWMProtocols(_d, _window, &_wmDeleteMessage, 1);
 
-    std::cout << "Window constructed"s << std::endl;
+    this->CreateImage();
+
+    std::cout << "Window constructed"s << (_useShm ? ", with MIT-SHM"s : ", without MIT-SHM"s)
+              << std::endl;
 }
 
 Window::~Window()
 {
+    this->DestroyImage();
     XCloseDisplay(_d);
 
     std::cout << "Window deconstructed"s << std::endl;
 }
 
+void Window::CreateImage()
+{
+    ::Visual* visual = DefaultVisual(_d, this->Screen());
+    unsigned int depth = DefaultDepth(_d, this->Screen());
+    if (_useShm) {
+        _image = XShmCreateImage(_d, visual, depth, ZPixmap, nullptr, &_shm, _w, _h);
+        if (_image) {
+            _shm.shmid
+                = shmget(IPC_PRIVATE, _image->bytes_per_line * _image->height, IPC_CREAT | 0600);
+        }
+        if (_image && _shm.shmid >= 0) {
+            _shm.shmaddr = _image->data = static_cast<char*>(shmat(_shm.shmid, nullptr, 0));
+            _shm.readOnly = false;
+            shmFailed = false;
+            auto previous = XSetErrorHandler(trapErrors);
+            XShmAttach(_d, &_shm);
+            XSync(_d, false);
+            XSetErrorHandler(previous);
+            // Marked for removal now, so that it is freed even if the program crashes.
+            // It stays around until both this process and the server have detached it.
+            shmctl(_shm.shmid, IPC_RMID, nullptr);
+            if (!shmFailed) {
+                return;
+            }
+            shmdt(_shm.shmaddr);
+        }
+        if (_image) {
+            _image->data = nullptr;
+            XDestroyImage(_image);
+            _image = nullptr;
+        }
+        std::cerr << "MIT-SHM could not be used, falling back to XPutImage"s << std::endl;
+        _useShm = false;
+    }
+    _image = XCreateImage(_d, visual, depth, ZPixmap, 0, nullptr, _w, _h, 32, 0);
+    if (_image == nullptr) {
+        throw std::runtime_error("failed to create an XImage"s);
+    }
+    _image->data = static_cast<char*>(malloc(_image->bytes_per_line * _image->height));
+    if (_image->data == nullptr) {
+        XDestroyImage(_image);
+        _image = nullptr;
+        throw std::runtime_error("failed to allocate the back buffer"s);
+    }
+}
+
+void Window::DestroyImage()
+{
+    if (_image == nullptr) {
+        return;
+    }
+    if (_useShm) {
+        XShmDetach(_d, &_shm);
+        XSync(_d, false);
+        shmdt(_shm.shmaddr);
+        _image->data = nullptr;
+    }
+    XDestroyImage(_image); // frees the data, if it was allocated with malloc
+    _image = nullptr;
+}
+
 int Window::Screen() { return DefaultScreen(_d); }
 
 int Window::RootWindow() { return ScreenOfDisplay(_d, this->Screen())->root; }
@@ -52,7 +142,7 @@ GC Window::GC() { return DefaultGC(_d, this->Screen()); }
 
 void Window::SelectInput()
 {
-    XSelectInput(_d, _window, ExposureMask | KeyPressMask | ButtonPressMask);
+    XSelectInput(_d, _window, ExposureMask | KeyPressMask | ButtonPressMask | StructureNotifyMask);
 }
 
 void Window::MapWindow() { XMapWindow(_d, _window); }
@@ -61,16 +151,79 @@ void Window::MapWindow() { XMapWindow(_d, _window); }
 
 ::Display* Window::GetDisplay() { return _d; }
 
+// Resizes the back buffer, when the window has been resized
+void Window::Resize(unsigned int w, unsigned int h)
+{
+    if (w == _w && h == _h) {
+        return;
+    }
+    this->DestroyImage();
+    _w = w;
+    _h = h;
+    this->CreateImage();
+}
+
+void Window::SetColor(unsigned long pixel) { _color = pixel; }
+
+void Window::Clear()
+{
+    unsigned long color = _color;
+    _color = WhitePixel(_d, this->Screen());
+    this->FillRectangle(0, 0, _w, _h);
+    _color = color;
+    _texts.clear();
+}
+
 void Window::FillRectangle(int x, int y, unsigned int w, unsigned int h)
 {
-    // TODO: save the gc in an object variable
-    XFillRectangle(_d, _window, this->GC(), x, y, w, h);
+    // Clip to the back buffer
+    int x0 = std::max(x, 0);
+    int y0 = std::max(y, 0);
+    int x1 = std::min(static_cast<long>(x) + w, static_cast<long>(_w));
+    int y1 = std::min(static_cast<long>(y) + h, static_cast<long>(_h));
+    if (_image->bits_per_pixel == 32) {
+        for (int py = y0; py < y1; py++) {
+            auto* row
+                = reinterpret_cast<std::uint32_t*>(_image->data + py * _image->bytes_per_line);
+            for (int px = x0; px < x1; px++) {
+                row[px] = static_cast<std::uint32_t>(_color);
+            }
+        }
+        return;
+    }
+    // Any other pixel format, which is rare, the slow way
+    for (int py = y0; py < y1; py++) {
+        for (int px = x0; px < x1; px++) {
+            XPutPixel(_image, px, py, _color);
+        }
+    }
 }
 
 void Window::DrawString(int x, int y, std::string msg)
 {
-    // TODO: save the gc in an object variable
-    XDrawString(_d, _window, this->GC(), x, y, msg.c_str(), msg.length());
+    _texts.push_back(Text { x, y, _color, std::move(msg) });
+}
+
+// Sends the back buffer and the strings to the window, and flushes the requests
+void Window::Present()
+{
+    ::GC gc = this->GC();
+    if (_useShm) {
+        XShmPutImage(_d, _window, gc, _image, 0, 0, 0, 0, _w, _h, false);
+    } else {
+        XPutImage(_d, _window, gc, _image, 0, 0, 0, 0, _w, _h);
+    }
+    for (const Text& t : _texts) {
+        XSetForeground(_d, gc, t.color);
+        XDrawString(_d, _window, gc, t.x, t.y, t.msg.c_str(), t.msg.length());
+    }
+    if (_useShm) {
+        // The server reads the image when it gets to the request, so wait for
+        // that before the next frame is drawn into it
+        XSync(_d, false);
+    } else {
+        XFlush(_d);
+    }
 }
 
 bool Window::WindowCloseMessage(const unsigned long msg) { return (msg == _wmDeleteMessage); }
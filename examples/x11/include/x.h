@@ -1,7 +1,10 @@
 #pragma once
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <string>
+#include <vector>
 
 using namespace std::string_literals;
 
@@ -11,15 +14,39 @@ namespace X {
 // #define RootWindow(dpy, scr)  (ScreenOfDisplay(dpy,scr)->root)
 #undef RootWindow
 
-// Class that wraps an X11 Display and an X11 Window
+// Class that wraps an X11 Display and an X11 Window.
+//
+// Drawing goes to an XImage in client memory, and Present sends it to the
+// window with a single request per frame. The image is shared with the X
+// server with MIT-SHM when possible, so that it is not copied through the
+// socket, and is sent with XPutImage otherwise, as over remote X.
 class Window {
 private:
     ::Display* _d;
     ::Window _window;
     ::Atom _wmDeleteMessage;
 
+    // The back buffer
+    XImage* _image = nullptr;
+    XShmSegmentInfo _shm {};
+    bool _useShm;
+    unsigned int _w, _h;
+    unsigned long _color;
+
+    // Strings are drawn by the server, on top of the image, when it is presented
+    struct Text {
+        int x, y;
+        unsigned long color;
+        std::string msg;
+    };
+    std::vector<Text> _texts;
+
+    void CreateImage();
+    void DestroyImage();
+
 public:
-    Window(int x, int y, unsigned int w, unsigned int h, std::string name = ""s);
+    Window(int x, int y, unsigned int w, unsigned int h, std::string name = ""s,
+        bool useShm = true);
     ~Window();
     int Screen();
     int RootWindow();
@@ -29,8 +56,15 @@ public:
     void MapWindow();
     ::Window GetWindow();
     ::Display* GetDisplay();
+    unsigned int Width() const { return _w; }
+    unsigned int Height() const { return _h; }
+    bool UsesShm() const { return _useShm; }
+    void Resize(unsigned int w, unsigned int h);
+    void SetColor(unsigned long pixel);
+    void Clear();
     void FillRectangle(int x, int y, unsigned int w, unsigned int h);
     void DrawString(int x, int y, std::string msg);
+    void Present();
     bool WindowCloseMessage(const unsigned long msg);
 };
 
@@ -1,11 +1,24 @@
+// Draws into a back buffer and presents it about 60 times per second.
+//
+//     x11 [--no-shm] [--rects n]
+//
+// --rects draws n moving rectangles per frame, to put some load on it, and
+// --no-shm sends the back buffer with XPutImage instead of MIT-SHM, which is
+// what happens over remote X. The average and the longest frame time of the
+// last second are shown in the window.
+
 #include "x.h"
 
+#include <algorithm>
 #include <chrono>
 #include <csignal>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <thread>
+#include <vector>
 
 using namespace std::string_literals;
 
@@ -20,9 +33,19 @@ void stop(int x)
 
 auto main(int argc, char** argv) -> int
 {
+    bool useShm = true;
+    int rects = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-shm") == 0) {
+            useShm = false;
+        } else if (strcmp(argv[i], "--rects") == 0 && i + 1 < argc) {
+            rects = std::max(0, atoi(argv[++i]));
+        }
+    }
+
     std::unique_ptr<X::Window> win;
     try {
-        win = std::make_unique<X::Window>(10, 10, 100, 100);
+        win = std::make_unique<X::Window>(10, 10, 320, 240, ""s, useShm);
     } catch (const std::runtime_error& err) {
         std::cerr << "ERROR: "s << err.what() << std::endl;
         return EXIT_FAILURE;
@@ -35,48 +58,105 @@ auto main(int argc, char** argv) -> int
 
     signal(SIGINT, stop);
 
+    struct Point {
+        int x, y;
+    };
+    std::vector<Point> clicks;
+
+    using clock = std::chrono::steady_clock;
+    const auto frameInterval = std::chrono::microseconds(16667);
+    auto nextFrame = clock::now();
+    auto statsStart = nextFrame;
+    double frameSum = 0, frameMax = 0; // in milliseconds, since statsStart
+    int frames = 0;
+    char stats[96] = "";
+    unsigned long frame = 0;
+
     while (running) {
-        // This check exists so that event-checking can be non-blocking if the program is
-        // interrupted by SIGINT
-        if (XPending(win->GetDisplay()) == 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            continue;
-        }
-        XNextEvent(win->GetDisplay(), &event);
-        switch (event.type) {
-        case Expose:
-            win->FillRectangle(10, 10, 20, 20);
-            win->DrawString(10, 50, "Hello, World!"s);
-            break;
-        case KeyPress:
-            std::cout << "Key pressed: "s << event.xkey.keycode << std::endl;
-            // Check for Esc or 'q'
-            if (event.xkey.keycode == 0x09 || event.xkey.keycode == 0x18) {
-                running = false;
-            }
-            break;
-        case ButtonPress:
-            switch (event.xbutton.button) {
-            case 1:
-                std::cout << "Left Click"s << std::endl;
-                auto x = event.xbutton.x;
-                auto y = event.xbutton.y;
-                win->FillRectangle(x, y, 20, 20);
+        // Handle all the pending events, without blocking, so that the
+        // program can be interrupted by SIGINT
+        while (running && XPending(win->GetDisplay()) > 0) {
+            XNextEvent(win->GetDisplay(), &event);
+            switch (event.type) {
+            case ConfigureNotify:
+                try {
+                    win->Resize(event.xconfigure.width, event.xconfigure.height);
+                } catch (const std::runtime_error& err) {
+                    std::cerr << "ERROR: "s << err.what() << std::endl;
+                    return EXIT_FAILURE;
+                }
                 break;
-            }
-            break;
-        case ClientMessage:
-            std::cout << "Client messages:"s << std::endl;
-            for (const unsigned long m : event.xclient.data.l) {
-                if (win->WindowCloseMessage(m)) {
+            case KeyPress:
+                std::cout << "Key pressed: "s << event.xkey.keycode << std::endl;
+                // Check for Esc or 'q'
+                if (event.xkey.keycode == 0x09 || event.xkey.keycode == 0x18) {
                     running = false;
-                    std::cout << "  Stop"s << std::endl;
-                } else {
-                    std::cout << "  Message: "s << m << std::endl;
                 }
+                break;
+            case ButtonPress:
+                switch (event.xbutton.button) {
+                case 1:
+                    std::cout << "Left Click"s << std::endl;
+                    clicks.push_back(Point { event.xbutton.x, event.xbutton.y });
+                    break;
+                }
+                break;
+            case ClientMessage:
+                std::cout << "Client messages:"s << std::endl;
+                for (const unsigned long m : event.xclient.data.l) {
+                    if (win->WindowCloseMessage(m)) {
+                        running = false;
+                        std::cout << "  Stop"s << std::endl;
+                    } else {
+                        std::cout << "  Message: "s << m << std::endl;
+                    }
+                }
+                break;
             }
+        }
+        if (!running) {
             break;
         }
+
+        // Draw the frame into the back buffer, and present it
+        auto frameStart = clock::now();
+        unsigned long black = BlackPixel(win->GetDisplay(), win->Screen());
+        win->Clear();
+        win->SetColor(black);
+        win->FillRectangle(10, 10, 20, 20);
+        win->DrawString(10, 50, "Hello, World!"s);
+        for (const Point& p : clicks) {
+            win->FillRectangle(p.x, p.y, 20, 20);
+        }
+        const int w = std::max(1u, win->Width()), h = std::max(1u, win->Height());
+        for (int i = 0; i < rects; i++) {
+            unsigned long x = (i * 53 + frame * (1 + i % 5)) % w, y = (i * 97 + frame) % h;
+            win->SetColor(0x3060c0ul ^ (0x010101ul * ((i * 37) & 0xff)));
+            win->FillRectangle(int(x), int(y), 8, 8);
+        }
+        win->SetColor(black);
+        win->DrawString(10, h - 10, stats);
+        win->Present();
+        frame++;
+
+        double ms = std::chrono::duration<double, std::milli>(clock::now() - frameStart).count();
+        frameSum += ms;
+        frameMax = std::max(frameMax, ms);
+        frames++;
+        if (clock::now() - statsStart >= std::chrono::seconds(1)) {
+            snprintf(stats, sizeof(stats), "frame %.3f ms, max %.3f ms%s", frameSum / frames,
+                frameMax, win->UsesShm() ? ", shm" : "");
+            statsStart = clock::now();
+            frameSum = frameMax = 0;
+            frames = 0;
+        }
+
+        nextFrame += frameInterval;
+        auto now = clock::now();
+        if (nextFrame < now) {
+            nextFrame = now; // behind, so do not try to catch up
+        }
+        std::this_thread::sleep_until(nextFrame);
     }
     return EXIT_SUCCESS;
 }
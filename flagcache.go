@@ -0,0 +1,149 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+)
+
+// flagCacheFile is where assembled build flags are cached between runs.
+var flagCacheFile = filepath.Join(projectCacheDir, "flags.cache")
+
+// maxFlagCacheEntries limits how many build configurations are kept in the flag cache.
+const maxFlagCacheEntries = 16
+
+// flagCacheEnv lists the environment variables that influence assembleFlags.
+var flagCacheEnv = []string{"CC", "CXX", "CFLAGS", "CXXFLAGS", "LDFLAGS", "PATH", "PKG_CONFIG_PATH", "PKG_CONFIG_LIBDIR", "MSYSTEM", "VCPKG_ROOT", "OH_LINKER"}
+
+// pkgConfigDirs are common .pc directories. Their mtimes change when packages
+// are installed or removed, which invalidates the flag cache.
+var pkgConfigDirs = []string{
+	"/usr/lib/pkgconfig", "/usr/lib64/pkgconfig", "/usr/share/pkgconfig",
+	"/usr/lib/x86_64-linux-gnu/pkgconfig", "/usr/lib/aarch64-linux-gnu/pkgconfig",
+	"/usr/local/lib/pkgconfig", "/usr/local/libdata/pkgconfig", "/usr/pkg/lib/pkgconfig",
+	"/opt/homebrew/lib/pkgconfig",
+}
+
+// assembleFlags creates the full set of build flags for a project, in the
+// project directory proj.Dir. The result is cached in .oh/flags.cache, keyed
+// on everything the flags are derived from, so that rebuilding an unchanged
+// project skips every compiler, pkg-config and package manager probe.
+func assembleFlags(proj Project, opts BuildOptions) BuildFlags {
+	span := startSpan("flags", "assembleFlags")
+	defer span.end()
+	cacheFile := projectFile(proj.Dir, flagCacheFile)
+	key := flagCacheKey(proj, opts)
+	if key != "" {
+		var cache map[string]BuildFlags
+		if readJSONFile(cacheFile, &cache) {
+			if bf, ok := cache[key]; ok {
+				span.arg("cache", "hit")
+				bf.Jobs = jobCount(opts.Jobs, bf.Compiler)
+				bf.ObjDir = objectDir(withStoredProfile(proj.Dir, opts, bf.Compiler), bf.Compiler)
+				bf.Dir = proj.Dir
+				return bf
+			}
+		}
+	}
+	span.arg("cache", "miss")
+	bf := assembleFlagsUncached(proj, opts)
+	bf.Dir = proj.Dir
+	if key != "" {
+		storeCachedFlags(cacheFile, key, bf)
+	}
+	return bf
+}
+
+// storeCachedFlags adds the build flags for the given key to the flag cache in cacheFile.
+func storeCachedFlags(cacheFile, key string, bf BuildFlags) {
+	var cache map[string]BuildFlags
+	if !readJSONFile(cacheFile, &cache) || len(cache) >= maxFlagCacheEntries {
+		cache = make(map[string]BuildFlags)
+	}
+	bf.Jobs = 0 // the job count and build directory are not part of the cached configuration
+	bf.ObjDir = ""
+	cache[key] = bf
+	if err := writeJSONFile(cacheFile, cache); err != nil {
+		fmt.Fprintf(os.Stderr, "warning: could not write %s: %v\n", cacheFile, err)
+	}
+}
+
+// flagCacheKey returns a key for the flag cache that covers the compiler binary,
+// the build options, the detected project features and includes, the relevant
+// environment variables and the layout of the project directory. Only cheap
+// lookups are done here. Returns "" if the result should not be cached.
+func flagCacheKey(proj Project, opts BuildOptions) string {
+	if !cachingEnabled() {
+		return ""
+	}
+	compiler := compilerCandidate(proj, opts)
+	if compiler == "" {
+		return ""
+	}
+	fi, err := os.Stat(compiler)
+	if err != nil {
+		return ""
+	}
+	parts := []string{compiler, fi.ModTime().String(), fmt.Sprint(fi.Size())}
+
+	opts.Jobs = 0
+	opts.InstallPrefix = ""
+	opts.Unity = false
+	opts.Events = nil
+	parts = append(parts, fmt.Sprintf("%+v", opts))
+
+	dir := proj.Dir
+	proj.Dir, proj.MainSource, proj.DepSources, proj.TestSources, proj.BenchSources = "", "", nil, nil, nil
+	parts = append(parts, fmt.Sprintf("%+v", proj))
+
+	for _, name := range flagCacheEnv {
+		parts = append(parts, name+"="+os.Getenv(name))
+	}
+
+	// Project layout: include paths, data directories, lib/*.so and profile data
+	for _, ip := range localIncludePaths {
+		if fileExists(projectFile(dir, ip)) {
+			parts = append(parts, "inc:"+ip)
+		}
+	}
+	parts = append(parts, dirDefines(dir)...)
+	soFiles, _ := filepath.Glob(projectFile(dir, "lib/*.so"))
+	for _, so := range soFiles {
+		parts = append(parts, filepath.Base(so))
+	}
+	parts = append(parts, profileStamp(dir))
+
+	// Installed packages and linkers
+	parts = append(parts, packageDBStamp(hostPlatform.typ()), linkerStamp())
+	for _, dir := range pkgConfigDirs {
+		if fi, err := os.Stat(dir); err == nil {
+			parts = append(parts, dir+"@"+fi.ModTime().String())
+		}
+	}
+
+	return hashStrings(parts...)
+}
+
+// compilerCandidate returns the path of the compiler assembleFlags would pick,
+// without probing it or falling back to Docker.
+func compilerCandidate(proj Project, opts BuildOptions) string {
+	if opts.Zap {
+		if p, err := exec.LookPath("zapcc++"); err == nil {
+			return p
+		}
+	}
+	if opts.Win64 || proj.HasWin64 {
+		return findWin64Compiler(proj.IsC)
+	}
+	return findCompiler(opts.Clang, proj.IsC)
+}
+
+// removeFlagCache removes the flag cache, so that the next build probes everything again.
+func removeFlagCache() bool {
+	if err := os.Remove(flagCacheFile); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
@@ -11,13 +11,10 @@ import (
 
 // systemIncludeDirs and compilerSupportsStd are in sysinclude_*.go files.
 
-// pkgConfigFlags runs pkg-config for a given package name and returns the flags.
+// pkgConfigFlags returns the pkg-config flags for a given package name.
+// Results are resolved from the .pc files where possible, and memoized.
 func pkgConfigFlags(pkg string) string {
-	out, err := exec.Command("pkg-config", "--cflags", "--libs", pkg).Output()
-	if err != nil {
-		return ""
-	}
-	return strings.TrimSpace(string(out))
+	return pkgConfig.flagsFor(pkg)
 }
 
 // hasPkgConfig checks if pkg-config is available.
@@ -29,7 +26,7 @@ func hasPkgConfig() bool {
 // bestGtkPkg returns the best available GTK pkg-config name, preferring the newest version.
 func bestGtkPkg() string {
 	for _, pkg := range []string{"gtk4", "gtk+-3.0", "gtk+-2.0"} {
-		if pkgConfigFlags(pkg) != "" {
+		if pkgConfig.exists(pkg) {
 			return pkg
 		}
 	}
@@ -40,12 +37,12 @@ func bestGtkPkg() string {
 func bestVtePkg() string {
 	gtk := bestGtkPkg()
 	if gtk == "gtk4" {
-		if pkgConfigFlags("vte-2.91-gtk4") != "" {
+		if pkgConfig.exists("vte-2.91-gtk4") {
 			return "vte-2.91-gtk4"
 		}
 	}
 	for _, pkg := range []string{"vte-2.91-gtk4", "vte-2.91"} {
-		if pkgConfigFlags(pkg) != "" {
+		if pkgConfig.exists(pkg) {
 			return pkg
 		}
 	}
@@ -54,11 +51,7 @@ func bestVtePkg() string {
 
 // sfmlMajorVersion returns the installed SFML major version (2 or 3), or 0 if unavailable.
 func sfmlMajorVersion() int {
-	out, err := exec.Command("pkg-config", "--modversion", "sfml-system").Output()
-	if err != nil {
-		return 0
-	}
-	ver := strings.TrimSpace(string(out))
+	ver := pkgConfig.version("sfml-system")
 	if strings.HasPrefix(ver, "3") {
 		return 3
 	}
@@ -143,7 +136,6 @@ func pkgNameFromInclude(inc string) string {
 
 // resolveExtraFlags returns additional link/compile flags for special includes.
 func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string) {
-	hasPkg := hasPkgConfig()
 	darwin := isDarwin()
 	hasFrameworks := fileExists("/Library/Frameworks")
 	hasSysFrameworks := fileExists("/System/Library/Frameworks")
@@ -172,7 +164,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 			} else if win64 {
 				ldflags = appendUnique(ldflags, "-lopengl32")
 			}
-			if hasPkg {
+			if hostPlatform.pkgConfig() {
 				if flags := pkgConfigFlags("gl"); flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				}
@@ -190,7 +182,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 				ldflags = appendUnique(ldflags, "OpenGL")
 			} else if win64 {
 				ldflags = appendUnique(ldflags, "-lopengl32")
-			} else if hasPkg {
+			} else if hostPlatform.pkgConfig() {
 				if flags := pkgConfigFlags("gl"); flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				}
@@ -211,7 +203,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 				ldflags = appendUnique(ldflags, "GLUT")
 			} else if win64 {
 				ldflags = appendUnique(ldflags, "-lglu32")
-			} else if hasPkg {
+			} else if hostPlatform.pkgConfig() {
 				if flags := pkgConfigFlags("glu"); flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				} else if flags := pkgConfigFlags("freeglut"); flags != "" {
@@ -232,7 +224,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 			if win64 {
 				ldflags = appendUnique(ldflags, "-lglew32")
 			}
-			if hasPkg {
+			if hostPlatform.pkgConfig() {
 				if flags := pkgConfigFlags("glew"); flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				}
@@ -248,7 +240,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 				ldflags = appendUnique(ldflags, "OpenAL")
 			} else if win64 {
 				ldflags = appendUnique(ldflags, "-lopenal32")
-			} else if hasPkg {
+			} else if hostPlatform.pkgConfig() {
 				if flags := pkgConfigFlags("openal"); flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				}
@@ -268,7 +260,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 		}
 
 		// SDL2_* sub-libraries
-		if strings.HasPrefix(lower, "sdl2/sdl_") && hasPkg {
+		if strings.HasPrefix(lower, "sdl2/sdl_") && hostPlatform.pkgConfig() {
 			word := "SDL2_" + inc[9:]
 			word = strings.TrimSuffix(word, filepath.Ext(word))
 			if flags := pkgConfigFlags(word); flags != "" {
@@ -278,7 +270,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 
 		// Vulkan
 		if strings.HasPrefix(lower, "vulkan/") {
-			if hasPkg {
+			if hostPlatform.pkgConfig() {
 				if flags := pkgConfigFlags("vulkan"); flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				}
@@ -292,7 +284,7 @@ func resolveExtraFlags(includes []string, win64 bool) (cflags, ldflags []string)
 			cflags = appendUnique(cflags, "-Wno-class-memaccess")
 			cflags = appendUnique(cflags, "-Wno-pedantic")
 			// Check for qt include dir
-			for _, sysDir := range systemIncludeDirs() {
+			for _, sysDir := range hostPlatform.systemIncludes() {
 				qtDir := filepath.Join(sysDir, "qt")
 				if fileExists(qtDir) {
 					cflags = appendUnique(cflags, "-I"+qtDir)
@@ -400,8 +392,9 @@ func findWin64Compiler(isC bool) string {
 	return ""
 }
 
-// dirDefines generates -D flags for data/img/shader directories.
-func dirDefines() []string {
+// dirDefines generates -D flags for the data/img/shader directories of the
+// project in root.
+func dirDefines(root string) []string {
 	var defs []string
 	dirTypes := map[string]string{
 		"img":       "IMGDIR",
@@ -418,9 +411,9 @@ func dirDefines() []string {
 
 	for dir, define := range dirTypes {
 		path := ""
-		if fileExists(dir) {
+		if fileExists(projectFile(root, dir)) {
 			path = dir + "/"
-		} else if fileExists(filepath.Join("..", dir)) {
+		} else if fileExists(projectFile(root, filepath.Join("..", dir))) {
 			path = filepath.Join("..", dir) + "/"
 		}
 		if path != "" {
@@ -433,13 +426,20 @@ func dirDefines() []string {
 // compilerSupportsStd and systemIncludeDirs are in sysinclude_*.go files.
 
 // bestStdFlag returns the best C++ standard flag the compiler supports.
+// It is probed once per compiler binary, and kept in its profile.
 func bestStdFlag(compiler string) string {
+	if std := compilerProfileOf(compiler).BestStd; std != "" {
+		return std
+	}
+	best := "c++17"
 	for _, std := range []string{"c++23", "c++2b", "c++20", "c++2a", "c++17", "c++14", "c++11"} {
 		if compilerSupportsStd(compiler, std) {
-			return std
+			best = std
+			break
 		}
 	}
-	return "c++17"
+	updateCompilerProfile(compiler, func(p *compilerProfile) { p.BestStd = best })
+	return best
 }
 
 func appendUnique(slice []string, val string) []string {
@@ -456,8 +456,9 @@ func prependUnique(slice []string, val string) []string {
 	return append([]string{val}, slice...)
 }
 
-// installDirDefines generates -D flags pointing to installed paths.
-func installDirDefines(prefix string) []string {
+// installDirDefines generates -D flags pointing to installed paths, for the
+// directories that the project in root has.
+func installDirDefines(root, prefix string) []string {
 	var defs []string
 	dirTypes := map[string]string{
 		"img":       "IMGDIR",
@@ -473,7 +474,7 @@ func installDirDefines(prefix string) []string {
 	}
 
 	for dir, define := range dirTypes {
-		if fileExists(dir) || fileExists(filepath.Join("..", dir)) {
+		if fileExists(projectFile(root, dir)) || fileExists(projectFile(root, filepath.Join("..", dir))) {
 			path := filepath.Join(prefix, dir) + "/"
 			defs = append(defs, `-D`+define+`="`+path+`"`)
 		}
@@ -508,16 +509,13 @@ func isCompilerClang(compiler string) bool {
 
 // isEffectivelyClang returns true if the compiler is clang or acts as clang.
 // On macOS, /usr/bin/g++ and /usr/bin/gcc are Apple clang wrappers, so
-// name-based detection is unreliable — this function checks the version string.
+// name-based detection is unreliable — this function checks the version line
+// in the profile of the compiler.
 func isEffectivelyClang(compiler string) bool {
 	if isCompilerClang(compiler) {
 		return true
 	}
-	out, err := exec.Command(compiler, "--version").Output()
-	if err != nil {
-		return false
-	}
-	return strings.Contains(strings.ToLower(string(out)), "clang")
+	return compilerProfileOf(compiler).Clang
 }
 
 // Qt6 hardcoded flags (from build.py)
@@ -1,6 +1,7 @@
 package orchideous
 
 import (
+	"bytes"
 	"fmt"
 	"os"
 	"os/exec"
@@ -8,22 +9,20 @@ import (
 	"sort"
 	"strings"
 	"time"
-
-	"github.com/xyproto/files"
 )
 
 // doCMake generates a CMakeLists.txt file.
 func doCMake(opts BuildOptions) error {
-	proj := detectProject()
-	if proj.MainSource == "" {
-		return fmt.Errorf("no main source file found")
+	proj, g, err := projectGraph(opts)
+	if err != nil {
+		return err
 	}
 
 	if fileExists("CMakeLists.txt") {
 		return fmt.Errorf("not overwriting existing CMakeLists.txt")
 	}
 
-	flags := assembleFlags(proj, opts)
+	flags := g.flags
 	exe := executableName()
 
 	f, err := os.Create("CMakeLists.txt")
@@ -33,7 +32,7 @@ func doCMake(opts BuildOptions) error {
 	defer f.Close()
 
 	date := time.Now().Format("2006-01-02")
-	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	srcs := g.sources()
 	incPaths := flags.IncPaths
 
 	fmt.Fprintf(f, "# Generated using oh from https://github.com/xyproto/orchideous, %s\n", date)
@@ -105,12 +104,12 @@ func doCMake(opts BuildOptions) error {
 
 // doPro generates a QtCreator .pro project file.
 func doPro(opts BuildOptions) error {
-	proj := detectProject()
-	if proj.MainSource == "" {
-		return fmt.Errorf("no main source file found")
+	_, g, err := projectGraph(opts)
+	if err != nil {
+		return err
 	}
 
-	flags := assembleFlags(proj, opts)
+	flags := g.flags
 	exe := executableName()
 	proFile := exe + ".pro"
 
@@ -124,7 +123,7 @@ func doPro(opts BuildOptions) error {
 	}
 	defer f.Close()
 
-	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	srcs := g.sources()
 
 	fmt.Fprintf(f, "TEMPLATE = app\n\n")
 	fmt.Fprintln(f, "CONFIG += c++23")
@@ -184,46 +183,6 @@ func doPro(opts BuildOptions) error {
 	return nil
 }
 
-// doNinja builds the project using CMake + Ninja.
-func doNinja() error {
-	if !fileExists("CMakeLists.txt") {
-		return fmt.Errorf("could not find CMakeLists.txt (run 'oh cmake' first)")
-	}
-
-	if _, err := exec.LookPath("ninja"); err != nil {
-		return fmt.Errorf("ninja not found in PATH")
-	}
-
-	// Remove and recreate build directory
-	os.RemoveAll("build")
-	if err := os.MkdirAll("build", 0o755); err != nil {
-		return err
-	}
-
-	// Run cmake in build/
-	cmakeArgs := []string{"-G", "Ninja", ".."}
-	if files.WhichCached("ccache") != "" {
-		cmakeArgs = []string{"-D", "CMAKE_CXX_COMPILER_LAUNCHER=ccache", "-G", "Ninja", ".."}
-	}
-	cmake := exec.Command("cmake", cmakeArgs...)
-	cmake.Dir = "build"
-	cmake.Stdout = os.Stdout
-	cmake.Stderr = os.Stderr
-	if err := cmake.Run(); err != nil {
-		return fmt.Errorf("cmake failed: %w", err)
-	}
-
-	// Run ninja in build/
-	ninja := exec.Command("ninja", "-C", "build")
-	ninja.Stdout = os.Stdout
-	ninja.Stderr = os.Stderr
-	if err := ninja.Run(); err != nil {
-		return fmt.Errorf("ninja failed: %w", err)
-	}
-
-	return nil
-}
-
 // doInstall installs the built executable and data directories.
 func doInstall() error {
 	prefix := os.Getenv("PREFIX")
@@ -234,7 +193,7 @@ func doInstall() error {
 	exe := executableName()
 
 	// Build with install-time directory defines
-	proj := detectProject()
+	proj := detectProject(".")
 	opts := BuildOptions{}
 	if proj.HasWin64 {
 		opts.Win64 = true
@@ -351,23 +310,17 @@ func doExport() error {
 	return nil
 }
 
-// doMakeFile generates a standalone Makefile.
+// doMakeFile generates a standalone Makefile from the build graph. Objects
+// are compiled with -MMD and the .d files are included, so that changed
+// headers rebuild the objects that include them, and "make -j" is safe.
 func doMakeFile() error {
 	if fileExists("Makefile") {
 		return fmt.Errorf("makefile already exists, will not overwrite")
 	}
 
-	proj := detectProject()
-	if proj.MainSource == "" {
-		return fmt.Errorf("no main source file found")
-	}
-
-	flags := assembleFlags(proj, BuildOptions{})
-	exe := executableName()
-	srcs := append([]string{proj.MainSource}, proj.DepSources...)
-	objs := make([]string, len(srcs))
-	for i, s := range srcs {
-		objs[i] = strings.TrimSuffix(s, filepath.Ext(s)) + ".o"
+	_, g, err := projectGraph(BuildOptions{})
+	if err != nil {
+		return err
 	}
 
 	f, err := os.Create("Makefile")
@@ -376,37 +329,50 @@ func doMakeFile() error {
 	}
 	defer f.Close()
 
-	var compileCmd strings.Builder
-	compileCmd.WriteString(flags.Compiler + " -std=" + flags.Std + " " + strings.Join(flags.CFlags, " "))
-	if len(flags.Defines) > 0 {
-		compileCmd.WriteString(" " + strings.Join(flags.Defines, " "))
+	var outputs, tests, depFiles []string
+	for _, t := range g.targets {
+		outputs = append(outputs, t.output)
+		if t.test {
+			tests = append(tests, t.output)
+		}
 	}
-	for _, ip := range flags.IncPaths {
-		compileCmd.WriteString(" -I" + ip)
+	for _, o := range g.objects {
+		depFiles = append(depFiles, o.depFile())
 	}
 
-	linkCmd := flags.Compiler + " -o " + exe + " " + strings.Join(objs, " ")
-	if len(flags.LDFlags) > 0 {
-		linkCmd += " " + strings.Join(flags.LDFlags, " ")
-	}
+	main := g.main()
+	fmt.Fprintf(f, ".PHONY: clean test\n\n")
+	fmt.Fprintf(f, "%s: %s\n", main.output, strings.Join(main.objects, " "))
+	fmt.Fprintf(f, "\t%s %s\n\n", g.flags.Compiler, strings.Join(main.args, " "))
 
-	fmt.Fprintf(f, ".PHONY: clean\n\n")
-	fmt.Fprintf(f, "%s: %s\n", exe, strings.Join(objs, " "))
-	fmt.Fprintf(f, "\t%s\n\n", linkCmd)
+	for _, o := range g.objects {
+		fmt.Fprintf(f, "%s: %s\n", o.obj, o.src)
+		fmt.Fprintf(f, "\t%s %s\n\n", g.flags.Compiler, strings.Join(o.args, " "))
+	}
 
-	for i, src := range srcs {
-		fmt.Fprintf(f, "%s: %s\n", objs[i], src)
-		fmt.Fprintf(f, "\t%s -c -o %s %s\n\n", compileCmd.String(), objs[i], src)
+	for _, t := range g.targets[1:] {
+		fmt.Fprintf(f, "%s: %s\n", t.output, strings.Join(t.objects, " "))
+		fmt.Fprintf(f, "\t%s %s\n\n", g.flags.Compiler, strings.Join(t.args, " "))
+	}
+	if len(tests) > 0 {
+		fmt.Fprintf(f, "test: %s\n", strings.Join(tests, " "))
+		for _, t := range tests {
+			fmt.Fprintf(f, "\t%s\n", dotSlash(t))
+		}
+		fmt.Fprintln(f)
 	}
 
 	fmt.Fprintln(f, "clean:")
-	fmt.Fprintf(f, "\trm -f %s *.o common/*.o include/*.o\n", exe)
+	fmt.Fprintf(f, "\trm -f %s *.o *.d common/*.o common/*.d include/*.o include/*.d\n\n", strings.Join(outputs, " "))
+
+	fmt.Fprintf(f, "-include %s\n", strings.Join(depFiles, " "))
 
 	fmt.Println("Generated Makefile")
 	return nil
 }
 
-// doScript generates standalone build.sh and clean.sh scripts.
+// doScript generates standalone build.sh and clean.sh scripts from the build
+// graph. The objects are compiled in parallel, before the executable is linked.
 func doScript() error {
 	if fileExists("build.sh") {
 		return fmt.Errorf("build.sh already exists, will not overwrite")
@@ -415,14 +381,12 @@ func doScript() error {
 		return fmt.Errorf("clean.sh already exists, will not overwrite")
 	}
 
-	proj := detectProject()
-	if proj.MainSource == "" {
-		return fmt.Errorf("no main source file found")
+	_, g, err := projectGraph(BuildOptions{})
+	if err != nil {
+		return err
 	}
-
-	flags := assembleFlags(proj, BuildOptions{})
-	exe := executableName()
-	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	main := g.main()
+	flags := g.flags
 
 	// build.sh
 	bf, err := os.Create("build.sh")
@@ -432,30 +396,17 @@ func doScript() error {
 	fmt.Fprintln(bf, "#!/bin/sh")
 	fmt.Fprintln(bf, `printf "Building... "`)
 
-	// If multiple sources, compile each to .o then link
-	if len(srcs) > 1 {
-		var compileCmd strings.Builder
-		compileCmd.WriteString(flags.Compiler + " -std=" + flags.Std + " " + strings.Join(flags.CFlags, " "))
-		if len(flags.Defines) > 0 {
-			compileCmd.WriteString(" " + strings.Join(flags.Defines, " "))
-		}
-		for _, ip := range flags.IncPaths {
-			compileCmd.WriteString(" -I" + ip)
-		}
-
-		var objs []string
-		for _, src := range srcs {
-			obj := strings.TrimSuffix(src, filepath.Ext(src)) + ".o"
-			objs = append(objs, obj)
-			fmt.Fprintf(bf, "%s -c -o %s %s || exit 1\n", compileCmd.String(), obj, src)
-		}
-		linkCmd := flags.Compiler + " -o " + exe + " " + strings.Join(objs, " ")
-		if len(flags.LDFlags) > 0 {
-			linkCmd += " " + strings.Join(flags.LDFlags, " ")
+	// If multiple sources, compile each to .o in the background, then link
+	if len(main.objects) > 1 {
+		fmt.Fprintln(bf, "pids=")
+		for _, obj := range main.objects {
+			fmt.Fprintf(bf, "%s %s &\n", flags.Compiler, strings.Join(g.object(obj).args, " "))
+			fmt.Fprintln(bf, `pids="$pids $!"`)
 		}
-		fmt.Fprintf(bf, "%s || exit 1\n", linkCmd)
+		fmt.Fprintln(bf, "for pid in $pids; do wait $pid || exit 1; done")
+		fmt.Fprintf(bf, "%s %s || exit 1\n", flags.Compiler, strings.Join(main.args, " "))
 	} else {
-		args := buildCompileArgs(flags, srcs, exe)
+		args := buildCompileArgs(flags, g.sources(), main.output)
 		fmt.Fprintf(bf, "%s %s || exit 1\n", flags.Compiler, strings.Join(args, " "))
 	}
 
@@ -471,7 +422,7 @@ func doScript() error {
 	}
 	fmt.Fprintln(cf, "#!/bin/sh")
 	fmt.Fprintln(cf, `printf "Cleaning... "`)
-	fmt.Fprintf(cf, "rm -f %s *.o common/*.o include/*.o\n", exe)
+	fmt.Fprintf(cf, "rm -f %s *.o *.d common/*.o common/*.d include/*.o include/*.d\n", main.output)
 	fmt.Fprintln(cf, `test $? -eq 0 && echo OK`)
 	cf.Close()
 	os.Chmod("clean.sh", 0o755)
@@ -525,11 +476,24 @@ func doNinjaInstall() error {
 	ninja := exec.Command("ninja", args...)
 	ninja.Stdout = os.Stdout
 	ninja.Stderr = os.Stderr
-	return ninja.Run()
+	return runCommand(ninja)
 }
 
-// doNinjaClean cleans a ninja build.
+// doNinjaClean cleans a ninja build, from "oh ninja" or "oh cmake ninja".
 func doNinjaClean() {
+	if data, err := os.ReadFile(ninjaFile); err == nil && bytes.HasPrefix(data, []byte(ninjaHeader)) {
+		if _, err := exec.LookPath("ninja"); err == nil {
+			ninja := exec.Command("ninja", "-t", "clean")
+			ninja.Stdout = os.Stdout
+			ninja.Stderr = os.Stderr
+			runCommand(ninja)
+		}
+		for _, f := range []string{ninjaFile, ".ninja_log", ".ninja_deps"} {
+			if os.Remove(f) == nil {
+				fmt.Println("Removed", f)
+			}
+		}
+	}
 	if fileExists("build") {
 		os.RemoveAll("build")
 		fmt.Println("Removed build/")
@@ -2,6 +2,9 @@ package orchideous
 
 import (
 	"os"
+	"path/filepath"
+	"runtime"
+	"slices"
 	"strings"
 	"testing"
 )
@@ -60,6 +63,57 @@ func TestPkgNameFromInclude(t *testing.T) {
 	}
 }
 
+func TestPkgConfigResolver_Native(t *testing.T) {
+	if runtime.GOOS == "windows" {
+		t.Skip("pkg-config files are always passed to pkg-config on Windows")
+	}
+	dir := t.TempDir()
+	t.Setenv("PKG_CONFIG_PATH", "")
+	t.Setenv("PKG_CONFIG_LIBDIR", dir)
+	t.Setenv("PKG_CONFIG_SYSROOT_DIR", "")
+	writeFile(t, filepath.Join(dir, "base.pc"), `prefix=/opt/base
+includedir=${prefix}/include
+Name: base
+Version: 1.2.3
+Cflags: -I${includedir} -I/usr/include
+Libs: -L${prefix}/lib -L/usr/lib -lbase
+`)
+	writeFile(t, filepath.Join(dir, "top.pc"), `prefix=/opt/top
+Name: top
+Version: 3.0
+Description: "quoted" text is fine outside of flags
+Requires: base >= 1.0
+Requires.private: priv
+Cflags: -I${prefix}/include -DTOP
+Libs: -L${prefix}/lib -ltop
+`)
+	writeFile(t, filepath.Join(dir, "priv.pc"), `Name: priv
+Version: 1
+Cflags: -DPRIV
+Libs: -lpriv
+`)
+	writeFile(t, filepath.Join(dir, "broken.pc"), `Name: broken
+Version: 1
+Requires: missing
+Libs: -lbroken
+`)
+
+	r := newPkgConfigResolver()
+	want := "-I/opt/top/include -DTOP -I/opt/base/include -DPRIV -L/opt/top/lib -ltop -L/opt/base/lib -lbase"
+	if got := r.flagsFor("top"); got != want {
+		t.Errorf("flagsFor(top) = %q, want %q", got, want)
+	}
+	if got := r.flagsFor("broken"); got != "" {
+		t.Errorf("expected no flags when a requirement is missing, got %q", got)
+	}
+	if !r.exists("base") || r.exists("missing") {
+		t.Error("exists does not match the available .pc files")
+	}
+	if got := r.version("top"); got != "3.0" {
+		t.Errorf("version(top) = %q, want 3.0", got)
+	}
+}
+
 func TestDoCMake(t *testing.T) {
 	withTempDir(t)
 	writeFile(t, "main.cpp", `#include <iostream>
@@ -119,6 +173,43 @@ int main() { return 0; }`)
 	if !strings.Contains(content, "clean:") {
 		t.Error("Makefile missing clean target")
 	}
+	if !strings.Contains(content, "-MMD") || !strings.Contains(content, "-include main.d") {
+		t.Error("Makefile missing header dependency tracking")
+	}
+}
+
+func TestBuildGraph(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `#include "util.h"
+int main() { return util(); }`)
+	writeFile(t, "include/util.h", `int util();`)
+	writeFile(t, "common/util.cpp", `int util() { return 0; }`)
+	writeFile(t, "common/util_test.cpp", `#include "util.h"
+int main() { return util(); }`)
+
+	_, g, err := projectGraph(BuildOptions{})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(g.objects) != 3 || len(g.targets) != 2 {
+		t.Fatalf("expected 3 objects and 2 targets, got %d and %d", len(g.objects), len(g.targets))
+	}
+	main := g.main()
+	if main.test || len(main.objects) != 2 {
+		t.Errorf("main target should link main.o and common/util.o, got %v", main.objects)
+	}
+	test := g.targets[1]
+	if !test.test || test.output != filepath.Join("common", "util_test") {
+		t.Errorf("unexpected test target %+v", test)
+	}
+	if !slices.Contains(test.objects, filepath.Join("common", "util.o")) || slices.Contains(test.objects, "main.o") {
+		t.Errorf("test should link the dependency objects, but not main.o, got %v", test.objects)
+	}
+	for _, o := range g.objects {
+		if !slices.Contains(o.args, "-MMD") {
+			t.Errorf("%s is compiled without -MMD", o.src)
+		}
+	}
 }
 
 func TestDoScript(t *testing.T) {
@@ -163,3 +254,37 @@ func TestDoScript_NoOverwrite(t *testing.T) {
 		t.Error("expected error when build.sh already exists")
 	}
 }
+
+func TestNinjaBuildFile(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+	writeFile(t, "common/util.cpp", `int util() { return 0; }`)
+
+	_, g, err := projectGraph(BuildOptions{})
+	if err != nil {
+		t.Fatal(err)
+	}
+	content := string(ninjaBuildFile(g, "/usr/bin/ccache"))
+	for _, want := range []string{
+		ninjaHeader,
+		"deps = gcc",
+		"command = /usr/bin/ccache $cxx $cflags -c -o $out $in",
+		"build main.o: cc main.cpp\n  depfile = main.d\n",
+		"build " + filepath.Join("common", "util.o") + ": cc " + filepath.Join("common", "util.cpp"),
+		"default " + g.main().output,
+	} {
+		if !strings.Contains(content, want) {
+			t.Errorf("build.ninja missing %q:\n%s", want, content)
+		}
+	}
+}
+
+func TestWriteNinjaFile_NoOverwrite(t *testing.T) {
+	withTempDir(t)
+	writeFile(t, "main.cpp", `int main() { return 0; }`)
+	writeFile(t, "build.ninja", "rule cc\n")
+
+	if err := writeNinjaFile(); err == nil {
+		t.Error("expected error when a build.ninja not generated by oh exists")
+	}
+}
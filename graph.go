@@ -0,0 +1,195 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"path/filepath"
+	"strings"
+)
+
+// graphObject is an object file in the build graph, compiled from one source.
+type graphObject struct {
+	src  string
+	obj  string
+	args []string // compiler arguments, with -MMD so that compiles write a .d file
+}
+
+// depFile returns the .d file that compiling the object writes.
+func (o graphObject) depFile() string {
+	return strings.TrimSuffix(o.obj, ".o") + ".d"
+}
+
+// graphTarget is an executable in the build graph, linked from objects.
+type graphTarget struct {
+	output  string
+	objects []string
+	args    []string // linker arguments, without the selected linker
+	test    bool
+}
+
+// buildGraph is the dependency graph of a project: the objects, the sources
+// they are compiled from, the .d files that list the headers they include,
+// and the executables they are linked into. The native builder runs it, and the generators write it out, so
+// that builds from generated files track the same dependencies.
+type buildGraph struct {
+	flags   BuildFlags
+	objects []graphObject
+	targets []graphTarget // the main executable, followed by the tests
+}
+
+// compileNodes returns the objects for the given sources.
+func compileNodes(srcs []string, flags BuildFlags) []graphObject {
+	nodes := make([]graphObject, 0, len(srcs))
+	for _, src := range srcs {
+		obj := objectPath(flags, src)
+		nodes = append(nodes, graphObject{src: src, obj: obj, args: objectCompileArgs(flags, src, obj)})
+	}
+	return nodes
+}
+
+// buildRoot holds the build directories of the configurations of a project.
+var buildRoot = filepath.Join(projectCacheDir, "build")
+
+// objectDir returns the build directory for the objects of a configuration,
+// named after the build mode and the compiler, such as .oh/build/opt-g++.
+// Every configuration keeps its own objects, so that switching between them
+// only relinks. Instrumented, profile optimized and BOLT builds have their
+// own directories too, see withStoredProfile.
+func objectDir(opts BuildOptions, compiler string) string {
+	mode := "default"
+	switch {
+	case opts.Debug:
+		mode = "debug"
+	case opts.Tiny:
+		mode = "tiny"
+	case opts.Small:
+		mode = "small"
+	case opts.Opt:
+		mode = "opt"
+	}
+	parts := []string{mode}
+	for _, o := range []struct {
+		on   bool
+		name string
+	}{{opts.Strict, "strict"}, {opts.Sloppy, "sloppy"}, {opts.Zap, "zap"}, {opts.NoSanitizers, "nosan"}, {opts.FramePointers, "fp"}, {opts.DebugInfo, "g"}, {opts.Native, "native"}, {opts.MultiArch, "multiarch"}, {opts.Win64, "win64"},
+		{opts.ProfileGenerate, "pgogen"}, {opts.ProfileUse && !opts.ProfileGenerate, "pgo"}, {opts.Bolt, "bolt"}} {
+		if o.on {
+			parts = append(parts, o.name)
+		}
+	}
+	parts = append(parts, filepath.Base(compiler))
+	return filepath.Join(buildRoot, strings.Join(parts, "-"))
+}
+
+// objectPath returns the object file for a source, in the build directory
+// of the configuration, or next to the source if flags has no build directory.
+func objectPath(flags BuildFlags, src string) string {
+	obj := strings.TrimSuffix(src, filepath.Ext(src)) + ".o"
+	if flags.ObjDir == "" {
+		return obj
+	}
+	return filepath.Join(flags.ObjDir, relativeOutputPath(obj))
+}
+
+// relativeOutputPath returns a path that can be put below an output
+// directory for a path in or next to the project: directories outside the
+// project, like ../common, become _up/common.
+func relativeOutputPath(path string) string {
+	parts := strings.Split(filepath.ToSlash(filepath.Clean(path)), "/")
+	for i, p := range parts {
+		if p == ".." {
+			parts[i] = "_up"
+		}
+	}
+	return filepath.FromSlash(strings.Join(parts, "/"))
+}
+
+// removeBuildDirs removes the build directories, and the cache directory if it is then empty.
+func removeBuildDirs() bool {
+	if _, err := os.Stat(buildRoot); err != nil {
+		return false
+	}
+	if err := os.RemoveAll(buildRoot); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
+
+// newBuildGraph returns the build graph for the main executable of a
+// project and its tests. Every test is linked with the dependency objects.
+func newBuildGraph(proj Project, flags BuildFlags, exe string, win64 bool) buildGraph {
+	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	srcs = append(srcs, proj.TestSources...)
+	g := buildGraph{flags: flags, objects: compileNodes(srcs, flags)}
+	n := 1 + len(proj.DepSources)
+	var depObjs []string
+	for _, o := range g.objects[1:n] {
+		depObjs = append(depObjs, o.obj)
+	}
+	mainObjs := append([]string{g.objects[0].obj}, depObjs...)
+	g.targets = append(g.targets, graphTarget{output: exe, objects: mainObjs, args: linkCommandArgs(flags, mainObjs, exe)})
+	for _, o := range g.objects[n:] {
+		testExe := testExecutable(o.src, win64)
+		objs := append([]string{o.obj}, depObjs...)
+		g.targets = append(g.targets, graphTarget{output: testExe, objects: objs, args: linkCommandArgs(flags, objs, testExe), test: true})
+	}
+	return g
+}
+
+// projectGraph detects the project in the current directory and returns it,
+// together with its build graph for the generators. The objects are put next
+// to their sources, since generated build files are meant to be used without oh.
+func projectGraph(opts BuildOptions) (Project, buildGraph, error) {
+	proj := detectProject(".")
+	if proj.MainSource == "" {
+		return proj, buildGraph{}, fmt.Errorf("no main source file found")
+	}
+	flags := assembleFlags(proj, opts)
+	flags.ObjDir = ""
+	exe := executableName()
+	if opts.Win64 {
+		exe += ".exe"
+	}
+	return proj, newBuildGraph(proj, flags, exe, opts.Win64), nil
+}
+
+// main returns the main executable of the graph.
+func (g buildGraph) main() graphTarget {
+	return g.targets[0]
+}
+
+// object returns the graph object for an object file.
+func (g buildGraph) object(obj string) graphObject {
+	for _, o := range g.objects {
+		if o.obj == obj {
+			return o
+		}
+	}
+	return graphObject{}
+}
+
+// sources returns the sources that the main executable is built from.
+func (g buildGraph) sources() []string {
+	var srcs []string
+	for _, obj := range g.main().objects {
+		srcs = append(srcs, g.object(obj).src)
+	}
+	return srcs
+}
+
+// linkCommandArgs returns the arguments for linking objFiles into output.
+func linkCommandArgs(flags BuildFlags, objFiles []string, output string) []string {
+	args := []string{"-o", output}
+	args = append(args, objFiles...)
+	return append(args, flags.LDFlags...)
+}
+
+// testExecutable returns the name of the executable for a test source.
+func testExecutable(src string, win64 bool) string {
+	exe := strings.TrimSuffix(src, filepath.Ext(src))
+	if win64 {
+		exe += ".exe"
+	}
+	return exe
+}
@@ -0,0 +1,96 @@
+package orchideous
+
+import (
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+)
+
+// headerIndexDepth is how many directory levels below a system include
+// directory are indexed.
+const headerIndexDepth = 3
+
+// headerIndexEntry is the persisted index of one system include directory.
+type headerIndexEntry struct {
+	Stamp string
+	Files []string // slash separated paths relative to the include directory, in walk order
+}
+
+// headerIndex maps every path suffix that starts at a path component, such as
+// "gl.h" and "GL/gl.h" for "GL/gl.h", to the first file in walk order that has it.
+type headerIndex struct {
+	suffixes map[string]string
+}
+
+var (
+	headerIndexMutex sync.Mutex
+	headerIndexes    = make(map[string]*headerIndex)
+	headerIndexCache map[string]headerIndexEntry // persisted entries, loaded on first use
+)
+
+// headerIndexFile is where the header indexes are kept between runs.
+func headerIndexFile() string {
+	return userCacheFile("headers.cache")
+}
+
+// indexedHeader returns the full path of the first header under sysDir whose
+// path ends with inc, or "" if there is none. The index for sysDir is built on
+// the first lookup and reused between runs until packages are installed or
+// removed, or the directory itself changes.
+func indexedHeader(sysDir, inc string) string {
+	return headerIndexFor(sysDir).suffixes[filepath.ToSlash(inc)]
+}
+
+func headerIndexFor(sysDir string) *headerIndex {
+	headerIndexMutex.Lock()
+	defer headerIndexMutex.Unlock()
+	if idx, ok := headerIndexes[sysDir]; ok {
+		return idx
+	}
+
+	stamp := ""
+	if fi, err := os.Stat(sysDir); err == nil {
+		stamp = hashStrings(fi.ModTime().String(), packageDBStamp(hostPlatform.typ()))
+	}
+	path := ""
+	if cachingEnabled() {
+		path = headerIndexFile()
+	}
+	if headerIndexCache == nil {
+		if path == "" || !readJSONFile(path, &headerIndexCache) || headerIndexCache == nil {
+			headerIndexCache = make(map[string]headerIndexEntry)
+		}
+	}
+
+	entry, ok := headerIndexCache[sysDir]
+	if !ok || entry.Stamp != stamp {
+		entry = headerIndexEntry{Stamp: stamp, Files: walkHeaders(sysDir)}
+		headerIndexCache[sysDir] = entry
+		if path != "" && stamp != "" {
+			writeJSONFile(path, headerIndexCache)
+		}
+	}
+
+	idx := &headerIndex{suffixes: make(map[string]string)}
+	for _, rel := range entry.Files {
+		full := filepath.Join(sysDir, filepath.FromSlash(rel))
+		for suffix := rel; ; {
+			if _, taken := idx.suffixes[suffix]; !taken {
+				idx.suffixes[suffix] = full
+			}
+			i := strings.IndexByte(suffix, '/')
+			if i < 0 {
+				break
+			}
+			suffix = suffix[i+1:]
+		}
+	}
+	headerIndexes[sysDir] = idx
+	return idx
+}
+
+// walkHeaders lists the files under sysDir, at most headerIndexDepth levels deep.
+func walkHeaders(sysDir string) []string {
+	return walkFiles(sysDir, headerIndexDepth)
+}
@@ -0,0 +1,630 @@
+package orchideous
+
+import (
+	"errors"
+	"os/exec"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// includeDirective is a single #include found in a source file.
+type includeDirective struct {
+	name   string
+	system bool // true for #include <...>, false for #include "..."
+}
+
+// includeNames returns the names of the given include directives, in order.
+func includeNames(dirs []includeDirective) []string {
+	names := make([]string, 0, len(dirs))
+	for _, d := range dirs {
+		names = append(names, d.name)
+	}
+	return names
+}
+
+// errUnevaluable is returned for preprocessor constructs that the native
+// scanner can not evaluate, such as function-like macros or __has_include.
+var errUnevaluable = errors.New("unevaluable preprocessor expression")
+
+// ppMacro is a macro definition, as captured from "cpp -dM" or a #define.
+type ppMacro struct {
+	body       string
+	isFunction bool
+}
+
+var (
+	predefinedOnce  sync.Once
+	predefinedTable map[string]ppMacro
+)
+
+// predefinedMacros returns the macros predefined by the C preprocessor,
+// captured once with "cpp -dM -E". Returns nil if cpp is unavailable.
+func predefinedMacros() map[string]ppMacro {
+	predefinedOnce.Do(func() {
+		cmd := exec.Command("cpp", "-dM", "-E", "-")
+		cmd.Stdin = strings.NewReader("")
+		out, err := runOutput(cmd)
+		if err != nil {
+			return
+		}
+		table := make(map[string]ppMacro)
+		for _, line := range strings.Split(string(out), "\n") {
+			if rest, ok := strings.CutPrefix(line, "#define "); ok {
+				defineMacro(table, rest)
+			}
+		}
+		predefinedTable = table
+	})
+	return predefinedTable
+}
+
+// defineMacro adds the macro from the text following "#define" to the table.
+func defineMacro(table map[string]ppMacro, rest string) {
+	rest = strings.TrimSpace(rest)
+	end := 0
+	for end < len(rest) && isIdentChar(rest[end]) {
+		end++
+	}
+	if end == 0 {
+		return
+	}
+	name := rest[:end]
+	if end < len(rest) && rest[end] == '(' {
+		table[name] = ppMacro{isFunction: true}
+		return
+	}
+	table[name] = ppMacro{body: strings.TrimSpace(rest[end:])}
+}
+
+// scanIncludes returns the #include directives of a source file that survive
+// preprocessing. Conditionals are evaluated in-process, against the predefined
+// macros of the preprocessor and the macros defined in the file itself. Only
+// files with constructs the native scanner can not evaluate are run through
+// cpp. Results are memoized for as long as the file is unchanged.
+// Returns nil if neither the native scan nor cpp worked.
+func scanIncludes(filename string) []includeDirective {
+	return scanSource(filename).survivingIncludes(filename)
+}
+
+// ppFrame is one level of #if nesting.
+type ppFrame struct {
+	parentActive bool // the enclosing region is active
+	active       bool // the current branch is active
+	taken        bool // a branch of this conditional has already been active
+}
+
+// nativeScanIncludes evaluates the conditionals in a source file and returns
+// the includes in active regions. Returns errUnevaluable if the file uses
+// constructs that require the real preprocessor.
+func nativeScanIncludes(data []byte) ([]includeDirective, error) {
+	predefined := predefinedMacros()
+	if predefined == nil {
+		return nil, errUnevaluable
+	}
+	macros := make(map[string]ppMacro, len(predefined))
+	for k, v := range predefined {
+		macros[k] = v
+	}
+
+	includes := []includeDirective{}
+	var stack []ppFrame
+	active := true
+
+	for _, line := range logicalLines(string(data)) {
+		line = strings.TrimSpace(line)
+		if !strings.HasPrefix(line, "#") {
+			continue
+		}
+		line = strings.TrimSpace(line[1:])
+		end := 0
+		for end < len(line) && isIdentChar(line[end]) {
+			end++
+		}
+		directive, rest := line[:end], strings.TrimSpace(line[end:])
+
+		switch directive {
+		case "if", "ifdef", "ifndef":
+			frame := ppFrame{parentActive: active}
+			if active {
+				cond, err := evalCondition(directive, rest, macros)
+				if err != nil {
+					return nil, err
+				}
+				frame.active = cond
+				frame.taken = cond
+			}
+			stack = append(stack, frame)
+			active = frame.active
+		case "elif", "elifdef", "elifndef":
+			if len(stack) == 0 {
+				continue
+			}
+			frame := &stack[len(stack)-1]
+			frame.active = false
+			if frame.parentActive && !frame.taken {
+				cond, err := evalCondition(strings.TrimPrefix(directive, "el"), rest, macros)
+				if err != nil {
+					return nil, err
+				}
+				frame.active = cond
+				frame.taken = cond
+			}
+			active = frame.active
+		case "else":
+			if len(stack) == 0 {
+				continue
+			}
+			frame := &stack[len(stack)-1]
+			frame.active = frame.parentActive && !frame.taken
+			frame.taken = true
+			active = frame.active
+		case "endif":
+			if len(stack) == 0 {
+				continue
+			}
+			active = stack[len(stack)-1].parentActive
+			stack = stack[:len(stack)-1]
+		case "define":
+			if active {
+				defineMacro(macros, rest)
+			}
+		case "undef":
+			if active {
+				delete(macros, strings.TrimSpace(rest))
+			}
+		case "include", "include_next":
+			if !active {
+				continue
+			}
+			inc, ok := parseIncludeTarget(rest)
+			if !ok {
+				// #include MACRO: only a simple object-like macro can be resolved
+				m, found := macros[rest]
+				if !found || m.isFunction {
+					return nil, errUnevaluable
+				}
+				if inc, ok = parseIncludeTarget(m.body); !ok {
+					return nil, errUnevaluable
+				}
+			}
+			includes = append(includes, inc)
+		}
+	}
+	return includes, nil
+}
+
+// parseIncludeTarget parses the <...> or "..." part of an #include directive.
+func parseIncludeTarget(s string) (includeDirective, bool) {
+	if len(s) < 2 {
+		return includeDirective{}, false
+	}
+	switch s[0] {
+	case '<':
+		if end := strings.IndexByte(s, '>'); end > 1 {
+			return includeDirective{name: s[1:end], system: true}, true
+		}
+	case '"':
+		if end := strings.IndexByte(s[1:], '"'); end > 0 {
+			return includeDirective{name: s[1 : end+1]}, true
+		}
+	}
+	return includeDirective{}, false
+}
+
+// logicalLines splits source code into lines, after joining backslash
+// continuations and replacing comments with a single space, as the first
+// translation phases of the preprocessor do. String, character and raw
+// string literals are kept as they are.
+func logicalLines(src string) []string {
+	src = strings.ReplaceAll(src, "\r\n", "\n")
+	src = strings.ReplaceAll(src, "\\\n", "")
+
+	var b strings.Builder
+	b.Grow(len(src))
+	for i := 0; i < len(src); i++ {
+		c := src[i]
+		switch {
+		case c == '/' && i+1 < len(src) && src[i+1] == '/':
+			for i < len(src) && src[i] != '\n' {
+				i++
+			}
+			b.WriteByte(' ')
+			if i < len(src) {
+				b.WriteByte('\n')
+			}
+		case c == '/' && i+1 < len(src) && src[i+1] == '*':
+			end := strings.Index(src[i+2:], "*/")
+			if end < 0 {
+				i = len(src)
+			} else {
+				i += end + 3
+			}
+			b.WriteByte(' ')
+		case c == 'R' && i+1 < len(src) && src[i+1] == '"' && (i == 0 || !isIdentChar(src[i-1]) || src[i-1] == 'u' || src[i-1] == 'U' || src[i-1] == 'L' || src[i-1] == '8'):
+			// Raw string literal: R"delim( ... )delim"
+			open := strings.IndexByte(src[i+2:], '(')
+			if open < 0 {
+				b.WriteByte(c)
+				continue
+			}
+			closing := ")" + src[i+2:i+2+open] + `"`
+			end := strings.Index(src[i+2+open:], closing)
+			if end < 0 {
+				b.WriteString(src[i:])
+				i = len(src)
+				continue
+			}
+			stop := i + 2 + open + end + len(closing)
+			b.WriteString(src[i:stop])
+			i = stop - 1
+		case c == '"' || c == '\'':
+			j := i + 1
+			for j < len(src) && src[j] != c && src[j] != '\n' {
+				if src[j] == '\\' {
+					j++
+				}
+				j++
+			}
+			if j >= len(src) {
+				j = len(src) - 1
+			}
+			b.WriteString(src[i : j+1])
+			i = j
+		default:
+			b.WriteByte(c)
+		}
+	}
+	return strings.Split(b.String(), "\n")
+}
+
+// evalCondition evaluates the condition of an #if, #ifdef or #ifndef directive.
+func evalCondition(directive, expr string, macros map[string]ppMacro) (bool, error) {
+	switch directive {
+	case "ifdef", "ifndef":
+		name := strings.TrimSpace(expr)
+		if i := strings.IndexFunc(name, func(r rune) bool { return r == ' ' || r == '\t' }); i >= 0 {
+			name = name[:i]
+		}
+		_, defined := macros[name]
+		return defined == (directive == "ifdef"), nil
+	}
+	v, err := evalPPExpression(expr, macros)
+	return v != 0, err
+}
+
+// evalPPExpression evaluates a preprocessor #if expression. Identifiers that
+// are not macros evaluate to 0, as in the C standard.
+func evalPPExpression(expr string, macros map[string]ppMacro) (int64, error) {
+	tokens, err := ppTokenize(expr)
+	if err != nil {
+		return 0, err
+	}
+	tokens, err = ppExpand(tokens, macros, nil, 0)
+	if err != nil {
+		return 0, err
+	}
+	p := ppParser{tokens: tokens}
+	v, err := p.ternary()
+	if err != nil {
+		return 0, err
+	}
+	if p.pos != len(p.tokens) {
+		return 0, errUnevaluable
+	}
+	return v, nil
+}
+
+// ppTokenize splits a preprocessor expression into identifiers, numbers,
+// character literals and operators.
+func ppTokenize(s string) ([]string, error) {
+	var tokens []string
+	for i := 0; i < len(s); {
+		c := s[i]
+		switch {
+		case c == ' ' || c == '\t':
+			i++
+		case isIdentChar(c):
+			j := i
+			for j < len(s) && (isIdentChar(s[j]) || (s[j] == '\'' && isDigit(c) && j+1 < len(s) && isIdentChar(s[j+1]))) {
+				j++
+			}
+			tokens = append(tokens, s[i:j])
+			i = j
+		case c == '\'':
+			j := i + 1
+			for j < len(s) && s[j] != '\'' {
+				if s[j] == '\\' {
+					j++
+				}
+				j++
+			}
+			if j >= len(s) {
+				return nil, errUnevaluable
+			}
+			tokens = append(tokens, s[i:j+1])
+			i = j + 1
+		default:
+			op := ""
+			for _, candidate := range []string{"<<", ">>", "<=", ">=", "==", "!=", "&&", "||"} {
+				if strings.HasPrefix(s[i:], candidate) {
+					op = candidate
+					break
+				}
+			}
+			if op == "" {
+				if !strings.ContainsRune("()!~+-*/%<>&^|?:", rune(c)) {
+					return nil, errUnevaluable
+				}
+				op = string(c)
+			}
+			tokens = append(tokens, op)
+			i += len(op)
+		}
+	}
+	return tokens, nil
+}
+
+// ppExpand replaces "defined" operators and object-like macros in the tokens.
+// Function-like macro invocations can not be evaluated natively.
+func ppExpand(tokens []string, macros map[string]ppMacro, hidden map[string]bool, depth int) ([]string, error) {
+	if depth > 64 {
+		return nil, errUnevaluable
+	}
+	var out []string
+	for i := 0; i < len(tokens); i++ {
+		tok := tokens[i]
+		if !isIdentChar(tok[0]) || isDigit(tok[0]) {
+			out = append(out, tok)
+			continue
+		}
+		if tok == "defined" {
+			name := ""
+			if i+1 < len(tokens) && tokens[i+1] == "(" {
+				if i+3 >= len(tokens) || tokens[i+3] != ")" {
+					return nil, errUnevaluable
+				}
+				name = tokens[i+2]
+				i += 3
+			} else if i+1 < len(tokens) {
+				name = tokens[i+1]
+				i++
+			} else {
+				return nil, errUnevaluable
+			}
+			if _, ok := macros[name]; ok {
+				out = append(out, "1")
+			} else {
+				out = append(out, "0")
+			}
+			continue
+		}
+		nextIsParen := i+1 < len(tokens) && tokens[i+1] == "("
+		m, ok := macros[tok]
+		if !ok || hidden[tok] {
+			if nextIsParen {
+				// __has_include(...), __GNUC_PREREQ(...) and similar
+				return nil, errUnevaluable
+			}
+			out = append(out, "0")
+			continue
+		}
+		if m.isFunction {
+			if nextIsParen {
+				return nil, errUnevaluable
+			}
+			out = append(out, "0")
+			continue
+		}
+		body, err := ppTokenize(m.body)
+		if err != nil {
+			return nil, err
+		}
+		inner := map[string]bool{tok: true}
+		for k := range hidden {
+			inner[k] = true
+		}
+		expanded, err := ppExpand(body, macros, inner, depth+1)
+		if err != nil {
+			return nil, err
+		}
+		out = append(out, expanded...)
+	}
+	return out, nil
+}
+
+// ppParser evaluates expanded preprocessor tokens with the C operator precedence.
+type ppParser struct {
+	tokens []string
+	pos    int
+}
+
+func (p *ppParser) peek() string {
+	if p.pos < len(p.tokens) {
+		return p.tokens[p.pos]
+	}
+	return ""
+}
+
+func (p *ppParser) ternary() (int64, error) {
+	cond, err := p.binary(0)
+	if err != nil || p.peek() != "?" {
+		return cond, err
+	}
+	p.pos++
+	a, err := p.ternary()
+	if err != nil {
+		return 0, err
+	}
+	if p.peek() != ":" {
+		return 0, errUnevaluable
+	}
+	p.pos++
+	b, err := p.ternary()
+	if err != nil {
+		return 0, err
+	}
+	if cond != 0 {
+		return a, nil
+	}
+	return b, nil
+}
+
+// ppBinaryLevels lists the binary operators, from the lowest to the highest precedence.
+var ppBinaryLevels = [][]string{
+	{"||"}, {"&&"}, {"|"}, {"^"}, {"&"}, {"==", "!="}, {"<", "<=", ">", ">="}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"},
+}
+
+func (p *ppParser) binary(level int) (int64, error) {
+	if level == len(ppBinaryLevels) {
+		return p.unary()
+	}
+	lhs, err := p.binary(level + 1)
+	if err != nil {
+		return 0, err
+	}
+	for {
+		op := p.peek()
+		found := false
+		for _, candidate := range ppBinaryLevels[level] {
+			if op == candidate {
+				found = true
+				break
+			}
+		}
+		if !found {
+			return lhs, nil
+		}
+		p.pos++
+		rhs, err := p.binary(level + 1)
+		if err != nil {
+			return 0, err
+		}
+		if lhs, err = ppApply(op, lhs, rhs); err != nil {
+			return 0, err
+		}
+	}
+}
+
+func ppApply(op string, a, b int64) (int64, error) {
+	boolInt := func(v bool) int64 {
+		if v {
+			return 1
+		}
+		return 0
+	}
+	switch op {
+	case "||":
+		return boolInt(a != 0 || b != 0), nil
+	case "&&":
+		return boolInt(a != 0 && b != 0), nil
+	case "|":
+		return a | b, nil
+	case "^":
+		return a ^ b, nil
+	case "&":
+		return a & b, nil
+	case "==":
+		return boolInt(a == b), nil
+	case "!=":
+		return boolInt(a != b), nil
+	case "<":
+		return boolInt(a < b), nil
+	case "<=":
+		return boolInt(a <= b), nil
+	case ">":
+		return boolInt(a > b), nil
+	case ">=":
+		return boolInt(a >= b), nil
+	case "<<":
+		return a << uint64(b&63), nil
+	case ">>":
+		return a >> uint64(b&63), nil
+	case "+":
+		return a + b, nil
+	case "-":
+		return a - b, nil
+	case "*":
+		return a * b, nil
+	case "/", "%":
+		if b == 0 {
+			return 0, errUnevaluable
+		}
+		if op == "/" {
+			return a / b, nil
+		}
+		return a % b, nil
+	}
+	return 0, errUnevaluable
+}
+
+func (p *ppParser) unary() (int64, error) {
+	switch tok := p.peek(); tok {
+	case "!", "~", "-", "+":
+		p.pos++
+		v, err := p.unary()
+		if err != nil {
+			return 0, err
+		}
+		switch tok {
+		case "!":
+			if v == 0 {
+				return 1, nil
+			}
+			return 0, nil
+		case "~":
+			return ^v, nil
+		case "-":
+			return -v, nil
+		}
+		return v, nil
+	case "(":
+		p.pos++
+		v, err := p.ternary()
+		if err != nil {
+			return 0, err
+		}
+		if p.peek() != ")" {
+			return 0, errUnevaluable
+		}
+		p.pos++
+		return v, nil
+	case "":
+		return 0, errUnevaluable
+	default:
+		p.pos++
+		return ppNumber(tok)
+	}
+}
+
+// ppNumber parses an integer or character literal in a preprocessor expression.
+func ppNumber(tok string) (int64, error) {
+	if strings.HasPrefix(tok, "'") {
+		s, err := strconv.Unquote(tok)
+		if err != nil || len(s) == 0 {
+			return 0, errUnevaluable
+		}
+		return int64(s[0]), nil
+	}
+	if !isDigit(tok[0]) {
+		return 0, errUnevaluable
+	}
+	tok = strings.TrimRight(tok, "uUlL")
+	tok = strings.ReplaceAll(tok, "'", "")
+	if len(tok) > 1 && tok[0] == '0' && isDigit(tok[1]) {
+		tok = "0o" + tok[1:]
+	}
+	v, err := strconv.ParseUint(tok, 0, 64)
+	if err != nil {
+		return 0, errUnevaluable
+	}
+	return int64(v), nil
+}
+
+func isIdentChar(c byte) bool {
+	return c == '_' || isLetter(c) || isDigit(c)
+}
+
+func isDigit(c byte) bool {
+	return c >= '0' && c <= '9'
+}
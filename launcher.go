@@ -0,0 +1,160 @@
+package orchideous
+
+import (
+	"encoding/json"
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"slices"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+var (
+	launcherOnce sync.Once
+	launcherPath string
+)
+
+// compilerLauncher returns the compiler cache that object compiles are run
+// through, such as ccache or sccache, or "" if there is none. The launcher
+// is OH_CACHE if set, or else the first of ccache and sccache in PATH.
+// OH_CACHE=0 turns it off.
+func compilerLauncher() string {
+	launcherOnce.Do(func() {
+		launcherPath = findCompilerLauncher(os.Getenv("OH_CACHE"))
+	})
+	return launcherPath
+}
+
+// findCompilerLauncher resolves an OH_CACHE setting to the path of a launcher.
+func findCompilerLauncher(setting string) string {
+	switch strings.ToLower(setting) {
+	case "0", "no", "off", "false", "none":
+		return ""
+	case "":
+		for _, name := range []string{"ccache", "sccache"} {
+			if path, err := exec.LookPath(name); err == nil {
+				return path
+			}
+		}
+		return ""
+	}
+	path, err := exec.LookPath(setting)
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "warning: OH_CACHE=%s not found, compiling without a compiler cache\n", setting)
+		return ""
+	}
+	return path
+}
+
+// launchedCommand returns the command and arguments for running the compiler
+// with args, through the compiler cache if this is an object compile. Links,
+// and compile-and-link steps, which compiler caches can not cache, are run
+// directly. Object compiles that are sent to build hosts go through distcc,
+// or through ccache, which calls distcc, but not through other launchers.
+// The environment they need is in remoteEnv.
+func launchedCommand(compiler string, args []string) (string, []string) {
+	launcher := compilerLauncher()
+	if !slices.Contains(args, "-c") {
+		return compiler, args
+	}
+	if b := remoteCompiles(); b != nil && !isCcache(launcher) {
+		launcher = b.distcc
+	}
+	if launcher == "" {
+		return compiler, args
+	}
+	return launcher, append([]string{compiler}, args...)
+}
+
+// launcherStats is a snapshot of the hit and miss counters of a compiler cache.
+type launcherStats struct {
+	hits, misses int64
+}
+
+// readLauncherStats returns the current counters of the compiler cache.
+// Returns false if there is no launcher, or its statistics can not be read.
+func readLauncherStats() (launcherStats, bool) {
+	launcher := compilerLauncher()
+	if launcher == "" {
+		return launcherStats{}, false
+	}
+	if strings.HasPrefix(filepath.Base(launcher), "sccache") {
+		out, err := commandOutput(launcher, "--show-stats", "--stats-format", "json")
+		if err != nil {
+			return launcherStats{}, false
+		}
+		return parseSccacheStats(out)
+	}
+	out, err := commandOutput(launcher, "--print-stats")
+	if err != nil {
+		return launcherStats{}, false
+	}
+	return parseCcacheStats(out)
+}
+
+// parseCcacheStats parses the output of "ccache --print-stats", which has
+// one tab separated counter per line.
+func parseCcacheStats(out []byte) (launcherStats, bool) {
+	var st launcherStats
+	found := false
+	for _, line := range strings.Split(string(out), "\n") {
+		name, value, ok := strings.Cut(line, "\t")
+		if !ok {
+			continue
+		}
+		n, err := strconv.ParseInt(strings.TrimSpace(value), 10, 64)
+		if err != nil {
+			continue
+		}
+		switch name {
+		case "direct_cache_hit", "preprocessed_cache_hit":
+			st.hits += n
+			found = true
+		case "cache_miss":
+			st.misses += n
+			found = true
+		}
+	}
+	return st, found
+}
+
+// parseSccacheStats parses the output of "sccache --show-stats --stats-format json".
+func parseSccacheStats(out []byte) (launcherStats, bool) {
+	var doc struct {
+		Stats struct {
+			CacheHits   struct{ Counts map[string]int64 } `json:"cache_hits"`
+			CacheMisses struct{ Counts map[string]int64 } `json:"cache_misses"`
+		} `json:"stats"`
+	}
+	if err := json.Unmarshal(out, &doc); err != nil {
+		return launcherStats{}, false
+	}
+	var st launcherStats
+	for _, n := range doc.Stats.CacheHits.Counts {
+		st.hits += n
+	}
+	for _, n := range doc.Stats.CacheMisses.Counts {
+		st.misses += n
+	}
+	return st, true
+}
+
+// reportLauncherStats prints the hits and misses of the compiler cache since before.
+func reportLauncherStats(dirName string, before launcherStats, ok bool) {
+	if !ok {
+		return
+	}
+	after, ok := readLauncherStats()
+	if !ok {
+		return
+	}
+	hits, misses := after.hits-before.hits, after.misses-before.misses
+	if hits+misses <= 0 {
+		return
+	}
+	fmt.Printf("[%s] %s: %d hits, %d misses (%d%% hit rate)\n", dirName, filepath.Base(compilerLauncher()),
+		hits, misses, hits*100/(hits+misses))
+}
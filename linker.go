@@ -0,0 +1,126 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+)
+
+// linkerCandidates are the linkers that are picked automatically, fastest
+// first, with the executable that has to be in PATH for each.
+var linkerCandidates = []struct{ name, executable string }{
+	{"mold", "mold"},
+	{"lld", "ld.lld"},
+}
+
+// selectLinker returns the -fuse-ld= flag for the fastest linker that works
+// with the compiler, or "" for the default linker. OH_LINKER picks a linker
+// by name, such as mold, lld, gold or bfd, and OH_LINKER=0 always uses the
+// default one. Linkers are only picked automatically for native ELF targets.
+func selectLinker(compiler string, win64 bool) string {
+	setting := os.Getenv("OH_LINKER")
+	switch strings.ToLower(setting) {
+	case "0", "no", "off", "none", "default":
+		return ""
+	case "":
+		if isDarwin() || win64 {
+			return ""
+		}
+		for _, c := range linkerCandidates {
+			if _, err := exec.LookPath(c.executable); err != nil {
+				continue
+			}
+			if compilerCanLinkCached(compiler, "-fuse-ld="+c.name) {
+				return "-fuse-ld=" + c.name
+			}
+		}
+		return ""
+	}
+	if !compilerCanLinkCached(compiler, "-fuse-ld="+setting) {
+		fmt.Fprintf(os.Stderr, "warning: %s can not link with OH_LINKER=%s, using the default linker\n", compiler, setting)
+		return ""
+	}
+	return "-fuse-ld=" + setting
+}
+
+// linkerStamp identifies which of the automatically picked linkers are
+// installed, so that the flag cache is invalidated when that changes.
+func linkerStamp() string {
+	var found []string
+	for _, c := range linkerCandidates {
+		if path, err := exec.LookPath(c.executable); err == nil {
+			found = append(found, path)
+		}
+	}
+	return "linkers:" + strings.Join(found, ",")
+}
+
+// gccMajorVersion returns the major version of a GCC compiler, or 0 if it
+// can not be found out, or if the compiler is clang.
+func gccMajorVersion(compiler string) int {
+	if p := compilerProfileOf(compiler); !p.Clang {
+		return p.Major
+	}
+	return 0
+}
+
+// linkArgs returns the arguments for linking objFiles into output.
+func linkArgs(flags BuildFlags, objFiles []string, output string) []string {
+	return withLinker(flags, linkCommandArgs(flags, objFiles, output))
+}
+
+// withLinker adds the selected linker and the LTO cache flags to the
+// arguments of a link. They are kept out of LDFlags, so that generated
+// build files do not depend on them.
+func withLinker(flags BuildFlags, args []string) []string {
+	if flags.Linker != "" {
+		args = append(args, flags.Linker)
+	}
+	if len(flags.LTOCache) > 0 {
+		// GCC requires the incremental LTO directory to exist
+		os.MkdirAll(projectFile(flags.Dir, ltoCacheDir), 0o755)
+		args = append(args, flags.LTOCache...)
+	}
+	return args
+}
+
+// ltoCacheDir is where the linker keeps the results of link time
+// optimization between builds, so that only changed objects are optimized again.
+var ltoCacheDir = filepath.Join(projectCacheDir, "lto")
+
+// ltoCacheFlags returns the link flags that make link time optimization
+// reuse the results for unchanged objects from ltoCacheDir: the ThinLTO cache
+// for clang with lld or on macOS, and -flto-incremental for GCC 15 and later.
+// Returns nil if the compiler and linker have no such cache.
+func ltoCacheFlags(compiler, linker string, win64 bool) []string {
+	if win64 {
+		return nil
+	}
+	if isEffectivelyClang(compiler) {
+		switch {
+		case isDarwin():
+			return []string{"-Wl,-cache_path_lto," + ltoCacheDir}
+		case linker == "-fuse-ld=lld":
+			return []string{"-Wl,--thinlto-cache-dir=" + ltoCacheDir}
+		}
+		return nil
+	}
+	if gccMajorVersion(compiler) >= 15 {
+		return []string{"-flto-incremental=" + ltoCacheDir}
+	}
+	return nil
+}
+
+// removeLTOCache removes the LTO cache, and the cache directory if it is then empty.
+func removeLTOCache() bool {
+	if _, err := os.Stat(ltoCacheDir); err != nil {
+		return false
+	}
+	if err := os.RemoveAll(ltoCacheDir); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
@@ -0,0 +1,386 @@
+package orchideous
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"io"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+)
+
+// buildManifestFile records, for each object file, the compile command and
+// the inputs it was built from, for each executable the link command, and
+// the other files and directories that the build writes, so that "oh clean"
+// can remove exactly what was built.
+var buildManifestFile = filepath.Join(projectCacheDir, "build.manifest")
+
+// manifestInput is the recorded state of one input file of an object.
+type manifestInput struct {
+	Size    int64
+	ModTime int64 // nanoseconds since the epoch
+	Hash    string
+}
+
+// manifestEntry is the recorded state of one object file, executable or
+// other artifact. Artifacts that are not built by a command, like a
+// generated source or a cache directory, only have a Config.
+type manifestEntry struct {
+	Command string                   `json:",omitempty"` // hash of the compiler and its arguments
+	Inputs  map[string]manifestInput `json:",omitempty"` // the source and the headers from its .d file
+	Config  string                   `json:",omitempty"` // the build directory name, like "debug-g++", or "" for none
+	Source  string                   `json:",omitempty"` // the source it was built from, the entry goes when the source does
+}
+
+// manifestConfig returns the configuration that files built with flags are
+// recorded under, which is the name of their build directory.
+func manifestConfig(flags BuildFlags) string {
+	if flags.ObjDir == "" {
+		return ""
+	}
+	return filepath.Base(flags.ObjDir)
+}
+
+// buildManifest decides which objects need to be recompiled. Input files are
+// first compared by size and mtime, and only hashed when those differ, so a
+// checkout or cache restore that touches files without changing them does
+// not trigger a rebuild. A changed compile command always does.
+type buildManifest struct {
+	mu      sync.Mutex
+	root    string // the project directory, that the paths in the manifest are relative to
+	path    string
+	Objects map[string]*manifestEntry
+	dirty   bool
+	current map[string]manifestInput // inputs examined during this run
+}
+
+// loadBuildManifest reads the build manifest of the current directory.
+// Returns nil if caching is disabled, in which case only mtimes are compared.
+func loadBuildManifest() *buildManifest {
+	return loadBuildManifestIn(mustGetwd())
+}
+
+// loadBuildManifestIn reads the build manifest of the project in root, so
+// that it can be used without changing directory.
+func loadBuildManifestIn(root string) *buildManifest {
+	if !cachingEnabled() {
+		return nil
+	}
+	m := &buildManifest{root: root, path: filepath.Join(root, buildManifestFile), current: make(map[string]manifestInput)}
+	if !readJSONFile(m.path, &m.Objects) || m.Objects == nil {
+		m.Objects = make(map[string]*manifestEntry)
+	}
+	return m
+}
+
+// commandHash identifies the exact command used to compile an object.
+func commandHash(flags BuildFlags, args []string) string {
+	return hashStrings(append([]string{flags.Compiler, flags.DockerImage}, args...)...)
+}
+
+// needsRecompile reports whether obj must be compiled again from src with args.
+func (m *buildManifest) needsRecompile(flags BuildFlags, src, obj string, args []string) bool {
+	if m == nil {
+		return needsRecompile(flags.Dir, src, obj)
+	}
+	if !fileExists(m.abs(obj)) {
+		return true
+	}
+	m.mu.Lock()
+	entry := m.Objects[obj]
+	m.mu.Unlock()
+	if entry == nil {
+		// Built before there was a manifest: trust the mtimes this once
+		if needsRecompile(m.root, src, obj) {
+			return true
+		}
+		m.record(flags, src, obj, args)
+		return false
+	}
+	if entry.Command != commandHash(flags, args) {
+		return true
+	}
+	if _, ok := entry.Inputs[src]; !ok {
+		return true
+	}
+	for path, recorded := range entry.Inputs {
+		cur, ok := m.inputState(path, recorded)
+		if !ok || cur.Hash != recorded.Hash {
+			return true
+		}
+		if cur.ModTime != recorded.ModTime || cur.Size != recorded.Size {
+			m.mu.Lock()
+			entry.Inputs[path] = cur
+			m.dirty = true
+			m.mu.Unlock()
+		}
+	}
+	return false
+}
+
+// record stores the command and the current inputs of a freshly compiled object.
+func (m *buildManifest) record(flags BuildFlags, src, obj string, args []string) {
+	if m == nil {
+		return
+	}
+	entry := &manifestEntry{Command: commandHash(flags, args), Inputs: make(map[string]manifestInput), Config: manifestConfig(flags), Source: src}
+	for _, path := range append([]string{src}, depFileInputs(m.abs(obj))...) {
+		if _, seen := entry.Inputs[path]; seen {
+			continue
+		}
+		// Inputs examined before the compile keep that state, so that an edit
+		// made while compiling is picked up by the next build
+		if st, ok := m.inputState(path, manifestInput{}); ok {
+			entry.Inputs[path] = st
+		}
+	}
+	m.mu.Lock()
+	m.Objects[obj] = entry
+	m.dirty = true
+	m.mu.Unlock()
+}
+
+// linkedWith reports whether output was last linked with the same command.
+// Since every configuration has its own objects, this is what tells that an
+// executable that is newer than its objects was linked from other ones.
+// Without a manifest, only the mtimes are compared.
+func (m *buildManifest) linkedWith(flags BuildFlags, output string, args []string) bool {
+	if m == nil {
+		return true
+	}
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	entry := m.Objects[output]
+	return entry != nil && entry.Command == commandHash(flags, args)
+}
+
+// recordLink stores the command that output was linked with, and the main
+// source of the executable. The LTO cache that the link may have written to
+// is recorded too, as shared by every configuration.
+func (m *buildManifest) recordLink(flags BuildFlags, src, output string, args []string) {
+	if m == nil {
+		return
+	}
+	m.mu.Lock()
+	m.Objects[output] = &manifestEntry{Command: commandHash(flags, args), Config: manifestConfig(flags), Source: src}
+	if len(flags.LTOCache) > 0 {
+		m.Objects[ltoCacheDir] = &manifestEntry{}
+	}
+	m.dirty = true
+	m.mu.Unlock()
+}
+
+// recordArtifacts stores files or directories that were written in the
+// given configuration, without a command to build them.
+func (m *buildManifest) recordArtifacts(config string, paths ...string) {
+	if m == nil || len(paths) == 0 {
+		return
+	}
+	m.mu.Lock()
+	for _, path := range paths {
+		if entry := m.Objects[path]; entry == nil || entry.Command == "" {
+			m.Objects[path] = &manifestEntry{Config: config}
+		}
+	}
+	m.dirty = true
+	m.mu.Unlock()
+}
+
+// recordArtifacts stores artifacts in the build manifest of the project in
+// dir, for the writers that do not otherwise use the manifest. It must not
+// be called while the manifest is loaded elsewhere, or one of the two
+// records is lost when both are saved.
+func recordArtifacts(dir, config string, paths ...string) {
+	m := loadBuildManifestIn(dir)
+	m.recordArtifacts(config, paths...)
+	m.save()
+}
+
+// inputState returns the current size, mtime and hash of an input file. If the
+// size and mtime match the recorded state, the recorded hash is reused.
+// Returns false if the file does not exist.
+func (m *buildManifest) inputState(path string, recorded manifestInput) (manifestInput, bool) {
+	m.mu.Lock()
+	st, ok := m.current[path]
+	m.mu.Unlock()
+	if ok {
+		return st, st.Hash != ""
+	}
+	fi, err := os.Stat(m.abs(path))
+	if err == nil {
+		st = manifestInput{Size: fi.Size(), ModTime: fi.ModTime().UnixNano()}
+		if recorded.Hash != "" && st.Size == recorded.Size && st.ModTime == recorded.ModTime {
+			st.Hash = recorded.Hash
+		} else {
+			st.Hash = hashFile(m.abs(path))
+		}
+	}
+	m.mu.Lock()
+	m.current[path] = st
+	m.mu.Unlock()
+	return st, st.Hash != ""
+}
+
+// abs returns a path of the manifest relative to the project directory.
+func (m *buildManifest) abs(path string) string {
+	if filepath.IsAbs(path) {
+		return path
+	}
+	return filepath.Join(m.root, path)
+}
+
+// save writes the manifest back to disk if it has changed. The files built
+// from sources that no longer exist are removed first, so that the objects
+// of removed or renamed sources do not pile up.
+func (m *buildManifest) save() {
+	if m == nil {
+		return
+	}
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if len(pruneRemovedSources(m.root, m.Objects)) > 0 {
+		m.dirty = true
+	}
+	if !m.dirty {
+		return
+	}
+	if err := writeJSONFile(m.path, m.Objects); err == nil {
+		m.dirty = false
+	}
+}
+
+// hashFile returns a hex encoded SHA-256 hash of the contents of a file,
+// or an empty string if it can not be read.
+func hashFile(path string) string {
+	f, err := os.Open(path)
+	if err != nil {
+		return ""
+	}
+	defer f.Close()
+	h := sha256.New()
+	if _, err := io.Copy(h, f); err != nil {
+		return ""
+	}
+	return hex.EncodeToString(h.Sum(nil))
+}
+
+// depFileInputs returns the dependencies listed in the .d file next to obj,
+// as written by the compiler for -MMD. Returns nil if there is no .d file.
+func depFileInputs(obj string) []string {
+	data, err := os.ReadFile(strings.TrimSuffix(obj, ".o") + ".d")
+	if err != nil {
+		return nil
+	}
+	// Parse the .d file: format is "obj: src header1 header2 ..."
+	// Lines may be continued with backslash
+	var deps []string
+	content := strings.ReplaceAll(string(data), "\\\n", " ")
+	for _, line := range strings.Split(content, "\n") {
+		target, after, ok := strings.Cut(line, ":")
+		if !ok || strings.HasSuffix(strings.TrimSpace(target), ".c++m") {
+			// The rules for the modules that GCC writes with -fmodules-ts
+			continue
+		}
+		after, _, _ = strings.Cut(after, "|") // order-only prerequisites
+		for _, dep := range strings.Fields(after) {
+			if !strings.HasSuffix(dep, ".c++m") {
+				deps = append(deps, dep)
+			}
+		}
+	}
+	return deps
+}
+
+// objectSideFiles are the extensions of the files that the compiler and the
+// instrumented executables write next to an object file.
+var objectSideFiles = []string{".d", ".dwo", ".gcno", ".gcda"}
+
+// matchesConfig reports whether a configuration is selected by name, which
+// is either the full name of a build directory, like "opt-fp-g++", or the
+// start of it, like "debug" for all the debug builds. An empty name selects
+// every configuration.
+func matchesConfig(config, name string) bool {
+	return name == "" || config == name || strings.HasPrefix(config, name+"-")
+}
+
+// removeArtifact removes a file or directory of the build manifest, and the
+// files next to it if it is an object. Returns the removed paths.
+func removeArtifact(root, path string) []string {
+	var removed []string
+	remove := func(path string) {
+		full := projectFile(root, path)
+		if fi, err := os.Lstat(full); err == nil && fi.IsDir() {
+			if os.RemoveAll(full) == nil {
+				removed = append(removed, path)
+			}
+		} else if err == nil && os.Remove(full) == nil {
+			removed = append(removed, path)
+		}
+	}
+	remove(path)
+	if strings.HasSuffix(path, ".o") {
+		for _, ext := range objectSideFiles {
+			remove(strings.TrimSuffix(path, ".o") + ext)
+		}
+	}
+	return removed
+}
+
+// pruneRemovedSources removes the files of the manifest entries in the
+// project in root whose source no longer exists, and the entries.
+// Returns the removed paths.
+func pruneRemovedSources(root string, objects map[string]*manifestEntry) []string {
+	var removed []string
+	for _, path := range sortedKeys(objects) {
+		if entry := objects[path]; entry != nil && entry.Source != "" && !fileExists(projectFile(root, entry.Source)) {
+			removed = append(removed, removeArtifact(root, path)...)
+			delete(objects, path)
+		}
+	}
+	return removed
+}
+
+// cleanArtifacts removes the files and directories in the build manifest
+// that were written in the configurations selected by name, see
+// matchesConfig, and the build directories of those configurations. They
+// are removed one by one, without searching for them, so objects below src/
+// or ../common are found as well. Returns the removed paths, and false if
+// there is no manifest to go by, in which case only the build directories
+// are removed.
+func cleanArtifacts(name string) ([]string, bool) {
+	var objects map[string]*manifestEntry
+	hasManifest := readJSONFile(buildManifestFile, &objects)
+	removed := pruneRemovedSources("", objects)
+	for _, path := range sortedKeys(objects) {
+		entry := objects[path]
+		if entry == nil || !matchesConfig(entry.Config, name) {
+			continue
+		}
+		removed = append(removed, removeArtifact("", path)...)
+		delete(objects, path)
+	}
+	if dirs, err := os.ReadDir(buildRoot); err == nil {
+		for _, d := range dirs {
+			if dir := filepath.Join(buildRoot, d.Name()); d.IsDir() && matchesConfig(d.Name(), name) && os.RemoveAll(dir) == nil {
+				removed = append(removed, dir)
+			}
+		}
+		os.Remove(buildRoot) // only succeeds if empty
+	}
+	if len(objects) > 0 {
+		writeJSONFile(buildManifestFile, objects)
+	} else if removeBuildManifest() {
+		removed = append(removed, buildManifestFile)
+	}
+	return removed, hasManifest
+}
+
+// removeBuildManifest removes the build manifest, and the cache directory if it is then empty.
+func removeBuildManifest() bool {
+	if err := os.Remove(buildManifestFile); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
@@ -0,0 +1,427 @@
+package orchideous
+
+import (
+	"bytes"
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"regexp"
+	"slices"
+	"strings"
+	"sync"
+)
+
+var (
+	moduleDeclPattern = regexp.MustCompile(`^(export\s+)?module\s+([\w.]+(?::[\w.]+)?)\s*;`)
+	importPattern     = regexp.MustCompile(`^(?:export\s+)?import\s+([\w.]+(?::[\w.]+)?|:[\w.]+|<[^>]+>|"[^"]+")\s*;`)
+)
+
+// scanLineForModules records the module declaration and the imports of a
+// line that starts with module, export module, import or export import.
+func scanLineForModules(trimmed string, s *sourceScan) {
+	if m := moduleDeclPattern.FindStringSubmatch(trimmed); m != nil {
+		name := m[2]
+		if m[1] != "" || strings.Contains(name, ":") {
+			// An interface or partition unit, which is compiled to a module interface
+			s.module = name
+		} else {
+			// An implementation unit implicitly imports its module
+			s.imports = append(s.imports, name)
+		}
+		s.flags.HasModules = true
+		return
+	}
+	m := importPattern.FindStringSubmatch(trimmed)
+	if m == nil {
+		return
+	}
+	name := m[1]
+	switch {
+	case strings.HasPrefix(name, "<") || strings.HasPrefix(name, `"`):
+		s.headerUnits = append(s.headerUnits, name)
+	case strings.HasPrefix(name, ":"):
+		// A partition of the module of this unit
+		primary, _, _ := strings.Cut(s.module, ":")
+		s.imports = append(s.imports, primary+name)
+	default:
+		s.imports = append(s.imports, name)
+	}
+	s.flags.HasModules = true
+}
+
+// moduleInterfaceExts are the extensions of module interface units, which
+// GCC has to be told are C++.
+var moduleInterfaceExts = []string{".cppm", ".ixx", ".mpp"}
+
+// gcmDir is where GCC writes the compiled module interfaces of a build, one
+// directory per configuration so that the flags they were built with match.
+func gcmDir(flags BuildFlags) string {
+	return filepath.Join(flags.ObjDir, "gcm")
+}
+
+// pcmDir is where clang writes the compiled module interfaces of a build.
+func pcmDir(flags BuildFlags) string {
+	return filepath.Join(flags.ObjDir, "pcm")
+}
+
+// moduleFlags returns the flags that every compile of a project with modules
+// needs. Generated build files, which have no build directory, use the
+// gcm.cache directory that GCC uses by default.
+func moduleFlags(flags BuildFlags) []string {
+	if !flags.Modules {
+		return nil
+	}
+	if isEffectivelyClang(flags.Compiler) {
+		return []string{"-fprebuilt-module-path=" + pcmDir(flags)}
+	}
+	if flags.ObjDir == "" {
+		return []string{"-fmodules-ts"}
+	}
+	return []string{"-fmodules-ts", "-fmodule-mapper=|@g++-mapper-server -r" + gcmDir(flags)}
+}
+
+// moduleSourceArgs returns the arguments that go right before src when it is
+// compiled: the language of module interface units, where the compiler can
+// not tell it from the extension, and with clang where the compiled module
+// interface is written, so that importers find it by its name.
+func moduleSourceArgs(flags BuildFlags, src string) []string {
+	if !flags.Modules {
+		return nil
+	}
+	module := scanSource(projectFile(flags.Dir, src)).module
+	if std := stdModuleFor(flags.Compiler, src); std != nil {
+		module = std.Name
+	}
+	if module == "" {
+		return nil
+	}
+	if isEffectivelyClang(flags.Compiler) {
+		args := []string{"-fmodule-output=" + moduleBMI(flags, module)}
+		if filepath.Ext(src) != ".cppm" {
+			args = append(args, "-x", "c++-module")
+		}
+		return args
+	}
+	if slices.Contains(moduleInterfaceExts, filepath.Ext(src)) {
+		return []string{"-x", "c++"}
+	}
+	return nil
+}
+
+// moduleBMI returns the compiled module interface of a named module.
+func moduleBMI(flags BuildFlags, module string) string {
+	if isEffectivelyClang(flags.Compiler) {
+		return filepath.Join(pcmDir(flags), strings.ReplaceAll(module, ":", "-")+".pcm")
+	}
+	return filepath.Join(gcmDir(flags), module+".gcm")
+}
+
+// stdModule is a module of the standard library that the toolchain ships the
+// source of, such as std or std.compat.
+type stdModule struct {
+	Name        string
+	Source      string
+	IncludeDirs []string // system include directories that the source needs
+}
+
+var stdModules sync.Map // compiler -> []stdModule
+
+// stdModulesOf returns the standard library modules that the compiler can
+// build, from the modules.json that GCC 15 and libc++ 17 and later install
+// next to the library. Returns nil if there is none.
+func stdModulesOf(compiler string) []stdModule {
+	if mods, ok := stdModules.Load(compiler); ok {
+		return mods.([]stdModule)
+	}
+	var mods []stdModule
+	manifest := "libstdc++.modules.json"
+	if isEffectivelyClang(compiler) {
+		manifest = "libc++.modules.json"
+	}
+	out, err := commandOutput(compiler, "-print-file-name="+manifest)
+	path := strings.TrimSpace(string(out))
+	if err == nil && filepath.IsAbs(path) {
+		var doc struct {
+			Modules []struct {
+				Name           string `json:"logical-name"`
+				Source         string `json:"source-path"`
+				LocalArguments struct {
+					SystemIncludeDirectories []string `json:"system-include-directories"`
+				} `json:"local-arguments"`
+			} `json:"modules"`
+		}
+		if readJSONFile(path, &doc) {
+			dir := filepath.Dir(path)
+			resolve := func(p string) string {
+				if filepath.IsAbs(p) {
+					return p
+				}
+				return filepath.Join(dir, p)
+			}
+			for _, m := range doc.Modules {
+				mod := stdModule{Name: m.Name, Source: resolve(m.Source)}
+				for _, inc := range m.LocalArguments.SystemIncludeDirectories {
+					mod.IncludeDirs = append(mod.IncludeDirs, resolve(inc))
+				}
+				mods = append(mods, mod)
+			}
+		}
+	}
+	stdModules.Store(compiler, mods)
+	return mods
+}
+
+// stdModuleFor returns the standard library module that src is the source of, or nil.
+func stdModuleFor(compiler, src string) *stdModule {
+	if !filepath.IsAbs(src) {
+		return nil
+	}
+	for _, m := range stdModulesOf(compiler) {
+		if m.Source == src {
+			return &m
+		}
+	}
+	return nil
+}
+
+// headerUnit is a header that is imported, such as with import <vector>;,
+// and compiled once to a module interface.
+type headerUnit struct {
+	name   string // as imported, with the <> or ""
+	path   string // the header file, or "" if it was not found
+	bmi    string // the compiled module interface
+	system bool
+}
+
+// moduleGraph is the order in which the sources of a project that uses
+// modules have to be compiled: module interfaces before the sources that
+// import them, and header units before everything else.
+type moduleGraph struct {
+	sources  []string            // the sources, followed by the standard library modules they import
+	provider map[string]string   // module name -> the source of its interface
+	module   map[string]string   // source -> the module it is the interface of
+	imports  map[string][]string // source -> the module names it imports
+	units    map[string][]string // source -> the header units it imports
+	levels   map[string]int
+	unitJobs []headerUnit
+}
+
+// newModuleGraph scans srcs for module declarations and imports.
+func newModuleGraph(srcs []string, flags BuildFlags) *moduleGraph {
+	g := &moduleGraph{
+		sources:  slices.Clone(srcs),
+		provider: make(map[string]string),
+		imports:  make(map[string][]string),
+		units:    make(map[string][]string),
+		levels:   make(map[string]int),
+		module:   make(map[string]string),
+	}
+	var unitNames []string
+	for _, src := range srcs {
+		s := scanSource(projectFile(flags.Dir, src))
+		if s.module != "" {
+			g.provider[s.module] = src
+			g.module[src] = s.module
+		}
+		g.imports[src] = s.imports
+		g.units[src] = s.headerUnits
+		for _, u := range s.headerUnits {
+			if !slices.Contains(unitNames, u) {
+				unitNames = append(unitNames, u)
+			}
+		}
+	}
+	// import std; builds the module from the source the toolchain ships
+	for _, src := range srcs {
+		for _, name := range g.imports[src] {
+			if _, ok := g.provider[name]; ok || (name != "std" && name != "std.compat") {
+				continue
+			}
+			found := false
+			for _, m := range stdModulesOf(flags.Compiler) {
+				if m.Name == name {
+					g.provider[name] = m.Source
+					g.module[m.Source] = name
+					g.sources = append(g.sources, m.Source)
+					found = true
+				}
+			}
+			if !found {
+				fmt.Fprintf(os.Stderr, "warning: %s can not build the %s module, import std needs GCC 15, or clang with libc++ 17 or later\n",
+					filepath.Base(flags.Compiler), name)
+				g.provider[name] = ""
+			}
+		}
+	}
+	if len(unitNames) > 0 {
+		g.unitJobs = headerUnits(flags, unitNames)
+	}
+	for _, src := range g.sources {
+		g.level(src, map[string]bool{})
+	}
+	return g
+}
+
+// level returns how many interfaces deep src is: 0 if it imports nothing,
+// and one more than the deepest interface it imports otherwise.
+func (g *moduleGraph) level(src string, visiting map[string]bool) int {
+	if l, ok := g.levels[src]; ok {
+		return l
+	}
+	if visiting[src] {
+		return 0 // an import cycle, which the compiler reports
+	}
+	visiting[src] = true
+	l := 0
+	if len(g.units[src]) > 0 {
+		l = 1
+	}
+	for _, name := range g.imports[src] {
+		if p := g.provider[name]; p != "" && p != src {
+			l = max(l, g.level(p, visiting)+1)
+		}
+	}
+	g.levels[src] = l
+	return l
+}
+
+// dependsOn reports whether src imports a module or a header unit whose
+// compile is in stale.
+func (g *moduleGraph) dependsOn(src string, stale map[string]bool) bool {
+	for _, name := range g.imports[src] {
+		if p := g.provider[name]; p != "" && stale[p] {
+			return true
+		}
+	}
+	for _, u := range g.units[src] {
+		if stale[u] {
+			return true
+		}
+	}
+	return false
+}
+
+// headerUnits finds the headers that are imported, and where GCC puts their
+// compiled module interfaces. Clang builds header units differently, so
+// they are left to the compiler there, which reports them.
+func headerUnits(flags BuildFlags, names []string) []headerUnit {
+	if isEffectivelyClang(flags.Compiler) {
+		fmt.Fprintln(os.Stderr, "warning: header units are only built with GCC, use named modules or #include with clang")
+		return nil
+	}
+	var units []headerUnit
+	var input strings.Builder
+	for _, name := range names {
+		units = append(units, headerUnit{name: name, system: strings.HasPrefix(name, "<")})
+		input.WriteString("#include " + name + "\n")
+	}
+	// The headers that the compiler opens first from the top level are the imported ones, in order
+	args := []string{"-std=" + flags.Std, "-x", "c++", "-fsyntax-only", "-H", "-"}
+	for _, ip := range flags.IncPaths {
+		args = append(args, "-I"+ip)
+	}
+	var out bytes.Buffer
+	cmd := exec.Command(flags.Compiler, args...)
+	cmd.Dir = flags.Dir
+	cmd.Stdin = strings.NewReader(input.String())
+	cmd.Stdout = &out
+	cmd.Stderr = &out
+	runCommand(cmd)
+	i := 0
+	for _, line := range strings.Split(out.String(), "\n") {
+		if path, ok := strings.CutPrefix(line, ". "); ok && i < len(units) {
+			units[i].path = filepath.Clean(path)
+			i++
+		}
+	}
+	for i, u := range units {
+		if u.path == "" {
+			continue
+		}
+		if filepath.IsAbs(u.path) {
+			units[i].bmi = filepath.Join(gcmDir(flags), u.path+".gcm")
+		} else {
+			units[i].bmi = filepath.Join(gcmDir(flags), ",", u.path+".gcm")
+		}
+	}
+	return units
+}
+
+// headerUnitArgs returns the arguments for compiling a header unit.
+func headerUnitArgs(flags BuildFlags, u headerUnit) []string {
+	name := strings.Trim(u.name, `<>"`)
+	lang := "c++-user-header"
+	if u.system {
+		lang = "c++-system-header"
+	}
+	args := []string{"-std=" + flags.Std}
+	args = append(args, flags.CFlags...)
+	args = append(args, flags.Defines...)
+	for _, ip := range flags.IncPaths {
+		args = append(args, "-I"+ip)
+	}
+	args = append(args, moduleFlags(flags)...)
+	return append(args, "-x", lang, name)
+}
+
+// planModuleJobs orders the compile jobs of a project that uses modules. A
+// source is also recompiled when an interface or header unit that it
+// imports is, an interface when its compiled interface is missing, and the
+// header units that are missing or stale get jobs of their own, which come first.
+func planModuleJobs(g *moduleGraph, nodes []graphObject, flags BuildFlags, manifest *buildManifest) []compileJob {
+	stale := make(map[string]bool)
+	var jobs []compileJob
+	if flags.ObjDir != "" {
+		// The compilers write the interfaces of named modules here, but do not create it
+		os.MkdirAll(projectFile(flags.Dir, filepath.Dir(moduleBMI(flags, "m"))), 0o755)
+	}
+	for _, u := range g.unitJobs {
+		if u.bmi == "" {
+			continue
+		}
+		args := headerUnitArgs(flags, u)
+		if manifest.needsRecompile(flags, u.path, u.bmi, args) {
+			os.MkdirAll(projectFile(flags.Dir, filepath.Dir(u.bmi)), 0o755)
+			stale[u.name] = true
+			jobs = append(jobs, compileJob{src: u.path, obj: u.bmi, args: args, manifest: manifest})
+		}
+	}
+	byLevel := slices.Clone(nodes)
+	slices.SortStableFunc(byLevel, func(a, b graphObject) int { return g.levels[a.src] - g.levels[b.src] })
+	for _, node := range byLevel {
+		module := g.module[node.src]
+		if manifest.needsRecompile(flags, node.src, node.obj, node.args) || g.dependsOn(node.src, stale) ||
+			(module != "" && flags.ObjDir != "" && !fileExists(projectFile(flags.Dir, moduleBMI(flags, module)))) {
+			stale[node.src] = true
+			os.MkdirAll(projectFile(flags.Dir, filepath.Dir(node.obj)), 0o755)
+			jobs = append(jobs, compileJob{src: node.src, obj: node.obj, args: node.args, manifest: manifest, level: g.levels[node.src]})
+		}
+	}
+	return jobs
+}
+
+// compileWaves splits jobs into groups that can run in parallel, in order:
+// all the jobs of one level of the module graph at a time.
+func compileWaves(jobs []compileJob) [][]compileJob {
+	var waves [][]compileJob
+	for _, job := range jobs {
+		for len(waves) <= job.level {
+			waves = append(waves, nil)
+		}
+		waves[job.level] = append(waves[job.level], job)
+	}
+	return slices.DeleteFunc(waves, func(w []compileJob) bool { return len(w) == 0 })
+}
+
+// stdModuleIncludeArgs returns the include flags that compiling a standard
+// library module needs, if src is one.
+func stdModuleIncludeArgs(flags BuildFlags, src string) []string {
+	var args []string
+	if m := stdModuleFor(flags.Compiler, src); m != nil {
+		for _, dir := range m.IncludeDirs {
+			args = append(args, "-isystem", dir)
+		}
+	}
+	return args
+}
@@ -0,0 +1,146 @@
+package orchideous
+
+import (
+	"bytes"
+	"fmt"
+	"os"
+	"os/exec"
+	"strings"
+)
+
+// ninjaFile is the ninja build file that "oh ninja" writes.
+const ninjaFile = "build.ninja"
+
+// ninjaHeader marks a build.ninja as generated by oh, so that it can be
+// replaced without asking.
+const ninjaHeader = "# Generated by oh, do not edit\n"
+
+// doNinja writes a build.ninja for the project, from the build graph, and
+// builds it with ninja. There is no configure step: the compile rule reads
+// the .d files that -MMD writes with deps = gcc, so that ninja tracks the
+// headers and schedules the compiles in parallel on its own.
+func doNinja() error {
+	if _, err := exec.LookPath("ninja"); err != nil {
+		return fmt.Errorf("ninja not found in PATH")
+	}
+	if err := writeNinjaFile(); err != nil {
+		return err
+	}
+	ninja := exec.Command("ninja")
+	ninja.Stdout = os.Stdout
+	ninja.Stderr = os.Stderr
+	if err := runCommand(ninja); err != nil {
+		return fmt.Errorf("ninja failed: %w", err)
+	}
+	return nil
+}
+
+// writeNinjaFile writes build.ninja, unless there is one that oh did not generate.
+func writeNinjaFile() error {
+	if data, err := os.ReadFile(ninjaFile); err == nil && !bytes.HasPrefix(data, []byte(ninjaHeader)) {
+		return fmt.Errorf("not overwriting existing %s", ninjaFile)
+	}
+	_, g, err := projectGraph(BuildOptions{})
+	if err != nil {
+		return err
+	}
+	data := ninjaBuildFile(g, compilerLauncher())
+	if old, err := os.ReadFile(ninjaFile); err == nil && bytes.Equal(old, data) {
+		return nil // keep the timestamp, so that ninja does not restat everything
+	}
+	if err := os.WriteFile(ninjaFile, data, 0o644); err != nil {
+		return err
+	}
+	fmt.Println("Generated", ninjaFile)
+	return nil
+}
+
+// ninjaBuildFile returns the contents of a build.ninja for the build graph.
+// Objects are compiled through launcher, such as ccache, if it is not "".
+func ninjaBuildFile(g buildGraph, launcher string) []byte {
+	var buf bytes.Buffer
+	buf.WriteString(ninjaHeader)
+	buf.WriteString("ninja_required_version = 1.3\n\n")
+	fmt.Fprintf(&buf, "cxx = %s\n", g.flags.Compiler)
+	fmt.Fprintf(&buf, "cflags = %s\n", ninjaVar(objectCompileFlags(g.flags)))
+	fmt.Fprintf(&buf, "ldflags = %s\n\n", ninjaVar(g.flags.LDFlags))
+
+	compile := "$cxx"
+	if launcher != "" {
+		compile = launcher + " $cxx"
+	}
+	fmt.Fprintf(&buf, "rule cc\n  command = %s $cflags -c -o $out $in\n  depfile = $depfile\n  deps = gcc\n  description = CC $out\n\n", compile)
+	buf.WriteString("rule link\n  command = $cxx -o $out $in $ldflags\n  description = LINK $out\n\n")
+
+	for _, o := range g.objects {
+		fmt.Fprintf(&buf, "build %s: cc %s\n  depfile = %s\n", ninjaPath(o.obj), ninjaPath(o.src), ninjaPath(o.depFile()))
+	}
+	buf.WriteString("\n")
+	var tests []string
+	for _, t := range g.targets {
+		var objs []string
+		for _, obj := range t.objects {
+			objs = append(objs, ninjaPath(obj))
+		}
+		fmt.Fprintf(&buf, "build %s: link %s\n", ninjaPath(t.output), strings.Join(objs, " "))
+		if t.test {
+			tests = append(tests, ninjaPath(t.output))
+		}
+	}
+	if len(tests) > 0 {
+		fmt.Fprintf(&buf, "build tests: phony %s\n", strings.Join(tests, " "))
+	}
+	fmt.Fprintf(&buf, "\ndefault %s\n", ninjaPath(g.main().output))
+	return buf.Bytes()
+}
+
+// ninjaPath escapes a path for a build statement.
+func ninjaPath(path string) string {
+	r := strings.NewReplacer("$", "$$", " ", "$ ", ":", "$:")
+	return r.Replace(path)
+}
+
+// ninjaVar escapes arguments for a variable, which is passed to the shell as it is.
+func ninjaVar(args []string) string {
+	return strings.ReplaceAll(strings.Join(args, " "), "$", "$$")
+}
+
+// doCMakeNinja builds the project using CMake + Ninja.
+func doCMakeNinja() error {
+	if !fileExists("CMakeLists.txt") {
+		return fmt.Errorf("could not find CMakeLists.txt (run 'oh cmake' first)")
+	}
+
+	if _, err := exec.LookPath("ninja"); err != nil {
+		return fmt.Errorf("ninja not found in PATH")
+	}
+
+	// Remove and recreate build directory
+	os.RemoveAll("build")
+	if err := os.MkdirAll("build", 0o755); err != nil {
+		return err
+	}
+
+	// Run cmake in build/
+	cmakeArgs := []string{"-G", "Ninja", ".."}
+	if compilerLauncher() != "" {
+		cmakeArgs = []string{"-D", "CMAKE_CXX_COMPILER_LAUNCHER=" + compilerLauncher(), "-G", "Ninja", ".."}
+	}
+	cmake := exec.Command("cmake", cmakeArgs...)
+	cmake.Dir = "build"
+	cmake.Stdout = os.Stdout
+	cmake.Stderr = os.Stderr
+	if err := runCommand(cmake); err != nil {
+		return fmt.Errorf("cmake failed: %w", err)
+	}
+
+	// Run ninja in build/
+	ninja := exec.Command("ninja", "-C", "build")
+	ninja.Stdout = os.Stdout
+	ninja.Stderr = os.Stderr
+	if err := runCommand(ninja); err != nil {
+		return fmt.Errorf("ninja failed: %w", err)
+	}
+
+	return nil
+}
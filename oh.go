@@ -1,18 +1,38 @@
 package orchideous
 
+import "time"
+
 // Exported functions for use by cmd/oh
 
 func DoBuild(opts BuildOptions) error                          { return doBuild(opts) }
+func DoSizeBuild(opts BuildOptions) error                      { return doSizeBuild(opts) }
 func ExecutableName() string                                   { return executableName() }
-func GetTestSources() []string                                 { return getTestSources() }
-func DetectProject() Project                                   { return detectProject() }
+func GetTestSources() []string                                 { return getTestSources(".") }
+func GetBenchSources() []string                                { return getBenchSources(".") }
+func DetectProject() Project                                   { return detectProject(".") }
 func AssembleFlags(proj Project, opts BuildOptions) BuildFlags { return assembleFlags(proj, opts) }
 func CompileSources(srcs []string, output string, flags BuildFlags) error {
 	return compileSources(srcs, output, flags)
 }
+func DoTests(opts BuildOptions, topts TestOptions) error  { return doTests(opts, topts) }
+func ParseShard(s string) (int, int, error)               { return parseShard(s) }
+func DoBench(opts BuildOptions, bopts BenchOptions) error { return doBench(opts, bopts) }
+func DoRec(training PGOTraining) error                    { return doRec(training) }
+func DoBolt(training PGOTraining) error                   { return doBolt(training) }
+func DoPerf(runArgs []string) error                       { return doPerf(runArgs) }
+func DoAll(opts BuildOptions, dirs []string) error        { return doAll(opts, dirs) }
+func CleanArtifacts(name string) ([]string, bool)         { return cleanArtifacts(name) }
+func RecordArtifacts(paths ...string)                     { recordArtifacts(".", "", paths...) }
+func DoWatch(opts BuildOptions, run bool, runArgs []string) error {
+	return doWatch(opts, run, runArgs)
+}
+func DoOpenMPSweep(opts BuildOptions, runArgs []string) error {
+	return doOpenMPSweep(opts, runArgs)
+}
 func DoCMake(opts BuildOptions) error { return doCMake(opts) }
 func DoPro(opts BuildOptions) error   { return doPro(opts) }
 func DoNinja() error                  { return doNinja() }
+func DoCMakeNinja() error             { return doCMakeNinja() }
 func DoNinjaInstall() error           { return doNinjaInstall() }
 func DoNinjaClean()                   { doNinjaClean() }
 func DoInstall() error                { return doInstall() }
@@ -21,3 +41,19 @@ func DoExport() error                 { return doExport() }
 func DoMakeFile() error               { return doMakeFile() }
 func DoScript() error                 { return doScript() }
 func DotSlash(name string) string     { return dotSlash(name) }
+func OpenMPEnv() []string             { return openMPEnv() }
+func RemoveFlagCache() bool           { return removeFlagCache() }
+func RemoveBuildManifest() bool       { return removeBuildManifest() }
+func RemovePrecompiledHeader() bool   { return removePrecompiledHeader() }
+func RemoveUnityBatches() bool        { return removeUnityBatches() }
+func RemoveLTOCache() bool            { return removeLTOCache() }
+func RemoveBoltData() bool            { return removeBoltData() }
+func RemovePerfData() bool            { return removePerfData() }
+func RemoveBuildDirs() bool           { return removeBuildDirs() }
+func WriteTrace() error               { return writeTrace() }
+func CancelBuilds()                   { cancelBuilds() }
+func DoStats() error                  { return doStats() }
+func CheckSpawnBudget() error         { return checkSpawnBudget() }
+func WaitForBuilds(timeout time.Duration) bool {
+	return waitForBuilds(timeout)
+}
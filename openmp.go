@@ -0,0 +1,203 @@
+package orchideous
+
+import (
+	"errors"
+	"fmt"
+	"math"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"runtime"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// openMPSettingsFile holds the OpenMP environment variables that the last
+// sweep found to be the fastest, which "oh run" and "oh bench" then use.
+var openMPSettingsFile = filepath.Join(projectCacheDir, "openmp.json")
+
+// errNoOpenMP is returned when asked to sweep the OpenMP settings of a
+// project that does not use OpenMP.
+var errNoOpenMP = errors.New("no #pragma omp found, so there are no OpenMP settings to sweep")
+
+// openMPVars are the environment variables that a sweep sets, in the order
+// they are shown.
+var openMPVars = []string{"OMP_NUM_THREADS", "OMP_PROC_BIND", "OMP_PLACES", "OMP_SCHEDULE"}
+
+// openMPConfig is one set of OpenMP settings that a sweep measures.
+type openMPConfig struct {
+	threads  int
+	bind     string // OMP_PROC_BIND: false, close or spread
+	schedule string // OMP_SCHEDULE, or "" to leave it alone
+}
+
+// env returns the environment variables of the settings.
+func (c openMPConfig) env() map[string]string {
+	env := map[string]string{"OMP_NUM_THREADS": strconv.Itoa(c.threads), "OMP_PROC_BIND": c.bind}
+	if c.bind != "false" {
+		env["OMP_PLACES"] = "cores"
+	}
+	if c.schedule != "" {
+		env["OMP_SCHEDULE"] = c.schedule
+	}
+	return env
+}
+
+// sweepThreadCounts returns 1, 2, 4 ... up to and including cpus.
+func sweepThreadCounts(cpus int) []int {
+	var counts []int
+	for n := 1; n < cpus; n *= 2 {
+		counts = append(counts, n)
+	}
+	return append(counts, max(cpus, 1))
+}
+
+// usesRuntimeSchedule reports whether any of the sources has a loop with
+// schedule(runtime), which is the only kind that OMP_SCHEDULE changes.
+func usesRuntimeSchedule(srcs []string) bool {
+	for _, src := range srcs {
+		data, err := os.ReadFile(src)
+		if err == nil && strings.Contains(strings.ReplaceAll(string(data), " ", ""), "schedule(runtime)") {
+			return true
+		}
+	}
+	return false
+}
+
+// sweepOpenMP measures the configurations with measure, which returns a
+// time where lower is better, and prints how well each one scales compared
+// with one thread. If schedules is set, the schedules are tried first, with
+// all the threads, and the fastest is used for the rest of the sweep.
+// Returns the fastest configuration.
+func sweepOpenMP(measure func(env []string) (float64, error), unit string, schedules bool) (openMPConfig, error) {
+	run := func(c openMPConfig) (float64, error) {
+		env := os.Environ()
+		for _, name := range openMPVars {
+			if v, ok := c.env()[name]; ok {
+				env = append(env, name+"="+v)
+			}
+		}
+		return measure(env)
+	}
+	fmt.Printf("%7s %7s %9s %14s %9s %11s\n", "threads", "bind", "schedule", unit, "speedup", "efficiency")
+	var serial float64 // the fastest time with one thread, once it is known
+	show := func(c openMPConfig, t float64) {
+		schedule := c.schedule
+		if schedule == "" {
+			schedule = "-"
+		}
+		if serial == 0 {
+			fmt.Printf("%7d %7s %9s %14.3f %9s %11s\n", c.threads, c.bind, schedule, t, "-", "-")
+			return
+		}
+		speedup := serial / t
+		fmt.Printf("%7d %7s %9s %14.3f %8.2fx %10.0f%%\n", c.threads, c.bind, schedule, t, speedup,
+			100*speedup/float64(c.threads))
+	}
+	counts := sweepThreadCounts(runtime.NumCPU())
+	schedule := ""
+	if schedules {
+		fastest := math.Inf(1)
+		for _, s := range []string{"static", "dynamic", "guided"} {
+			c := openMPConfig{threads: counts[len(counts)-1], bind: "false", schedule: s}
+			t, err := run(c)
+			if err != nil {
+				return c, err
+			}
+			show(c, t)
+			if t < fastest {
+				schedule, fastest = s, t
+			}
+		}
+	}
+	best, bestTime := openMPConfig{}, math.Inf(1)
+	for _, threads := range counts {
+		for _, bind := range []string{"false", "close", "spread"} {
+			c := openMPConfig{threads: threads, bind: bind, schedule: schedule}
+			t, err := run(c)
+			if err != nil {
+				return best, err
+			}
+			if threads == 1 && (serial == 0 || t < serial) {
+				serial = t
+			}
+			show(c, t)
+			if t < bestTime {
+				best, bestTime = c, t
+			}
+		}
+	}
+	return best, nil
+}
+
+// saveOpenMPSettings writes the settings of c to the project.
+func saveOpenMPSettings(c openMPConfig) error {
+	if err := writeJSONFile(openMPSettingsFile, c.env()); err != nil {
+		return err
+	}
+	fmt.Printf("Saved %s to %s\n", formatOpenMPEnv(c.env()), openMPSettingsFile)
+	return nil
+}
+
+// openMPEnv returns the saved OpenMP settings as "NAME=value" strings, for
+// the variables that are not set in the environment already.
+func openMPEnv() []string {
+	settings := make(map[string]string)
+	if !readJSONFile(openMPSettingsFile, &settings) {
+		return nil
+	}
+	var env []string
+	for _, name := range openMPVars {
+		if v, ok := settings[name]; ok && os.Getenv(name) == "" {
+			env = append(env, name+"="+v)
+		}
+	}
+	return env
+}
+
+// formatOpenMPEnv formats the settings as NAME=value pairs, in order.
+func formatOpenMPEnv(env map[string]string) string {
+	var pairs []string
+	for _, name := range openMPVars {
+		if v, ok := env[name]; ok {
+			pairs = append(pairs, name+"="+v)
+		}
+	}
+	return strings.Join(pairs, " ")
+}
+
+// doOpenMPSweep builds the executable and runs it with the given arguments
+// for 1, 2, 4 ... threads, up to the number of CPUs, with the threads not
+// bound, or bound close together or spread over the cores. OMP_SCHEDULE is
+// also tried if a loop has schedule(runtime). The wall time and the scaling
+// efficiency of each run are printed, and the fastest settings are saved
+// for the next "oh run".
+func doOpenMPSweep(opts BuildOptions, runArgs []string) error {
+	proj := detectProject(".")
+	if !proj.HasOpenMP {
+		return errNoOpenMP
+	}
+	if err := doBuild(opts); err != nil {
+		return err
+	}
+	exe := executableName()
+	if exe == "" {
+		return fmt.Errorf("no executable to run")
+	}
+	srcs := append([]string{proj.MainSource}, proj.DepSources...)
+	best, err := sweepOpenMP(func(env []string) (float64, error) {
+		c := exec.Command(dotSlash(exe), runArgs...)
+		c.Env = env
+		start := time.Now()
+		if output, err := c.CombinedOutput(); err != nil {
+			os.Stderr.Write(output)
+			return 0, fmt.Errorf("%s: %w", exe, err)
+		}
+		return time.Since(start).Seconds(), nil
+	}, "seconds", usesRuntimeSchedule(srcs))
+	if err != nil {
+		return err
+	}
+	return saveOpenMPSettings(best)
+}
@@ -0,0 +1,181 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"slices"
+	"strings"
+)
+
+// pchDir holds the generated precompiled header of a project.
+var pchDir = filepath.Join(projectCacheDir, "pch")
+
+// pchAutoSources is the number of sources from which a precompiled header
+// is used without being asked for with OH_PCH.
+const pchAutoSources = 8
+
+// pchEnabled reports whether a precompiled header should be used for a build
+// of n sources. OH_PCH=1 always enables it and OH_PCH=0 disables it.
+func pchEnabled(n int) bool {
+	if n < 2 || remoteCompiles() != nil {
+		// distcc compiles with a precompiled header locally, which defeats the point
+		return false
+	}
+	switch strings.ToLower(os.Getenv("OH_PCH")) {
+	case "":
+		return n >= pchAutoSources
+	case "0", "no", "off", "false":
+		return false
+	}
+	return true
+}
+
+// withPrecompiledHeader returns flags that include a precompiled header of the
+// system headers that every one of srcs includes first, generating the header
+// in the project directory flags.Dir if it is missing, or if the include set
+// or the flags have changed. Returns flags unchanged if precompiled headers
+// are disabled, if there are no such headers, or if the header can not be
+// precompiled.
+func withPrecompiledHeader(srcs []string, flags BuildFlags, dirName string) BuildFlags {
+	if !pchEnabled(len(srcs)) || flags.Modules {
+		return flags
+	}
+	includes := pchIncludes(projectFiles(flags.Dir, srcs))
+	if len(includes) == 0 {
+		return flags
+	}
+
+	var content strings.Builder
+	content.WriteString("// Generated by oh from the system headers that all sources include\n")
+	for _, inc := range includes {
+		content.WriteString("#include <" + inc + ">\n")
+	}
+
+	dir := pchDir
+	if flags.ObjDir != "" {
+		// Each configuration keeps its own precompiled header, next to its objects
+		dir = filepath.Join(flags.ObjDir, "pch")
+	}
+	header := filepath.Join(dir, "oh_pch.h")
+	output := header + ".gch"
+	if isEffectivelyClang(flags.Compiler) {
+		output = header + ".pch"
+	}
+	lang := "c-header"
+	if strings.Contains(filepath.Base(flags.Compiler), "++") {
+		lang = "c++-header"
+	}
+
+	compilerStamp := ""
+	if path, err := exec.LookPath(flags.Compiler); err == nil {
+		if fi, err := os.Stat(path); err == nil {
+			compilerStamp = fi.ModTime().String()
+		}
+	}
+	keyParts := []string{flags.Compiler, compilerStamp, flags.DockerImage, flags.Std, content.String(), packageDBStamp(hostPlatform.typ())}
+	keyParts = append(keyParts, flags.CFlags...)
+	keyParts = append(keyParts, flags.Defines...)
+	keyParts = append(keyParts, flags.IncPaths...)
+	key := hashStrings(keyParts...)
+	keyFile := filepath.Join(dir, "oh_pch.key")
+
+	withHeader := flags
+	withHeader.CFlags = append(slices.Clone(flags.CFlags), "-include", header)
+
+	if data, err := os.ReadFile(projectFile(flags.Dir, keyFile)); err == nil && cachingEnabled() && string(data) == key && fileExists(projectFile(flags.Dir, output)) {
+		return withHeader
+	}
+
+	if err := os.MkdirAll(projectFile(flags.Dir, dir), 0o755); err != nil {
+		return flags
+	}
+	recordArtifacts(flags.Dir, manifestConfig(flags), dir)
+	if err := os.WriteFile(projectFile(flags.Dir, header), []byte(content.String()), 0o644); err != nil {
+		return flags
+	}
+	args := []string{"-std=" + flags.Std}
+	args = append(args, flags.CFlags...)
+	args = append(args, flags.Defines...)
+	for _, ip := range flags.IncPaths {
+		args = append(args, "-I"+ip)
+	}
+	args = append(args, "-x", lang, "-o", output, header)
+	cmd := runCompiler(flags, args)
+	fmt.Printf("[%s] %s %s\n", dirName, flags.Compiler, strings.Join(compactArgs(args), " "))
+	cmd.Stdout = os.Stdout
+	cmd.Stderr = os.Stderr
+	span := startSpan("compile", header)
+	err := cmd.Run()
+	span.end()
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "warning: could not precompile %s, building without it: %v\n", header, err)
+		os.Remove(projectFile(flags.Dir, output))
+		os.Remove(projectFile(flags.Dir, keyFile))
+		return flags
+	}
+	os.WriteFile(projectFile(flags.Dir, keyFile), []byte(key), 0o644)
+	return withHeader
+}
+
+// pchIncludes returns the system headers that every source includes before
+// anything else, in the order of the first source. Headers that are only
+// included after a definition, a local include or a conditional are left out,
+// since including them up front could change their meaning.
+func pchIncludes(srcs []string) []string {
+	var common []string
+	for i, src := range srcs {
+		leading := scanSource(src).leadingIncludes
+		if i == 0 {
+			common = leading
+			continue
+		}
+		set := toSet(leading)
+		common = slices.DeleteFunc(common, func(inc string) bool { return !set[inc] })
+		if len(common) == 0 {
+			break
+		}
+	}
+	return common
+}
+
+// leadingSystemIncludes returns the #include <...> directives at the top of a
+// file, up to the first line that is something else, such as a #define, a
+// local include, a conditional or code.
+func leadingSystemIncludes(data []byte) []string {
+	var includes []string
+	for _, line := range logicalLines(string(data)) {
+		trimmed := strings.TrimSpace(line)
+		if trimmed == "" || trimmed == "#pragma once" {
+			continue
+		}
+		if !strings.HasPrefix(trimmed, "#") {
+			break
+		}
+		directive := strings.TrimSpace(trimmed[1:])
+		rest, ok := strings.CutPrefix(directive, "include")
+		if !ok {
+			break
+		}
+		inc, ok := parseIncludeTarget(strings.TrimSpace(rest))
+		if !ok || !inc.system {
+			break
+		}
+		includes = append(includes, inc.name)
+	}
+	return includes
+}
+
+// removePrecompiledHeader removes the generated precompiled header, and the
+// cache directory if it is then empty.
+func removePrecompiledHeader() bool {
+	if _, err := os.Stat(pchDir); err != nil {
+		return false
+	}
+	if err := os.RemoveAll(pchDir); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
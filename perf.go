@@ -0,0 +1,368 @@
+package orchideous
+
+import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"hash/fnv"
+	"html"
+	"io"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"slices"
+	"strings"
+)
+
+// perfDir holds the recorded samples, the folded stacks and the flame graph
+// of "oh perf".
+var perfDir = filepath.Join(projectCacheDir, "perf")
+
+// perfTopFunctions is how many functions the summary of "oh perf" lists.
+const perfTopFunctions = 20
+
+// doPerf builds the executable with -O2, -g and frame pointers, runs it with
+// the given arguments under "perf record -g", and folds the recorded call
+// stacks into a flame graph and a summary of the functions that most of the
+// time was spent in. On macOS, where there is no perf, it is recorded with
+// xctrace for Instruments, or else with sample.
+func doPerf(runArgs []string) error {
+	proj := detectProject(".")
+	if proj.HasWin64 {
+		return fmt.Errorf("oh perf can not profile Windows executables")
+	}
+	exe := executableName()
+	if exe == "" {
+		return fmt.Errorf("no executable to profile")
+	}
+	if err := doBuild(BuildOptions{DebugInfo: true, FramePointers: true}); err != nil {
+		return err
+	}
+	os.RemoveAll(perfDir)
+	if err := os.MkdirAll(perfDir, 0o755); err != nil {
+		return err
+	}
+	recordArtifacts(".", "", perfDir)
+	if isDarwin() {
+		return recordDarwinProfile(exe, runArgs)
+	}
+	perf, err := exec.LookPath("perf")
+	if err != nil {
+		return fmt.Errorf("perf not found in PATH")
+	}
+
+	data := filepath.Join(perfDir, "perf.data")
+	record := exec.Command(perf, append([]string{"record", "-g", "-o", data, "--", dotSlash(exe)}, runArgs...)...)
+	record.Stdin = os.Stdin
+	record.Stdout = os.Stdout
+	record.Stderr = os.Stderr
+	if err := record.Run(); err != nil {
+		// The profile of a program that fails is still worth looking at
+		fmt.Fprintf(os.Stderr, "warning: perf record exited with: %v\n", err)
+	}
+	script := exec.Command(perf, "script", "-i", data, "-F", "comm,ip,sym")
+	script.Stderr = os.Stderr
+	out, err := runOutput(script)
+	if err != nil {
+		return fmt.Errorf("perf script: %w", err)
+	}
+	stacks := foldPerfScript(bytes.NewReader(out))
+	if len(stacks) == 0 {
+		return fmt.Errorf("perf recorded no samples in %s", data)
+	}
+
+	folded := filepath.Join(perfDir, "perf.folded")
+	if err := writeFoldedStacks(folded, stacks); err != nil {
+		return err
+	}
+	svg := filepath.Join(perfDir, "flamegraph.svg")
+	f, err := os.Create(svg)
+	if err != nil {
+		return err
+	}
+	writeFlameGraph(f, exe, stacks)
+	if err := f.Close(); err != nil {
+		return err
+	}
+	fmt.Println()
+	printHotFunctions(os.Stdout, stacks, perfTopFunctions)
+	fmt.Printf("\nWrote %s and %s\n", svg, folded)
+	return nil
+}
+
+// recordDarwinProfile records a Time Profiler trace with xctrace, which can
+// be opened in Instruments, or, if xctrace is missing, a call tree report
+// with sample.
+func recordDarwinProfile(exe string, runArgs []string) error {
+	if xctrace := llvmTool("xctrace"); xctrace != "" {
+		trace := filepath.Join(perfDir, exe+".trace")
+		args := append([]string{"record", "--template", "Time Profiler", "--output", trace, "--launch", "--", dotSlash(exe)}, runArgs...)
+		if err := runTool(xctrace, args...); err != nil {
+			return fmt.Errorf("xctrace: %w", err)
+		}
+		fmt.Printf("Wrote %s, open it with: open %s\n", trace, trace)
+		return nil
+	}
+	sample, err := exec.LookPath("sample")
+	if err != nil {
+		return fmt.Errorf("neither xctrace nor sample was found")
+	}
+	c := exec.Command(dotSlash(exe), runArgs...)
+	c.Stdin = os.Stdin
+	c.Stdout = os.Stdout
+	c.Stderr = os.Stderr
+	if err := c.Start(); err != nil {
+		return err
+	}
+	// Sample until the program exits, for up to an hour
+	report := filepath.Join(perfDir, "sample.txt")
+	s := exec.Command(sample, fmt.Sprint(c.Process.Pid), "3600", "-mayDie", "-file", report)
+	s.Stdout = io.Discard
+	s.Stderr = os.Stderr
+	if err := s.Start(); err != nil {
+		c.Process.Kill()
+		c.Wait()
+		return err
+	}
+	if err := c.Wait(); err != nil {
+		fmt.Fprintf(os.Stderr, "warning: %s exited with: %v\n", exe, err)
+	}
+	s.Wait()
+	fmt.Printf("Wrote %s\n", report)
+	return nil
+}
+
+// foldPerfScript reads the output of "perf script -F comm,ip,sym", where
+// every sample is a line with the command name followed by one indented
+// line per frame, innermost first, and counts the samples of each call
+// stack. The stacks are folded like for flamegraph.pl: the command name and
+// then the functions from the outermost to the innermost, joined by ";".
+func foldPerfScript(r io.Reader) map[string]int {
+	stacks := make(map[string]int)
+	var comm string
+	var frames []string
+	flush := func() {
+		if comm == "" && len(frames) == 0 {
+			return
+		}
+		stack := []string{comm}
+		for i := len(frames) - 1; i >= 0; i-- {
+			stack = append(stack, frames[i])
+		}
+		stacks[strings.Join(stack, ";")]++
+		comm, frames = "", nil
+	}
+	scanner := bufio.NewScanner(r)
+	scanner.Buffer(make([]byte, 64*1024), 1024*1024)
+	for scanner.Scan() {
+		line := scanner.Text()
+		trimmed := strings.TrimSpace(line)
+		switch {
+		case trimmed == "":
+			flush()
+		case line[0] != ' ' && line[0] != '\t':
+			flush()
+			comm = strings.ReplaceAll(trimmed, ";", ":")
+		default:
+			// "<address> <symbol>", where the symbol may have an offset
+			_, sym, _ := strings.Cut(trimmed, " ")
+			sym = strings.TrimSpace(sym)
+			if i := strings.LastIndex(sym, "+0x"); i > 0 {
+				sym = sym[:i]
+			}
+			if sym == "" {
+				sym = "[unknown]"
+			}
+			frames = append(frames, strings.ReplaceAll(sym, ";", ":"))
+		}
+	}
+	flush()
+	return stacks
+}
+
+// writeFoldedStacks writes the folded stacks, one "stack count" per line,
+// in the format that flamegraph.pl and speedscope read.
+func writeFoldedStacks(path string, stacks map[string]int) error {
+	var b strings.Builder
+	for _, stack := range sortedKeys(stacks) {
+		fmt.Fprintf(&b, "%s %d\n", stack, stacks[stack])
+	}
+	return os.WriteFile(path, []byte(b.String()), 0o644)
+}
+
+// hotFunction is the number of samples in a function, and in the functions
+// it called.
+type hotFunction struct {
+	name  string
+	self  int
+	total int
+}
+
+// hotFunctions returns the functions of the folded stacks, with the most
+// samples in the function itself first. A function that is on a stack more
+// than once, when it recurses, is only counted once for its total.
+func hotFunctions(stacks map[string]int) ([]hotFunction, int) {
+	byName := make(map[string]*hotFunction)
+	get := func(name string) *hotFunction {
+		if byName[name] == nil {
+			byName[name] = &hotFunction{name: name}
+		}
+		return byName[name]
+	}
+	samples := 0
+	for stack, n := range stacks {
+		samples += n
+		frames := strings.Split(stack, ";")[1:] // without the command name
+		if len(frames) == 0 {
+			continue
+		}
+		get(frames[len(frames)-1]).self += n
+		seen := make(map[string]bool, len(frames))
+		for _, f := range frames {
+			if !seen[f] {
+				seen[f] = true
+				get(f).total += n
+			}
+		}
+	}
+	funcs := make([]hotFunction, 0, len(byName))
+	for _, f := range byName {
+		funcs = append(funcs, *f)
+	}
+	slices.SortFunc(funcs, func(a, b hotFunction) int {
+		if a.self != b.self {
+			return b.self - a.self
+		}
+		if a.total != b.total {
+			return b.total - a.total
+		}
+		return strings.Compare(a.name, b.name)
+	})
+	return funcs, samples
+}
+
+// printHotFunctions prints the n functions with the most samples.
+func printHotFunctions(w io.Writer, stacks map[string]int, n int) {
+	funcs, samples := hotFunctions(stacks)
+	fmt.Fprintf(w, "%7s %7s  function (of %d samples)\n", "self", "total", samples)
+	for _, f := range funcs[:min(n, len(funcs))] {
+		fmt.Fprintf(w, "%6.2f%% %6.2f%%  %s\n", 100*float64(f.self)/float64(samples),
+			100*float64(f.total)/float64(samples), f.name)
+	}
+}
+
+// flameNode is a function in the tree of call stacks of a flame graph.
+type flameNode struct {
+	name     string
+	samples  int
+	children map[string]*flameNode
+}
+
+func (n *flameNode) child(name string) *flameNode {
+	if n.children == nil {
+		n.children = make(map[string]*flameNode)
+	}
+	c := n.children[name]
+	if c == nil {
+		c = &flameNode{name: name}
+		n.children[name] = c
+	}
+	return c
+}
+
+func (n *flameNode) depth() int {
+	d := 0
+	for _, c := range n.children {
+		d = max(d, c.depth())
+	}
+	return d + 1
+}
+
+// writeFlameGraph writes the folded stacks as an SVG flame graph, with the
+// outermost functions at the bottom, the callees above their callers and
+// the width of every function in proportion to its samples. The functions
+// are sorted by name on each level, like flamegraph.pl does, and the name,
+// the samples and the share of each function are shown when hovering it.
+func writeFlameGraph(w io.Writer, title string, stacks map[string]int) {
+	const width, frameHeight, pad = 1200.0, 16.0, 10.0
+	root := &flameNode{name: "all"}
+	for stack, n := range stacks {
+		root.samples += n
+		node := root
+		for _, f := range strings.Split(stack, ";") {
+			node = node.child(f)
+			node.samples += n
+		}
+	}
+	depth := root.depth()
+	height := float64(depth)*frameHeight + 3*pad + frameHeight
+	scale := (width - 2*pad) / float64(max(root.samples, 1))
+
+	fmt.Fprintf(w, `<?xml version="1.0" standalone="no"?>
+<svg version="1.1" width="%.0f" height="%.0f" xmlns="http://www.w3.org/2000/svg">
+<rect x="0" y="0" width="100%%" height="100%%" fill="#f8f8f0"/>
+<text x="%.0f" y="%.0f" text-anchor="middle" font-family="Verdana" font-size="15">%s</text>
+<g font-family="Verdana" font-size="12">
+`, width, height, width/2, pad+frameHeight/2+4, html.EscapeString("Flame graph of "+title))
+
+	var draw func(n *flameNode, x float64, level int)
+	draw = func(n *flameNode, x float64, level int) {
+		fw := float64(n.samples) * scale
+		if fw < 0.1 {
+			return
+		}
+		y := height - pad - float64(level+1)*frameHeight
+		fmt.Fprintf(w, "<g><title>%s (%d samples, %.2f%%)</title>", html.EscapeString(n.name), n.samples,
+			100*float64(n.samples)/float64(root.samples))
+		fmt.Fprintf(w, `<rect x="%.1f" y="%.1f" width="%.1f" height="%.0f" fill="%s" rx="2"/>`,
+			x, y, fw, frameHeight-1, flameColor(n.name))
+		// Verdana 12 is about 7 pixels per character
+		if chars := int((fw - 6) / 7); chars >= 3 {
+			label := n.name
+			if len(label) > chars {
+				label = label[:chars-2] + ".."
+			}
+			fmt.Fprintf(w, `<text x="%.1f" y="%.1f">%s</text>`, x+3, y+frameHeight-4, html.EscapeString(label))
+		}
+		fmt.Fprintln(w, "</g>")
+		for _, name := range sortedKeys(n.children) {
+			c := n.children[name]
+			draw(c, x, level+1)
+			x += float64(c.samples) * scale
+		}
+	}
+	draw(root, pad, 0)
+	fmt.Fprintln(w, "</g>\n</svg>")
+}
+
+// flameColor returns a warm color for a function, which is always the same
+// for the same function, so that it is easy to follow between graphs.
+func flameColor(name string) string {
+	h := fnv.New32a()
+	h.Write([]byte(name))
+	v := h.Sum32()
+	return fmt.Sprintf("rgb(%d,%d,%d)", 205+v%50, 80+(v>>8)%150, (v>>16)%55)
+}
+
+// removePerfData removes the recordings of "oh perf", and the cache
+// directory if it is then empty.
+func removePerfData() bool {
+	if _, err := os.Stat(perfDir); err != nil {
+		return false
+	}
+	if err := os.RemoveAll(perfDir); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
+
+// sortedKeys returns the keys of m, sorted.
+func sortedKeys[V any](m map[string]V) []string {
+	keys := make([]string, 0, len(m))
+	for k := range m {
+		keys = append(keys, k)
+	}
+	slices.Sort(keys)
+	return keys
+}
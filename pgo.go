@@ -0,0 +1,260 @@
+package orchideous
+
+import (
+	"errors"
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+)
+
+// pgoProfileDir holds the merged profiles that "oh rec" records. It is kept
+// out of .oh, so that "oh clean" leaves it alone and it can be committed, and
+// "oh opt" builds use the profile in it until it is removed.
+const pgoProfileDir = "pgo"
+
+// clangProfile is the merged clang profile.
+var clangProfile = filepath.Join(pgoProfileDir, "default.profdata")
+
+// gccProfileDir holds the GCC .gcda files. Those of objects are kept below
+// obj/, with the same paths as the objects have in their build directory,
+// and those of executables that were compiled and linked in one step at the top.
+var gccProfileDir = filepath.Join(pgoProfileDir, "gcc")
+
+// pgoRawDir is where clang instrumented executables write their raw profiles.
+var pgoRawDir = filepath.Join(projectCacheDir, "pgo", "raw")
+
+// gcdaFiles returns the .gcda files that GCC instrumented executables have
+// written: next to the objects in objDir, or in the project directory for
+// executables that were compiled and linked in one step.
+func gcdaFiles(objDir string) []string {
+	files, _ := filepath.Glob("*.gcda")
+	filepath.WalkDir(objDir, func(path string, d os.DirEntry, err error) error {
+		if err == nil && !d.IsDir() && filepath.Ext(path) == ".gcda" {
+			files = append(files, path)
+		}
+		return nil
+	})
+	return files
+}
+
+// PGOTraining is the workload that "oh rec" and "oh bolt" record profiles from.
+type PGOTraining struct {
+	Script string     // a shell script that runs the executable, which is given in $OH_EXE
+	Runs   [][]string // sets of arguments to run the executable with, one run each
+}
+
+// commands returns the commands of the training workload for the given
+// executable. Without a script or runs, the executable is run once.
+func (t PGOTraining) commands(exe string) [][]string {
+	var cmds [][]string
+	if t.Script != "" {
+		cmds = append(cmds, []string{"sh", t.Script})
+	} else if len(t.Runs) == 0 {
+		cmds = append(cmds, []string{exe})
+	}
+	for _, args := range t.Runs {
+		cmds = append(cmds, append([]string{exe}, args...))
+	}
+	return cmds
+}
+
+// run runs the training workload with the given executable, interactively.
+// If prefix is not nil, the i-th command is started through prefix(i).
+func (t PGOTraining) run(exe string, prefix func(i int) []string) error {
+	for i, c := range t.commands(exe) {
+		argv := c
+		if prefix != nil {
+			argv = append(prefix(i), c...)
+		}
+		fmt.Printf("Training: %s\n", strings.Join(c, " "))
+		cmd := exec.Command(argv[0], argv[1:]...)
+		cmd.Env = append(os.Environ(), "OH_EXE="+exe)
+		cmd.Stdin = os.Stdin
+		cmd.Stdout = os.Stdout
+		cmd.Stderr = os.Stderr
+		span := startSpan("train", strings.Join(c, " "))
+		err := cmd.Run()
+		span.end()
+		var exitErr *exec.ExitError
+		if err != nil && !errors.As(err, &exitErr) {
+			return fmt.Errorf("training run %q: %w", strings.Join(c, " "), err)
+		}
+		if err != nil {
+			// The profile is written even when the program exits with an error
+			fmt.Fprintf(os.Stderr, "warning: training run %q: %v\n", strings.Join(c, " "), err)
+		}
+	}
+	return nil
+}
+
+// doRec builds an instrumented executable, runs the training workload with
+// it, stores the merged profile in pgoProfileDir and then builds the
+// executable again, optimized with the profile. Objects are recompiled
+// because their compile commands change, so nothing has to be cleaned first.
+func doRec(training PGOTraining) error {
+	proj := detectProject(".")
+	flags := assembleFlags(proj, BuildOptions{Opt: true, ProfileGenerate: true, Win64: proj.HasWin64})
+	removeRawProfiles(flags.ObjDir)
+	if err := doBuild(BuildOptions{Opt: true, ProfileGenerate: true}); err != nil {
+		return fmt.Errorf("profile generation build: %w", err)
+	}
+	exe := executableName()
+	if exe == "" {
+		return fmt.Errorf("no executable to run for profiling")
+	}
+	if proj.HasWin64 {
+		exe += ".exe"
+	}
+	err := training.run(dotSlash(exe), nil)
+	// The profiles that the instrumented executable wrote, and the .gcno
+	// files of an executable that was compiled and linked in one step
+	gcno, _ := filepath.Glob("*.gcno")
+	recordArtifacts(".", manifestConfig(flags), append(append([]string{pgoRawDir}, gcdaFiles(flags.ObjDir)...), gcno...)...)
+	if err != nil {
+		return err
+	}
+	if err := storeProfile(flags.Compiler, flags.ObjDir); err != nil {
+		return err
+	}
+	return doBuild(BuildOptions{Opt: true, ProfileUse: true})
+}
+
+// removeRawProfiles removes the profiles of earlier training runs, since
+// instrumented executables add their counters to existing ones.
+func removeRawProfiles(objDir string) {
+	os.RemoveAll(pgoRawDir)
+	for _, f := range gcdaFiles(objDir) {
+		os.Remove(f)
+	}
+}
+
+// storeProfile stores the profile of the training runs in pgoProfileDir,
+// replacing the profile that was there. The raw clang profiles, one per
+// executable, are merged with llvm-profdata. A GCC executable adds the
+// counters of every run to the same .gcda files, which are copied as they are.
+func storeProfile(compiler, objDir string) error {
+	if isEffectivelyClang(compiler) {
+		raw, _ := filepath.Glob(filepath.Join(pgoRawDir, "*.profraw"))
+		if len(raw) == 0 {
+			return fmt.Errorf("the training runs wrote no profiles to %s", pgoRawDir)
+		}
+		profdata := llvmTool("llvm-profdata")
+		if profdata == "" {
+			return fmt.Errorf("llvm-profdata not found in PATH")
+		}
+		if err := os.MkdirAll(pgoProfileDir, 0o755); err != nil {
+			return err
+		}
+		if err := runTool(profdata, append([]string{"merge", "-o", clangProfile}, raw...)...); err != nil {
+			return fmt.Errorf("llvm-profdata merge: %w", err)
+		}
+		fmt.Printf("Stored the profile of %d runs in %s\n", len(raw), clangProfile)
+		return nil
+	}
+
+	gcda := gcdaFiles(objDir)
+	if len(gcda) == 0 {
+		return fmt.Errorf("the training runs wrote no .gcda files")
+	}
+	if err := os.RemoveAll(gccProfileDir); err != nil {
+		return err
+	}
+	for _, f := range gcda {
+		dst := gccProfilePath(f, objDir)
+		if err := os.MkdirAll(filepath.Dir(dst), 0o755); err != nil {
+			return err
+		}
+		if err := copyFile(f, dst, 0o644); err != nil {
+			return err
+		}
+	}
+	fmt.Printf("Stored the profile in %s\n", gccProfileDir)
+	return nil
+}
+
+// gccProfilePath returns where the .gcda file at path is stored in gccProfileDir.
+func gccProfilePath(path, objDir string) string {
+	if rel, err := filepath.Rel(objDir, path); err == nil && !strings.HasPrefix(rel, "..") {
+		return filepath.Join(gccProfileDir, "obj", rel)
+	}
+	return filepath.Join(gccProfileDir, filepath.Base(path))
+}
+
+// installGCCProfile copies the stored .gcda files next to the objects in
+// objDir, where GCC looks for them when compiling with -fprofile-use.
+func installGCCProfile(objDir string) error {
+	return filepath.WalkDir(gccProfileDir, func(path string, d os.DirEntry, err error) error {
+		if err != nil || d.IsDir() || filepath.Ext(path) != ".gcda" {
+			return err
+		}
+		rel, err := filepath.Rel(gccProfileDir, path)
+		if err != nil {
+			return err
+		}
+		dst := rel
+		if after, ok := strings.CutPrefix(filepath.ToSlash(rel), "obj/"); ok {
+			dst = filepath.Join(objDir, filepath.FromSlash(after))
+		}
+		if err := os.MkdirAll(filepath.Dir(dst), 0o755); err != nil {
+			return err
+		}
+		return copyFile(path, dst, 0o644)
+	})
+}
+
+// hasStoredProfile reports whether "oh rec" has stored a profile for the
+// compiler, in the project in dir.
+func hasStoredProfile(dir, compiler string) bool {
+	if isEffectivelyClang(compiler) {
+		return fileExists(projectFile(dir, clangProfile))
+	}
+	return isCompilerGCC(compiler) && fileExists(projectFile(dir, gccProfileDir))
+}
+
+// withStoredProfile returns opts with ProfileUse set if it is an optimized
+// build that uses the profile stored for the compiler in the project in dir,
+// so that it is built in the same directory as an explicit ProfileUse build.
+func withStoredProfile(dir string, opts BuildOptions, compiler string) BuildOptions {
+	if opts.Opt && !opts.ProfileGenerate && !opts.ProfileUse && hasStoredProfile(dir, compiler) {
+		opts.ProfileUse = true
+	}
+	return opts
+}
+
+// profileUseFlags returns the flags for optimizing with the stored profile.
+// Sources that changed since the profile was recorded only get a warning,
+// and are optimized without profile data.
+func profileUseFlags(compiler string) []string {
+	if isEffectivelyClang(compiler) {
+		return []string{"-fprofile-use=" + clangProfile}
+	}
+	if isCompilerGCC(compiler) {
+		return []string{"-fprofile-use", "-fprofile-correction", "-Wno-error=coverage-mismatch"}
+	}
+	return nil
+}
+
+// profileStamp identifies the stored profile of the project in dir, so that
+// the flag cache is invalidated when a profile is recorded or removed.
+func profileStamp(dir string) string {
+	stamp := "pgo:"
+	for _, p := range []string{clangProfile, gccProfileDir} {
+		if fi, err := os.Stat(projectFile(dir, p)); err == nil {
+			stamp += p + "@" + fi.ModTime().String() + ","
+		}
+	}
+	return stamp
+}
+
+// llvmTool finds an LLVM tool in PATH, or with xcrun on macOS.
+func llvmTool(name string) string {
+	if path, err := exec.LookPath(name); err == nil {
+		return path
+	}
+	if out, err := commandOutput("xcrun", "-f", name); err == nil {
+		return strings.TrimSpace(string(out))
+	}
+	return ""
+}
@@ -0,0 +1,425 @@
+package orchideous
+
+import (
+	"bufio"
+	"errors"
+	"os"
+	"path/filepath"
+	"regexp"
+	"runtime"
+	"slices"
+	"strings"
+	"sync"
+)
+
+// pkgConfigResolver answers pkg-config queries by parsing .pc files directly.
+// The only process it needs is a single query for the search path of
+// pkg-config. Anything it can not handle the way pkg-config would, such as a
+// sysroot or quoted values, is passed on to pkg-config itself. All results are
+// memoized, so each package is resolved at most once per run.
+type pkgConfigResolver struct {
+	mu         sync.Mutex
+	searchOnce sync.Once
+	searchPath []string // nil if the search path is unknown
+
+	pcFiles  map[string]*pcFile // parsed .pc files by package name, nil if not found
+	flags    map[string]string  // package -> "--cflags --libs" output
+	versions map[string]string  // package -> "--modversion" output
+}
+
+// pcFile is a parsed pkg-config file.
+type pcFile struct {
+	vars   map[string]string
+	fields map[string]string
+}
+
+// pkgConfig is the resolver shared by all pkg-config lookups in a run.
+var pkgConfig = newPkgConfigResolver()
+
+func newPkgConfigResolver() *pkgConfigResolver {
+	return &pkgConfigResolver{
+		pcFiles:  make(map[string]*pcFile),
+		flags:    make(map[string]string),
+		versions: make(map[string]string),
+	}
+}
+
+// errPCUnsupported is returned for .pc files that only pkg-config itself can interpret.
+var errPCUnsupported = errors.New("unsupported .pc file")
+
+// pcRequireSep splits Requires fields into package names and version constraints.
+var pcRequireSep = regexp.MustCompile(`[\s,]+`)
+
+// nativeSupported returns false if .pc files should not be interpreted natively,
+// because pkg-config would rewrite them (sysroots, and prefix redefinition on Windows).
+func (r *pkgConfigResolver) nativeSupported() bool {
+	if runtime.GOOS == "windows" || os.Getenv("PKG_CONFIG_SYSROOT_DIR") != "" {
+		return false
+	}
+	return r.dirs() != nil
+}
+
+// dirs returns the directories pkg-config searches for .pc files, in order.
+func (r *pkgConfigResolver) dirs() []string {
+	r.searchOnce.Do(func() {
+		var dirs []string
+		if p := os.Getenv("PKG_CONFIG_PATH"); p != "" {
+			dirs = append(dirs, filepath.SplitList(p)...)
+		}
+		if libdir, ok := os.LookupEnv("PKG_CONFIG_LIBDIR"); ok {
+			dirs = append(dirs, filepath.SplitList(libdir)...)
+		} else {
+			out, err := commandOutput("pkg-config", "--variable", "pc_path", "pkg-config")
+			if err != nil {
+				return
+			}
+			dirs = append(dirs, filepath.SplitList(strings.TrimSpace(string(out)))...)
+		}
+		r.searchPath = append([]string{}, dirs...)
+	})
+	return r.searchPath
+}
+
+// exists returns true if the package is available to pkg-config.
+func (r *pkgConfigResolver) exists(pkg string) bool {
+	if !r.nativeSupported() {
+		return r.flagsFor(pkg) != ""
+	}
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	return r.load(pkg) != nil
+}
+
+// flagsFor returns the output of "pkg-config --cflags --libs pkg", or "" if
+// the package or one of its requirements is not available.
+func (r *pkgConfigResolver) flagsFor(pkg string) string {
+	r.mu.Lock()
+	if flags, ok := r.flags[pkg]; ok {
+		r.mu.Unlock()
+		return flags
+	}
+	r.mu.Unlock()
+
+	flags, err := "", errPCUnsupported
+	if r.nativeSupported() {
+		r.mu.Lock()
+		flags, err = r.nativeFlags(pkg)
+		r.mu.Unlock()
+	}
+	if err == errPCUnsupported {
+		out, err := commandOutput("pkg-config", "--cflags", "--libs", pkg)
+		flags = ""
+		if err == nil {
+			flags = strings.TrimSpace(string(out))
+		}
+	}
+
+	r.mu.Lock()
+	r.flags[pkg] = flags
+	r.mu.Unlock()
+	return flags
+}
+
+// version returns the output of "pkg-config --modversion pkg", or "" if the package is not available.
+func (r *pkgConfigResolver) version(pkg string) string {
+	r.mu.Lock()
+	if v, ok := r.versions[pkg]; ok {
+		r.mu.Unlock()
+		return v
+	}
+	r.mu.Unlock()
+
+	v := ""
+	native := false
+	if r.nativeSupported() {
+		r.mu.Lock()
+		if pc := r.load(pkg); pc != nil {
+			if expanded, err := pc.expand(pc.fields["Version"]); err == nil {
+				v, native = expanded, true
+			}
+		} else {
+			native = true
+		}
+		r.mu.Unlock()
+	}
+	if !native {
+		if out, err := commandOutput("pkg-config", "--modversion", pkg); err == nil {
+			v = strings.TrimSpace(string(out))
+		}
+	}
+
+	r.mu.Lock()
+	r.versions[pkg] = v
+	r.mu.Unlock()
+	return v
+}
+
+// load finds and parses the .pc file for a package. Must be called with r.mu held.
+func (r *pkgConfigResolver) load(pkg string) *pcFile {
+	if pc, ok := r.pcFiles[pkg]; ok {
+		return pc
+	}
+	var pc *pcFile
+	for _, dir := range r.dirs() {
+		if p, err := parsePCFile(filepath.Join(dir, pkg+".pc")); err == nil {
+			pc = p
+			break
+		}
+	}
+	r.pcFiles[pkg] = pc
+	return pc
+}
+
+// nativeFlags computes "--cflags --libs" from the parsed .pc files: the Cflags
+// of the package and all its requirements, including private ones, followed by
+// the Libs of the package and its public requirements. Flags for the system
+// include and library directories are left out, as pkg-config does.
+// Must be called with r.mu held.
+func (r *pkgConfigResolver) nativeFlags(pkg string) (string, error) {
+	var cflags []string
+	seenC := make(map[string]bool)
+	visited := make(map[string]bool)
+	var visit func(name string, depth int) error
+	visit = func(name string, depth int) error {
+		if depth > 64 {
+			return errPCUnsupported
+		}
+		if visited[name] {
+			return nil
+		}
+		visited[name] = true
+		pc := r.load(name)
+		if pc == nil {
+			return os.ErrNotExist
+		}
+		fields, err := pc.fragments("Cflags")
+		if err != nil {
+			return err
+		}
+		for _, f := range fields {
+			if !seenC[f] && !isSystemPCFlag(f) {
+				seenC[f] = true
+				cflags = append(cflags, f)
+			}
+		}
+		for _, field := range []string{"Requires", "Requires.private"} {
+			reqs, err := pc.requires(field)
+			if err != nil {
+				return err
+			}
+			for _, req := range reqs {
+				if err := visit(req, depth+1); err != nil {
+					return err
+				}
+			}
+		}
+		return nil
+	}
+	err := visit(pkg, 0)
+	var libs []string
+	if err == nil {
+		libs, err = r.nativeLibs(pkg, make(map[string][]string), make(map[string]bool))
+	}
+	if err != nil {
+		if err == errPCUnsupported {
+			return "", err
+		}
+		return "", nil // a missing package or requirement, pkg-config would fail too
+	}
+	return strings.Join(append(cflags, libs...), " "), nil
+}
+
+// nativeLibs returns the Libs of a package followed by those of its public
+// requirements. Like pkg-config, only the last occurrence of each library is
+// kept, so that libraries come after everything that depends on them.
+// Must be called with r.mu held.
+func (r *pkgConfigResolver) nativeLibs(name string, memo map[string][]string, active map[string]bool) ([]string, error) {
+	if libs, ok := memo[name]; ok {
+		return libs, nil
+	}
+	if active[name] || len(active) > 64 {
+		return nil, errPCUnsupported // circular requirements
+	}
+	active[name] = true
+	defer delete(active, name)
+	pc := r.load(name)
+	if pc == nil {
+		return nil, os.ErrNotExist
+	}
+	libs, err := pc.fragments("Libs")
+	if err != nil {
+		return nil, err
+	}
+	reqs, err := pc.requires("Requires")
+	if err != nil {
+		return nil, err
+	}
+	for _, req := range reqs {
+		reqLibs, err := r.nativeLibs(req, memo, active)
+		if err != nil {
+			return nil, err
+		}
+		libs = append(libs, reqLibs...)
+	}
+	seen := make(map[string]bool)
+	var kept []string
+	for i := len(libs) - 1; i >= 0; i-- {
+		if f := libs[i]; !seen[f] && !isSystemPCFlag(f) {
+			seen[f] = true
+			kept = append(kept, f)
+		}
+	}
+	slices.Reverse(kept)
+	memo[name] = kept
+	return kept, nil
+}
+
+// isSystemPCFlag returns true for -I and -L flags that point at directories
+// the compiler and linker search anyway, which pkg-config does not output.
+func isSystemPCFlag(f string) bool {
+	if dir, ok := strings.CutPrefix(f, "-I"); ok {
+		if os.Getenv("PKG_CONFIG_ALLOW_SYSTEM_CFLAGS") != "" {
+			return false
+		}
+		return filepath.Clean(dir) == "/usr/include"
+	}
+	if dir, ok := strings.CutPrefix(f, "-L"); ok {
+		if os.Getenv("PKG_CONFIG_ALLOW_SYSTEM_LIBS") != "" {
+			return false
+		}
+		dir = filepath.Clean(dir)
+		switch dir {
+		case "/lib", "/lib32", "/lib64", "/libx32", "/usr/lib", "/usr/lib32", "/usr/lib64", "/usr/libx32":
+			return true
+		}
+		// Multiarch directories, such as /usr/lib/x86_64-linux-gnu
+		parent, base := filepath.Dir(dir), filepath.Base(dir)
+		return (parent == "/lib" || parent == "/usr/lib") && strings.Contains(base, "-linux-")
+	}
+	return false
+}
+
+// parsePCFile reads a .pc file into variables and fields.
+func parsePCFile(path string) (*pcFile, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	pc := &pcFile{vars: make(map[string]string), fields: make(map[string]string)}
+	// pkg-config defines pcfiledir for every .pc file
+	pc.vars["pcfiledir"] = filepath.Dir(path)
+	if strings.ContainsAny(pc.vars["pcfiledir"], `"'\$`) {
+		return nil, errPCUnsupported
+	}
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		line := scanner.Text()
+		if i := strings.IndexByte(line, '#'); i >= 0 {
+			line = line[:i]
+		}
+		line = strings.TrimSpace(line)
+		if line == "" {
+			continue
+		}
+		// Whichever of ':' and '=' comes first decides between a field and a variable
+		i := strings.IndexAny(line, ":=")
+		if i <= 0 {
+			continue
+		}
+		key := strings.TrimSpace(line[:i])
+		value := strings.TrimSpace(line[i+1:])
+		if line[i] == '=' {
+			pc.vars[key] = value
+		} else {
+			pc.fields[key] = value
+		}
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return pc, nil
+}
+
+// expand substitutes ${var} references in a value. Values with quotes or
+// escapes are not supported, since pkg-config would unquote them.
+func (pc *pcFile) expand(value string) (string, error) {
+	return pc.expandDepth(value, 0)
+}
+
+func (pc *pcFile) expandDepth(value string, depth int) (string, error) {
+	if depth > 16 || strings.ContainsAny(value, `"'\`) {
+		return "", errPCUnsupported
+	}
+	var b strings.Builder
+	for {
+		start := strings.Index(value, "${")
+		if start < 0 {
+			b.WriteString(value)
+			return b.String(), nil
+		}
+		end := strings.IndexByte(value[start:], '}')
+		if end < 0 {
+			return "", errPCUnsupported
+		}
+		name := value[start+2 : start+end]
+		raw, ok := pc.vars[name]
+		if !ok {
+			return "", errPCUnsupported
+		}
+		v, err := pc.expandDepth(raw, depth+1)
+		if err != nil {
+			return "", err
+		}
+		b.WriteString(value[:start])
+		b.WriteString(v)
+		value = value[start+end+1:]
+	}
+}
+
+// fragments returns the expanded flags of a Cflags or Libs field.
+func (pc *pcFile) fragments(field string) ([]string, error) {
+	value, ok := pc.fields[field]
+	if !ok && field == "Cflags" {
+		value = pc.fields["CFlags"]
+	}
+	expanded, err := pc.expand(value)
+	if err != nil {
+		return nil, err
+	}
+	fields := strings.Fields(expanded)
+	for _, f := range fields {
+		if f == "-I" || f == "-L" || f == "-l" {
+			return nil, errPCUnsupported // the argument is in the next field
+		}
+	}
+	return fields, nil
+}
+
+// requires returns the package names in a Requires or Requires.private field,
+// without version constraints.
+func (pc *pcFile) requires(field string) ([]string, error) {
+	expanded, err := pc.expand(pc.fields[field])
+	if err != nil {
+		return nil, err
+	}
+	var names []string
+	skipVersion := false
+	for _, word := range pcRequireSep.Split(expanded, -1) {
+		switch {
+		case word == "":
+		case skipVersion:
+			skipVersion = false
+		case strings.ContainsAny(word[:1], "<>=!"):
+			skipVersion = strings.TrimLeft(word, "<>=!") == ""
+		default:
+			// A constraint may also be written without spaces, as in "glib-2.0>=2.50"
+			if i := strings.IndexAny(word, "<>=!"); i > 0 {
+				skipVersion = strings.TrimLeft(word[i:], "<>=!") == ""
+				word = word[:i]
+			}
+			names = append(names, word)
+		}
+	}
+	return names, nil
+}
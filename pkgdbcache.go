@@ -0,0 +1,111 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+)
+
+// maxIncludeResolveEntries limits the size of the include resolution cache.
+const maxIncludeResolveEntries = 4096
+
+// includeResolveCache remembers which flags an include path resolved to via
+// the package manager, including includes that could not be resolved. It is
+// shared by all projects, and is invalidated as a whole when the package
+// database or the pkg-config setup changes.
+type includeResolveCache struct {
+	Stamp string
+	Flags map[string]string // include path and compiler -> flags, "" if unresolved
+	path  string
+	dirty bool
+}
+
+// loadIncludeResolveCache reads the include resolution cache for the given
+// platform type. Returns nil if caching is disabled or not possible.
+func loadIncludeResolveCache(platform string) *includeResolveCache {
+	if !cachingEnabled() {
+		return nil
+	}
+	path := userCacheFile("includes.cache")
+	if path == "" {
+		return nil
+	}
+	c := &includeResolveCache{path: path}
+	stamp := packageDBStamp(platform)
+	if !readJSONFile(path, c) || c.Stamp != stamp || len(c.Flags) >= maxIncludeResolveEntries {
+		c.Stamp = stamp
+		c.Flags = make(map[string]string)
+	}
+	return c
+}
+
+// resolve returns the flags for an include path, asking the package manager
+// only when the answer is not cached.
+func (c *includeResolveCache) resolve(platform, incPath, cxx string) string {
+	if c == nil {
+		return platformResolve(platform, incPath, cxx)
+	}
+	if !fileExists(incPath) {
+		return "" // cheap to find out again, and may appear without a package
+	}
+	key := incPath + "\x00" + cxx
+	if flags, ok := c.Flags[key]; ok {
+		return flags
+	}
+	flags := platformResolve(platform, incPath, cxx)
+	c.Flags[key] = flags
+	c.dirty = true
+	return flags
+}
+
+// save writes the cache back to disk if it has changed.
+func (c *includeResolveCache) save() {
+	if c == nil || !c.dirty {
+		return
+	}
+	if err := writeJSONFile(c.path, c); err != nil {
+		fmt.Fprintf(os.Stderr, "warning: could not write %s: %v\n", c.path, err)
+	}
+}
+
+// packageDBStamp returns a string that changes whenever packages are
+// installed, upgraded or removed on the given platform type.
+func packageDBStamp(platform string) string {
+	var paths []string
+	switch platform {
+	case "arch":
+		paths = []string{"/var/lib/pacman/local"}
+	case "deb":
+		paths = []string{"/var/lib/dpkg/status"}
+	case "freebsd":
+		paths = []string{"/var/db/pkg/local.sqlite"}
+	case "openbsd":
+		paths = []string{"/var/db/pkg"}
+	case "brew":
+		paths = []string{"/usr/local/Cellar", "/opt/homebrew/Cellar"}
+	case "msys2":
+		// pacman is in <root>/usr/bin and its database in <root>/var/lib/pacman/local
+		if p, err := exec.LookPath("pacman"); err == nil {
+			paths = []string{filepath.Join(filepath.Dir(filepath.Dir(filepath.Dir(p))), "var", "lib", "pacman", "local")}
+		}
+	case "vcpkg":
+		if root := os.Getenv("VCPKG_ROOT"); root != "" {
+			paths = []string{filepath.Join(root, "installed")}
+		} else if p, err := exec.LookPath("vcpkg"); err == nil {
+			paths = []string{filepath.Join(filepath.Dir(p), "installed")}
+		}
+	default:
+		// The generic resolver looks for libraries directly
+		paths = []string{"/usr/lib", "/usr/lib/x86_64-linux-gnu", "/usr/local/lib", "/usr/pkg/lib"}
+	}
+	paths = append(paths, pkgConfigDirs...)
+
+	parts := []string{platform, os.Getenv("PKG_CONFIG_PATH"), os.Getenv("PKG_CONFIG_LIBDIR")}
+	for _, path := range paths {
+		if fi, err := os.Stat(path); err == nil {
+			parts = append(parts, fmt.Sprintf("%s@%d/%d", path, fi.ModTime().UnixNano(), fi.Size()))
+		}
+	}
+	return hashStrings(parts...)
+}
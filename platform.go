@@ -3,9 +3,9 @@ package orchideous
 import (
 	"fmt"
 	"os"
-	"os/exec"
 	"path/filepath"
 	"strings"
+	"sync"
 
 	"github.com/xyproto/files"
 )
@@ -15,17 +15,23 @@ var skipPackages = map[string]bool{
 	"glibc": true, "gcc": true, "wine": true,
 }
 
-// cachedPCFiles caches package -> .pc file list lookups.
-var cachedPCFiles = make(map[string][]string)
+// cachedPCFiles caches package -> .pc file list lookups within a run, and is
+// shared by concurrent builds. Resolved include flags are also cached between
+// runs, see includeResolveCache.
+var cachedPCFiles sync.Map
 
 // resolveIncludesViaPackageManager resolves unresolved includes using the platform's
-// package manager. Returns additional cflags and ldflags.
-func resolveIncludesViaPackageManager(includes []string, systemIncDirs []string, win64 bool, cxx string) (cflags, ldflags []string) {
-	if !hasPkgConfig() {
+// package manager. Returns additional cflags and ldflags. The platform is
+// only examined if there are includes to resolve.
+func resolveIncludesViaPackageManager(includes []string, env *platformEnv, win64 bool, cxx string) (cflags, ldflags []string) {
+	if len(includes) == 0 || !env.pkgConfig() {
 		return nil, nil
 	}
 
-	platform := detectPlatformType()
+	platform := env.typ()
+	systemIncDirs := env.systemIncludes()
+	cache := loadIncludeResolveCache(platform)
+	defer cache.save()
 	resolved := make(map[string]bool)
 
 	for _, inc := range includes {
@@ -35,7 +41,7 @@ func resolveIncludesViaPackageManager(includes []string, systemIncDirs []string,
 		// First pass: direct path lookup
 		for _, sysDir := range systemIncDirs {
 			incPath := filepath.Join(sysDir, inc)
-			flags := platformResolve(platform, incPath, cxx)
+			flags := cache.resolve(platform, incPath, cxx)
 			if flags != "" {
 				cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 				resolved[inc] = true
@@ -49,7 +55,7 @@ func resolveIncludesViaPackageManager(includes []string, systemIncDirs []string,
 				if incPath == "" {
 					continue
 				}
-				flags := platformResolve(platform, incPath, cxx)
+				flags := cache.resolve(platform, incPath, cxx)
 				if flags != "" {
 					cflags, ldflags = mergeFlags(cflags, ldflags, flags)
 					resolved[inc] = true
@@ -90,27 +96,9 @@ func findIncludeFile(sysDir, inc string) string {
 	if fileExists(direct) {
 		return direct
 	}
-	// Try recursive walk (up to 3 levels deep) — portable alternative to Unix find
-	maxDepth := 3
-	target := filepath.ToSlash(inc)
-	var found string
-	filepath.WalkDir(sysDir, func(path string, d os.DirEntry, err error) error {
-		if err != nil {
-			return filepath.SkipDir
-		}
-		// Enforce max depth
-		rel, _ := filepath.Rel(sysDir, path)
-		depth := strings.Count(filepath.ToSlash(rel), "/")
-		if d.IsDir() && depth >= maxDepth {
-			return filepath.SkipDir
-		}
-		if !d.IsDir() && strings.HasSuffix(filepath.ToSlash(path), target) {
-			found = path
-			return filepath.SkipAll
-		}
-		return nil
-	})
-	return found
+	// Look up the path suffix in the header index of the directory, which
+	// covers up to three levels below it
+	return indexedHeader(sysDir, inc)
 }
 
 // pcFilesToFlags takes a list of .pc file paths and returns combined pkg-config flags.
@@ -140,8 +128,8 @@ func pcFilesToFlagsWithDir(pcFiles []string) string {
 	for _, pcFile := range pcFiles {
 		pcName := strings.TrimSuffix(filepath.Base(pcFile), ".pc")
 		pcDir := filepath.Dir(pcFile)
-		out, err := exec.Command("sh", "-c",
-			fmt.Sprintf(`PKG_CONFIG_PATH="%s" pkg-config --cflags --libs %s 2>/dev/null`, pcDir, pcName)).Output()
+		out, err := commandOutput("sh", "-c",
+			fmt.Sprintf(`PKG_CONFIG_PATH="%s" pkg-config --cflags --libs %s 2>/dev/null`, pcDir, pcName))
 		flags := ""
 		if err == nil {
 			flags = strings.TrimSpace(string(out))
@@ -195,8 +183,8 @@ func tryLibFallback(includePath, packageName string, libPaths []string) string {
 
 // lookupPCFiles queries the package manager for .pc files belonging to a package.
 func lookupPCFiles(platform, pkg string) []string {
-	if cached, ok := cachedPCFiles[pkg]; ok {
-		return cached
+	if cached, ok := cachedPCFiles.Load(pkg); ok {
+		return cached.([]string)
 	}
 	var cmd string
 	switch platform {
@@ -213,7 +201,7 @@ func lookupPCFiles(platform, pkg string) []string {
 	default:
 		return nil
 	}
-	out, err := exec.Command("sh", "-c", cmd).Output()
+	out, err := commandOutput("sh", "-c", cmd)
 	var pcFiles []string
 	if err == nil {
 		for _, line := range strings.Split(strings.TrimSpace(string(out)), "\n") {
@@ -222,7 +210,7 @@ func lookupPCFiles(platform, pkg string) []string {
 			}
 		}
 	}
-	cachedPCFiles[pkg] = pcFiles
+	cachedPCFiles.Store(pkg, pcFiles)
 	return pcFiles
 }
 
@@ -241,7 +229,7 @@ func lookupPackageOwner(platform, filePath string) string {
 	default:
 		return ""
 	}
-	out, err := exec.Command("sh", "-c", cmd).Output()
+	out, err := commandOutput("sh", "-c", cmd)
 	if err != nil {
 		return ""
 	}
@@ -281,9 +269,7 @@ func debIncludePathToFlags(includePath, cxx string) string {
 	if len(pcFiles) == 0 {
 		machineName := ""
 		if cxx != "" {
-			if out, err := exec.Command(cxx, "-dumpmachine").Output(); err == nil {
-				machineName = strings.TrimSpace(string(out))
-			}
+			machineName = compilerTarget(cxx)
 		}
 		libPaths := []string{"/usr/lib", "/usr/lib/x86_64-linux-gnu", "/usr/local/lib"}
 		if machineName != "" {
@@ -429,10 +415,10 @@ func recommendPackage(missingIncludes []string) {
 	if len(missingIncludes) == 0 {
 		return
 	}
-	platform := detectPlatformType()
+	platform := hostPlatform.typ()
 	for _, inc := range missingIncludes {
 		found := false
-		for _, sysDir := range systemIncludeDirs() {
+		for _, sysDir := range hostPlatform.systemIncludes() {
 			if fileExists(filepath.Join(sysDir, inc)) {
 				found = true
 				break
@@ -444,7 +430,7 @@ func recommendPackage(missingIncludes []string) {
 		switch platform {
 		case "arch":
 			if files.WhichCached("pkgfile") != "" {
-				out, err := exec.Command("sh", "-c", "LC_ALL=C pkgfile "+inc+" 2>/dev/null").Output()
+				out, err := commandOutput("sh", "-c", "LC_ALL=C pkgfile "+inc+" 2>/dev/null")
 				if err == nil {
 					for _, line := range strings.Split(strings.TrimSpace(string(out)), "\n") {
 						pkg := line
@@ -461,7 +447,7 @@ func recommendPackage(missingIncludes []string) {
 			}
 		case "deb":
 			if files.WhichCached("apt-file") != "" {
-				out, err := exec.Command("sh", "-c", "LC_ALL=C apt-file find -Fl "+inc+" 2>/dev/null").Output()
+				out, err := commandOutput("sh", "-c", "LC_ALL=C apt-file find -Fl "+inc+" 2>/dev/null")
 				if err == nil {
 					pkg := strings.TrimSpace(string(out))
 					if pkg != "" && !skipPackages[pkg] {
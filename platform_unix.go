@@ -15,9 +15,7 @@ func systemIncludeDirs() []string {
 	}
 	cxx := findCompiler(false, false)
 	if cxx != "" {
-		out, err := exec.Command(cxx, "-dumpmachine").Output()
-		if err == nil {
-			machine := strings.TrimSpace(string(out))
+		if machine := compilerTarget(cxx); machine != "" {
 			machineDir := "/usr/include/" + machine
 			if fileExists(machineDir) {
 				dirs = append(dirs, machineDir)
@@ -34,10 +32,19 @@ func systemIncludeDirs() []string {
 }
 
 // compilerSupportsStd checks if the compiler supports a given -std= flag.
+// The program is piped to the compiler, without a shell in between.
 func compilerSupportsStd(compiler, std string) bool {
-	cmd := exec.Command("sh", "-c",
-		"echo 'int main(){}' | "+compiler+" -std="+std+" -x c++ -fsyntax-only - 2>/dev/null")
-	return cmd.Run() == nil
+	cmd := exec.Command(compiler, "-std="+std, "-x", "c++", "-fsyntax-only", "-")
+	cmd.Stdin = strings.NewReader("int main(){}")
+	return runCommand(cmd) == nil
+}
+
+// compilerCanLink checks if the compiler can link a program with the given flags.
+func compilerCanLink(compiler string, flags ...string) bool {
+	args := append([]string{"-x", "c++", "-"}, flags...)
+	cmd := exec.Command(compiler, append(args, "-o", "/dev/null")...)
+	cmd.Stdin = strings.NewReader("int main(){}")
+	return runCommand(cmd) == nil
 }
 
 // msys2IncludePathToFlags is a no-op on non-Windows platforms.
@@ -141,9 +141,7 @@ func systemIncludeDirs() []string {
 	}
 	cxx := findCompiler(false, false)
 	if cxx != "" {
-		out, err := exec.Command(cxx, "-dumpmachine").Output()
-		if err == nil {
-			machine := strings.TrimSpace(string(out))
+		if machine := compilerTarget(cxx); machine != "" {
 			machineDir := "/usr/include/" + machine
 			if fileExists(machineDir) {
 				dirs = append(dirs, machineDir)
@@ -168,7 +166,20 @@ func compilerSupportsStd(compiler, std string) bool {
 	cmd := exec.Command(compiler, "-std="+std, "-fsyntax-only", tmpFile)
 	cmd.Stderr = nil
 	cmd.Stdout = nil
-	return cmd.Run() == nil
+	return runCommand(cmd) == nil
+}
+
+// compilerCanLink checks if the compiler can link a program with the given flags.
+// On Windows, uses temp files instead of piping via sh -c.
+func compilerCanLink(compiler string, flags ...string) bool {
+	tmpFile := filepath.Join(os.TempDir(), "oh_linkcheck.cpp")
+	tmpExe := filepath.Join(os.TempDir(), "oh_linkcheck.exe")
+	os.WriteFile(tmpFile, []byte("int main(){}"), 0o644)
+	defer os.Remove(tmpFile)
+	defer os.Remove(tmpExe)
+	args := append([]string{tmpFile}, flags...)
+	cmd := exec.Command(compiler, append(args, "-o", tmpExe)...)
+	return runCommand(cmd) == nil
 }
 
 // msys2IncludePathToFlags resolves an include path to compiler/linker flags
@@ -198,10 +209,10 @@ func msys2IncludePathToFlags(includePath string) string {
 func lookupPackageOwnerMSYS2(filePath string) string {
 	// Convert Windows path to MSYS2-style path for pacman
 	msysPath := windowsToMSYS2Path(filePath)
-	out, err := exec.Command("pacman", "-Qo", "--quiet", msysPath).Output()
+	out, err := commandOutput("pacman", "-Qo", "--quiet", msysPath)
 	if err != nil {
 		// Try with the original Windows path
-		out, err = exec.Command("pacman", "-Qo", "--quiet", filePath).Output()
+		out, err = commandOutput("pacman", "-Qo", "--quiet", filePath)
 		if err != nil {
 			return ""
 		}
@@ -211,12 +222,12 @@ func lookupPackageOwnerMSYS2(filePath string) string {
 
 // lookupPCFilesMSYS2 queries pacman for .pc files belonging to a package.
 func lookupPCFilesMSYS2(pkg string) []string {
-	if cached, ok := cachedPCFiles[pkg]; ok {
-		return cached
+	if cached, ok := cachedPCFiles.Load(pkg); ok {
+		return cached.([]string)
 	}
-	out, err := exec.Command("pacman", "-Ql", pkg).Output()
+	out, err := commandOutput("pacman", "-Ql", pkg)
 	if err != nil {
-		cachedPCFiles[pkg] = nil
+		cachedPCFiles.Store(pkg, []string(nil))
 		return nil
 	}
 	var pcFiles []string
@@ -233,7 +244,7 @@ func lookupPCFilesMSYS2(pkg string) []string {
 			}
 		}
 	}
-	cachedPCFiles[pkg] = pcFiles
+	cachedPCFiles.Store(pkg, pcFiles)
 	return pcFiles
 }
 
@@ -300,7 +311,7 @@ func vcpkgGuessPackage(includePath, installedDir string) string {
 func vcpkgPkgConfigFlags(pkgName, pkgconfigDir string) string {
 	cmd := exec.Command("pkg-config", "--cflags", "--libs", pkgName)
 	cmd.Env = append(os.Environ(), "PKG_CONFIG_PATH="+pkgconfigDir)
-	out, err := cmd.Output()
+	out, err := runOutput(cmd)
 	if err != nil {
 		return ""
 	}
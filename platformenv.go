@@ -0,0 +1,47 @@
+package orchideous
+
+import "sync"
+
+// platformEnv is what resolving external includes needs to know about the
+// platform: the kind of package system, whether pkg-config is installed and
+// the system include directories. Each of them is found on first use and
+// remembered for the rest of the run, so that a project that only includes
+// standard headers never looks for any of them.
+type platformEnv struct {
+	typeOnce     sync.Once
+	platformType string
+
+	pkgConfigOnce sync.Once
+	hasPkgConfig  bool
+
+	includeOnce sync.Once
+	includeDirs []string
+}
+
+// hostPlatform is the platform environment shared by all builds in a run.
+var hostPlatform = &platformEnv{}
+
+// typ returns the kind of package system, see detectPlatformType.
+func (e *platformEnv) typ() string {
+	e.typeOnce.Do(func() {
+		e.platformType = detectPlatformType()
+	})
+	return e.platformType
+}
+
+// pkgConfig reports whether pkg-config is installed.
+func (e *platformEnv) pkgConfig() bool {
+	e.pkgConfigOnce.Do(func() {
+		e.hasPkgConfig = hasPkgConfig()
+	})
+	return e.hasPkgConfig
+}
+
+// systemIncludes returns the system include directories, see
+// systemIncludeDirs. The returned slice must not be modified.
+func (e *platformEnv) systemIncludes() []string {
+	e.includeOnce.Do(func() {
+		e.includeDirs = systemIncludeDirs()
+	})
+	return e.includeDirs
+}
@@ -0,0 +1,9 @@
+//go:build !unix
+
+package orchideous
+
+import "os/exec"
+
+// killProcessGroupOnCancel is a no-op on platforms without POSIX process groups;
+// cancelling the command kills only the process itself.
+func killProcessGroupOnCancel(_ *exec.Cmd) {}
@@ -0,0 +1,17 @@
+//go:build unix
+
+package orchideous
+
+import (
+	"os/exec"
+	"syscall"
+)
+
+// killProcessGroupOnCancel makes a cancelled command kill its whole process group,
+// so that compiler subprocesses (cc1plus, as, ld) do not outlive the driver.
+func killProcessGroupOnCancel(cmd *exec.Cmd) {
+	cmd.SysProcAttr = &syscall.SysProcAttr{Setpgid: true}
+	cmd.Cancel = func() error {
+		return syscall.Kill(-cmd.Process.Pid, syscall.SIGKILL)
+	}
+}
@@ -0,0 +1,182 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// remoteBackend sends object compiles to a pool of build hosts with distcc,
+// which preprocesses each source locally, compiles it on a host with a free
+// slot and fetches the object back. Hosts are given in the distcc syntax,
+// such as "build1/16 @build2/8,lzo", where the @ hosts are reached over ssh.
+type remoteBackend struct {
+	distcc string
+	hosts  []string // the distcc host specifications, or nil for the hosts distcc is configured with
+}
+
+var (
+	remoteOnce sync.Once
+	remote     *remoteBackend
+)
+
+// remoteCompiles returns the build hosts that OH_REMOTE selects, or nil if
+// objects are compiled locally. OH_REMOTE is a distcc host list, or
+// "distcc" for the hosts in DISTCC_HOSTS or ~/.distcc/hosts.
+func remoteCompiles() *remoteBackend {
+	remoteOnce.Do(func() {
+		remote = findRemoteBackend(os.Getenv("OH_REMOTE"))
+	})
+	return remote
+}
+
+// findRemoteBackend resolves an OH_REMOTE setting.
+func findRemoteBackend(setting string) *remoteBackend {
+	switch strings.ToLower(setting) {
+	case "", "0", "no", "off", "false", "none":
+		return nil
+	}
+	path, err := exec.LookPath("distcc")
+	if err != nil {
+		fmt.Fprintln(os.Stderr, "warning: OH_REMOTE is set, but distcc is not in PATH, compiling locally")
+		return nil
+	}
+	b := &remoteBackend{distcc: path}
+	if strings.ToLower(setting) != "distcc" {
+		b.hosts = strings.Fields(setting)
+	}
+	return b
+}
+
+// slots returns how many compiles with compiler the build hosts take at
+// once. Only the hosts that hostsFor keeps are counted.
+func (b *remoteBackend) slots(compiler string) int {
+	if b == nil {
+		return 0
+	}
+	if b.hosts == nil {
+		out, err := commandOutput(b.distcc, "-j")
+		n, _ := strconv.Atoi(strings.TrimSpace(string(out)))
+		if err != nil {
+			return 0
+		}
+		return n
+	}
+	n := 0
+	for _, h := range b.hostsFor(compiler) {
+		n += hostSlots(h)
+	}
+	return n
+}
+
+// hostSlots returns the job limit of a distcc host specification, which is
+// 4 by default, and 2 for localhost, like distcc does. Options such as
+// --randomize take no slots.
+func hostSlots(spec string) int {
+	if strings.HasPrefix(spec, "-") || strings.HasPrefix(spec, "+") {
+		return 0
+	}
+	host, _, _ := strings.Cut(spec, ",")
+	if i := strings.LastIndex(host, "/"); i >= 0 {
+		if n, err := strconv.Atoi(host[i+1:]); err == nil && n > 0 {
+			return n
+		}
+	}
+	if strings.HasPrefix(host, "localhost") {
+		return 2
+	}
+	return 4
+}
+
+// sshHost returns the ssh destination of a distcc host specification, such
+// as user@build2 for "user@build2:/opt/bin/distccd/8,lzo", or "" if the host
+// is not reached over ssh.
+func sshHost(spec string) string {
+	host, _, _ := strings.Cut(spec, ",")
+	if !strings.Contains(host, "@") {
+		return ""
+	}
+	if i := strings.LastIndex(host, "/"); i >= 0 {
+		if _, err := strconv.Atoi(host[i+1:]); err == nil {
+			host = host[:i]
+		}
+	}
+	host, _, _ = strings.Cut(host, ":")
+	return strings.TrimPrefix(host, "@")
+}
+
+var (
+	remoteHostsMutex sync.Mutex
+	remoteHosts      = make(map[string][]string) // compiler -> the hosts with the same compiler
+)
+
+// hostsFor returns the hosts that compiles with compiler can be sent to.
+// Objects from another compiler version would silently differ, so every ssh
+// host is asked for the version of its compiler once per run, and left out
+// if it does not match or can not be reached. TCP hosts can not be asked,
+// and are trusted to match.
+func (b *remoteBackend) hostsFor(compiler string) []string {
+	if b.hosts == nil {
+		return nil
+	}
+	remoteHostsMutex.Lock()
+	defer remoteHostsMutex.Unlock()
+	if hosts, ok := remoteHosts[compiler]; ok {
+		return hosts
+	}
+	local, err := commandOutput(compiler, "--version")
+	want, _, _ := strings.Cut(string(local), "\n")
+	keep := make([]bool, len(b.hosts))
+	forEachParallel(len(b.hosts), len(b.hosts), func(i int) {
+		dest := sshHost(b.hosts[i])
+		if dest == "" || err != nil {
+			keep[i] = true
+			return
+		}
+		out, sshErr := commandOutput("ssh", "-o", "BatchMode=yes", "-o", "ConnectTimeout=5", dest, compiler, "--version")
+		got, _, _ := strings.Cut(string(out), "\n")
+		switch {
+		case sshErr != nil:
+			fmt.Fprintf(os.Stderr, "warning: could not run %s on %s, not compiling there: %v\n", filepath.Base(compiler), dest, sshErr)
+		case got != want:
+			fmt.Fprintf(os.Stderr, "warning: %s on %s is %q, not %q, not compiling there\n", filepath.Base(compiler), dest, got, want)
+		default:
+			keep[i] = true
+		}
+	})
+	hosts := []string{}
+	for i, h := range b.hosts {
+		if keep[i] {
+			hosts = append(hosts, h)
+		}
+	}
+	remoteHosts[compiler] = hosts
+	return hosts
+}
+
+// remoteEnv returns the environment for sending an object compile with
+// compiler to the build hosts through the launcher, or nil if it is
+// compiled locally. A ccache launcher runs distcc itself on cache misses.
+func remoteEnv(compiler, launcher string) []string {
+	b := remoteCompiles()
+	if b == nil {
+		return nil
+	}
+	env := []string{}
+	if b.hosts != nil {
+		env = append(env, "DISTCC_HOSTS="+strings.Join(b.hostsFor(compiler), " "))
+	}
+	if isCcache(launcher) {
+		env = append(env, "CCACHE_PREFIX="+b.distcc)
+	}
+	return env
+}
+
+// isCcache reports whether a compiler launcher is ccache.
+func isCcache(launcher string) bool {
+	return launcher != "" && strings.HasPrefix(filepath.Base(launcher), "ccache")
+}
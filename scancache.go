@@ -0,0 +1,118 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"sync"
+)
+
+// maxPreprocessedIncludeEntries limits the size of the preprocessed include cache.
+const maxPreprocessedIncludeEntries = 4096
+
+// cachedInclude is an includeDirective, as stored in the preprocessed include cache.
+type cachedInclude struct {
+	Name   string
+	System bool `json:",omitempty"`
+}
+
+// preprocessedIncludeCache remembers the includes that survive cpp for the
+// files that the native scanner can not evaluate, by the hash of their
+// contents, so that every version of such a file is only run through cpp
+// once, whichever project or checkout it is in. Every include directive,
+// indented or not, is hidden from cpp, so the included headers are never
+// read, only the predefined macros of cpp can change the result, and the
+// cache is invalidated as a whole when they do.
+type preprocessedIncludeCache struct {
+	Stamp    string
+	Includes map[string][]cachedInclude // hash of the contents -> surviving includes
+	mu       sync.Mutex
+	path     string
+	dirty    bool
+}
+
+var (
+	preprocessedIncludeOnce  sync.Once
+	preprocessedIncludeTable *preprocessedIncludeCache
+)
+
+// loadPreprocessedIncludeCache returns the preprocessed include cache, which
+// is read once per process. Returns nil if caching is disabled or not possible.
+func loadPreprocessedIncludeCache() *preprocessedIncludeCache {
+	if !cachingEnabled() {
+		return nil
+	}
+	preprocessedIncludeOnce.Do(func() {
+		path := userCacheFile("preprocessed.cache")
+		if path == "" {
+			return
+		}
+		c := &preprocessedIncludeCache{path: path}
+		stamp := predefinedMacrosStamp()
+		if !readJSONFile(path, c) || c.Stamp != stamp || len(c.Includes) >= maxPreprocessedIncludeEntries {
+			c.Stamp = stamp
+			c.Includes = make(map[string][]cachedInclude)
+		}
+		preprocessedIncludeTable = c
+	})
+	return preprocessedIncludeTable
+}
+
+// predefinedMacrosStamp returns a string that changes whenever the macros
+// that cpp predefines change, such as when the compiler is upgraded.
+func predefinedMacrosStamp() string {
+	macros := predefinedMacros()
+	parts := make([]string, 0, len(macros))
+	for _, name := range sortedKeys(macros) {
+		parts = append(parts, name+"="+macros[name].body)
+	}
+	return hashStrings(parts...)
+}
+
+// includes returns the includes of filename, with the contents that hash to
+// key, that survive cpp, running cpp only when the answer is not cached.
+// Returns nil if cpp did not work.
+func (c *preprocessedIncludeCache) includes(key, filename string) []includeDirective {
+	if c == nil {
+		return cppPreprocessIncludes(filename)
+	}
+	c.mu.Lock()
+	cached, ok := c.Includes[key]
+	c.mu.Unlock()
+	if ok {
+		dirs := make([]includeDirective, 0, len(cached))
+		for _, inc := range cached {
+			dirs = append(dirs, includeDirective{name: inc.Name, system: inc.System})
+		}
+		return dirs
+	}
+	dirs := cppPreprocessIncludes(filename)
+	if dirs == nil {
+		return nil // cpp may work next time
+	}
+	stored := make([]cachedInclude, 0, len(dirs))
+	for _, d := range dirs {
+		stored = append(stored, cachedInclude{Name: d.name, System: d.system})
+	}
+	c.mu.Lock()
+	c.Includes[key] = stored
+	c.dirty = true
+	c.mu.Unlock()
+	return dirs
+}
+
+// save writes the cache back to disk if it has changed.
+func (c *preprocessedIncludeCache) save() {
+	if c == nil {
+		return
+	}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if !c.dirty {
+		return
+	}
+	if err := writeJSONFile(c.path, c); err != nil {
+		fmt.Fprintf(os.Stderr, "warning: could not write %s: %v\n", c.path, err)
+		return
+	}
+	c.dirty = false
+}
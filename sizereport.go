@@ -0,0 +1,330 @@
+package orchideous
+
+import (
+	"context"
+	"debug/elf"
+	"debug/macho"
+	"debug/pe"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"os/exec"
+	"sort"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/xyproto/files"
+)
+
+// sizeTopSymbols is how many symbols the size report lists.
+const sizeTopSymbols = 10
+
+// startupRuns is how many times the executable is started, for each stage
+// of the size report of oh tiny. The first run is shown as the cold start,
+// and the fastest of the others as the warm start.
+const startupRuns = 5
+
+// startupTimeout is how long an executable may run before the size report
+// gives up on timing it, since it is then not a program that just exits.
+const startupTimeout = time.Second
+
+// segmentSizes are the sizes of an executable as it is loaded into memory,
+// like size(1) shows them: the code and read-only data (text), the
+// initialized data (data) and the zero-initialized data (bss).
+type segmentSizes struct {
+	text, data, bss uint64
+}
+
+// executableSegments returns the segment sizes of an ELF, PE or Mach-O
+// executable. ELF executables are measured by their program headers, which
+// sstrip keeps, rather than by their sections.
+func executableSegments(path string) (segmentSizes, error) {
+	var s segmentSizes
+	if f, err := elf.Open(path); err == nil {
+		defer f.Close()
+		for _, p := range f.Progs {
+			if p.Type != elf.PT_LOAD {
+				continue
+			}
+			if p.Flags&elf.PF_W != 0 {
+				s.data += p.Filesz
+				s.bss += p.Memsz - p.Filesz
+			} else {
+				s.text += p.Filesz
+			}
+		}
+		return s, nil
+	}
+	if f, err := pe.Open(path); err == nil {
+		defer f.Close()
+		for _, sec := range f.Sections {
+			switch c := sec.Characteristics; {
+			case c&pe.IMAGE_SCN_CNT_UNINITIALIZED_DATA != 0:
+				s.bss += uint64(sec.VirtualSize)
+			case c&pe.IMAGE_SCN_MEM_WRITE != 0:
+				s.data += uint64(sec.Size)
+			default:
+				s.text += uint64(sec.Size)
+			}
+		}
+		return s, nil
+	}
+	if f, err := macho.Open(path); err == nil {
+		defer f.Close()
+		for _, l := range f.Loads {
+			seg, ok := l.(*macho.Segment)
+			if !ok || seg.Name == "__PAGEZERO" || seg.Name == "__LINKEDIT" {
+				continue
+			}
+			if seg.Prot&2 != 0 { // VM_PROT_WRITE
+				s.data += seg.Filesz
+				s.bss += seg.Memsz - seg.Filesz
+			} else {
+				s.text += seg.Filesz
+			}
+		}
+		return s, nil
+	}
+	return s, fmt.Errorf("%s: not an ELF, PE or Mach-O executable", path)
+}
+
+// startupTime runs the executable a few times, with no arguments and no
+// input, and returns how long the first run took and the fastest of the
+// other runs. For a program that exits right away, that is how long it takes
+// to be loaded, unpacked and started, first with little of it in the page
+// cache (cold) and then with all of it there (warm). Returns false if the
+// program can not be run, or does not exit within startupTimeout.
+func startupTime(exe string) (cold, warm time.Duration, ok bool) {
+	for i := 0; i < startupRuns; i++ {
+		ctx, cancel := context.WithTimeout(context.Background(), startupTimeout)
+		c := exec.CommandContext(ctx, exe)
+		start := time.Now()
+		err := c.Run()
+		elapsed := time.Since(start)
+		timedOut := ctx.Err() != nil
+		cancel()
+		var exitErr *exec.ExitError
+		if timedOut || (err != nil && !errors.As(err, &exitErr)) {
+			return 0, 0, false
+		}
+		switch {
+		case i == 0:
+			cold = elapsed
+		case i == 1 || elapsed < warm:
+			warm = elapsed
+		}
+	}
+	return cold, warm, true
+}
+
+// symbolSize is the size of a symbol, in bytes.
+type symbolSize struct {
+	name string
+	size uint64
+}
+
+// parseNMSizes parses the output of "nm --size-sort -S", and returns the
+// size of every symbol. A symbol that is in several files, like an inline
+// function, is only counted once, as the linker keeps one copy.
+func parseNMSizes(output string) map[string]uint64 {
+	sizes := make(map[string]uint64)
+	for _, line := range strings.Split(output, "\n") {
+		fields := strings.Fields(line)
+		if len(fields) < 4 {
+			continue
+		}
+		size, err := strconv.ParseUint(fields[1], 16, 64)
+		if err != nil {
+			continue
+		}
+		name := strings.Join(fields[3:], " ")
+		sizes[name] = max(sizes[name], size)
+	}
+	return sizes
+}
+
+// parseBloatyCSV parses the output of "bloaty -d symbols --csv", which has
+// the columns symbols, vmsize and filesize, and returns the size of every symbol.
+func parseBloatyCSV(output string) map[string]uint64 {
+	sizes := make(map[string]uint64)
+	for _, line := range strings.Split(output, "\n")[1:] {
+		cut := strings.LastIndexByte(line, ',')
+		if cut < 0 {
+			continue
+		}
+		rest, file := line[:cut], line[cut+1:]
+		cut = strings.LastIndexByte(rest, ',')
+		if cut < 0 {
+			continue
+		}
+		name, vm := strings.Trim(rest[:cut], `"`), rest[cut+1:]
+		vmSize, err1 := strconv.ParseUint(strings.TrimSpace(vm), 10, 64)
+		fileSize, err2 := strconv.ParseUint(strings.TrimSpace(file), 10, 64)
+		if err1 != nil || err2 != nil {
+			continue
+		}
+		sizes[name] = max(vmSize, fileSize)
+	}
+	return sizes
+}
+
+// largestSymbols returns the n largest symbols of the given object files or
+// executable, found with bloaty if it is installed, or else with nm.
+func largestSymbols(paths []string, n int) []symbolSize {
+	var sizes map[string]uint64
+	if bloaty := files.WhichCached("bloaty"); bloaty != "" {
+		args := append([]string{"-d", "symbols", "-n", strconv.Itoa(n), "--csv"}, paths...)
+		if out, err := commandOutput(bloaty, args...); err == nil {
+			sizes = parseBloatyCSV(string(out))
+		}
+	}
+	if len(sizes) == 0 {
+		args := append([]string{"--size-sort", "-S", "-C", "--defined-only"}, paths...)
+		out, _ := commandOutput("nm", args...) // stripped files are not an error
+		sizes = parseNMSizes(string(out))
+	}
+	symbols := make([]symbolSize, 0, len(sizes))
+	for name, size := range sizes {
+		symbols = append(symbols, symbolSize{name, size})
+	}
+	sort.Slice(symbols, func(i, j int) bool {
+		if symbols[i].size != symbols[j].size {
+			return symbols[i].size > symbols[j].size
+		}
+		return symbols[i].name < symbols[j].name
+	})
+	return symbols[:min(n, len(symbols))]
+}
+
+// sizeStage is the executable after one of the steps that make it smaller.
+type sizeStage struct {
+	name       string // the step, like "built", "sstrip" or "upx"
+	size       int64
+	segments   segmentSizes
+	cold, warm time.Duration // the startup times, see startupTime
+	timed      bool
+}
+
+// measureStage measures the size of the executable, and the time it takes
+// to start if timed is set.
+func measureStage(name, exe string, timed bool) (sizeStage, error) {
+	fi, err := os.Stat(exe)
+	if err != nil {
+		return sizeStage{}, err
+	}
+	st := sizeStage{name: name, size: fi.Size()}
+	st.segments, _ = executableSegments(exe) // upx may leave nothing to parse
+	if timed {
+		st.cold, st.warm, st.timed = startupTime(exe)
+	}
+	return st, nil
+}
+
+// formatSize formats a number of bytes as B, KiB or MiB.
+func formatSize(n uint64) string {
+	switch {
+	case n < 1<<10:
+		return fmt.Sprintf("%d B", n)
+	case n < 1<<20:
+		return fmt.Sprintf("%.1f KiB", float64(n)/(1<<10))
+	}
+	return fmt.Sprintf("%.1f MiB", float64(n)/(1<<20))
+}
+
+// printSizeReport prints the size of each stage, the cold and warm startup
+// times of the stages that were timed, and the largest symbols.
+func printSizeReport(w io.Writer, exe string, stages []sizeStage, symbols []symbolSize) {
+	fmt.Fprintf(w, "\nSize of %s:\n", exe)
+	fmt.Fprintf(w, "%-8s %11s %11s %11s %11s %10s %10s\n", "stage", "file", "text", "data", "bss", "cold", "warm")
+	ms := func(d time.Duration) string {
+		return fmt.Sprintf("%.2f ms", float64(d.Microseconds())/1000)
+	}
+	for _, st := range stages {
+		cold, warm := "-", "-"
+		if st.timed {
+			cold, warm = ms(st.cold), ms(st.warm)
+		}
+		fmt.Fprintf(w, "%-8s %11s %11s %11s %11s %10s %10s\n", st.name, formatSize(uint64(st.size)),
+			formatSize(st.segments.text), formatSize(st.segments.data), formatSize(st.segments.bss), cold, warm)
+	}
+	if len(symbols) == 0 {
+		return
+	}
+	fmt.Fprintln(w, "\nLargest symbols:")
+	for _, s := range symbols {
+		fmt.Fprintf(w, "%11s  %s\n", formatSize(s.size), s.name)
+	}
+}
+
+// projectObjects returns the object files of the executable of the project
+// that were built with opts, for a look at the symbols that a stripped
+// executable no longer has. Returns nil for single source projects, that
+// are compiled directly to an executable.
+func projectObjects(proj Project, opts BuildOptions) []string {
+	flags := assembleFlags(proj, opts)
+	var objs []string
+	for _, src := range append([]string{proj.MainSource}, proj.DepSources...) {
+		if obj := objectPath(flags, src); fileExists(obj) {
+			objs = append(objs, obj)
+		}
+	}
+	return objs
+}
+
+// doSizeBuild builds with opts, which should be a small or tiny build, and
+// prints a report of the size of the executable. With opts.Tiny, the
+// executable is also stripped with sstrip and packed with upx, if they are
+// installed, and the report compares the executable after each step,
+// including how long it takes to start, since a packed executable is
+// smaller but has to be unpacked every time it starts. The program is only
+// run for oh tiny, and Windows executables are neither packed nor timed.
+func doSizeBuild(opts BuildOptions) error {
+	if err := doBuild(opts); err != nil {
+		return err
+	}
+	exe := executableName()
+	if exe == "" {
+		return nil
+	}
+	proj := detectProject(".")
+	win64 := opts.Win64 || proj.HasWin64
+	if win64 {
+		exe += ".exe"
+	}
+	exePath := dotSlash(exe)
+
+	// Only time programs that exit on their own, and not windows or servers
+	timed := opts.Tiny && !win64
+	var stages []sizeStage
+	measure := func(name string) {
+		st, err := measureStage(name, exePath, timed)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "warning: %v\n", err)
+			return
+		}
+		timed = st.timed
+		stages = append(stages, st)
+	}
+	measure("built")
+	symbolFiles := projectObjects(proj, opts)
+	if len(symbolFiles) == 0 {
+		symbolFiles = []string{exePath}
+	}
+	symbols := largestSymbols(symbolFiles, sizeTopSymbols)
+
+	if opts.Tiny && !win64 {
+		for _, step := range [][]string{{"sstrip"}, {"upx", "--brute"}} {
+			if files.WhichCached(step[0]) == "" {
+				continue
+			}
+			if err := runTool(step[0], append(step[1:], exePath)...); err == nil {
+				fmt.Println(strings.Join(step, " "), exePath)
+				measure(step[0])
+			}
+		}
+	}
+	printSizeReport(os.Stdout, exe, stages, symbols)
+	return nil
+}
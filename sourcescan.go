@@ -0,0 +1,188 @@
+package orchideous
+
+import (
+	"bytes"
+	"os"
+	"path/filepath"
+	"runtime"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// sourceScan is everything detection needs to know about one source or header
+// file, gathered from a single read of the file. Only what is derived from
+// the contents is kept, not the contents themselves, since the records of a
+// whole tree stay in memory for as long as oh all or oh watch runs.
+type sourceScan struct {
+	hash            string   // hash of the contents, or "" if the file could not be read
+	directives      []byte   // the preprocessor lines, until survivingIncludes has used them
+	leadingIncludes []string // the system headers at the top of the file, see leadingSystemIncludes
+	unityOptOut     bool     // has the marker that keeps it out of unity batches
+	hasMain         bool
+	flags           Project  // only the Has* fields and BoostLibs are set
+	localIncludes   []string // #include "..." targets, in order
+	directIncludes  []string // #include <...> targets, in order, ignoring conditionals
+	module          string   // the C++20 module that this file is the interface of, or ""
+	imports         []string // the named modules this file imports, in order
+	headerUnits     []string // the imported headers, with the <> or "", in order
+
+	includesOnce sync.Once
+	includes     []includeDirective // includes that survive preprocessing, or nil
+}
+
+type sourceScanEntry struct {
+	stamp string
+	scan  *sourceScan
+}
+
+var (
+	sourceScanMutex sync.Mutex
+	sourceScanCache = make(map[string]sourceScanEntry)
+)
+
+// scanSource returns the scan record for a file. Records are memoized for as
+// long as the size and modification time of the file are unchanged.
+// Returns an empty record if the file can not be read.
+func scanSource(filename string) *sourceScan {
+	fi, err := os.Stat(filename)
+	if err != nil {
+		return &sourceScan{}
+	}
+	key, err := filepath.Abs(filename)
+	if err != nil {
+		key = filename
+	}
+	key = normalizePath(key)
+	stamp := fi.ModTime().String() + "/" + strconv.FormatInt(fi.Size(), 10)
+
+	sourceScanMutex.Lock()
+	entry, ok := sourceScanCache[key]
+	sourceScanMutex.Unlock()
+	if ok && entry.stamp == stamp {
+		return entry.scan
+	}
+
+	data, err := os.ReadFile(filename)
+	if err != nil {
+		return &sourceScan{}
+	}
+	s := newSourceScan(data)
+
+	sourceScanMutex.Lock()
+	sourceScanCache[key] = sourceScanEntry{stamp: stamp, scan: s}
+	sourceScanMutex.Unlock()
+	return s
+}
+
+// scanSources scans the given files concurrently, so that later calls to
+// scanSource for the same files are served from memory.
+func scanSources(files []string) {
+	sem := make(chan struct{}, runtime.NumCPU())
+	var wg sync.WaitGroup
+	for _, f := range files {
+		if f == "" {
+			continue
+		}
+		wg.Add(1)
+		sem <- struct{}{}
+		go func(f string) {
+			defer wg.Done()
+			scanSource(f)
+			<-sem
+		}(f)
+	}
+	wg.Wait()
+}
+
+// preprocessSources finds the includes that survive preprocessing in the
+// given files concurrently, in the single pass that the win64 detection and
+// the external include collection then share. Files that have to be run
+// through cpp are spread over the CPUs, and their results are cached by the
+// hash of their contents, see preprocessedIncludeCache.
+func preprocessSources(files []string) {
+	forEachParallel(len(files), runtime.NumCPU(), func(i int) {
+		if files[i] != "" {
+			scanIncludes(files[i])
+		}
+	})
+	loadPreprocessedIncludeCache().save()
+}
+
+// newSourceScan builds a scan record from the contents of a file.
+func newSourceScan(data []byte) *sourceScan {
+	s := &sourceScan{
+		hash:            hashStrings(string(data)),
+		leadingIncludes: leadingSystemIncludes(data),
+		unityOptOut:     bytes.Contains(data, []byte(unityOptOut)),
+	}
+	var directives bytes.Buffer
+	for _, line := range logicalLines(string(data)) {
+		if strings.HasPrefix(strings.TrimSpace(line), "#") {
+			directives.WriteString(line)
+			directives.WriteByte('\n')
+		}
+	}
+	s.directives = directives.Bytes()
+	for _, line := range strings.Split(string(data), "\n") {
+		trimmed := strings.TrimSpace(line)
+		if !s.hasMain && lineContainsMain(line, trimmed) {
+			s.hasMain = true
+		}
+		scanLineForFlags(line, trimmed, &s.flags)
+		if strings.HasPrefix(trimmed, "import") || strings.HasPrefix(trimmed, "export") || strings.HasPrefix(trimmed, "module") {
+			scanLineForModules(trimmed, s)
+		}
+		if !strings.HasPrefix(trimmed, "#include") {
+			continue
+		}
+		if strings.HasPrefix(trimmed, "#include \"") {
+			parts := strings.SplitN(trimmed, "\"", 3)
+			if len(parts) >= 2 {
+				s.localIncludes = append(s.localIncludes, parts[1])
+			}
+		}
+		if idx := strings.Index(trimmed, "<"); idx >= 0 {
+			if end := strings.Index(trimmed[idx:], ">"); end >= 0 {
+				s.directIncludes = append(s.directIncludes, trimmed[idx+1:idx+end])
+			}
+		}
+	}
+	return s
+}
+
+// survivingIncludes returns the includes of the file that survive
+// preprocessing, evaluated on first use. The path is only used if the
+// file has to be run through cpp. Returns nil if that did not work.
+func (s *sourceScan) survivingIncludes(filename string) []includeDirective {
+	s.includesOnce.Do(func() {
+		if s.hash == "" {
+			return
+		}
+		dirs, err := nativeScanIncludes(s.directives)
+		if err != nil {
+			dirs = loadPreprocessedIncludeCache().includes(s.hash, filename)
+		}
+		s.includes = dirs
+		s.directives = nil
+	})
+	return s.includes
+}
+
+// mergeFlags adds the flags detected in a single file to the project.
+func (p *Project) mergeFlags(f *Project) {
+	p.HasOpenMP = p.HasOpenMP || f.HasOpenMP
+	p.HasBoost = p.HasBoost || f.HasBoost
+	p.HasQt6 = p.HasQt6 || f.HasQt6
+	p.HasMathLib = p.HasMathLib || f.HasMathLib
+	p.HasFS = p.HasFS || f.HasFS
+	p.HasThreads = p.HasThreads || f.HasThreads
+	p.HasWin64 = p.HasWin64 || f.HasWin64
+	p.HasGLFWVulkan = p.HasGLFWVulkan || f.HasGLFWVulkan
+	p.HasDlopen = p.HasDlopen || f.HasDlopen
+	p.HasModules = p.HasModules || f.HasModules
+	p.HasParallel = p.HasParallel || f.HasParallel
+	for _, lib := range f.BoostLibs {
+		p.BoostLibs = appendUnique(p.BoostLibs, lib)
+	}
+}
@@ -0,0 +1,219 @@
+package orchideous
+
+import (
+	"bytes"
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/xyproto/files"
+)
+
+// The probes that oh runs, such as pkg-config, package manager lookups and
+// compiler checks, all go through runOutput and runCommand, which count and
+// time them per category. Identical commands that run at the same time, as
+// with the parallel lookups of "oh all", are only run once.
+
+// spawnStat is the number and the total time of the subprocesses of one category.
+type spawnStat struct {
+	Category string
+	Count    int
+	Shared   int // commands that got the output of an identical one that was already running
+	Duration time.Duration
+}
+
+// inflightCommand is a command of runOutput that is running.
+type inflightCommand struct {
+	done chan struct{}
+	out  []byte
+	err  error
+}
+
+var (
+	spawnCount   atomic.Int64 // all the subprocesses, for the benchmarks and the budget
+	spawnMutex   sync.Mutex
+	spawnStats   = make(map[string]*spawnStat)
+	inflight     = make(map[string]*inflightCommand)
+	budgetWarned bool
+)
+
+// commandOutput runs a command and returns its standard output, like
+// exec.Command(name, args...).Output().
+func commandOutput(name string, args ...string) ([]byte, error) {
+	return runOutput(exec.Command(name, args...))
+}
+
+// runOutput is cmd.Output. If an identical command is already running, its
+// output is used instead of running another one.
+func runOutput(cmd *exec.Cmd) ([]byte, error) {
+	run := func() ([]byte, error) {
+		var out []byte
+		err := runSpawn(cmd, func() (err error) {
+			out, err = cmd.Output()
+			return err
+		})
+		return out, err
+	}
+	if cmd.Stdin != nil {
+		return run()
+	}
+	key := strings.Join(append([]string{cmd.Path, cmd.Dir, strings.Join(cmd.Env, "\n")}, cmd.Args...), "\x00")
+	spawnMutex.Lock()
+	if c, ok := inflight[key]; ok {
+		spawnStatFor(spawnCategory(cmd)).Shared++
+		spawnMutex.Unlock()
+		<-c.done
+		return bytes.Clone(c.out), c.err
+	}
+	c := &inflightCommand{done: make(chan struct{})}
+	inflight[key] = c
+	spawnMutex.Unlock()
+
+	c.out, c.err = run()
+	spawnMutex.Lock()
+	delete(inflight, key)
+	spawnMutex.Unlock()
+	close(c.done)
+	return bytes.Clone(c.out), c.err
+}
+
+// runCommand is cmd.Run.
+func runCommand(cmd *exec.Cmd) error {
+	return runSpawn(cmd, cmd.Run)
+}
+
+// runSpawn runs a command with run, and records it.
+func runSpawn(cmd *exec.Cmd, run func() error) error {
+	n := spawnCount.Add(1)
+	if budget, _ := spawnBudget(); budget >= 0 && n > int64(budget) {
+		spawnMutex.Lock()
+		warn := !budgetWarned
+		budgetWarned = true
+		spawnMutex.Unlock()
+		if warn {
+			fmt.Fprintf(os.Stderr, "warning: more than %d subprocesses were spawned (OH_SPAWN_BUDGET), run oh stats to see which\n", budget)
+		}
+	}
+	span := execSpan(cmd)
+	start := time.Now()
+	err := run()
+	d := time.Since(start)
+	span.end()
+	spawnMutex.Lock()
+	s := spawnStatFor(spawnCategory(cmd))
+	s.Count++
+	s.Duration += d
+	spawnMutex.Unlock()
+	return err
+}
+
+// spawnStatFor returns the stats of a category. spawnMutex must be held.
+func spawnStatFor(category string) *spawnStat {
+	s, ok := spawnStats[category]
+	if !ok {
+		s = &spawnStat{Category: category}
+		spawnStats[category] = s
+	}
+	return s
+}
+
+// spawnCategory returns the category of a command: "compiler" for the
+// compilers, the tool that a shell pipeline starts with, such as
+// "dpkg-query (sh)", and the name of the executable otherwise.
+func spawnCategory(cmd *exec.Cmd) string {
+	name := filepath.Base(cmd.Path)
+	if name == "sh" && len(cmd.Args) > 2 && cmd.Args[1] == "-c" {
+		if fields := strings.Fields(cmd.Args[2]); len(fields) > 0 {
+			return filepath.Base(fields[0]) + " (sh)"
+		}
+	}
+	switch {
+	case isCompilerGCC(name), isCompilerClang(name), name == "cc", name == "c++", name == "cpp", strings.HasPrefix(name, "zapcc"):
+		return "compiler"
+	}
+	return strings.TrimSuffix(name, ".exe")
+}
+
+// spawnBreakdown returns the stats of every category, the most time first.
+func spawnBreakdown() []spawnStat {
+	spawnMutex.Lock()
+	var stats []spawnStat
+	for _, s := range spawnStats {
+		stats = append(stats, *s)
+	}
+	spawnMutex.Unlock()
+	sort.Slice(stats, func(i, j int) bool {
+		if stats[i].Duration != stats[j].Duration {
+			return stats[i].Duration > stats[j].Duration
+		}
+		return stats[i].Category < stats[j].Category
+	})
+	return stats
+}
+
+// spawnBudget returns the budget in OH_SPAWN_BUDGET, such as "20" to warn
+// when a run spawns more than 20 subprocesses, or "20:fail" to also fail.
+// Returns -1 if there is no budget.
+func spawnBudget() (int, bool) {
+	setting := os.Getenv("OH_SPAWN_BUDGET")
+	n, mode, _ := strings.Cut(setting, ":")
+	budget, err := strconv.Atoi(strings.TrimSpace(n))
+	if err != nil || budget < 0 {
+		return -1, false
+	}
+	return budget, strings.EqualFold(strings.TrimSpace(mode), "fail")
+}
+
+// checkSpawnBudget returns an error if OH_SPAWN_BUDGET is set to fail, and
+// more subprocesses than that were spawned.
+func checkSpawnBudget() error {
+	budget, fail := spawnBudget()
+	if n := spawnCount.Load(); fail && budget >= 0 && n > int64(budget) {
+		return fmt.Errorf("%d subprocesses were spawned, and OH_SPAWN_BUDGET allows %d", n, budget)
+	}
+	return nil
+}
+
+// doStats detects the project and assembles its build flags, like a build
+// does, and prints the subprocesses that took.
+func doStats() error {
+	start := time.Now()
+	proj := detectProject(".")
+	if proj.MainSource == "" {
+		return fmt.Errorf("no main source file found")
+	}
+	detected := time.Since(start)
+	opts := BuildOptions{Win64: proj.HasWin64}
+	if opts.Win64 && findWin64Compiler(proj.IsC) == "" && files.WhichCached("docker") == "" {
+		return fmt.Errorf("no mingw cross-compiler found for win64 and docker is not available")
+	}
+	mainTarget(opts, proj)
+	total := time.Since(start)
+
+	fmt.Printf("Detecting the project took %s, and assembling the flags %s\n\n", detected.Round(time.Microsecond), (total - detected).Round(time.Microsecond))
+	stats := spawnBreakdown()
+	if len(stats) == 0 {
+		fmt.Println("No subprocesses were spawned")
+	} else {
+		fmt.Printf("%-24s %6s %6s %10s\n", "spawned", "count", "shared", "time")
+		var sum spawnStat
+		for _, s := range stats {
+			fmt.Printf("%-24s %6d %6d %10s\n", s.Category, s.Count, s.Shared, s.Duration.Round(time.Microsecond))
+			sum.Count += s.Count
+			sum.Shared += s.Shared
+			sum.Duration += s.Duration
+		}
+		fmt.Printf("%-24s %6d %6d %10s\n", "total", sum.Count, sum.Shared, sum.Duration.Round(time.Microsecond))
+	}
+	if cachingEnabled() {
+		fmt.Println("\nThe caches were used, run OH_NOCACHE=1 oh stats to see what a first build spawns")
+	}
+	return nil
+}
@@ -0,0 +1,201 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"slices"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+// TestOptions configures how tests are built and run.
+type TestOptions struct {
+	Run    bool // run the tests after building them
+	Shard  int  // the shard of the tests to build and run, from 1 to Shards
+	Shards int  // the number of shards, or 0 to build and run all tests
+}
+
+// parseShard parses a shard given as "i/n", where i is from 1 to n.
+func parseShard(s string) (int, int, error) {
+	a, b, ok := strings.Cut(s, "/")
+	i, err1 := strconv.Atoi(a)
+	n, err2 := strconv.Atoi(b)
+	if !ok || err1 != nil || err2 != nil || n < 1 || i < 1 || i > n {
+		return 0, 0, fmt.Errorf("invalid shard %q, expected i/n with 1 <= i <= n", s)
+	}
+	return i, n, nil
+}
+
+// shardTests returns the tests in the given shard. Tests are assigned to
+// shards round robin, in sorted order, so that every node of a CI job that
+// runs the same shard count gets a stable and disjoint set of tests.
+func shardTests(tests []string, shard, shards int) []string {
+	sorted := slices.Clone(tests)
+	slices.Sort(sorted)
+	if shards <= 1 {
+		return sorted
+	}
+	var picked []string
+	for i, ts := range sorted {
+		if i%shards == shard-1 {
+			picked = append(picked, ts)
+		}
+	}
+	return picked
+}
+
+// testResult is the outcome of linking and running one test.
+type testResult struct {
+	src      string
+	exe      string
+	err      error
+	duration time.Duration
+}
+
+// doTests builds the test executables of the project, and runs them if
+// topts.Run is set. The dependency sources are compiled once, together with
+// the test sources, and shared between the tests. The tests are then
+// linked, and run, in parallel on up to flags.Jobs workers, with the output
+// of each test printed when it is done. A summary with the time each test
+// took is printed at the end.
+func doTests(opts BuildOptions, topts TestOptions) error {
+	proj := detectProject(".")
+	tests := shardTests(proj.TestSources, topts.Shard, topts.Shards)
+	if len(tests) == 0 {
+		fmt.Println("Nothing to test")
+		return nil
+	}
+	if proj.HasWin64 {
+		opts.Win64 = true
+	}
+	flags := assembleFlags(proj, opts)
+	if flags.DockerImage != "" {
+		defer stopDockerContainers(mustGetwd())
+	}
+
+	results, err := buildTestExecutables(tests, proj.DepSources, flags, opts.Win64)
+	if err != nil {
+		return err
+	}
+	if !topts.Run {
+		return nil
+	}
+
+	var mu sync.Mutex // keeps the output of parallel test runs apart
+	forEachParallel(len(tests), flags.Jobs, func(i int) {
+		r := &results[i]
+		c := exec.Command(dotSlash(r.exe))
+		span := startSpan("test", r.exe)
+		start := time.Now()
+		output, err := c.CombinedOutput()
+		r.duration = time.Since(start)
+		span.end()
+		r.err = err
+		mu.Lock()
+		fmt.Printf("Running %s...\n", r.exe)
+		os.Stdout.Write(output)
+		mu.Unlock()
+	})
+
+	failed := 0
+	fmt.Println()
+	for _, r := range results {
+		status := "PASS"
+		if r.err != nil {
+			status = "FAIL"
+			failed++
+		}
+		fmt.Printf("%s  %-30s %8s\n", status, r.exe, r.duration.Round(time.Millisecond))
+	}
+	if failed > 0 {
+		return fmt.Errorf("%d of %d tests failed", failed, len(results))
+	}
+	fmt.Printf("All %d tests passed\n", len(results))
+	return nil
+}
+
+// buildTestExecutables compiles the given test (or benchmark) sources and
+// the dependency sources, which are compiled once and shared, and links
+// one executable per test, in parallel on up to flags.Jobs workers.
+func buildTestExecutables(tests, deps []string, flags BuildFlags, win64 bool) ([]testResult, error) {
+	dirName := filepath.Base(mustGetwd())
+	srcs := append(slices.Clone(tests), deps...)
+	objFiles, jobs := planCompileJobs(srcs, flags)
+	if err := runCompileJobs(flags, jobs, func(r compileResult) {
+		fmt.Printf("[%s] %s %s\n", dirName, flags.Compiler, strings.Join(compactArgs(r.job.args), " "))
+		os.Stderr.Write(r.output)
+	}); err != nil {
+		return nil, err
+	}
+	depObjs := objFiles[len(tests):]
+
+	results := make([]testResult, len(tests))
+	manifest := loadBuildManifest()
+	defer manifest.save()
+	var mu sync.Mutex // keeps the output of parallel links apart
+	forEachParallel(len(tests), flags.Jobs, func(i int) {
+		exe := testExecutable(tests[i], win64)
+		results[i] = testResult{src: tests[i], exe: exe}
+		inputs := append([]string{objFiles[i]}, depObjs...)
+		args := linkArgs(flags, inputs, exe)
+		if !needsRelink(exe, inputs) && manifest.linkedWith(flags, exe, args) {
+			return
+		}
+		span := startSpan("link", exe)
+		output, err := runCompiler(flags, args).CombinedOutput()
+		span.end()
+		mu.Lock()
+		fmt.Printf("[%s] %s %s\n", dirName, flags.Compiler, strings.Join(compactArgs(args), " "))
+		os.Stderr.Write(output)
+		mu.Unlock()
+		if err != nil {
+			results[i].err = fmt.Errorf("linking test %s: %w", exe, err)
+			return
+		}
+		manifest.recordLink(flags, tests[i], exe, args)
+	})
+	for _, r := range results {
+		if r.err != nil {
+			return nil, r.err
+		}
+	}
+	return results, nil
+}
+
+// needsRelink reports whether output is missing or older than any of its inputs.
+func needsRelink(output string, inputs []string) bool {
+	fi, err := os.Stat(output)
+	if err != nil {
+		return true
+	}
+	for _, in := range inputs {
+		if inFi, err := os.Stat(in); err != nil || inFi.ModTime().After(fi.ModTime()) {
+			return true
+		}
+	}
+	return false
+}
+
+// forEachParallel calls fn for every index from 0 to n-1, on up to workers goroutines.
+func forEachParallel(n, workers int, fn func(i int)) {
+	queue := make(chan int)
+	var wg sync.WaitGroup
+	for w := 0; w < min(max(workers, 1), n); w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := range queue {
+				fn(i)
+			}
+		}()
+	}
+	for i := 0; i < n; i++ {
+		queue <- i
+	}
+	close(queue)
+	wg.Wait()
+}
@@ -0,0 +1,159 @@
+package orchideous
+
+import (
+	"encoding/json"
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"sync"
+	"time"
+)
+
+// traceEvent is one complete ("X") event in the Chrome trace_event format,
+// as read by chrome://tracing, Perfetto and speedscope.
+type traceEvent struct {
+	Name  string            `json:"name"`
+	Cat   string            `json:"cat"`
+	Ph    string            `json:"ph"`
+	Ts    int64             `json:"ts"`  // microseconds since the trace started
+	Dur   int64             `json:"dur"` // microseconds
+	Pid   int               `json:"pid"`
+	Tid   int               `json:"tid"`
+	Args  map[string]string `json:"args,omitempty"`
+	start time.Time
+}
+
+// tracer collects spans while tracing is enabled. Spans that overlap in time
+// are put on different lanes (shown as threads), so that concurrent compiles
+// and lookups are drawn side by side.
+type tracer struct {
+	mu     sync.Mutex
+	path   string
+	start  time.Time
+	events []traceEvent
+	lanes  []bool // lanes in use
+}
+
+var (
+	traceOnce   sync.Once
+	traceActive *tracer // nil when tracing is disabled
+)
+
+// activeTracer returns the tracer, or nil if OH_TRACE is not set.
+func activeTracer() *tracer {
+	traceOnce.Do(func() {
+		if path := os.Getenv("OH_TRACE"); path != "" {
+			traceActive = &tracer{path: path, start: time.Now()}
+		}
+	})
+	return traceActive
+}
+
+// traceSpan is a span that has been started, but not ended.
+type traceSpan struct {
+	t     *tracer
+	event traceEvent
+}
+
+// startSpan starts a span in the given category, such as "detect", "exec",
+// "compile" or "link". Returns nil if tracing is disabled; ending a nil span
+// does nothing.
+func startSpan(cat, name string) *traceSpan {
+	t := activeTracer()
+	if t == nil {
+		return nil
+	}
+	t.mu.Lock()
+	lane := 0
+	for lane < len(t.lanes) && t.lanes[lane] {
+		lane++
+	}
+	if lane == len(t.lanes) {
+		t.lanes = append(t.lanes, true)
+	} else {
+		t.lanes[lane] = true
+	}
+	t.mu.Unlock()
+	now := time.Now()
+	return &traceSpan{t: t, event: traceEvent{
+		Name: name, Cat: cat, Ph: "X", Pid: 1, Tid: lane + 1,
+		Ts: now.Sub(t.start).Microseconds(), start: now,
+	}}
+}
+
+// arg attaches a key and value to the span, shown when it is selected.
+func (s *traceSpan) arg(key, value string) *traceSpan {
+	if s == nil {
+		return nil
+	}
+	if s.event.Args == nil {
+		s.event.Args = make(map[string]string)
+	}
+	s.event.Args[key] = value
+	return s
+}
+
+// end records the span.
+func (s *traceSpan) end() {
+	if s == nil {
+		return
+	}
+	s.event.Dur = time.Since(s.event.start).Microseconds()
+	s.t.mu.Lock()
+	s.t.events = append(s.t.events, s.event)
+	s.t.lanes[s.event.Tid-1] = false
+	s.t.mu.Unlock()
+}
+
+// writeTrace writes the collected spans to the file named by OH_TRACE, if
+// tracing is enabled, followed by a summary of the time spent per category.
+func writeTrace() error {
+	t := activeTracer()
+	if t == nil {
+		return nil
+	}
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	data, err := json.Marshal(struct {
+		TraceEvents     []traceEvent `json:"traceEvents"`
+		DisplayTimeUnit string       `json:"displayTimeUnit"`
+	}{t.events, "ms"})
+	if err != nil {
+		return err
+	}
+	if err := os.WriteFile(t.path, data, 0o644); err != nil {
+		return fmt.Errorf("writing trace: %w", err)
+	}
+	totals := make(map[string]time.Duration)
+	var cats []string
+	for _, e := range t.events {
+		if _, ok := totals[e.Cat]; !ok {
+			cats = append(cats, e.Cat)
+		}
+		totals[e.Cat] += time.Duration(e.Dur) * time.Microsecond
+	}
+	var parts []string
+	for _, cat := range cats {
+		parts = append(parts, fmt.Sprintf("%s %v", cat, totals[cat].Round(time.Millisecond)))
+	}
+	fmt.Fprintf(os.Stderr, "Wrote %s (%d spans, %s)\n", t.path, len(t.events), strings.Join(parts, ", "))
+	return nil
+}
+
+// execSpan starts an "exec" span for a subprocess.
+func execSpan(cmd *exec.Cmd) *traceSpan {
+	if activeTracer() == nil {
+		return nil
+	}
+	name := filepath.Base(cmd.Path)
+	for _, a := range cmd.Args[1:] {
+		if len(name) > 80 {
+			name += " ..."
+			break
+		}
+		name += " " + a
+	}
+	return startSpan("exec", name).arg("command", strings.Join(cmd.Args, " "))
+}
@@ -0,0 +1,167 @@
+package orchideous
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"os"
+	"path/filepath"
+	"slices"
+)
+
+// unityDir holds the generated unity translation units of a project.
+var unityDir = filepath.Join(projectCacheDir, "unity")
+
+// unityFailedFile lists the unity batches that failed to compile, so that
+// their sources are compiled separately until one of them changes.
+var unityFailedFile = filepath.Join(unityDir, "failed.cache")
+
+// unityOptOut is the marker comment that keeps a source out of unity batches.
+const unityOptOut = "oh:no-unity"
+
+// unityMinBatch is the smallest number of sources worth batching together.
+const unityMinBatch = 2
+
+// unityEnabled reports whether dependency sources should be batched,
+// either because of "oh unity" or because OH_UNITY=1 is set.
+func unityEnabled(opts BuildOptions) bool {
+	return opts.Unity || os.Getenv("OH_UNITY") == "1"
+}
+
+// unityBatch is one generated unity translation unit.
+type unityBatch struct {
+	file    string   // the generated source file
+	members []string // the sources it includes
+	key     string   // identifies the members and their contents
+}
+
+// compileUnity builds the executable from the main source and the dependency
+// sources, compiling the dependencies in unity batches. A batch that fails to
+// compile, for example because two of its sources define the same static
+// function, is compiled as separate sources instead, now and in later builds,
+// until one of its sources changes.
+func compileUnity(mainSrc string, deps []string, output string, flags BuildFlags) error {
+	batches, single := planUnityBatches(deps, flags.Jobs)
+	var failed map[string]bool
+	if !readJSONFile(unityFailedFile, &failed) || failed == nil {
+		failed = make(map[string]bool)
+	}
+	// Forget batches that no longer exist, so that the list does not grow
+	for key := range failed {
+		if !slices.ContainsFunc(batches, func(b unityBatch) bool { return b.key == key }) {
+			delete(failed, key)
+		}
+	}
+
+	recordArtifacts(flags.Dir, "", unityDir)
+	srcs := append([]string{mainSrc}, single...)
+	byFile := make(map[string]unityBatch)
+	for _, b := range batches {
+		if failed[b.key] {
+			srcs = append(srcs, b.members...)
+			continue
+		}
+		if err := writeUnityBatch(b); err != nil {
+			srcs = append(srcs, b.members...)
+			continue
+		}
+		srcs = append(srcs, b.file)
+		byFile[b.file] = b
+	}
+
+	for {
+		err := compileSources(srcs, output, flags)
+		var ce *compileError
+		if err == nil || !errors.As(err, &ce) {
+			return err
+		}
+		b, ok := byFile[ce.src]
+		if !ok {
+			return err
+		}
+		fmt.Fprintf(os.Stderr, "warning: unity batch %s failed, compiling its sources separately\n", b.file)
+		delete(byFile, b.file)
+		i := slices.Index(srcs, b.file)
+		srcs = slices.Replace(srcs, i, i+1, b.members...)
+		failed[b.key] = true
+		writeJSONFile(unityFailedFile, failed)
+	}
+}
+
+// planUnityBatches splits the dependency sources into at most jobs batches
+// of sources with the same language, so that parallel compilation still has
+// work. Sources with the opt-out marker, and languages with too few sources
+// to batch, are returned as single sources.
+func planUnityBatches(deps []string, jobs int) ([]unityBatch, []string) {
+	var single []string
+	groups := make(map[string][]string) // ".c" or ".cpp" -> sources
+	for _, src := range deps {
+		if scanSource(src).unityOptOut {
+			single = append(single, src)
+			continue
+		}
+		lang := ".cpp"
+		if filepath.Ext(src) == ".c" {
+			lang = ".c"
+		}
+		groups[lang] = append(groups[lang], src)
+	}
+
+	var batches []unityBatch
+	for _, lang := range []string{".cpp", ".c"} {
+		members := groups[lang]
+		if len(members) < unityMinBatch {
+			single = append(single, members...)
+			continue
+		}
+		slices.Sort(members)
+		n := min(max(jobs, 1), len(members)/unityMinBatch)
+		for i := 0; i < n; i++ {
+			chunk := members[i*len(members)/n : (i+1)*len(members)/n]
+			keyParts := []string{}
+			for _, m := range chunk {
+				keyParts = append(keyParts, m, hashFile(m))
+			}
+			batches = append(batches, unityBatch{
+				file:    filepath.Join(unityDir, fmt.Sprintf("unity_%d%s", i, lang)),
+				members: chunk,
+				key:     hashStrings(keyParts...),
+			})
+		}
+	}
+	return batches, single
+}
+
+// writeUnityBatch writes the source of a unity batch, if it has changed.
+// The sources are included with paths relative to the batch file.
+func writeUnityBatch(b unityBatch) error {
+	var buf bytes.Buffer
+	buf.WriteString("// Generated by oh, do not edit\n")
+	for _, m := range b.members {
+		rel, err := filepath.Rel(filepath.Dir(b.file), m)
+		if err != nil {
+			return err
+		}
+		fmt.Fprintf(&buf, "#include \"%s\"\n", filepath.ToSlash(rel))
+	}
+	if data, err := os.ReadFile(b.file); err == nil && bytes.Equal(data, buf.Bytes()) {
+		return nil
+	}
+	if err := os.MkdirAll(filepath.Dir(b.file), 0o755); err != nil {
+		return err
+	}
+	return os.WriteFile(b.file, buf.Bytes(), 0o644)
+}
+
+// removeUnityBatches removes the generated unity sources and their objects,
+// and the cache directory if it is then empty.
+func removeUnityBatches() bool {
+	if _, err := os.Stat(unityDir); err != nil {
+		return false
+	}
+	if err := os.RemoveAll(unityDir); err != nil {
+		return false
+	}
+	os.Remove(projectCacheDir) // only succeeds if empty
+	return true
+}
@@ -0,0 +1,255 @@
+package orchideous
+
+import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"slices"
+	"sort"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/xyproto/files"
+)
+
+// watchInterval is how often the watched files are polled for changes.
+var watchInterval = 300 * time.Millisecond
+
+// watchHeaderExts are the header extensions that are watched next to the sources.
+var watchHeaderExts = []string{".h", ".hh", ".hpp", ".hxx", ".h++", ".inl", ".ipp", ".tpp"}
+
+// watchSession keeps the detected project and its flags between rebuilds.
+type watchSession struct {
+	opts     BuildOptions
+	proj     Project
+	exe      string
+	flags    BuildFlags
+	stamps   map[string]string      // watched file -> size and mtime
+	scans    map[string]*sourceScan // watched file -> the scan the project was detected from
+	run      bool
+	runArgs  []string
+	process  *exec.Cmd
+	finished chan struct{} // closed when process has exited
+}
+
+// doWatch builds the project, then rebuilds it whenever one of its sources
+// or local headers changes. The project is only detected again if a change
+// can affect detection, such as a new source file or a changed #include.
+// Otherwise the resident flags are reused, and only the objects whose .d
+// dependencies changed are recompiled before relinking. If run is true, the
+// executable is started after every successful build, and restarted after
+// the next one. Files are polled, so that no platform specific file
+// notification API is needed. Does not return unless the project can not be built at all.
+func doWatch(opts BuildOptions, run bool, runArgs []string) error {
+	w := &watchSession{opts: opts, run: run, runArgs: runArgs}
+	w.detect()
+	if w.proj.MainSource == "" {
+		return fmt.Errorf("no main source file found")
+	}
+	w.stamps = w.snapshot()
+	w.rebuild()
+	w.remember()
+	fmt.Println("Watching for changes, press ctrl-c to stop")
+	for {
+		time.Sleep(watchInterval)
+		changed := changedFiles(w.stamps, w.snapshot())
+		if len(changed) == 0 {
+			continue
+		}
+		// Let editors finish writing before building
+		for {
+			time.Sleep(watchInterval)
+			more := changedFiles(w.stamps, w.snapshot())
+			if slices.Equal(more, changed) {
+				break
+			}
+			changed = more
+		}
+		fmt.Printf("Changed: %s\n", strings.Join(changed, " "))
+		if w.affectsDetection(changed) {
+			w.detect()
+		}
+		w.stamps = w.snapshot()
+		w.rebuild()
+		w.remember()
+	}
+}
+
+// detect detects the project and assembles its flags, and remembers the
+// scans of the files it was detected from.
+func (w *watchSession) detect() {
+	w.proj = detectProject(".")
+	if w.proj.HasWin64 && !w.opts.Win64 {
+		w.opts.Win64 = true
+	}
+	w.exe, w.flags = mainTarget(w.opts, w.proj)
+	w.scans = make(map[string]*sourceScan)
+	w.remember()
+}
+
+// remember records the current scan and stamp of every watched file that
+// has none yet, such as a header that first showed up in a .d file after a build.
+func (w *watchSession) remember() {
+	current := w.snapshot()
+	for f, stamp := range current {
+		if _, ok := w.scans[f]; !ok {
+			w.scans[f] = scanSource(f)
+		}
+		if _, ok := w.stamps[f]; !ok && w.stamps != nil {
+			w.stamps[f] = stamp
+		}
+	}
+}
+
+// affectsDetection reports whether any of the changed files can change the
+// detected project: a file that was added or removed, or one whose
+// includes, main function or flag triggers are not what they were.
+func (w *watchSession) affectsDetection(changed []string) bool {
+	for _, f := range changed {
+		old, ok := w.scans[f]
+		if !ok || !fileExists(f) {
+			return true
+		}
+		if !sameDetection(f, old, scanSource(f)) {
+			return true
+		}
+	}
+	return false
+}
+
+// sameDetection reports whether two scans of a file lead to the same project.
+func sameDetection(filename string, a, b *sourceScan) bool {
+	return a.hasMain == b.hasMain &&
+		slices.Equal(a.survivingIncludes(filename), b.survivingIncludes(filename)) &&
+		slices.Equal(a.localIncludes, b.localIncludes) &&
+		slices.Equal(a.directIncludes, b.directIncludes) &&
+		slices.Equal(a.flags.BoostLibs, b.flags.BoostLibs) &&
+		a.module == b.module &&
+		slices.Equal(a.imports, b.imports) &&
+		slices.Equal(a.headerUnits, b.headerUnits) &&
+		a.flags.HasOpenMP == b.flags.HasOpenMP &&
+		a.flags.HasBoost == b.flags.HasBoost &&
+		a.flags.HasQt6 == b.flags.HasQt6 &&
+		a.flags.HasMathLib == b.flags.HasMathLib &&
+		a.flags.HasFS == b.flags.HasFS &&
+		a.flags.HasThreads == b.flags.HasThreads &&
+		a.flags.HasWin64 == b.flags.HasWin64 &&
+		a.flags.HasGLFWVulkan == b.flags.HasGLFWVulkan &&
+		a.flags.HasDlopen == b.flags.HasDlopen &&
+		a.flags.HasParallel == b.flags.HasParallel &&
+		a.flags.HasModules == b.flags.HasModules
+}
+
+// rebuild compiles and links the project, and restarts the executable if requested.
+// Build errors are reported, but do not stop the watch.
+func (w *watchSession) rebuild() {
+	if w.proj.MainSource == "" {
+		fmt.Fprintln(os.Stderr, "error: no main source file found")
+		return
+	}
+	srcs := append([]string{w.proj.MainSource}, w.proj.DepSources...)
+	if err := compileSources(srcs, w.exe, w.flags); err != nil {
+		fmt.Fprintf(os.Stderr, "error: %v\n", err)
+		return
+	}
+	if w.run {
+		w.restart()
+	}
+}
+
+// restart stops the running executable, if any, and starts it again.
+func (w *watchSession) restart() {
+	if w.process != nil {
+		select {
+		case <-w.finished:
+		default:
+			w.process.Process.Kill()
+			<-w.finished
+		}
+		w.process = nil
+	}
+	exePath := dotSlash(w.exe)
+	c := exec.Command(exePath, w.runArgs...)
+	if strings.HasSuffix(exePath, ".exe") {
+		if winePath := files.WhichCached("wine"); winePath != "" {
+			c = exec.Command(winePath, append([]string{exePath}, w.runArgs...)...)
+		}
+	}
+	c.Stdin = os.Stdin
+	c.Stdout = os.Stdout
+	c.Stderr = os.Stderr
+	if err := c.Start(); err != nil {
+		fmt.Fprintf(os.Stderr, "error: could not run %s: %v\n", exePath, err)
+		return
+	}
+	w.process = c
+	w.finished = make(chan struct{})
+	go func(c *exec.Cmd, finished chan struct{}) {
+		if err := c.Wait(); err != nil {
+			fmt.Fprintf(os.Stderr, "%s exited: %v\n", exePath, err)
+		}
+		close(finished)
+	}(c, w.finished)
+}
+
+// watchedFiles returns the sources and headers in the local include
+// directories, and every input listed in the .d files of the project objects.
+func (w *watchSession) watchedFiles() []string {
+	seen := make(map[string]bool)
+	var watched []string
+	add := func(path string) {
+		path = filepath.Clean(path)
+		if !seen[path] {
+			seen[path] = true
+			watched = append(watched, path)
+		}
+	}
+	for _, dir := range localIncludePaths {
+		if dir == ".." {
+			continue // the parent directory is only searched for includes, not watched
+		}
+		for _, m := range filesWithExts(dir, append(slices.Clone(SourceExts), watchHeaderExts...)) {
+			add(m)
+		}
+	}
+	if w.proj.MainSource != "" {
+		for _, src := range append([]string{w.proj.MainSource}, w.proj.DepSources...) {
+			for _, dep := range depFileInputs(objectPath(w.flags, src)) {
+				add(dep)
+			}
+		}
+	}
+	sort.Strings(watched)
+	return watched
+}
+
+// snapshot returns the size and mtime of every watched file.
+func (w *watchSession) snapshot() map[string]string {
+	stamps := make(map[string]string)
+	for _, f := range w.watchedFiles() {
+		if fi, err := os.Stat(f); err == nil {
+			stamps[f] = fi.ModTime().String() + "/" + strconv.FormatInt(fi.Size(), 10)
+		}
+	}
+	return stamps
+}
+
+// changedFiles returns the files that were added, removed or modified
+// between two snapshots, sorted.
+func changedFiles(before, after map[string]string) []string {
+	var changed []string
+	for f, stamp := range after {
+		if before[f] != stamp {
+			changed = append(changed, f)
+		}
+	}
+	for f := range before {
+		if _, ok := after[f]; !ok {
+			changed = append(changed, f)
+		}
+	}
+	sort.Strings(changed)
+	return changed
+}
@@ -1,7 +1,42 @@
 package orchideous
 
+import (
+	"path/filepath"
+	"sync"
+)
+
+// mingwIncludeDir is where the headers of the mingw-w64 cross-compiler are installed.
+const mingwIncludeDir = "/usr/x86_64-w64-mingw32/include"
+
+var (
+	mingwTreeOnce sync.Once
+	hasMingwTree  bool
+)
+
+// isWin64SystemHeader reports whether an include is one of the Windows
+// headers that come with mingw-w64, and should not trigger pkg-config
+// lookups when cross-compiling for win64. If the mingw-w64 headers are
+// installed, they are consulted directly: a header is a Windows header if
+// it is there, unless it belongs to a library that has installed a
+// pkg-config file next to them, like SDL2 or glew. Otherwise, such as when
+// building with Docker, win64SkipHeaders is used.
+func isWin64SystemHeader(inc string) bool {
+	mingwTreeOnce.Do(func() {
+		hasMingwTree = fileExists(mingwIncludeDir)
+	})
+	if !hasMingwTree {
+		return win64SkipHeaders[inc]
+	}
+	if !fileExists(filepath.Join(mingwIncludeDir, inc)) {
+		return false
+	}
+	pkgName := pkgNameFromInclude(inc)
+	return pkgName == "" || !fileExists(filepath.Join(filepath.Dir(mingwIncludeDir), "lib", "pkgconfig", pkgName+".pc"))
+}
+
 // win64SkipHeaders are Windows headers that should not trigger pkg-config lookups
-// when cross-compiling for win64. Ported from build.py.
+// when cross-compiling for win64, for when the mingw-w64 headers are not
+// installed locally. Ported from build.py.
 var win64SkipHeaders = map[string]bool{
 	"GL/gl.h":                            true,
 	"GL/glaux.h":                         true,